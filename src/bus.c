@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bus.h"
+#include "log.h"
+#include "metrics.h"
+
+// The slots start on their own page after the header
+#define SLOTS_OFFSET 4096
+
+// How long bus_open waits for another process to finish creating the ring
+#define OPEN_WAIT_US 1000000
+
+/**
+ * @brief Get the slot of the sequence
+ *
+ * @param bus the Bus
+ * @param seq the sequence
+ * @return BusSlot* the slot
+ */
+static BusSlot* slot_at(Bus *bus, uint64_t seq) {
+    BusHeader* header = bus->header;
+    return (BusSlot*)(bus->slots + (seq & (header->slot_count - 1)) * header->slot_size);
+}
+
+static uint32_t round_up_pow2(uint32_t value) {
+    uint32_t pow2 = 2;
+    while (pow2 < value && pow2 < (1U << 30))
+        pow2 <<= 1;
+    return pow2;
+}
+
+/**
+ * @brief Create the ring in the new shared memory object
+ *
+ * @param fd the shared memory object
+ * @param slot_count amount of slots
+ * @param slot_size size of a slot
+ * @return BusHeader* the mapped ring or NULL if fail
+ */
+static BusHeader* create_ring(int fd, uint32_t slot_count, uint32_t slot_size) {
+    size_t size = SLOTS_OFFSET + (size_t)slot_count * slot_size;
+
+    if (ftruncate(fd, size) == -1)
+        return NULL;
+
+    BusHeader* header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+        return NULL;
+
+    // ftruncate filled the slots with zeros, which no sequence matches
+    header->version = BUS_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->write_seq = 0;
+    header->futex = 0;
+    header->waiters = 0;
+    // The other processes use the ring only after they see the magic
+    __atomic_store_n(&header->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+
+    return header;
+}
+
+/**
+ * @brief Map the ring another process has created
+ *
+ * The creator may still be setting it up, so this waits for the magic.
+ *
+ * @param fd the shared memory object
+ * @return BusHeader* the mapped ring or NULL if fail
+ */
+static BusHeader* attach_ring(int fd) {
+    BusHeader* header = NULL;
+
+    for (int waited = 0; waited < OPEN_WAIT_US; waited += 1000) {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            return NULL;
+
+        if ((size_t)st.st_size >= SLOTS_OFFSET) {
+            if (header == NULL) {
+                header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (header == MAP_FAILED)
+                    return NULL;
+            }
+            if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == BUS_MAGIC) {
+                size_t size = SLOTS_OFFSET + (size_t)header->slot_count * header->slot_size;
+                if (header->version != BUS_VERSION || (size_t)st.st_size < size) {
+                    LOG_ERROR("The bus is not compatible with this server");
+                    munmap(header, st.st_size);
+                    return NULL;
+                }
+                return header;
+            }
+        }
+        usleep(1000);
+    }
+
+    LOG_ERROR("The bus was not set up in time");
+    if (header != NULL)
+        munmap(header, SLOTS_OFFSET);
+    return NULL;
+}
+
+/**
+ * @brief Open the bus, creating it if it doesn't exist
+ *
+ * The geometry is only used when the ring is created, later processes use
+ * whatever the creator chose. The shared memory object stays until it's
+ * removed with shm_unlink or rm /dev/shm/NAME, so the position of the
+ * publishers survives restarts.
+ *
+ * @param name name of the shared memory object, like "/feed"
+ * @param slot_count amount of slots, rounded up to a power of two
+ * @param slot_size size of a slot, the largest message is a bit less
+ * @return Bus* the bus or NULL if fail
+ */
+Bus* bus_open(const char *name, uint32_t slot_count, uint32_t slot_size) {
+    Bus* bus = malloc(sizeof(Bus));
+    if (bus == NULL)
+        return NULL;
+
+    slot_count = round_up_pow2(slot_count);
+    // Whole cache lines, so the seqlock of a slot never shares a line
+    // with the neighbour that is being written
+    if (slot_size < sizeof(BusSlot) + 64)
+        slot_size = sizeof(BusSlot) + 64;
+    slot_size = (slot_size + 63) & ~63U;
+
+    BusHeader* header = NULL;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        header = create_ring(fd, slot_count, slot_size);
+        if (header == NULL)
+            shm_unlink(name);
+    } else if (errno == EEXIST) {
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+        if (fd != -1)
+            header = attach_ring(fd);
+    }
+
+    if (header == NULL) {
+        LOG_ERROR("Cannot open the bus %s: %s", name, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        free(bus);
+        return NULL;
+    }
+
+    // The mapping stays after the descriptor is closed
+    close(fd);
+    bus->header = header;
+    bus->slots = (uint8_t*)header + SLOTS_OFFSET;
+    bus->map_size = SLOTS_OFFSET + (size_t)header->slot_count * header->slot_size;
+
+    return bus;
+}
+
+void bus_close(Bus *bus) {
+    munmap(bus->header, bus->map_size);
+    free(bus);
+}
+
+/**
+ * @brief Get the largest topic and payload length a record can carry
+ *
+ * @param bus the Bus
+ * @return size_t the topic and the payload together can be this long
+ */
+size_t bus_max_message(Bus *bus) {
+    return bus->header->slot_size - sizeof(BusSlot);
+}
+
+/**
+ * @brief Write the message to the ring and wake up the waiting consumers
+ *
+ * Can be called by any thread of any process that has the bus open.
+ *
+ * @param bus the Bus
+ * @param topic the topic of the message
+ * @param type opcode of the message
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if the message doesn't fit in a slot
+ */
+int bus_publish(Bus *bus, const char *topic, uint8_t type, const uint8_t *data, size_t len) {
+    BusHeader* header = bus->header;
+    size_t topic_len = strlen(topic);
+
+    if (topic_len > BUS_MAX_TOPIC || topic_len + len > bus_max_message(bus))
+        return -1;
+
+    uint64_t seq = __atomic_fetch_add(&header->write_seq, 1, __ATOMIC_RELAXED);
+    BusSlot* slot = slot_at(bus, seq);
+
+    // Odd sequence first, so a consumer that reads the slot meanwhile
+    // sees that it changed
+    __atomic_store_n(&slot->seq, 2 * seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->published_ns = metrics_now_ns();
+    slot->type = type;
+    slot->topic_len = (uint8_t)topic_len;
+    slot->len = (uint32_t)len;
+    memcpy(slot->data, topic, topic_len);
+    if (len > 0)
+        memcpy(slot->data + topic_len, data, len);
+
+    __atomic_store_n(&slot->seq, 2 * seq + 2, __ATOMIC_RELEASE);
+
+    // Only wake the consumers when somebody sleeps, the seq_cst pair
+    // with bus_wait makes sure a consumer that is about to sleep sees the
+    // new value
+    __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    return 0;
+}
+
+/**
+ * @brief Start reading from the newest record, the older ones are skipped
+ *
+ * @param consumer the BusConsumer
+ * @param bus the Bus
+ */
+void bus_consumer_init(BusConsumer *consumer, Bus *bus) {
+    consumer->bus = bus;
+    consumer->read_seq = __atomic_load_n(&bus->header->write_seq, __ATOMIC_ACQUIRE);
+    consumer->slot_seq = 0;
+    consumer->dropped = 0;
+    consumer->gaps = 0;
+    consumer->stall_seq = UINT64_MAX;
+    consumer->stall_ns = 0;
+}
+
+/**
+ * @brief Check if the unfinished slot of read_seq should be given up
+ *
+ * @param consumer the BusConsumer
+ * @param write_seq the published head
+ * @return bool true if the publisher of the slot is taken as dead
+ */
+static bool slot_stale(BusConsumer *consumer, uint64_t write_seq) {
+    uint64_t behind = write_seq - consumer->read_seq;
+
+    // Nothing waits for the slot
+    if (behind <= 1)
+        return false;
+    // A live publisher would have finished long before the others got
+    // half way around the ring
+    if (behind > consumer->bus->header->slot_count / 2)
+        return true;
+
+    uint64_t now = metrics_now_ns();
+    if (consumer->stall_seq != consumer->read_seq) {
+        consumer->stall_seq = consumer->read_seq;
+        consumer->stall_ns = now;
+        return false;
+    }
+    return now - consumer->stall_ns >= BUS_STALE_NS;
+}
+
+/**
+ * @brief Find the next complete record
+ *
+ * The record points to the ring, a publisher may overwrite it any time.
+ * The caller copies what it needs and then calls bus_commit, which tells
+ * if the copy is good.
+ *
+ * @param consumer the BusConsumer
+ * @param record set to the next record
+ * @return int 1 if there is a record, 0 if the consumer has read everything
+ * that is complete
+ */
+int bus_peek(BusConsumer *consumer, BusRecord *record) {
+    Bus* bus = consumer->bus;
+    uint32_t slot_count = bus->header->slot_count;
+
+    for (;;) {
+        uint64_t write_seq = __atomic_load_n(&bus->header->write_seq, __ATOMIC_ACQUIRE);
+        if (consumer->read_seq >= write_seq)
+            return 0;
+
+        // The publishers went around the ring, jump to the oldest record
+        // that can still be there
+        if (write_seq - consumer->read_seq > slot_count) {
+            consumer->dropped += write_seq - slot_count - consumer->read_seq;
+            consumer->read_seq = write_seq - slot_count;
+        }
+
+        BusSlot* slot = slot_at(bus, consumer->read_seq);
+        uint64_t expected = 2 * consumer->read_seq + 2;
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        // The publisher that claimed the sequence hasn't finished yet,
+        // the records after it wait for it to keep the order, unless it
+        // looks like the publisher died
+        if (seq < expected) {
+            if (!slot_stale(consumer, write_seq))
+                return 0;
+            consumer->gaps++;
+            consumer->read_seq++;
+            continue;
+        }
+
+        size_t topic_len = slot->topic_len;
+        size_t len = slot->len;
+        // A later lap already took the slot, or took it while the lengths
+        // were read
+        if (seq > expected || topic_len + len > bus_max_message(bus)) {
+            consumer->dropped++;
+            consumer->read_seq++;
+            continue;
+        }
+
+        record->type = slot->type;
+        record->topic = (const char*)slot->data;
+        record->topic_len = topic_len;
+        record->data = slot->data + topic_len;
+        record->len = len;
+        record->published_ns = slot->published_ns;
+        consumer->slot_seq = seq;
+        return 1;
+    }
+}
+
+/**
+ * @brief Move past the record bus_peek returned
+ *
+ * @param consumer the BusConsumer
+ * @return bool true if the record didn't change while it was read, false
+ * if it was overwritten and the copy must be thrown away
+ */
+bool bus_commit(BusConsumer *consumer) {
+    BusSlot* slot = slot_at(consumer->bus, consumer->read_seq);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    bool intact = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == consumer->slot_seq;
+
+    consumer->read_seq++;
+    if (!intact)
+        consumer->dropped++;
+    return intact;
+}
+
+/**
+ * @brief Get the amount of records the consumer has not read yet
+ *
+ * @param consumer the BusConsumer
+ * @return uint64_t amount of records
+ */
+uint64_t bus_lag(BusConsumer *consumer) {
+    uint64_t write_seq = __atomic_load_n(&consumer->bus->header->write_seq, __ATOMIC_RELAXED);
+    return write_seq > consumer->read_seq ? write_seq - consumer->read_seq : 0;
+}
+
+/**
+ * @brief Sleep until something is published
+ *
+ * @param bus the Bus
+ * @param seen the value this returned last time, 0 at first
+ * @return uint32_t the new value to give to the next call
+ */
+uint32_t bus_wait(Bus *bus, uint32_t seen) {
+    BusHeader* header = bus->header;
+
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->futex, __ATOMIC_SEQ_CST) == seen)
+        syscall(SYS_futex, &header->futex, FUTEX_WAIT, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+}
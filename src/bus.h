@@ -0,0 +1,116 @@
+#ifndef WEB_SOCKET_BUS_H
+#define WEB_SOCKET_BUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+// Identifies a mapping that is a bus ring
+#define BUS_MAGIC 0x57534255
+#define BUS_VERSION 1
+
+// Longest topic name a record can carry
+#define BUS_MAX_TOPIC 255
+
+/**
+ * Shared memory broadcast bus
+ *
+ * A ring of fixed size slots in a POSIX shared memory object. Any process
+ * on the host can publish to it and every consumer reads every record, so
+ * a feed is written once and each server process fans it out to its own
+ * subscribers.
+ *
+ * Publishers claim a sequence number with an atomic add and write the
+ * slot of the sequence under a seqlock. Publishers never wait for the
+ * consumers: a consumer that falls a whole ring behind loses the oldest
+ * records and counts them as dropped. Consumers only read the ring, they
+ * keep their position to themselves, so there is no limit on how many
+ * there are.
+ *
+ * A publisher that dies while it writes leaves its slot unfinished. The
+ * consumers wait for the slot to keep the order, but only until half a
+ * ring has been claimed after it or the records after it have waited for
+ * BUS_STALE_NS, then the record is lost.
+ *
+ * Consumers sleep on a futex in the ring header, publishers wake them
+ * only when somebody waits.
+ */
+
+// How long the records after an unfinished one wait for it
+#define BUS_STALE_NS 100000000ULL
+
+typedef struct {
+    // 2 * seq + 1 while the record of seq is written, 2 * seq + 2 when
+    // it's complete
+    uint64_t seq;
+    // CLOCK_MONOTONIC time of the publish, same clock in every process
+    uint64_t published_ns;
+    // Message type, same as the frame opcode
+    uint8_t type;
+    uint8_t topic_len;
+    uint16_t reserved;
+    // Length of the payload, it's in data after the topic
+    uint32_t len;
+    uint8_t data[];
+} BusSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // Power of two
+    uint32_t slot_count;
+    // Size of a slot with the BusSlot header
+    uint32_t slot_size;
+    // Next sequence a publisher claims
+    uint64_t write_seq __attribute__((aligned(64)));
+    // Bumped after every publish, consumers wait on it
+    uint32_t futex __attribute__((aligned(64)));
+    // Amount of consumers waiting on the futex
+    uint32_t waiters;
+} BusHeader;
+
+typedef struct Bus {
+    BusHeader* header;
+    // Start of the slots
+    uint8_t* slots;
+    size_t map_size;
+} Bus;
+
+// A record the consumer is reading. The pointers are into the ring, so the
+// bytes must be copied and then checked with bus_commit
+typedef struct {
+    uint8_t type;
+    const char* topic;
+    size_t topic_len;
+    const uint8_t* data;
+    size_t len;
+    uint64_t published_ns;
+} BusRecord;
+
+typedef struct {
+    Bus* bus;
+    // Next sequence to read
+    uint64_t read_seq;
+    // The seq value of the slot bus_peek returned
+    uint64_t slot_seq;
+    // Records lost because the publishers lapped the consumer
+    uint64_t dropped;
+    // Records given up because their publisher never finished them
+    uint64_t gaps;
+    // The unfinished sequence the consumer waits for and since when,
+    // UINT64_MAX if it doesn't wait
+    uint64_t stall_seq;
+    uint64_t stall_ns;
+} BusConsumer;
+
+Bus* bus_open(const char *name, uint32_t slot_count, uint32_t slot_size);
+void bus_close(Bus *bus);
+size_t bus_max_message(Bus *bus);
+int bus_publish(Bus *bus, const char *topic, uint8_t type, const uint8_t *data, size_t len);
+void bus_consumer_init(BusConsumer *consumer, Bus *bus);
+int bus_peek(BusConsumer *consumer, BusRecord *record);
+bool bus_commit(BusConsumer *consumer);
+uint64_t bus_lag(BusConsumer *consumer);
+uint32_t bus_wait(Bus *bus, uint32_t seen);
+
+#endif
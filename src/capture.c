@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+// Size of the stdio buffer of the capture file
+#define CAPTURE_BUF_SIZE (1024 * 1024)
+
+// How often the buffered records are flushed to the file
+#define CAPTURE_FLUSH_US 1000000
+
+// Longest varint of uint64_t
+#define VARINT_MAX 10
+
+// Capture is shared by every connection thread, so it's guarded by lock.
+// Records are written in the order they arrive, which keeps the time
+// deltas positive.
+static struct {
+    pthread_mutex_t lock;
+    FILE* file;
+    char* buf;
+    // Time of the previous record
+    uint64_t last_us;
+    // Time of the previous flush
+    uint64_t flushed_us;
+    // Id for the next captured connection
+    uint32_t next_id;
+} capture = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int put_varint(uint8_t *buf, uint64_t value) {
+    int len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (uint8_t)value;
+    return len;
+}
+
+static int get_varint(FILE *file, uint64_t *value) {
+    int c;
+    int shift = 0;
+    *value = 0;
+
+    do {
+        c = fgetc(file);
+        if (c == EOF || shift > 63)
+            return 0;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return 1;
+}
+
+/**
+ * @brief Write the common record header. Caller holds the lock
+ *
+ * @param type type of the record
+ * @param conn_id id of the connection
+ */
+static void write_record_header(CaptureRecord type, uint32_t conn_id) {
+    uint8_t header[1 + 2 * VARINT_MAX];
+    int len = 0;
+    uint64_t now = now_us();
+
+    header[len++] = (uint8_t)type;
+    len += put_varint(header + len, now - capture.last_us);
+    len += put_varint(header + len, conn_id);
+    capture.last_us = now;
+
+    fwrite(header, 1, len, capture.file);
+}
+
+/**
+ * @brief Flush the records every now and then so the log is usable
+ * even if the server is killed. Caller holds the lock
+ */
+static void maybe_flush(void) {
+    if (capture.last_us - capture.flushed_us >= CAPTURE_FLUSH_US) {
+        fflush(capture.file);
+        capture.flushed_us = capture.last_us;
+    }
+}
+
+/**
+ * @brief Start capturing the inbound frames to file
+ *
+ * @param path path to the capture log, existing file is overwritten
+ * @return int 1 if success, 0 if the file can't be opened
+ */
+int capture_open(const char *path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return 0;
+
+    pthread_mutex_lock(&capture.lock);
+    capture.buf = malloc(CAPTURE_BUF_SIZE);
+    setvbuf(file, capture.buf, _IOFBF, CAPTURE_BUF_SIZE);
+    fwrite(CAPTURE_MAGIC, 1, 8, file);
+    __atomic_store_n(&capture.file, file, __ATOMIC_RELEASE);
+    capture.last_us = now_us();
+    capture.flushed_us = capture.last_us;
+    capture.next_id = 1;
+    pthread_mutex_unlock(&capture.lock);
+
+    return 1;
+}
+
+/**
+ * @brief Stop capturing and flush the log
+ */
+void capture_close(void) {
+    pthread_mutex_lock(&capture.lock);
+    if (capture.file != NULL) {
+        fclose(capture.file);
+        free(capture.buf);
+        __atomic_store_n(&capture.file, NULL, __ATOMIC_RELEASE);
+        capture.buf = NULL;
+    }
+    pthread_mutex_unlock(&capture.lock);
+}
+
+/**
+ * @brief Record a new connection
+ *
+ * @return uint32_t id for the connection, 0 if the capture is not on
+ */
+uint32_t capture_connection_open(void) {
+    uint32_t id = 0;
+
+    // Cheap check so connections don't touch the lock when capture is off
+    if (__atomic_load_n(&capture.file, __ATOMIC_RELAXED) == NULL)
+        return 0;
+
+    pthread_mutex_lock(&capture.lock);
+    // The rest of the connections are not captured, a longer log couldn't
+    // be replayed
+    if (capture.file != NULL && capture.next_id <= CAPTURE_MAX_ID) {
+        id = capture.next_id++;
+        write_record_header(CAPTURE_OPEN, id);
+        maybe_flush();
+    }
+    pthread_mutex_unlock(&capture.lock);
+
+    return id;
+}
+
+/**
+ * @brief Record the frame the connection received
+ *
+ * @param conn_id id from capture_connection_open
+ * @param control control byte of the frame
+ * @param data unmasked payload
+ * @param len length of the payload
+ */
+void capture_frame(uint32_t conn_id, uint8_t control, const uint8_t *data, uint64_t len) {
+    uint8_t header[1 + VARINT_MAX];
+    int header_len = 0;
+
+    if (conn_id == 0)
+        return;
+
+    header[header_len++] = control;
+    header_len += put_varint(header + header_len, len);
+
+    pthread_mutex_lock(&capture.lock);
+    if (capture.file != NULL) {
+        write_record_header(CAPTURE_FRAME, conn_id);
+        fwrite(header, 1, header_len, capture.file);
+        fwrite(data, 1, len, capture.file);
+        maybe_flush();
+    }
+    pthread_mutex_unlock(&capture.lock);
+}
+
+/**
+ * @brief Record that the connection was closed
+ *
+ * @param conn_id id from capture_connection_open
+ */
+void capture_connection_close(uint32_t conn_id) {
+    if (conn_id == 0)
+        return;
+
+    pthread_mutex_lock(&capture.lock);
+    if (capture.file != NULL) {
+        write_record_header(CAPTURE_CLOSE, conn_id);
+        // Closes are rare compared to frames, so the log is flushed to have
+        // the complete connection on disk
+        fflush(capture.file);
+        capture.flushed_us = capture.last_us;
+    }
+    pthread_mutex_unlock(&capture.lock);
+}
+
+/**
+ * @brief Check that the file is a capture log
+ *
+ * @param file the opened log
+ * @return int 1 if the magic matches, 0 if not
+ */
+int capture_read_header(FILE *file) {
+    char magic[8];
+
+    if (fread(magic, 1, 8, file) != 8)
+        return 0;
+
+    return !memcmp(magic, CAPTURE_MAGIC, 8);
+}
+
+/**
+ * @brief Read the next record from the log
+ *
+ * @param file the opened log
+ * @param type set to the record type
+ * @param delta_us set to microseconds since the previous record
+ * @param conn_id set to the connection id
+ * @param control set to the control byte of the frame
+ * @param data set to the allocated payload of the frame, caller frees it
+ * @param len set to the payload length
+ * @return int 1 if success, 0 at the end of the log or if it's truncated
+ * or broken
+ */
+int capture_read_record(FILE *file, CaptureRecord *type, uint64_t *delta_us,
+                        uint32_t *conn_id, uint8_t *control, uint8_t **data, uint64_t *len) {
+    uint64_t id;
+    int c = fgetc(file);
+
+    if (c == EOF)
+        return 0;
+
+    *type = (CaptureRecord)c;
+    *data = NULL;
+    *len = 0;
+
+    if (!get_varint(file, delta_us) || !get_varint(file, &id))
+        return 0;
+    if (id == 0 || id > CAPTURE_MAX_ID)
+        return 0;
+    *conn_id = (uint32_t)id;
+
+    if (*type != CAPTURE_FRAME)
+        return 1;
+
+    if ((c = fgetc(file)) == EOF || !get_varint(file, len))
+        return 0;
+    *control = (uint8_t)c;
+
+    *data = malloc(*len > 0 ? *len : 1);
+    if (*data == NULL || fread(*data, 1, *len, file) != *len) {
+        free(*data);
+        *data = NULL;
+        return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef WEB_SOCKET_CAPTURE_H
+#define WEB_SOCKET_CAPTURE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+/**
+ * Capture log format
+ *
+ * The log starts with the 8 byte magic CAPTURE_MAGIC and is followed by
+ * records. Integers are unsigned LEB128 varints so small values take
+ * a single byte.
+ *
+ * Record:
+ *   uint8  type (CaptureRecord)
+ *   varint microseconds since the previous record
+ *   varint connection id, ids start from 1 and are unique in the log
+ *
+ * CAPTURE_FRAME records continue with:
+ *   uint8  control byte of the frame (FIN, RSV and opcode)
+ *   varint payload length
+ *   bytes  unmasked payload
+ */
+
+#define CAPTURE_MAGIC "WSCAP001"
+
+// Largest connection id in a log, the replay keeps a socket for every id
+#define CAPTURE_MAX_ID (1U << 24)
+
+typedef enum {
+    // Connection finished the handshake
+    CAPTURE_OPEN = 1,
+    // Connection received a frame
+    CAPTURE_FRAME = 2,
+    // Connection was closed
+    CAPTURE_CLOSE = 3,
+} CaptureRecord;
+
+int capture_open(const char *path);
+void capture_close(void);
+uint32_t capture_connection_open(void);
+void capture_frame(uint32_t conn_id, uint8_t control, const uint8_t *data, uint64_t len);
+void capture_connection_close(uint32_t conn_id);
+
+// Reading side, used by the replay tool
+int capture_read_header(FILE *file);
+int capture_read_record(FILE *file, CaptureRecord *type, uint64_t *delta_us,
+                        uint32_t *conn_id, uint8_t *control, uint8_t **data, uint64_t *len);
+
+#endif
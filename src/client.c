@@ -0,0 +1,1016 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto/base64.h"
+#include "crypto/sha1.h"
+#include "client.h"
+#include "dataframe.h"
+
+// Get the op code from byte. The op code is the four rightmost bits
+#define OP_CODE(byte) (byte & 0x0f)
+
+// Check if the FIN bit is set in the control byte
+#define FIN_BIT(byte) (byte >> 7)
+
+// Get the RSV bits from the control byte
+#define RSV_BITS(byte) (byte & 0x70)
+
+// Check if the opcode is a control frame opcode
+#define IS_CONTROL(opcode) ((opcode) & 0x08)
+
+// Initial size of the per client receive buffer
+#define CLIENT_BUF_SIZE 4096
+
+// Largest handshake response that is accepted
+#define MAX_RESPONSE_SIZE 8192
+
+// Largest frame or reassembled message that is accepted
+#define CLIENT_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+// Amount of events handled after a single epoll_wait
+#define CLIENT_MAX_EVENTS 256
+
+// Close codes, https://tools.ietf.org/html/rfc6455#section-7.4.1
+#define CLOSE_PROTOCOL_ERROR 1002
+#define CLOSE_NO_STATUS 1005
+#define CLOSE_ABNORMAL 1006
+#define CLOSE_TOO_BIG 1009
+
+typedef enum {
+    // The tcp connect is in progress
+    CLIENT_CONNECTING,
+    // The upgrade request is sent, waiting for the 101 response
+    CLIENT_HANDSHAKE,
+    CLIENT_OPEN,
+    // The close frame is sent, waiting for the server to close
+    CLIENT_CLOSING,
+    // The socket is closed, the struct is freed at the end of the loop round
+    CLIENT_CLOSED,
+} ClientState;
+
+struct WebSocketClient {
+    WebSocketClientLoop* loop;
+    int fd;
+    ClientState state;
+    WebSocketClientHandler handler;
+    void* user_data;
+    // State of the mask key generator
+    uint64_t rng;
+    // Sec-WebSocket-Key of the upgrade request
+    char key[32];
+
+    // Bytes read from the socket that are not handled yet
+    uint8_t* rx;
+    size_t rx_len;
+    size_t rx_cap;
+    // Amount of bytes the next frame needs in the buffer
+    size_t rx_need;
+    // Framed output that is not written yet
+    uint8_t* tx;
+    size_t tx_len;
+    size_t tx_cap;
+
+    // Fragments of the current message are gathered here
+    uint8_t* message;
+    size_t message_len;
+    // Opcode of the first fragment, 0 if there is no fragmented message
+    uint8_t message_opcode;
+    // The close frame was received or the input was broken, the rest of
+    // the input is dropped
+    bool input_closed;
+    // Close code sent by the server
+    int close_code;
+
+    // True while epoll waits for EPOLLOUT
+    bool want_write;
+    // True while the client is in the flush list of the loop
+    bool flush_pending;
+    // Links of the loop lists
+    struct WebSocketClient* next;
+    struct WebSocketClient* prev;
+    struct WebSocketClient* next_flush;
+};
+
+struct WebSocketClientLoop {
+    int epoll_fd;
+    // The open clients
+    WebSocketClient* clients;
+    size_t count;
+    // Clients with output queued during the round
+    WebSocketClient* flush_list;
+    // Closed clients, freed at the end of the round, linked with next
+    WebSocketClient* closed;
+};
+
+/**
+ * @brief Seed for the mask key generator
+ *
+ * @return uint64_t random seed, never 0
+ */
+static uint64_t seed_random(void) {
+    uint64_t seed = 0;
+
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = (uint64_t)ts.tv_nsec * 6364136223846793005ULL ^ (uint64_t)(uintptr_t)&seed;
+    }
+
+    // xorshift gets stuck at 0
+    return seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * @brief Next value of the xorshift64* generator
+ *
+ * A few cycles per mask key. The keys only have to be unpredictable to
+ * the page scripts of a browser, which a client library doesn't have,
+ * so a fast generator seeded from the kernel is enough.
+ *
+ * @param state the generator state
+ * @return uint32_t random value
+ */
+static uint32_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/**
+ * @brief Format the upgrade request with a new Sec-WebSocket-Key
+ *
+ * @param rng the generator state
+ * @param host value of the Host header
+ * @param path the requested path
+ * @param key the generated key is written here, 25 bytes
+ * @param buf where the request is written
+ * @param size size of buf
+ * @return int length of the request, >= size if it didn't fit
+ */
+static int format_request(uint64_t *rng, const char *host, const char *path,
+                          char *key, char *buf, size_t size) {
+    uint8_t nonce[16];
+
+    for (int i = 0; i < 16; i += 4) {
+        uint32_t value = next_random(rng);
+        memcpy(nonce + i, &value, 4);
+    }
+    base64encode(nonce, key, 16);
+
+    // Ipv6 addresses are in brackets in the Host header
+    bool ipv6 = strchr(host, ':') != NULL;
+
+    return snprintf(buf, size,
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s%s%s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %s\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n", path, ipv6 ? "[" : "", host, ipv6 ? "]" : "", key);
+}
+
+/**
+ * @brief Check the handshake response of the server
+ *
+ * @param response the response headers as a string
+ * @param key the Sec-WebSocket-Key of the request
+ * @return int 1 if the server accepted the upgrade, 0 if not
+ */
+static int check_response(const char *response, const char *key) {
+    // Magic string for the socket handshake hash
+    const char* magic_str = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char expected[32];
+    char hash_in[128];
+    Sha1 sha1;
+
+    if (strncmp(response, "HTTP/1.1 101", 12))
+        return 0;
+
+    // The server has to prove it understood the handshake
+    snprintf(hash_in, sizeof(hash_in), "%s%s", key, magic_str);
+    sha1hash(&sha1, (uint8_t*)hash_in, strlen(hash_in));
+    base64encode(sha1.hash, expected, 20);
+
+    for (const char* line = response; line != NULL && *line != '\0'; line = strstr(line, "\r\n")) {
+        if (line[0] == '\r')
+            line += 2;
+        if (!strncasecmp(line, "Sec-WebSocket-Accept:", 21)) {
+            const char* value = line + 21;
+            while (*value == ' ')
+                value++;
+            return !strncmp(value, expected, strlen(expected));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Open tcp connection to the server
+ *
+ * @param host ipv4 address of the server
+ * @param port port of the server
+ * @return int socket file descriptor or -1 if failed
+ */
+int client_connect(const char *host, uint16_t port) {
+    struct sockaddr_in sa;
+
+    int fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1)
+        return -1;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Frames are small and latency sensitive
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+    return fd;
+}
+
+/**
+ * @brief Do the websocket opening handshake on a connected socket
+ *
+ * The response is read byte by byte so none of the frames the server
+ * may send right after the handshake are consumed here.
+ *
+ * @param fd connected socket
+ * @param host value of the Host header
+ * @param path the requested path
+ * @return int 1 if success, 0 if the server didn't accept the handshake
+ */
+int client_handshake(int fd, const char *host, const char *path) {
+    uint64_t rng = seed_random();
+    char key[32];
+    char buf[1024];
+
+    int len = format_request(&rng, host, path, key, buf, sizeof(buf));
+    if (len >= (int)sizeof(buf))
+        return 0;
+
+    if (send(fd, buf, len, 0) != len)
+        return 0;
+
+    // Read the response headers until the empty line
+    len = 0;
+    while (len < (int)sizeof(buf) - 1) {
+        if (recv(fd, buf + len, 1, 0) != 1)
+            return 0;
+        len++;
+        if (len >= 4 && !memcmp(buf + len - 4, "\r\n\r\n", 4))
+            break;
+    }
+    buf[len] = '\0';
+
+    return check_response(buf, key);
+}
+
+/**
+ * @brief Create an event loop for client connections
+ *
+ * @return WebSocketClientLoop* the loop or NULL if fail
+ */
+WebSocketClientLoop* ws_client_loop_create(void) {
+    WebSocketClientLoop* loop = calloc(1, sizeof(WebSocketClientLoop));
+    if (loop == NULL)
+        return NULL;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+static void free_client(WebSocketClient *client) {
+    free(client->rx);
+    free(client->tx);
+    free(client->message);
+    free(client);
+}
+
+/**
+ * @brief Free the clients closed during the round
+ *
+ * @param loop the loop
+ */
+static void free_closed(WebSocketClientLoop *loop) {
+    while (loop->closed != NULL) {
+        WebSocketClient* client = loop->closed;
+        loop->closed = client->next;
+        free_client(client);
+    }
+}
+
+/**
+ * @brief Close the socket and tell the application
+ *
+ * @param client the client
+ */
+static void finish_client(WebSocketClient *client) {
+    WebSocketClientLoop* loop = client->loop;
+
+    if (client->state == CLIENT_CLOSED)
+        return;
+    client->state = CLIENT_CLOSED;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+
+    if (client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        loop->clients = client->next;
+    if (client->next != NULL)
+        client->next->prev = client->prev;
+    loop->count--;
+
+    // The struct lives until the end of the round, events and the flush
+    // list may still point to it
+    client->next = loop->closed;
+    loop->closed = client;
+
+    if (client->handler.on_close != NULL)
+        client->handler.on_close(client, client->close_code);
+}
+
+/**
+ * @brief Close every client and free the loop
+ *
+ * on_close is called for the clients that are still open.
+ *
+ * @param loop the loop
+ */
+void ws_client_loop_free(WebSocketClientLoop *loop) {
+    while (loop->clients != NULL)
+        finish_client(loop->clients);
+    free_closed(loop);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+/**
+ * @brief Get the amount of clients that are not closed
+ *
+ * @param loop the loop
+ * @return size_t amount of clients
+ */
+size_t ws_client_loop_count(WebSocketClientLoop *loop) {
+    return loop->count;
+}
+
+/**
+ * @brief Set the events epoll waits for the client
+ *
+ * @param client the client
+ * @param want_write true if the socket is full and EPOLLOUT is needed
+ */
+static void watch_output(WebSocketClient *client, bool want_write) {
+    if (client->want_write == want_write)
+        return;
+
+    struct epoll_event event = {
+        .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+        .data.ptr = client,
+    };
+    epoll_ctl(client->loop->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    client->want_write = want_write;
+}
+
+/**
+ * @brief Write the queued output to the socket
+ *
+ * @param client the client
+ */
+static void flush_client(WebSocketClient *client) {
+    size_t done = 0;
+
+    // The socket isn't connected yet, EPOLLOUT tells when it is
+    if (client->state == CLIENT_CONNECTING || client->state == CLIENT_CLOSED)
+        return;
+
+    while (done < client->tx_len) {
+        ssize_t n = send(client->fd, client->tx + done, client->tx_len - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            finish_client(client);
+            return;
+        }
+        done += n;
+    }
+
+    client->tx_len -= done;
+    if (client->tx_len > 0 && done > 0)
+        memmove(client->tx, client->tx + done, client->tx_len);
+    watch_output(client, client->tx_len > 0);
+}
+
+/**
+ * @brief Write the output of every client that queued something
+ *
+ * Every frame sent during the round goes out with a single send per client.
+ *
+ * @param loop the loop
+ */
+static void flush_clients(WebSocketClientLoop *loop) {
+    while (loop->flush_list != NULL) {
+        WebSocketClient* client = loop->flush_list;
+        loop->flush_list = client->next_flush;
+        client->flush_pending = false;
+        flush_client(client);
+    }
+}
+
+/**
+ * @brief Make room for more output
+ *
+ * @param client the client
+ * @param len amount of bytes that will be added
+ * @return int 1 if success, 0 if out of memory
+ */
+static int reserve_output(WebSocketClient *client, size_t len) {
+    if (client->tx_len + len <= client->tx_cap)
+        return 1;
+
+    size_t cap = client->tx_cap > 0 ? client->tx_cap : CLIENT_BUF_SIZE;
+    while (cap < client->tx_len + len)
+        cap *= 2;
+
+    uint8_t* tx = realloc(client->tx, cap);
+    if (tx == NULL)
+        return 0;
+    client->tx = tx;
+    client->tx_cap = cap;
+    return 1;
+}
+
+/**
+ * @brief Frame and mask the payload and add it to the output
+ *
+ * The frame is written to the socket at the end of the loop round.
+ *
+ * @param client the client
+ * @param control the control byte of the frame
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if out of memory
+ */
+static int queue_frame(WebSocketClient *client, uint8_t control, const uint8_t *data, size_t len) {
+    Dataframe frame;
+
+    init_dataframe(&frame);
+    frame.control = control;
+    // Client frames must always be masked
+    set_mask_key(&frame, next_random(&client->rng));
+    set_data_length(&frame, len);
+
+    // The header is at most 14 bytes
+    if (!reserve_output(client, len + 14))
+        return -1;
+
+    uint8_t* out = client->tx + client->tx_len;
+    uint64_t header_len = get_frame_header(&frame, out);
+    if (len > 0)
+        mask_copy(out + header_len, data, len, out + header_len - 4);
+    client->tx_len += frame.total_len;
+
+    if (!client->flush_pending) {
+        client->flush_pending = true;
+        client->next_flush = client->loop->flush_list;
+        client->loop->flush_list = client;
+    }
+    return 0;
+}
+
+/**
+ * @brief Connect to a websocket server
+ *
+ * The connect and the handshake run in the loop, on_open is called when
+ * they are done and on_close if they fail. The host is not resolved, so
+ * the loop never blocks on dns.
+ *
+ * @param loop the loop that runs the connection
+ * @param host ipv4 or ipv6 address of the server
+ * @param port port of the server
+ * @param path the requested path, like "/"
+ * @param handler the callbacks, copied
+ * @param user_data set as the user data of the client
+ * @return WebSocketClient* the client or NULL if the connect failed right away
+ */
+WebSocketClient* ws_client_connect(WebSocketClientLoop *loop, const char *host, uint16_t port,
+                                   const char *path, const WebSocketClientHandler *handler,
+                                   void *user_data) {
+    struct addrinfo hints;
+    struct addrinfo* addr;
+    char port_str[8];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(port_str, sizeof(port_str), "%u", (unsigned int)port);
+    if (getaddrinfo(host, port_str, &hints, &addr) != 0)
+        return NULL;
+
+    int fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == -1) {
+        freeaddrinfo(addr);
+        return NULL;
+    }
+
+    // Frames are small and latency sensitive
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+    int ret = connect(fd, addr->ai_addr, addr->ai_addrlen);
+    freeaddrinfo(addr);
+    if (ret == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+
+    WebSocketClient* client = calloc(1, sizeof(WebSocketClient));
+    if (client == NULL) {
+        close(fd);
+        return NULL;
+    }
+    client->loop = loop;
+    client->fd = fd;
+    client->state = CLIENT_CONNECTING;
+    if (handler != NULL)
+        client->handler = *handler;
+    client->user_data = user_data;
+    client->rng = seed_random();
+    client->close_code = CLOSE_ABNORMAL;
+
+    // The request waits in the output until the socket is connected
+    char request[1024];
+    int len = format_request(&client->rng, host, path, client->key, request, sizeof(request));
+    if (len >= (int)sizeof(request) || !reserve_output(client, len)) {
+        close(fd);
+        free_client(client);
+        return NULL;
+    }
+    memcpy(client->tx, request, len);
+    client->tx_len = len;
+
+    // EPOLLOUT tells when the connect is done
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = client };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        free_client(client);
+        return NULL;
+    }
+    client->want_write = true;
+
+    client->next = loop->clients;
+    if (loop->clients != NULL)
+        loop->clients->prev = client;
+    loop->clients = client;
+    loop->count++;
+
+    return client;
+}
+
+/**
+ * @brief Send a message to the server
+ *
+ * The payload is masked and copied, so the caller can reuse the buffer
+ * right away. The frames sent during a loop round are written together at
+ * the end of it.
+ *
+ * @param client the client
+ * @param type WS_TEXT or WS_BINARY
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if the message was queued, -1 if the client isn't open
+ */
+int ws_client_send(WebSocketClient *client, WebSocketMessageType type,
+                   const uint8_t *data, size_t len) {
+    if (client->state != CLIENT_OPEN)
+        return -1;
+    return queue_frame(client, 0x80 | type, data, len);
+}
+
+/**
+ * @brief Start the closing handshake
+ *
+ * The socket is closed when the server closes it after its close frame.
+ * A client that isn't open yet is just disconnected.
+ *
+ * @param client the client
+ * @param code the close code, like 1000
+ * @param reason text sent with the code, can be NULL
+ * @return int 0 if success, -1 if the client is already closing
+ */
+int ws_client_close(WebSocketClient *client, uint16_t code, const char *reason) {
+    // Control frame payload can't be longer than 125 bytes
+    uint8_t payload[125];
+    size_t reason_len = reason != NULL ? strlen(reason) : 0;
+
+    if (client->state == CLIENT_CONNECTING || client->state == CLIENT_HANDSHAKE) {
+        // epoll reports the hang up and the loop closes the client
+        shutdown(client->fd, SHUT_RDWR);
+        return 0;
+    }
+    if (client->state != CLIENT_OPEN)
+        return -1;
+
+    if (reason_len > sizeof(payload) - 2)
+        reason_len = sizeof(payload) - 2;
+
+    payload[0] = (uint8_t)(code >> 8);
+    payload[1] = (uint8_t)code;
+    memcpy(payload + 2, reason, reason_len);
+
+    client->state = CLIENT_CLOSING;
+    return queue_frame(client, 0x80 | CLOSE_FRAME, payload, reason_len + 2);
+}
+
+/**
+ * @brief Get the amount of bytes queued but not yet written to the socket
+ *
+ * @param client the client
+ * @return size_t amount of bytes
+ */
+size_t ws_client_buffered_amount(WebSocketClient *client) {
+    return client->tx_len;
+}
+
+void ws_client_set_user_data(WebSocketClient *client, void *data) {
+    client->user_data = data;
+}
+
+void* ws_client_get_user_data(WebSocketClient *client) {
+    return client->user_data;
+}
+
+/**
+ * @brief Close because the server broke the protocol
+ *
+ * @param client the client
+ * @param code the close code
+ * @param reason the reason sent with the code
+ */
+static void protocol_error(WebSocketClient *client, uint16_t code, const char *reason) {
+    client->input_closed = true;
+    ws_client_close(client, code, reason);
+}
+
+/**
+ * @brief Check the frame header sent by the server
+ *
+ * @param frame the frame header
+ * @param code set to the close code if the frame is not valid
+ * @return const char* NULL if the frame is valid, otherwise the reason
+ */
+static const char* check_frame(const Dataframe *frame, uint16_t *code) {
+    uint8_t opcode = OP_CODE(frame->control);
+
+    *code = CLOSE_PROTOCOL_ERROR;
+    // Server frames are never masked
+    if (frame->data_info & 0x80)
+        return "Frame is masked";
+    if (RSV_BITS(frame->control))
+        return "Reserved bits set";
+    // Control frames can't be fragmented and have at most 125 bytes
+    if (IS_CONTROL(opcode) && (!FIN_BIT(frame->control) || frame->data_length > 125))
+        return "Invalid control frame";
+    if (frame->data_length > CLIENT_MAX_MESSAGE_SIZE) {
+        *code = CLOSE_TOO_BIG;
+        return "Message too big";
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Give the complete message to the application
+ */
+static void deliver(WebSocketClient *client, uint8_t opcode, const uint8_t *data, size_t len) {
+    if (client->handler.on_message != NULL)
+        client->handler.on_message(client, (WebSocketMessageType)opcode, data, len);
+}
+
+/**
+ * @brief Add a fragment to the message that is being gathered
+ *
+ * @return int 1 if success, 0 if the message is too big
+ */
+static int append_fragment(WebSocketClient *client, const uint8_t *data, size_t len) {
+    if (client->message_len + len > CLIENT_MAX_MESSAGE_SIZE)
+        return 0;
+
+    uint8_t* message = realloc(client->message, client->message_len + len);
+    if (message == NULL && client->message_len + len > 0)
+        return 0;
+    client->message = message;
+    if (len > 0)
+        memcpy(client->message + client->message_len, data, len);
+    client->message_len += len;
+    return 1;
+}
+
+/**
+ * @brief Handle a single complete frame
+ *
+ * @param client the client
+ * @param frame the frame header
+ * @param payload the payload in the receive buffer
+ */
+static void handle_frame(WebSocketClient *client, const Dataframe *frame, const uint8_t *payload) {
+    uint8_t opcode = OP_CODE(frame->control);
+    size_t len = frame->data_length;
+
+    switch (opcode) {
+        case PING_FRAME:
+            if (client->state == CLIENT_OPEN)
+                queue_frame(client, 0x80 | PONG_FRAME, payload, len);
+            break;
+        case PONG_FRAME:
+            break;
+        case CLOSE_FRAME:
+            client->input_closed = true;
+            client->close_code = len >= 2 ? (payload[0] << 8 | payload[1]) : CLOSE_NO_STATUS;
+            // Answer with the same code, the server closes the socket after it
+            if (client->state == CLIENT_OPEN) {
+                client->state = CLIENT_CLOSING;
+                queue_frame(client, 0x80 | CLOSE_FRAME, payload, len >= 2 ? 2 : 0);
+            }
+            break;
+        case TEXT_FRAME:
+        case BIN_FRAME:
+            if (client->message_opcode != 0) {
+                protocol_error(client, CLOSE_PROTOCOL_ERROR, "Expected continuation frame");
+                break;
+            }
+            // Unfragmented messages are given straight from the receive buffer
+            if (FIN_BIT(frame->control)) {
+                deliver(client, opcode, payload, len);
+                break;
+            }
+            client->message_opcode = opcode;
+            client->message_len = 0;
+            if (!append_fragment(client, payload, len))
+                protocol_error(client, CLOSE_TOO_BIG, "Message too big");
+            break;
+        case CONT_FRAME:
+            if (client->message_opcode == 0) {
+                protocol_error(client, CLOSE_PROTOCOL_ERROR, "Unexpected continuation frame");
+                break;
+            }
+            if (!append_fragment(client, payload, len)) {
+                protocol_error(client, CLOSE_TOO_BIG, "Message too big");
+                break;
+            }
+            if (FIN_BIT(frame->control)) {
+                uint8_t message_opcode = client->message_opcode;
+                client->message_opcode = 0;
+                deliver(client, message_opcode, client->message, client->message_len);
+            }
+            break;
+        default:
+            protocol_error(client, CLOSE_PROTOCOL_ERROR, "Unknown opcode");
+            break;
+    }
+}
+
+/**
+ * @brief Handle every complete frame in the receive buffer
+ *
+ * @param client the client
+ * @return size_t amount of bytes handled
+ */
+static size_t handle_frames(WebSocketClient *client) {
+    size_t offset = 0;
+
+    client->rx_need = 0;
+
+    while (!client->input_closed && client->state != CLIENT_CLOSED) {
+        uint8_t* data = client->rx + offset;
+        size_t available = client->rx_len - offset;
+        Dataframe frame;
+        uint16_t code;
+
+        init_dataframe(&frame);
+        uint64_t header_len = read_frame_header(&frame, data, available);
+        if (header_len == 0)
+            break;
+
+        const char* error = check_frame(&frame, &code);
+        if (error != NULL) {
+            protocol_error(client, code, error);
+            break;
+        }
+
+        // Wait until the whole frame is in the buffer
+        if (frame.total_len > available) {
+            client->rx_need = frame.total_len;
+            break;
+        }
+
+        offset += frame.total_len;
+        handle_frame(client, &frame, data + header_len);
+    }
+
+    return offset;
+}
+
+/**
+ * @brief Check the handshake response once all of it is in the buffer
+ *
+ * @param client the client
+ * @return size_t amount of bytes in the response, 0 if it's not complete
+ * or the client was closed
+ */
+static size_t handle_response(WebSocketClient *client) {
+    char response[MAX_RESPONSE_SIZE + 1];
+
+    uint8_t* end = memmem(client->rx, client->rx_len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        if (client->rx_len > MAX_RESPONSE_SIZE)
+            finish_client(client);
+        return 0;
+    }
+
+    size_t len = end + 4 - client->rx;
+    if (len > MAX_RESPONSE_SIZE) {
+        finish_client(client);
+        return 0;
+    }
+    memcpy(response, client->rx, len);
+    response[len] = '\0';
+
+    if (!check_response(response, client->key)) {
+        finish_client(client);
+        return 0;
+    }
+
+    client->state = CLIENT_OPEN;
+    if (client->handler.on_open != NULL)
+        client->handler.on_open(client);
+    return len;
+}
+
+/**
+ * @brief Drop bytes from the start of the receive buffer
+ *
+ * @param client the client
+ * @param len amount of bytes that were handled
+ */
+static void consume_input(WebSocketClient *client, size_t len) {
+    if (len == 0 || client->state == CLIENT_CLOSED)
+        return;
+
+    client->rx_len -= len;
+    if (client->rx_len > 0)
+        memmove(client->rx, client->rx + len, client->rx_len);
+
+    // Don't keep the memory of a large frame around after it's handled
+    if (client->rx_len == 0 && client->rx_cap > CLIENT_BUF_SIZE) {
+        free(client->rx);
+        client->rx = NULL;
+        client->rx_cap = 0;
+    }
+}
+
+/**
+ * @brief Read from the socket and handle the response or the frames
+ *
+ * @param client the client
+ */
+static void read_client(WebSocketClient *client) {
+    if (client->rx_need > client->rx_cap ||
+        client->rx_cap - client->rx_len < CLIENT_BUF_SIZE / 4) {
+        size_t cap = client->rx_cap > 0 ? client->rx_cap * 2 : CLIENT_BUF_SIZE;
+        if (cap < client->rx_need)
+            cap = client->rx_need;
+
+        uint8_t* rx = realloc(client->rx, cap);
+        if (rx == NULL) {
+            finish_client(client);
+            return;
+        }
+        client->rx = rx;
+        client->rx_cap = cap;
+    }
+
+    ssize_t n = recv(client->fd, client->rx + client->rx_len, client->rx_cap - client->rx_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        finish_client(client);
+        return;
+    }
+    client->rx_len += n;
+
+    if (client->state == CLIENT_HANDSHAKE) {
+        size_t len = handle_response(client);
+        if (len == 0)
+            return;
+        // The frames sent right after the handshake may already be here
+        consume_input(client, len);
+    }
+
+    // Nothing is handled after the close frame
+    if (client->input_closed)
+        consume_input(client, client->rx_len);
+    else if (client->state != CLIENT_CLOSED)
+        consume_input(client, handle_frames(client));
+}
+
+/**
+ * @brief The connect finished, send the upgrade request or fail
+ *
+ * @param client the client
+ */
+static void connect_done(WebSocketClient *client) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+        finish_client(client);
+        return;
+    }
+
+    client->state = CLIENT_HANDSHAKE;
+    flush_client(client);
+}
+
+/**
+ * @brief Wait for the sockets once and handle what happened
+ *
+ * The callbacks are called from here. Output queued between the calls is
+ * written before the wait.
+ *
+ * @param loop the loop
+ * @param timeout_ms longest wait in milliseconds, -1 waits until something
+ * happens
+ * @return int amount of clients left, the loop is done when it's 0. -1 if
+ * epoll failed
+ */
+int ws_client_loop_run(WebSocketClientLoop *loop, int timeout_ms) {
+    struct epoll_event events[CLIENT_MAX_EVENTS];
+
+    flush_clients(loop);
+    free_closed(loop);
+    if (loop->count == 0)
+        return 0;
+
+    int count = epoll_wait(loop->epoll_fd, events, CLIENT_MAX_EVENTS, timeout_ms);
+    if (count == -1) {
+        if (errno != EINTR)
+            return -1;
+        count = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        WebSocketClient* client = events[i].data.ptr;
+
+        if (client->state == CLIENT_CONNECTING) {
+            connect_done(client);
+            continue;
+        }
+        if (events[i].events & EPOLLOUT)
+            flush_client(client);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && client->state != CLIENT_CLOSED)
+            read_client(client);
+    }
+
+    // Everything the callbacks sent goes out with a single pass
+    flush_clients(loop);
+    free_closed(loop);
+    return (int)loop->count;
+}
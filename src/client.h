@@ -0,0 +1,54 @@
+#ifndef WEB_SOCKET_CLIENT_H
+#define WEB_SOCKET_CLIENT_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "server.h"
+
+// WebSocketClientLoop runs many client connections on a single thread
+typedef struct WebSocketClientLoop WebSocketClientLoop;
+
+// WebSocketClient is a single client connection. The pointer is valid
+// until on_close returns
+typedef struct WebSocketClient WebSocketClient;
+
+/**
+ * Client callbacks
+ *
+ * Every callback is called from ws_client_loop_run on the thread that runs
+ * the loop. Any callback can be NULL.
+ */
+typedef struct {
+    // The handshake is done and messages can be sent
+    void (*on_open)(WebSocketClient *client);
+    // A complete message was received. The data is borrowed from the
+    // receive buffer and is only valid until the callback returns
+    void (*on_message)(WebSocketClient *client, WebSocketMessageType type,
+                       const uint8_t *data, size_t len);
+    // The connection is gone. code is the close code the server sent, or
+    // 1006 if the connection failed or was lost without a close frame
+    void (*on_close)(WebSocketClient *client, int code);
+} WebSocketClientHandler;
+
+// Blocking helpers for the tools that drive the sockets themselves
+int client_connect(const char *host, uint16_t port);
+int client_handshake(int fd, const char *host, const char *path);
+
+// The ws_client_* functions are called on the thread that runs the loop,
+// from the callbacks or between the ws_client_loop_run calls
+WebSocketClientLoop* ws_client_loop_create(void);
+void ws_client_loop_free(WebSocketClientLoop *loop);
+int ws_client_loop_run(WebSocketClientLoop *loop, int timeout_ms);
+size_t ws_client_loop_count(WebSocketClientLoop *loop);
+WebSocketClient* ws_client_connect(WebSocketClientLoop *loop, const char *host, uint16_t port,
+                                   const char *path, const WebSocketClientHandler *handler,
+                                   void *user_data);
+int ws_client_send(WebSocketClient *client, WebSocketMessageType type,
+                   const uint8_t *data, size_t len);
+int ws_client_close(WebSocketClient *client, uint16_t code, const char *reason);
+size_t ws_client_buffered_amount(WebSocketClient *client);
+void ws_client_set_user_data(WebSocketClient *client, void *data);
+void* ws_client_get_user_data(WebSocketClient *client);
+
+#endif
@@ -0,0 +1,965 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cluster.h"
+#include "log.h"
+#include "metrics.h"
+#include "pubsub.h"
+#include "socketcon.h"
+
+// The length field and the kind and topic length bytes
+#define RECORD_HEADER 6
+
+// Longest record after the length field, a whole message with its topic
+#define MAX_RECORD (2 + 255 + 1 + MAX_MESSAGE_SIZE)
+
+// How long to wait before a lost outbound link is dialed again
+#define RECONNECT_NS 1000000000ULL
+
+// Records for a peer that doesn't read are dropped past this
+#define LINK_MAX_OUTPUT (64 * 1024 * 1024)
+
+// Amount of bytes read from a link at once
+#define LINK_READ_SIZE 65536
+
+#define MAX_EVENTS 64
+
+/**
+ * @brief Wake the cluster thread up from epoll_wait
+ *
+ * @param cluster the Cluster
+ */
+static void wake_cluster(Cluster *cluster) {
+    if (__atomic_exchange_n(&cluster->wake_pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    uint64_t one = 1;
+    ssize_t n = write(cluster->wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+/**
+ * @brief Allocate an event with the record header filled in
+ *
+ * @param kind CLUSTER_SUB, CLUSTER_UNSUB or CLUSTER_MSG
+ * @param topic the topic name
+ * @param topic_len length of the name, at most 255
+ * @param body_len amount of bytes after the topic
+ * @return ClusterEvent* the event or NULL if out of memory
+ */
+static ClusterEvent* new_event(uint8_t kind, const char *topic, size_t topic_len, size_t body_len) {
+    size_t len = RECORD_HEADER + topic_len + body_len;
+    ClusterEvent* event = malloc(sizeof(ClusterEvent) + len);
+    if (event == NULL)
+        return NULL;
+
+    uint32_t rest = (uint32_t)(len - 4);
+    event->len = len;
+    event->record[0] = (uint8_t)(rest >> 24);
+    event->record[1] = (uint8_t)(rest >> 16);
+    event->record[2] = (uint8_t)(rest >> 8);
+    event->record[3] = (uint8_t)rest;
+    event->record[4] = kind;
+    event->record[5] = (uint8_t)topic_len;
+    memcpy(event->record + RECORD_HEADER, topic, topic_len);
+
+    return event;
+}
+
+static void push_event(Cluster *cluster, ClusterEvent *event) {
+    ClusterEvent* head = __atomic_load_n(&cluster->events, __ATOMIC_RELAXED);
+    do {
+        event->next = head;
+    } while (!__atomic_compare_exchange_n(&cluster->events, &head, event, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    wake_cluster(cluster);
+}
+
+/**
+ * @brief Tell the cluster a reactor got its first subscriber for the topic,
+ * or lost its last one
+ *
+ * Called by the reactors. The peers hear about it when the first reactor
+ * subscribes and when the last one leaves.
+ *
+ * @param cluster the Cluster
+ * @param topic the topic name
+ * @param subscribe true if the reactor subscribed, false if it left
+ */
+void cluster_interest(Cluster *cluster, const char *topic, bool subscribe) {
+    ClusterEvent* event = new_event(subscribe ? CLUSTER_SUB : CLUSTER_UNSUB, topic,
+                                    strlen(topic), 0);
+    if (event == NULL) {
+        LOG_ERROR("cluster event alloc failed");
+        return;
+    }
+    push_event(cluster, event);
+}
+
+/**
+ * @brief Send the published message to the peers that want it
+ *
+ * Can be called from any thread. Nothing is copied while no peer has
+ * subscribers for any topic.
+ *
+ * @param cluster the Cluster
+ * @param topic the topic name
+ * @param topic_len length of the name, at most 255
+ * @param type WS_TEXT or WS_BINARY
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if the message is too big or out of memory
+ */
+int cluster_forward(Cluster *cluster, const char *topic, size_t topic_len, uint8_t type,
+                    const uint8_t *data, size_t len) {
+    if (len > MAX_MESSAGE_SIZE)
+        return -1;
+    if (__atomic_load_n(&cluster->remote_topics, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    ClusterEvent* event = new_event(CLUSTER_MSG, topic, topic_len, 1 + len);
+    if (event == NULL)
+        return -1;
+
+    uint8_t* body = event->record + RECORD_HEADER + topic_len;
+    body[0] = type;
+    if (len > 0)
+        memcpy(body + 1, data, len);
+
+    push_event(cluster, event);
+    return 0;
+}
+
+/**
+ * @brief Set the events epoll waits for the link
+ *
+ * @param cluster the Cluster
+ * @param link the link
+ * @param want_write true if the socket is full and EPOLLOUT is needed
+ */
+static void watch_link(Cluster *cluster, ClusterLink *link, bool want_write) {
+    if (link->want_write == want_write)
+        return;
+
+    struct epoll_event event = {
+        .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+        .data.ptr = link,
+    };
+    epoll_ctl(cluster->epoll_fd, EPOLL_CTL_MOD, link->fd, &event);
+    link->want_write = want_write;
+}
+
+/**
+ * @brief Close the socket of the link
+ *
+ * Outbound links are dialed again later, inbound links are freed since the
+ * peer dials them again.
+ *
+ * @param cluster the Cluster
+ * @param link the link
+ */
+static void drop_link(Cluster *cluster, ClusterLink *link) {
+    epoll_ctl(cluster->epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+    close(link->fd);
+    link->fd = -1;
+
+    if (link->connected) {
+        metrics_add(METRIC_CLUSTER_LINKS, -1);
+        LOG_WARN("Cluster link %s is down", link->name);
+    }
+    link->connected = false;
+    link->want_write = false;
+    free(link->in);
+    free(link->out);
+    link->in = NULL;
+    link->out = NULL;
+    link->in_len = link->in_cap = 0;
+    link->out_len = link->out_cap = link->out_sent = 0;
+
+    if (link->outbound) {
+        link->retry_ns = metrics_now_ns() + RECONNECT_NS;
+        return;
+    }
+
+    __atomic_sub_fetch(&cluster->remote_topics, link->interest.count, __ATOMIC_RELAXED);
+    topic_table_free(&link->interest);
+
+    ClusterLink** prev = &cluster->links;
+    while (*prev != link)
+        prev = &(*prev)->next;
+    *prev = link->next;
+    free(link);
+}
+
+/**
+ * @brief Add the record to the output of the link
+ *
+ * @param link the link
+ * @param record the record
+ * @param len length of the record
+ * @return int 1 if success, 0 if the record was dropped
+ */
+static int append_output(ClusterLink *link, const uint8_t *record, size_t len) {
+    if (link->out_len - link->out_sent + len > LINK_MAX_OUTPUT) {
+        metrics_add(METRIC_CLUSTER_DROPPED, 1);
+        return 0;
+    }
+
+    if (link->out_len + len > link->out_cap) {
+        // Move the unwritten bytes to the start before growing
+        if (link->out_sent > 0) {
+            memmove(link->out, link->out + link->out_sent, link->out_len - link->out_sent);
+            link->out_len -= link->out_sent;
+            link->out_sent = 0;
+        }
+        size_t cap = link->out_cap != 0 ? link->out_cap : LINK_READ_SIZE;
+        while (cap < link->out_len + len)
+            cap *= 2;
+        if (cap != link->out_cap) {
+            uint8_t* out = realloc(link->out, cap);
+            if (out == NULL) {
+                metrics_add(METRIC_CLUSTER_DROPPED, 1);
+                return 0;
+            }
+            link->out = out;
+            link->out_cap = cap;
+        }
+    }
+
+    memcpy(link->out + link->out_len, record, len);
+    link->out_len += len;
+    return 1;
+}
+
+/**
+ * @brief Write the output of the link
+ *
+ * Every record added during the round goes out with a single send.
+ *
+ * @param cluster the Cluster
+ * @param link the link
+ * @return int 1 if the link is still up, 0 if it was dropped
+ */
+static int flush_link(Cluster *cluster, ClusterLink *link) {
+    while (link->out_sent < link->out_len) {
+        ssize_t n = send(link->fd, link->out + link->out_sent, link->out_len - link->out_sent,
+                         MSG_NOSIGNAL);
+        metrics_add(METRIC_CLUSTER_WRITES, 1);
+
+        if (n > 0) {
+            link->out_sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            watch_link(cluster, link, true);
+            return 1;
+        } else if (errno != EINTR) {
+            drop_link(cluster, link);
+            return 0;
+        }
+    }
+
+    link->out_sent = 0;
+    link->out_len = 0;
+    watch_link(cluster, link, false);
+    return 1;
+}
+
+/**
+ * @brief Handle a record the peer sent
+ *
+ * @param cluster the Cluster
+ * @param link the link the record came from
+ * @param record the record after the length field
+ * @param len length of the record
+ * @return int 1 if success, 0 if the record is broken
+ */
+static int handle_record(Cluster *cluster, ClusterLink *link, const uint8_t *record, size_t len) {
+    uint8_t kind = record[0];
+    size_t topic_len = record[1];
+    const char* topic = (const char*)record + 2;
+
+    if (topic_len == 0 || 2 + topic_len > len)
+        return 0;
+
+    uint64_t hash = topic_hash(topic, topic_len);
+    Topic* found;
+
+    switch (kind) {
+        case CLUSTER_SUB:
+            if (link->outbound)
+                return 0;
+            if (topic_find(&link->interest, topic, topic_len, hash) != NULL)
+                return 1;
+            if (topic_add(&link->interest, topic, topic_len, hash) == NULL)
+                return 0;
+            __atomic_add_fetch(&cluster->remote_topics, 1, __ATOMIC_RELAXED);
+            return 1;
+        case CLUSTER_UNSUB:
+            if (link->outbound)
+                return 0;
+            found = topic_find(&link->interest, topic, topic_len, hash);
+            if (found != NULL) {
+                topic_remove(&link->interest, found);
+                __atomic_sub_fetch(&cluster->remote_topics, 1, __ATOMIC_RELAXED);
+            }
+            return 1;
+        case CLUSTER_MSG:
+            if (!link->outbound || 3 + topic_len > len)
+                return 0;
+            uint8_t type = record[2 + topic_len];
+            if (type != WS_TEXT && type != WS_BINARY)
+                return 0;
+            metrics_add(METRIC_CLUSTER_RECEIVED, 1);
+            pubsub_publish_local(cluster->wss, topic, topic_len, type,
+                                 record + 3 + topic_len, len - 3 - topic_len);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Read from the link and handle the complete records
+ *
+ * @param cluster the Cluster
+ * @param link the link
+ */
+static void read_link(Cluster *cluster, ClusterLink *link) {
+    for (;;) {
+        // Room for a read, or for the whole record that is coming
+        size_t need = link->in_len + LINK_READ_SIZE;
+        if (link->in_len >= 4) {
+            size_t record_len = 4 + ((uint32_t)link->in[0] << 24 | (uint32_t)link->in[1] << 16 |
+                                     (uint32_t)link->in[2] << 8 | link->in[3]);
+            if (record_len > need)
+                need = record_len;
+        }
+        if (need > link->in_cap) {
+            uint8_t* in = realloc(link->in, need);
+            if (in == NULL) {
+                LOG_ERROR("cluster buffer alloc failed");
+                drop_link(cluster, link);
+                return;
+            }
+            link->in = in;
+            link->in_cap = need;
+        }
+
+        size_t space = link->in_cap - link->in_len;
+        ssize_t n = recv(link->fd, link->in + link->in_len, space, 0);
+        if (n == 0) {
+            drop_link(cluster, link);
+            return;
+        }
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                drop_link(cluster, link);
+            return;
+        }
+        link->in_len += n;
+
+        size_t offset = 0;
+        while (link->in_len - offset >= 4) {
+            const uint8_t* p = link->in + offset;
+            size_t record_len = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                                (uint32_t)p[2] << 8 | p[3];
+            if (record_len < 2 || record_len > MAX_RECORD) {
+                LOG_WARN("Broken record from cluster link %s", link->name);
+                drop_link(cluster, link);
+                return;
+            }
+            if (link->in_len - offset < 4 + record_len)
+                break;
+            if (!handle_record(cluster, link, p + 4, record_len)) {
+                LOG_WARN("Broken record from cluster link %s", link->name);
+                drop_link(cluster, link);
+                return;
+            }
+            offset += 4 + record_len;
+        }
+
+        link->in_len -= offset;
+        if (link->in_len > 0 && offset > 0)
+            memmove(link->in, link->in + offset, link->in_len);
+
+        // The socket is drained
+        if ((size_t)n < space)
+            return;
+    }
+}
+
+/**
+ * @brief Queue a record for every topic of this node to the new link
+ *
+ * @param cluster the Cluster
+ * @param link the outbound link
+ */
+static void send_interest(Cluster *cluster, ClusterLink *link) {
+    for (size_t i = 0; i < cluster->local.bucket_count; i++) {
+        for (Topic* topic = cluster->local.buckets[i]; topic != NULL; topic = topic->next) {
+            ClusterEvent* event = new_event(CLUSTER_SUB, topic->name, strlen(topic->name), 0);
+            if (event == NULL)
+                continue;
+            append_output(link, event->record, event->len);
+            free(event);
+        }
+    }
+}
+
+static void link_up(Cluster *cluster, ClusterLink *link) {
+    link->connected = true;
+    metrics_add(METRIC_CLUSTER_LINKS, 1);
+    LOG_INFO("Cluster link %s is up", link->name);
+}
+
+/**
+ * @brief Start dialing the outbound link
+ *
+ * @param cluster the Cluster
+ * @param link the link
+ */
+static void dial_link(Cluster *cluster, ClusterLink *link) {
+    int fd = socket(link->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == -1) {
+        link->retry_ns = metrics_now_ns() + RECONNECT_NS;
+        return;
+    }
+
+    // The records are batched here, so they should go out right away
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr*)&link->addr, link->addr_len) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        link->retry_ns = metrics_now_ns() + RECONNECT_NS;
+        return;
+    }
+
+    // EPOLLOUT tells when the connect has finished
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = link };
+    if (epoll_ctl(cluster->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        link->retry_ns = metrics_now_ns() + RECONNECT_NS;
+        return;
+    }
+    link->fd = fd;
+    link->want_write = true;
+    link->retry_ns = 0;
+}
+
+/**
+ * @brief Check the result of the connect and tell the peer what we want
+ *
+ * @param cluster the Cluster
+ * @param link the link
+ */
+static void finish_connect(Cluster *cluster, ClusterLink *link) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+        // The peer may not be up yet, so this is not worth a warning
+        LOG_DEBUG("Cannot connect to cluster peer %s", link->name);
+        drop_link(cluster, link);
+        return;
+    }
+
+    link_up(cluster, link);
+    send_interest(cluster, link);
+    flush_link(cluster, link);
+}
+
+/**
+ * @brief Put the address in text for the logs
+ *
+ * @param addr the address
+ * @param out where the text is written
+ * @param size size of out
+ */
+static void format_addr(const struct sockaddr_storage *addr, char *out, size_t size) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    unsigned int port = 0;
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        port = ntohs(in->sin_port);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        port = ntohs(in6->sin6_port);
+    }
+    snprintf(out, size, "%s:%u", host, port);
+}
+
+/**
+ * @brief Get the IP address without the port
+ *
+ * An IPv4 address mapped to IPv6, like a v4 peer of a v6 socket gets, is
+ * taken as the IPv4 address.
+ *
+ * @param addr the address
+ * @param len set to the length of the address
+ * @return const uint8_t* the address bytes or NULL if not IP
+ */
+static const uint8_t* host_bytes(const struct sockaddr_storage *addr, size_t *len) {
+    static const uint8_t v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    if (addr->ss_family == AF_INET) {
+        *len = 4;
+        return (const uint8_t*)&((const struct sockaddr_in*)addr)->sin_addr;
+    }
+    if (addr->ss_family == AF_INET6) {
+        const uint8_t* bytes = ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+        if (!memcmp(bytes, v4_mapped, sizeof(v4_mapped))) {
+            *len = 4;
+            return bytes + 12;
+        }
+        *len = 16;
+        return bytes;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check if the address is one of the peers in the list
+ *
+ * The peers dial from any port, so only the hosts are compared.
+ *
+ * @param cluster the Cluster
+ * @param addr address of the link
+ * @return bool true if a peer has the address
+ */
+bool cluster_peer_allowed(Cluster *cluster, const struct sockaddr_storage *addr) {
+    size_t len;
+    const uint8_t* host = host_bytes(addr, &len);
+    if (host == NULL)
+        return false;
+
+    for (ClusterLink* link = cluster->links; link != NULL; link = link->next) {
+        size_t peer_len;
+        const uint8_t* peer = link->outbound ? host_bytes(&link->addr, &peer_len) : NULL;
+        if (peer != NULL && peer_len == len && !memcmp(peer, host, len))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Accept the links the peers dialed
+ *
+ * @param cluster the Cluster
+ */
+static void accept_links(Cluster *cluster) {
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(cluster->listen_fd, (struct sockaddr*)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        // Anybody else could subscribe to every topic
+        if (!cluster_peer_allowed(cluster, &addr)) {
+            char name[64];
+            format_addr(&addr, name, sizeof(name));
+            LOG_WARN("Cluster link from %s refused, it's not a peer", name);
+            metrics_add(METRIC_CLUSTER_REFUSED, 1);
+            close(fd);
+            continue;
+        }
+
+        ClusterLink* link = calloc(1, sizeof(ClusterLink));
+        if (link == NULL) {
+            close(fd);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        link->fd = fd;
+        link->addr = addr;
+        link->addr_len = addr_len;
+        format_addr(&addr, link->name, sizeof(link->name));
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = link };
+        if (epoll_ctl(cluster->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            free(link);
+            continue;
+        }
+        link->next = cluster->links;
+        cluster->links = link;
+        link_up(cluster, link);
+    }
+}
+
+/**
+ * @brief Handle the records the reactors and the publishers handed over
+ *
+ * @param cluster the Cluster
+ */
+static void handle_events(Cluster *cluster) {
+    ClusterEvent* event = __atomic_exchange_n(&cluster->events, NULL, __ATOMIC_ACQUIRE);
+    ClusterEvent* head = NULL;
+
+    // The list is newest first, the subscribes and unsubscribes of a topic
+    // must be handled in order
+    while (event != NULL) {
+        ClusterEvent* next = event->next;
+        event->next = head;
+        head = event;
+        event = next;
+    }
+
+    while (head != NULL) {
+        ClusterEvent* next = head->next;
+        uint8_t kind = head->record[4];
+        size_t topic_len = head->record[5];
+        const char* topic = (const char*)head->record + RECORD_HEADER;
+        uint64_t hash = topic_hash(topic, topic_len);
+        Topic* found;
+
+        // Only the first subscribe and the last unsubscribe of the node
+        // reach the peers
+        bool send = false;
+        switch (kind) {
+            case CLUSTER_SUB:
+                found = topic_find(&cluster->local, topic, topic_len, hash);
+                if (found == NULL)
+                    found = topic_add(&cluster->local, topic, topic_len, hash);
+                send = found != NULL && found->count++ == 0;
+                break;
+            case CLUSTER_UNSUB:
+                found = topic_find(&cluster->local, topic, topic_len, hash);
+                if (found != NULL && --found->count == 0) {
+                    topic_remove(&cluster->local, found);
+                    send = true;
+                }
+                break;
+            case CLUSTER_MSG:
+                for (ClusterLink* link = cluster->links; link != NULL; link = link->next) {
+                    if (link->outbound || !link->connected ||
+                        topic_find(&link->interest, topic, topic_len, hash) == NULL)
+                        continue;
+                    if (append_output(link, head->record, head->len))
+                        metrics_add(METRIC_CLUSTER_FORWARDED, 1);
+                }
+                break;
+        }
+
+        if (send) {
+            for (ClusterLink* link = cluster->links; link != NULL; link = link->next) {
+                if (link->outbound && link->connected)
+                    append_output(link, head->record, head->len);
+            }
+        }
+
+        free(head);
+        head = next;
+    }
+}
+
+/**
+ * @brief Get how long epoll_wait can sleep before a link is dialed again
+ *
+ * @param cluster the Cluster
+ * @param now current time in nanoseconds
+ * @return int the timeout in milliseconds, -1 if nothing waits
+ */
+static int retry_timeout(Cluster *cluster, uint64_t now) {
+    int timeout = -1;
+
+    for (ClusterLink* link = cluster->links; link != NULL; link = link->next) {
+        if (!link->outbound || link->fd != -1)
+            continue;
+        int wait_ms = link->retry_ns > now ? (int)((link->retry_ns - now + 999999) / 1000000) : 0;
+        if (timeout == -1 || wait_ms < timeout)
+            timeout = wait_ms;
+    }
+    return timeout;
+}
+
+static void* cluster_loop(void *arg) {
+    Cluster* cluster = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!__atomic_load_n(&cluster->stopping, __ATOMIC_ACQUIRE)) {
+        uint64_t now = metrics_now_ns();
+        for (ClusterLink* link = cluster->links; link != NULL; link = link->next) {
+            if (link->outbound && link->fd == -1 && link->retry_ns <= now)
+                dial_link(cluster, link);
+        }
+
+        int count = epoll_wait(cluster->epoll_fd, events, MAX_EVENTS,
+                               retry_timeout(cluster, metrics_now_ns()));
+        if (count == -1) {
+            if (errno != EINTR)
+                LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+            count = 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            void* ptr = events[i].data.ptr;
+
+            if (ptr == NULL) {
+                uint64_t value;
+                ssize_t n = read(cluster->wake_fd, &value, sizeof(value));
+                (void)n;
+                continue;
+            }
+            if (ptr == cluster) {
+                accept_links(cluster);
+                continue;
+            }
+
+            ClusterLink* link = ptr;
+            if (!link->connected) {
+                finish_connect(cluster, link);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT && !flush_link(cluster, link))
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                read_link(cluster, link);
+        }
+
+        // Everything handed over during the round goes out with one write
+        // per link
+        __atomic_store_n(&cluster->wake_pending, false, __ATOMIC_SEQ_CST);
+        handle_events(cluster);
+
+        ClusterLink* link = cluster->links;
+        while (link != NULL) {
+            ClusterLink* next = link->next;
+            if (link->connected && link->out_len > link->out_sent && !link->want_write)
+                flush_link(cluster, link);
+            link = next;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Add an outbound link for the peer address
+ *
+ * @param cluster the Cluster
+ * @param peer "host:port", or "[v6 address]:port"
+ * @return int 1 if success, 0 if the address is bad
+ */
+static int add_peer(Cluster *cluster, const char *peer) {
+    char host[256];
+    const char* colon = strrchr(peer, ':');
+
+    if (colon == NULL || (size_t)(colon - peer) >= sizeof(host)) {
+        fprintf(stderr, "invalid cluster peer %s\n", peer);
+        return 0;
+    }
+    const char* start = peer;
+    const char* end = colon;
+    if (*start == '[' && end > start && end[-1] == ']') {
+        start++;
+        end--;
+    }
+    memcpy(host, start, end - start);
+    host[end - start] = '\0';
+
+    struct addrinfo hints;
+    struct addrinfo* addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    int status = getaddrinfo(host, colon + 1, &hints, &addr);
+    if (status != 0) {
+        fprintf(stderr, "invalid cluster peer %s: %s\n", peer, gai_strerror(status));
+        return 0;
+    }
+
+    ClusterLink* link = calloc(1, sizeof(ClusterLink));
+    if (link == NULL) {
+        freeaddrinfo(addr);
+        return 0;
+    }
+    link->fd = -1;
+    link->outbound = true;
+    memcpy(&link->addr, addr->ai_addr, addr->ai_addrlen);
+    link->addr_len = addr->ai_addrlen;
+    snprintf(link->name, sizeof(link->name), "%.63s", peer);
+    freeaddrinfo(addr);
+
+    link->next = cluster->links;
+    cluster->links = link;
+    return 1;
+}
+
+/**
+ * @brief Open the socket the peers dial
+ *
+ * Without cluster_bind the port is on the bind address of the server, or
+ * on loopback if the server listens on every address. The links are not
+ * meant for the internet.
+ *
+ * @param config the settings
+ * @return int the listening socket or -1 if fail
+ */
+static int open_cluster_listener(const WebSocketServerConfig *config) {
+    struct addrinfo hints;
+    struct addrinfo* addr;
+    char port[8];
+    const char* bind_address = config->cluster_bind;
+
+    if (bind_address == NULL)
+        bind_address = config->bind_address != NULL ? config->bind_address : "127.0.0.1";
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(port, sizeof(port), "%u", (unsigned int)config->cluster_port);
+
+    if (getaddrinfo(bind_address, port, &hints, &addr) != 0) {
+        fprintf(stderr, "invalid cluster bind address %s\n", bind_address);
+        return -1;
+    }
+
+    int fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    int one = 1;
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        bind(fd, addr->ai_addr, addr->ai_addrlen) == -1 || listen(fd, 128) == -1) {
+        perror("cannot open the cluster port");
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addr);
+    return fd;
+}
+
+/**
+ * @brief Open the cluster port and parse the peers
+ *
+ * @param wss the server, config.cluster_port is set
+ * @return Cluster* the cluster or NULL if fail
+ */
+Cluster* create_cluster(WebSocketServer *wss) {
+    Cluster* cluster = calloc(1, sizeof(Cluster));
+    if (cluster == NULL)
+        return NULL;
+
+    cluster->wss = wss;
+    cluster->listen_fd = open_cluster_listener(&wss->config);
+    cluster->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    cluster->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cluster->listen_fd == -1 || cluster->epoll_fd == -1 || cluster->wake_fd == -1) {
+        free_cluster(cluster);
+        return NULL;
+    }
+
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event listen = { .events = EPOLLIN, .data.ptr = cluster };
+    if (epoll_ctl(cluster->epoll_fd, EPOLL_CTL_ADD, cluster->wake_fd, &wake) == -1 ||
+        epoll_ctl(cluster->epoll_fd, EPOLL_CTL_ADD, cluster->listen_fd, &listen) == -1) {
+        free_cluster(cluster);
+        return NULL;
+    }
+
+    // Comma separated list of the other nodes
+    const char* peers = wss->config.cluster_peers;
+    while (peers != NULL && *peers != '\0') {
+        char peer[300];
+        size_t len = strcspn(peers, ",");
+        if (len > 0 && len < sizeof(peer)) {
+            memcpy(peer, peers, len);
+            peer[len] = '\0';
+            if (!add_peer(cluster, peer)) {
+                free_cluster(cluster);
+                return NULL;
+            }
+        }
+        peers += len;
+        if (*peers == ',')
+            peers++;
+    }
+
+    return cluster;
+}
+
+/**
+ * @brief Start the thread that runs the links
+ *
+ * @param cluster the Cluster
+ * @return int 1 if success, 0 if fail
+ */
+int start_cluster(Cluster *cluster) {
+    cluster->started = pthread_create(&cluster->thread, NULL, cluster_loop, cluster) == 0;
+    return cluster->started;
+}
+
+/**
+ * @brief Stop the thread and close every link
+ *
+ * The events that were not handled yet are lost.
+ *
+ * @param cluster the Cluster
+ */
+void free_cluster(Cluster *cluster) {
+    if (cluster->started) {
+        __atomic_store_n(&cluster->stopping, true, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        ssize_t n = write(cluster->wake_fd, &one, sizeof(one));
+        (void)n;
+        pthread_join(cluster->thread, NULL);
+    }
+
+    ClusterLink* link = cluster->links;
+    while (link != NULL) {
+        ClusterLink* next = link->next;
+        if (link->fd != -1) {
+            close(link->fd);
+            if (link->connected)
+                metrics_add(METRIC_CLUSTER_LINKS, -1);
+        }
+        free(link->in);
+        free(link->out);
+        topic_table_free(&link->interest);
+        free(link);
+        link = next;
+    }
+
+    ClusterEvent* event = __atomic_exchange_n(&cluster->events, NULL, __ATOMIC_ACQUIRE);
+    while (event != NULL) {
+        ClusterEvent* next = event->next;
+        free(event);
+        event = next;
+    }
+
+    topic_table_free(&cluster->local);
+    if (cluster->listen_fd != -1)
+        close(cluster->listen_fd);
+    if (cluster->epoll_fd != -1)
+        close(cluster->epoll_fd);
+    if (cluster->wake_fd != -1)
+        close(cluster->wake_fd);
+    free(cluster);
+}
@@ -0,0 +1,112 @@
+#ifndef WEB_SOCKET_CLUSTER_H
+#define WEB_SOCKET_CLUSTER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+#include "pubsub.h"
+#include "server.h"
+
+/**
+ * Cluster backplane
+ *
+ * Every node dials every peer in its list and keeps the link open. The
+ * node tells the peer over the link it dialed which topics it has
+ * subscribers for, and the peer sends the messages of those topics back
+ * on the same link. A node with no subscribers for a topic gets none of
+ * its messages.
+ *
+ * One thread per process runs the links. Reactors and publishers hand it
+ * work with a lock-free list, and everything handed over during a round
+ * is written to a link with a single write.
+ *
+ * A message is forwarded only by the node it was published on, the peers
+ * deliver it to their own subscribers. So every node has to list every
+ * other node. The list is also who may link to the node, a link from any
+ * other host is closed right away. The links are not encrypted, so the
+ * cluster port is for a private network.
+ *
+ * The records on the links are
+ *   uint32 length of the rest of the record, big endian
+ *   uint8 kind, CLUSTER_SUB, CLUSTER_UNSUB or CLUSTER_MSG
+ *   uint8 length of the topic
+ *   the topic
+ *   for CLUSTER_MSG, uint8 message type and the payload
+ */
+
+#define CLUSTER_SUB 1
+#define CLUSTER_UNSUB 2
+#define CLUSTER_MSG 3
+
+// ClusterEvent is a record handed to the cluster thread
+typedef struct ClusterEvent {
+    struct ClusterEvent* next;
+    // Length of the record
+    size_t len;
+    // The record as it's written to the links
+    uint8_t record[];
+} ClusterEvent;
+
+typedef struct ClusterLink {
+    struct ClusterLink* next;
+    int fd;
+    // Dialed by this node. The outbound links carry the interest of this
+    // node and bring back the messages, the inbound links the other way
+    bool outbound;
+    // The connect has finished
+    bool connected;
+    // True while the thread waits for EPOLLOUT
+    bool want_write;
+    // Address of the peer, printable for the logs
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[64];
+    // Time to dial the outbound link again after it was lost
+    uint64_t retry_ns;
+    // Received bytes that don't make a whole record yet
+    uint8_t* in;
+    size_t in_len;
+    size_t in_cap;
+    // Records waiting to be written
+    uint8_t* out;
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;
+    // Topics the peer wants, only on the inbound links
+    TopicTable interest;
+} ClusterLink;
+
+typedef struct Cluster {
+    WebSocketServer* wss;
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    int listen_fd;
+    // True from the first wake up until the thread takes the events
+    bool wake_pending;
+    // The thread runs, and free_cluster asked it to stop
+    bool started;
+    bool stopping;
+    // Records handed to the thread, newest first
+    ClusterEvent* events;
+    // Every link, only the cluster thread touches these
+    ClusterLink* links;
+    // Topics the peers want in total, the publishers skip the copy at 0
+    size_t remote_topics;
+    // Topics with subscribers on this node. count is the amount of
+    // reactors that have subscribers
+    TopicTable local;
+} Cluster;
+
+Cluster* create_cluster(WebSocketServer *wss);
+int start_cluster(Cluster *cluster);
+void free_cluster(Cluster *cluster);
+bool cluster_peer_allowed(Cluster *cluster, const struct sockaddr_storage *addr);
+void cluster_interest(Cluster *cluster, const char *topic, bool subscribe);
+int cluster_forward(Cluster *cluster, const char *topic, size_t topic_len, uint8_t type,
+                    const uint8_t *data, size_t len);
+
+#endif
@@ -16,7 +16,7 @@ static int char_val_table[128] = {
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 10
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 20
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 30
-    -1, -1, -1, -1, 62, -1, -1, 63, 52, 53, // 40
+    -1, -1, -1, 62, -1, -1, -1, 63, 52, 53, // 40
     54, 55, 56, 57, 58, 59, 60, 61, -1, -1, // 50
     -1, 64, -1, -1, -1,  0,  1,  2,  3,  4, // 60
      5,  6,  7,  8,  9, 10, 11, 12, 13, 14, // 70
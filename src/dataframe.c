@@ -61,6 +61,70 @@ uint64_t len_bytes_int(uint8_t* bytes, size_t size) {
     return value;
 }
 
+/**
+ * @brief Mask or unmask the payload in place
+ *
+ * Masking is a xor with the mask key so the same function does both
+ *
+ * @param data the payload bytes
+ * @param len amount of bytes in payload
+ * @param mask the four mask bytes in the order they are in the frame
+ */
+void mask_data(uint8_t* data, uint64_t len, const uint8_t* mask) {
+    // https://developer.mozilla.org/en-US/docs/Web/API/WebSockets_API/Writing_WebSocket_servers#Reading_and_Unmasking_the_Data
+    for (uint64_t i = 0; i < len; i++) {
+        data[i] = data[i] ^ mask[i % 4];
+    }
+}
+
+/**
+ * @brief Copy the payload and mask it on the way
+ *
+ * The client masks every frame it sends, so the mask is applied eight
+ * bytes at a time while the payload is copied to the send buffer.
+ *
+ * @param out where the masked payload is written
+ * @param data the payload bytes
+ * @param len amount of bytes in payload
+ * @param mask the four mask bytes in the order they are in the frame
+ */
+void mask_copy(uint8_t* out, const uint8_t* data, uint64_t len, const uint8_t* mask) {
+    uint8_t pattern[8];
+    uint64_t mask64;
+    uint64_t i = 0;
+
+    // The mask repeats every four bytes, so two of them fill a word in
+    // the same byte order as the payload
+    memcpy(pattern, mask, 4);
+    memcpy(pattern + 4, mask, 4);
+    memcpy(&mask64, pattern, 8);
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= mask64;
+        memcpy(out + i, &word, 8);
+    }
+    for (; i < len; i++)
+        out[i] = data[i] ^ mask[i % 4];
+}
+
+/**
+ * @brief Get the total length of the frame from the first bytes of it
+ *
+ * @param data the bytes received so far
+ * @param len amount of bytes received so far
+ * @return uint64_t total length of the frame or 0 if there isn't enough
+ * bytes to tell the length yet
+ */
+uint64_t get_frame_length(uint8_t* data, uint64_t len) {
+    Dataframe frame;
+
+    if (read_frame_header(&frame, data, len) == 0)
+        return 0;
+    return frame.total_len;
+}
+
 void init_dataframe(Dataframe *frame) {
     frame->control = 0;
     frame->data_info = 0;
@@ -122,13 +186,12 @@ void set_mask_key(Dataframe *frame, uint32_t mask_key) {
 }
 
 /**
- * @brief Allocate the memory for the actual data and set it
+ * @brief Set the payload length of the frame without setting the data
  *
- * @param frame The Dataframe you want to set the data to
- * @param mask_key byte array of the data you want to set
- * @param len the length of the array
+ * @param frame The Dataframe you want to set the length to
+ * @param len the length of the payload
  */
-void set_data(Dataframe *frame, uint8_t* data, uint64_t len) {
+void set_data_length(Dataframe *frame, uint64_t len) {
     // First set the data_info length bytes
     // Length bits are the seven left most bits
     // if length is < 126 we can store the whole length to info_byte
@@ -146,6 +209,17 @@ void set_data(Dataframe *frame, uint8_t* data, uint64_t len) {
 
     // Set the data_length
     frame->data_length = len;
+}
+
+/**
+ * @brief Allocate the memory for the actual data and set it
+ *
+ * @param frame The Dataframe you want to set the data to
+ * @param mask_key byte array of the data you want to set
+ * @param len the length of the array
+ */
+void set_data(Dataframe *frame, uint8_t* data, uint64_t len) {
+    set_data_length(frame, len);
 
     // Allocate the memory for the data and copy the data to it
     frame->data = (uint8_t*) malloc(sizeof(uint8_t) * len);
@@ -153,6 +227,88 @@ void set_data(Dataframe *frame, uint8_t* data, uint64_t len) {
 
 }
 
+/**
+ * @brief Parse the frame header without touching the payload
+ *
+ * The payload is left where it is, so the caller can use it straight
+ * from the receive buffer. frame->data stays NULL.
+ *
+ * @param frame The Dataframe the header values are set to
+ * @param data the bytes received so far
+ * @param len amount of bytes received so far
+ * @return uint64_t length of the header or 0 if the header is not complete
+ */
+uint64_t read_frame_header(Dataframe *frame, uint8_t* data, uint64_t len) {
+    uint64_t header_len = 2;
+
+    if (len < 2)
+        return 0;
+
+    frame->control = data[0];
+    frame->data_info = data[1];
+
+    if (DATA_INFO_LEN(frame) == 126)
+        header_len += 2;
+    else if (DATA_INFO_LEN(frame) == 127)
+        header_len += 8;
+    if (HAS_MASK(frame))
+        header_len += 4;
+
+    if (len < header_len)
+        return 0;
+
+    if (DATA_INFO_LEN(frame) == 126)
+        frame->data_length = len_bytes_int(data + 2, 2);
+    else if (DATA_INFO_LEN(frame) == 127)
+        frame->data_length = len_bytes_int(data + 2, 8);
+    else
+        frame->data_length = DATA_INFO_LEN(frame);
+
+    // The mask bytes are right before the payload
+    if (HAS_MASK(frame))
+        frame->mask_key = (int32_t)len_bytes_int(data + header_len - 4, 4);
+
+    frame->total_len = header_len + frame->data_length;
+    return header_len;
+}
+
+/**
+ * @brief Write the header bytes of the frame
+ *
+ * The payload is not written, so it can be sent from where it already is.
+ * Masking the payload is up to the caller.
+ *
+ * @param frame The Dataframe which header is written
+ * @param out buffer for the header, needs space for 14 bytes
+ * @return uint64_t length of the header
+ */
+uint64_t get_frame_header(Dataframe *frame, uint8_t* out) {
+    uint64_t header_len = 2;
+
+    // The control byte needs to be first
+    out[0] = frame->control;
+    // The second contains the frame info
+    out[1] = frame->data_info;
+
+    // If the info length is 126 copy the full length as two byte array
+    if (DATA_INFO_LEN(frame) == 126) {
+        memcpy(out + 2, UINT16_LEN_BYTES(frame), 2);
+        header_len += 2;
+    // If the info length is 127 copy the full length as eight byte array
+    } else if (DATA_INFO_LEN(frame) == 127) {
+        memcpy(out + 2, UINT64_LEN_BYTES(frame), 8);
+        header_len += 8;
+    }
+
+    if (HAS_MASK(frame)) {
+        memcpy(out + header_len, MASK_BYTES(frame), 4);
+        header_len += 4;
+    }
+
+    frame->total_len = header_len + frame->data_length;
+    return header_len;
+}
+
 /**
  * @brief Create frame struct from data array
  *
@@ -194,10 +350,7 @@ int create_frame(Dataframe *frame, uint8_t* data) {
         // The msg starts right after the mask bytes
         uint8_t* msg = data + current_index;
 
-        // https://developer.mozilla.org/en-US/docs/Web/API/WebSockets_API/Writing_WebSocket_servers#Reading_and_Unmasking_the_Data
-        for (uint64_t i = 0; i < frame->data_length; i++) {
-            msg[i] = msg[i] ^ mask[i % 4];
-        }
+        mask_data(msg, frame->data_length, mask);
     }
 
     // Set total length to be the current_index (i.e. how many bytes before actual data)
@@ -218,49 +371,21 @@ int create_frame(Dataframe *frame, uint8_t* data) {
  * @return uint8_t* pointer to the array
  */
 uint8_t* get_frame_bytes(Dataframe *frame) {
-    uint8_t* data_bytes = NULL;
+    uint8_t header[14];
     // Extra bytes are the bytes that are not the actual data bytes
-    // We always need atleast two since for the control and info byte
-    uint64_t extra_bytes = 2;
+    uint64_t extra_bytes = get_frame_header(frame, header);
 
-    // If the length in data_info is 126, we need two bytes to represent the value
-    // 126 reprecent 16 bit length value
-    if (DATA_INFO_LEN(frame) == 126)
-        extra_bytes += 2;
-    // If the length in data_info is 127, we need eight bytes to represent the value
-    // 127 reprecent 64 bit length value
-    else if (DATA_INFO_LEN(frame) == 127)
-        extra_bytes += 8;
-
-    // If frame has  mask, we need four bytes to store it
-    if (HAS_MASK(frame))
-        extra_bytes += 4;
-
-    // The total of the frame is the length of the data bytes and the extra bytes
-    uint64_t length = frame->data_length + extra_bytes;
-    // Set the total length to frame struct so it can be used when sending the data
-    frame->total_len = length;
     // Allocate the memory for the byte array
-    data_bytes = (uint8_t*) malloc(sizeof(uint8_t) * length);
-
-    // The control byte needs to be first
-    data_bytes[0] = frame->control;
-    // The second contains the frame info
-    data_bytes[1] = frame->data_info;
-
-    // If the info length is 126 copy the full length as two byte array
-    if (DATA_INFO_LEN(frame) == 126)
-        memcpy(data_bytes + 2, UINT16_LEN_BYTES(frame), 2);
-    // If the info length is 127 copy the full length as eight byte array
-    else if (DATA_INFO_LEN(frame) == 127)
-        memcpy(data_bytes + 2, UINT64_LEN_BYTES(frame), 8);
-
-    // If the frame has mask, append the four mask bytes to end of data_bytes
-    if (HAS_MASK(frame))
-        memcpy(data_bytes + strlen((char*)data_bytes), MASK_BYTES(frame), 4);
+    uint8_t* data_bytes = (uint8_t*) malloc(sizeof(uint8_t) * frame->total_len);
 
+    memcpy(data_bytes, header, extra_bytes);
     // Copy the actual data from frame to array
     memcpy(data_bytes + extra_bytes, frame->data, frame->data_length);
 
+    // If the frame has mask, the four mask bytes are right before the data
+    // and the data is sent masked
+    if (HAS_MASK(frame))
+        mask_data(data_bytes + extra_bytes, frame->data_length, header + extra_bytes - 4);
+
     return data_bytes;
 }
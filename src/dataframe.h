@@ -71,8 +71,14 @@ void free_dataframe(Dataframe *frame);
 void set_as_last_frame(Dataframe *frame);
 void set_op_code(Dataframe *frame, Opcode code);
 void set_mask_key(Dataframe *frame, uint32_t mask_key);
+void set_data_length(Dataframe *frame, uint64_t len);
 void set_data(Dataframe *frame, uint8_t* data, uint64_t len);
 uint64_t len_bytes_int(uint8_t* bytes, size_t size);
+void mask_data(uint8_t* data, uint64_t len, const uint8_t* mask);
+void mask_copy(uint8_t* out, const uint8_t* data, uint64_t len, const uint8_t* mask);
+uint64_t get_frame_length(uint8_t* data, uint64_t len);
+uint64_t read_frame_header(Dataframe *frame, uint8_t* data, uint64_t len);
+uint64_t get_frame_header(Dataframe *frame, uint8_t* out);
 int create_frame(Dataframe *frame, uint8_t* data);
 uint8_t* get_frame_bytes(Dataframe *frame);
 
@@ -0,0 +1,69 @@
+/**
+ * Example worker process for the server --workers option
+ *
+ * Reads the messages of the clients from the shared memory rings and sends
+ * every message back to its connection. A real worker runs the business
+ * logic here. The worker waits for the server to create the rings, so it
+ * can be started before the server, and exits when the server closes the
+ * rings.
+ *
+ * Usage: echo_worker [-i index] name
+ *   -i  index of this worker, below the --worker-count of the server
+ */
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+int main(int argc, char *argv[]) {
+    uint32_t index = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+            case 'i': index = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default: optind = argc + 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-i index] name\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    WorkerEnd* worker;
+    while ((worker = worker_attach(argv[optind], index)) == NULL)
+        usleep(100000);
+
+    uint64_t messages = 0, closed = 0;
+    WorkerMessage message;
+
+    while (!worker_closed(worker)) {
+        if (!worker_next(worker, &message)) {
+            worker_wait(worker);
+            continue;
+        }
+
+        if (message.type == WORKER_CLOSE) {
+            closed++;
+        } else {
+            // The reply ring is full while the server is behind, the
+            // request stays in its ring meanwhile
+            while (worker_reply(worker, message.handle, message.type, message.data,
+                                message.len) != 0 && !worker_closed(worker))
+                sched_yield();
+            messages++;
+        }
+        worker_done(worker);
+    }
+
+    printf("Server closed the rings, echoed %" PRIu64 " messages, %" PRIu64
+           " connections closed\n", messages, closed);
+    worker_detach(worker);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+#include <string.h>
+#include "histogram.h"
+
+/**
+ * @brief Get the index of the bucket the value belongs to
+ *
+ * @param value the recorded value
+ * @return int index to the counts array
+ */
+static int bucket_index(uint64_t value) {
+    // Small values have their own buckets
+    if (value < HIST_SUB_COUNT)
+        return (int)value;
+
+    // Position of the highest set bit
+    int msb = 63 - __builtin_clzll(value);
+    // How many bits the value needs to be shifted so only the
+    // HIST_SUB_BITS highest bits are left
+    int shift = msb - (HIST_SUB_BITS - 1);
+    // The top bits are in range [HIST_HALF_COUNT, HIST_SUB_COUNT)
+    int sub = (int)(value >> shift) - HIST_HALF_COUNT;
+
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + sub;
+}
+
+/**
+ * @brief Get the largest value that is counted to the bucket
+ *
+ * @param index index of the bucket
+ * @return uint64_t the highest value of the bucket
+ */
+uint64_t histogram_bucket_value(int index) {
+    if (index < HIST_SUB_COUNT)
+        return (uint64_t)index;
+
+    int shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    uint64_t sub = (uint64_t)((index - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT);
+
+    // Every value which top bits are sub belong to this bucket
+    return (sub << shift) | ((UINT64_C(1) << shift) - 1);
+}
+
+void init_histogram(Histogram *hist) {
+    memset(hist->counts, 0, sizeof(hist->counts));
+    hist->total = 0;
+    hist->sum = 0;
+    hist->min = UINT64_MAX;
+    hist->max = 0;
+}
+
+/**
+ * @brief Record a single value to histogram
+ *
+ * @param hist the Histogram
+ * @param value value to record
+ */
+void histogram_record(Histogram *hist, uint64_t value) {
+    hist->counts[bucket_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/**
+ * @brief Add the values of one histogram to another
+ *
+ * @param to the Histogram the values are added to
+ * @param from the Histogram the values are read from
+ */
+void histogram_merge(Histogram *to, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+/**
+ * @brief Get the value at percentile
+ *
+ * @param hist the Histogram
+ * @param percentile percentile in range 0-100, like 99.9
+ * @return uint64_t the highest value of the bucket the percentile is in
+ */
+uint64_t histogram_percentile(const Histogram *hist, double percentile) {
+    if (hist->total == 0)
+        return 0;
+
+    // The amount of values that need to be at or below the result
+    uint64_t wanted = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    if (wanted == 0)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = histogram_bucket_value(i);
+            // The bucket value can't be larger than the largest value we saw
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+/**
+ * @brief Record a value to histogram that is read by other threads
+ *
+ * Only one thread may record to the histogram, but any thread can merge
+ * it with histogram_merge_relaxed at the same time without locks. Every
+ * field is stored with a single relaxed atomic store so the reader never
+ * sees torn values, only slightly stale ones.
+ *
+ * @param hist the Histogram owned by the calling thread
+ * @param value value to record
+ */
+void histogram_record_relaxed(Histogram *hist, uint64_t value) {
+    int index = bucket_index(value);
+
+    __atomic_store_n(&hist->counts[index], hist->counts[index] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+    if (value < hist->min)
+        __atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->total, hist->total + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Add the values of a histogram another thread records to
+ *
+ * @param to the Histogram the values are added to
+ * @param from the Histogram recorded with histogram_record_relaxed
+ */
+void histogram_merge_relaxed(Histogram *to, const Histogram *from) {
+    uint64_t total = 0;
+
+    // The buckets are summed instead of reading the total, so the
+    // percentiles always add up even if values were recorded meanwhile
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t count = __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+        to->counts[i] += count;
+        total += count;
+    }
+
+    to->total += total;
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+
+    uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (min < to->min)
+        to->min = min;
+    if (max > to->max)
+        to->max = max;
+}
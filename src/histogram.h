@@ -0,0 +1,48 @@
+#ifndef WEB_SOCKET_HISTOGRAM_H
+#define WEB_SOCKET_HISTOGRAM_H
+
+#include <inttypes.h>
+
+/**
+ * Log-linear (HDR style) histogram
+ *
+ * Values below 2^HIST_SUB_BITS are counted exactly. Above that every power
+ * of two range is split to 2^(HIST_SUB_BITS - 1) linear buckets, so the
+ * recorded value is never off by more than 1 / 2^(HIST_SUB_BITS - 1)
+ * (~1.6%) while the whole uint64_t range fits to a fixed size array.
+ */
+
+// Amount of bits used for the linear part of the bucket
+#define HIST_SUB_BITS 7
+
+// Amount of exact buckets in the beginning of the histogram
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+
+// Amount of buckets in each power of two range after the exact buckets
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+
+// Total amount of buckets needed for the uint64_t range
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+typedef struct {
+    // counts has the amount of values recorded to each bucket
+    uint64_t counts[HIST_BUCKETS];
+    // total is the amount of recorded values
+    uint64_t total;
+    // sum of the recorded values, used for the mean
+    uint64_t sum;
+    // smallest recorded value
+    uint64_t min;
+    // largest recorded value
+    uint64_t max;
+} Histogram;
+
+void init_histogram(Histogram *hist);
+void histogram_record(Histogram *hist, uint64_t value);
+void histogram_merge(Histogram *to, const Histogram *from);
+uint64_t histogram_percentile(const Histogram *hist, double percentile);
+uint64_t histogram_bucket_value(int index);
+void histogram_record_relaxed(Histogram *hist, uint64_t value);
+void histogram_merge_relaxed(Histogram *to, const Histogram *from);
+
+#endif
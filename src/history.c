@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+#include "log.h"
+#include "metrics.h"
+
+/**
+ * @brief Create the message history of the topics
+ *
+ * @param size messages kept per topic
+ * @param linger_ns how long the ring of a topic without subscribers is kept
+ * @return History* the History or NULL if out of memory
+ */
+History* create_history(size_t size, uint64_t linger_ns) {
+    History* history = calloc(1, sizeof(History));
+    if (history == NULL)
+        return NULL;
+
+    pthread_mutex_init(&history->lock, NULL);
+    history->size = size;
+    history->linger_ns = linger_ns;
+    return history;
+}
+
+static void free_ring(History *history, HistoryRing *ring) {
+    for (size_t i = 0; i < ring->count; i++)
+        release_message(ring->messages[(ring->head + i) % history->size]);
+    free(ring->messages);
+    free(ring);
+}
+
+void free_history(History *history) {
+    for (size_t i = 0; i < history->topics.bucket_count; i++) {
+        for (Topic* topic = history->topics.buckets[i]; topic != NULL; topic = topic->next)
+            free_ring(history, topic->ring);
+    }
+    topic_table_free(&history->topics);
+    pthread_mutex_destroy(&history->lock);
+    free(history);
+}
+
+/**
+ * @brief Find the ring of the topic
+ *
+ * The caller holds the lock.
+ *
+ * @param history the History
+ * @param topic the topic name, doesn't have to be terminated
+ * @param len length of the name
+ * @param hash hash of the name
+ * @return HistoryRing* the ring or NULL if the topic has none
+ */
+HistoryRing* history_find(History *history, const char *topic, size_t len, uint64_t hash) {
+    Topic* found = topic_find(&history->topics, topic, len, hash);
+    return found != NULL ? found->ring : NULL;
+}
+
+/**
+ * @brief Add the message to the ring, the oldest message is dropped when
+ * the ring is full
+ *
+ * The caller holds the lock and the messages come in sequence order.
+ *
+ * @param history the History
+ * @param ring the ring of the topic of the message
+ * @param message the message, the ring takes a reference
+ */
+void history_append(History *history, HistoryRing *ring, PubMessage *message) {
+    __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+
+    if (ring->count == history->size) {
+        PubMessage* oldest = ring->messages[ring->head];
+        ring->floor = oldest->seq;
+        ring->messages[ring->head] = message;
+        ring->head = (ring->head + 1) % history->size;
+        release_message(oldest);
+        return;
+    }
+    ring->messages[(ring->head + ring->count) % history->size] = message;
+    ring->count++;
+}
+
+static void unlink_idle(History *history, HistoryRing *ring) {
+    if (ring->idle_prev != NULL)
+        ring->idle_prev->idle_next = ring->idle_next;
+    else
+        history->idle_head = ring->idle_next;
+    if (ring->idle_next != NULL)
+        ring->idle_next->idle_prev = ring->idle_prev;
+    else
+        history->idle_tail = ring->idle_prev;
+    ring->idle_prev = NULL;
+    ring->idle_next = NULL;
+}
+
+/**
+ * @brief Free the rings that have been without subscribers too long
+ *
+ * @param history the History, the lock is held
+ * @param now current time in nanoseconds
+ */
+static void expire_idle(History *history, uint64_t now) {
+    while (history->idle_head != NULL &&
+           now - history->idle_head->idle_since_ns > history->linger_ns) {
+        HistoryRing* ring = history->idle_head;
+        unlink_idle(history, ring);
+        topic_remove(&history->topics, ring->topic);
+        free_ring(history, ring);
+    }
+}
+
+/**
+ * @brief Start keeping the messages of the topic when a reactor gets its
+ * first subscriber, or start the linger when the last reactor loses its
+ * last one
+ *
+ * @param history the History
+ * @param topic the topic name
+ * @param subscribe true if the reactor subscribed, false if it left
+ */
+void history_watch(History *history, const char *topic, bool subscribe) {
+    size_t len = strlen(topic);
+    uint64_t hash = topic_hash(topic, len);
+    uint64_t now = metrics_now_ns();
+
+    pthread_mutex_lock(&history->lock);
+    expire_idle(history, now);
+
+    Topic* found = topic_find(&history->topics, topic, len, hash);
+    if (subscribe && found == NULL) {
+        HistoryRing* ring = calloc(1, sizeof(HistoryRing));
+        PubMessage** messages = malloc(history->size * sizeof(PubMessage*));
+        found = topic_add(&history->topics, topic, len, hash);
+        if (ring == NULL || messages == NULL || found == NULL) {
+            LOG_ERROR("history alloc failed");
+            if (found != NULL)
+                topic_remove(&history->topics, found);
+            free(ring);
+            free(messages);
+            pthread_mutex_unlock(&history->lock);
+            return;
+        }
+        ring->topic = found;
+        ring->messages = messages;
+        // Only the messages after this are recorded
+        ring->floor = __atomic_load_n(&history->seq, __ATOMIC_RELAXED);
+        found->ring = ring;
+    }
+
+    if (found != NULL) {
+        HistoryRing* ring = found->ring;
+        if (subscribe) {
+            if (ring->reactors++ == 0 && ring->idle_since_ns != 0)
+                unlink_idle(history, ring);
+            ring->idle_since_ns = 0;
+        } else if (--ring->reactors == 0) {
+            ring->idle_since_ns = now;
+            ring->idle_prev = history->idle_tail;
+            if (history->idle_tail != NULL)
+                history->idle_tail->idle_next = ring;
+            else
+                history->idle_head = ring;
+            history->idle_tail = ring;
+        }
+    }
+
+    pthread_mutex_unlock(&history->lock);
+}
+
+/**
+ * @brief Queue the messages of the topic the client hasn't seen
+ *
+ * Called on the reactor thread after the connection is subscribed, so the
+ * messages published after this reach it through the subscription.
+ *
+ * A since past the newest sequence, like from a client of an earlier run
+ * of the server, is a gap. It's clamped to the newest sequence, or the
+ * subscription would skip every message up to it.
+ *
+ * @param history the History
+ * @param conn the connection
+ * @param topic the topic name
+ * @param since the last sequence the client has seen
+ * @param gap set to true if the ring doesn't reach back to since
+ * @return uint64_t the sequence the subscription has seen now, the live
+ * messages up to it are skipped
+ */
+uint64_t history_resume(History *history, Connection *conn, const char *topic, uint64_t since,
+                        bool *gap) {
+    size_t len = strlen(topic);
+    uint64_t hash = topic_hash(topic, len);
+    size_t replayed = 0;
+
+    pthread_mutex_lock(&history->lock);
+
+    uint64_t seen = __atomic_load_n(&history->seq, __ATOMIC_RELAXED);
+    HistoryRing* ring = history_find(history, topic, len, hash);
+    *gap = since > seen || ring == NULL || since < ring->floor;
+    if (since > seen)
+        since = seen;
+
+    for (size_t i = 0; ring != NULL && i < ring->count; i++) {
+        PubMessage* message = ring->messages[(ring->head + i) % history->size];
+        if (message->seq <= since)
+            continue;
+        // The queued frame holds a reference until it's written
+        __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+        conn_queue_frame(conn, message->frame, message->frame_len, release_message, message);
+        replayed++;
+    }
+
+    pthread_mutex_unlock(&history->lock);
+
+    metrics_add(METRIC_REPLAYED, replayed);
+    if (*gap)
+        metrics_add(METRIC_REPLAY_GAPS, 1);
+    return seen;
+}
@@ -0,0 +1,70 @@
+#ifndef WEB_SOCKET_HISTORY_H
+#define WEB_SOCKET_HISTORY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "pubsub.h"
+#include "socketcon.h"
+
+/**
+ * History
+ *
+ * The process keeps the last messages of every topic that has subscribers
+ * in a bounded ring, so a client that reconnects can get the messages it
+ * missed. The ring holds the framed messages the subscribers got, so a
+ * replay queues the same bytes again without encoding anything.
+ *
+ * Every message gets a sequence number that grows over all the topics, so
+ * a single number tells what a client has seen of every topic it's
+ * subscribed to. With the bus the sequence is the one of the bus record,
+ * so it's the same in every server process on the host. The sequence is
+ * sent to the client in front of the payload, see ws_subscribe.
+ *
+ * The ring of a topic is kept for replay_linger_ms after the last
+ * subscriber leaves, long enough for the clients to come back after a
+ * network blip.
+ */
+
+typedef struct HistoryRing {
+    Topic* topic;
+    // The messages oldest first, starting from head
+    PubMessage** messages;
+    size_t head;
+    size_t count;
+    // The messages after this sequence are all in the ring
+    uint64_t floor;
+    // Reactors that have subscribers for the topic
+    size_t reactors;
+    // When the last subscriber left, and the links of the idle list
+    uint64_t idle_since_ns;
+    struct HistoryRing* idle_prev;
+    struct HistoryRing* idle_next;
+} HistoryRing;
+
+typedef struct History {
+    pthread_mutex_t lock;
+    // The topics with a ring, Topic.ring is set
+    TopicTable topics;
+    // Messages kept per topic
+    size_t size;
+    uint64_t linger_ns;
+    // Newest sequence handed out without the bus, or recorded from the
+    // bus. Read without the lock to skip the records already recorded
+    uint64_t seq;
+    // Rings of the topics without subscribers, the oldest first
+    HistoryRing* idle_head;
+    HistoryRing* idle_tail;
+} History;
+
+History* create_history(size_t size, uint64_t linger_ns);
+void free_history(History *history);
+HistoryRing* history_find(History *history, const char *topic, size_t len, uint64_t hash);
+void history_append(History *history, HistoryRing *ring, PubMessage *message);
+void history_watch(History *history, const char *topic, bool subscribe);
+uint64_t history_resume(History *history, Connection *conn, const char *topic, uint64_t since,
+                        bool *gap);
+
+#endif
@@ -48,6 +48,14 @@
  * memset(), strcpy(), strlen()
  */
 #include <string.h>
+/**
+ * <strings.h>
+ *
+ * functions:
+ * strcasecmp(), strncasecmp()
+ */
+#include <strings.h>
+
 /**
  * <string.h>
  *
@@ -56,53 +64,144 @@
  */
 #include <unistd.h>
 
+/**
+ * <fcntl.h>
+ *
+ * functions:
+ * open()
+ */
+#include <fcntl.h>
+
+/**
+ * <sys/stat.h>
+ *
+ * functions:
+ * fstat()
+ */
+#include <sys/stat.h>
+
+
 #include "crypto/base64.h"
 #include "crypto/sha1.h"
 #include "dataframe.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "reactor.h"
 #include "socketcon.h"
 
 #define SERVER_STR "Server: webasmhttpd/0.0.1\r\n"
 
-static int read_line(Connection *conn, char *buffer, int size) {
-    int i = 0, n;
-    char c = 0;
+// Directory where the static files are served from
+#define WEB_ROOT "html"
+
+// File that is served when the client asks for the root path
+#define INDEX_FILE "/ws_only.html"
+
+// Largest request line and headers that are accepted
+#define MAX_HEADER_SIZE 8192
 
-    while(i < size && c != '\n') {
-        n = recv(conn->conn_fd, &c, 1, 0);
+// Largest request body that is accepted, the body is skipped anyway
+#define MAX_BODY_SIZE (1024 * 1024)
 
-        if(n == -1) break; // TODO: Should we report an error?
+// Sent when the client asks for a websocket version we don't speak
+static const char UPGRADE_REQUIRED[] =
+    "HTTP/1.1 426 Upgrade Required\r\n"
+    SERVER_STR
+    "Sec-WebSocket-Version: 13\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/**
+ * @brief read a single line from the request
+ *
+ * @param pos start of the line, moved to the start of the next line
+ * @param end end of the request headers
+ * @param buffer where the line is put, terminated with null
+ * @param size size of the buffer
+ * @return int length of the line
+ */
+static int read_line(const char **pos, const char *end, char *buffer, int size) {
+    const char* p = *pos;
+    int i = 0;
+
+    while (p < end) {
+        char c = *p++;
 
         // ignore the \r
         if(c == '\r') continue;
         // when \n is found
         if(c == '\n') break;
 
-        buffer[i] = c;
-        i++;
+        // Drop the chars that don't fit to the buffer
+        if (i < size - 1) {
+            buffer[i] = c;
+            i++;
+        }
     }
 
     // Terminate the string with null
     buffer[i] = '\0';
+    *pos = p;
 
     return i;
 }
 
-
+/**
+ * @brief Copy the header value without the leading white space
+ *
+ * @param s1 header line
+ * @param s2 buffer the value is copied to
+ * @param size size of s2
+ * @param start index where the value starts in s1
+ */
 static void get_str_from_buf(const char *s1, char *s2, int size, int start) {
-    int char_start = 0;
-    char c = s1[char_start + start];
+    const char* value = s1 + start;
 
     // Skip all the white space from the start
-    while (c == ' ' || c == '\t') {
-        c = s1[char_start + start];
-        char_start++;
-    }
+    while (*value == ' ' || *value == '\t')
+        value++;
 
     // Set rest of the chars to s2
-    for(int i = 0; i < size; i++){
-        c = s1[i + start + char_start];
-        s2[i] = c;
+    int i;
+    for(i = 0; i < size - 1 && value[i] != '\0'; i++){
+        s2[i] = value[i];
     }
+    s2[i] = '\0';
+}
+
+/**
+ * @brief Check if comma separated header value contains the token
+ *
+ * Connection header can be something like "keep-alive, Upgrade"
+ *
+ * @param value header value
+ * @param token the token we are looking for
+ * @return bool true if the token is found
+ */
+static bool has_token(const char *value, const char *token) {
+    size_t token_len = strlen(token);
+
+    while (*value != '\0') {
+        // Skip the separators
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+
+        size_t len = strcspn(value, ",");
+        // Ignore the trailing white space
+        size_t end = len;
+        while (end > 0 && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+            end--;
+
+        if (end == token_len && !strncasecmp(value, token, token_len))
+            return true;
+
+        value += len;
+    }
+
+    return false;
 }
 
 void sendFrame(Connection *conn) {
@@ -165,7 +264,7 @@ static void socket_hash(char *in, char *out) {
     strcpy(buf, in);
     strcpy(buf + strlen(in), magic_str);
 
-    printf("BUF LENGTH: %s\n", buf);
+    LOG_TRACE("Handshake hash input: %s", buf);
 
     // Hask the concated string
     sha1hash(&sha1, (uint8_t*) buf, strlen(buf));
@@ -181,138 +280,658 @@ static void socket_hash(char *in, char *out) {
  *
  * @param conn Connection struct
  * @param accept the base64 string of the handshake hash
+ * @param protocol the picked subprotocol or NULL
  */
-static void header_101(Connection *conn, const char *accept) {
+static void header_101(Connection *conn, const char *accept, const char *protocol) {
     char buf[1024];
 
-    strcpy(buf, "HTTP/1.1 101 Switching Protocols\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, "Upgrade: websocket\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, "Connection: Upgrade\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, "Sec-WebSocket-Accept: ");
-    strcat(buf, accept);
-    strcat(buf, "\r\n");
-    printf("%s", buf);
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, "\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
+    int len = snprintf(buf, sizeof(buf),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "%s%.128s%s"
+        "\r\n", accept,
+        protocol != NULL ? "Sec-WebSocket-Protocol: " : "",
+        protocol != NULL ? protocol : "",
+        protocol != NULL ? "\r\n" : "");
+    LOG_DEBUG("Sec-WebSocket-Accept: %s", accept);
+    conn_queue(conn, buf, len);
 }
 
 /**
- * @brief send 200 header to client
+ * @brief Get the Content-Type from the file extension
  *
- * @param conn Connection struct
  * @param filename path and name to the file
+ * @return const char* the mime type
+ */
+static const char* content_type(const char *filename) {
+    const char* ext = strrchr(filename, '.');
+
+    if (ext == NULL)
+        return "application/octet-stream";
+    if (!strcmp(ext, ".html"))
+        return "text/html; charset=utf-8";
+    if (!strcmp(ext, ".js"))
+        return "application/javascript";
+    if (!strcmp(ext, ".css"))
+        return "text/css";
+    if (!strcmp(ext, ".json"))
+        return "application/json";
+    if (!strcmp(ext, ".png"))
+        return "image/png";
+    if (!strcmp(ext, ".ico"))
+        return "image/x-icon";
+
+    return "application/octet-stream";
+}
+
+/**
+ * @brief send response header to client
+ *
+ * The body is always framed with Content-Length so the client knows
+ * where the response ends and can reuse the connection.
+ *
+ * @param conn Connection struct
+ * @param status status line, like "200 OK"
+ * @param type Content-Type of the body
+ * @param length length of the body
+ * @param req the request we are responding to
  */
-static void header_200(Connection *conn, const char *filename) {
+static void send_header(Connection *conn, const char *status, const char *type,
+                        uint64_t length, HttpRequest *req) {
     char buf[1024];
 
-    //TODO: use filename to determine the Content-Type
+    int len = snprintf(buf, sizeof(buf),
+        "HTTP/1.1 %s\r\n"
+        SERVER_STR
+        "Content-Type: %s\r\n"
+        "Content-Length: %" PRIu64 "\r\n",
+        status, type, length);
+
+    if (req->keep_alive) {
+        len += snprintf(buf + len, sizeof(buf) - len,
+            "Connection: keep-alive\r\n"
+            "Keep-Alive: timeout=%d\r\n", KEEP_ALIVE_TIMEOUT);
+    } else {
+        len += snprintf(buf + len, sizeof(buf) - len, "Connection: close\r\n");
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
 
-    strcpy(buf, "HTTP/1.0 200 OK\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, SERVER_STR);
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, "\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
+    conn_queue(conn, buf, len);
 }
 
 /**
- * @brief send 404 header to client
+ * @brief send response with in-memory body to client
  *
  * @param conn Connection struct
+ * @param status status line, like "200 OK"
+ * @param type Content-Type of the body
+ * @param body the body bytes
+ * @param len length of the body
+ * @param req the request we are responding to
  */
-static void header_404(Connection *conn){
-    char buf[1024];
+static void send_body(Connection *conn, const char *status, const char *type,
+                      const char *body, size_t len, HttpRequest *req) {
+    send_header(conn, status, type, len, req);
+    if (strcmp(req->method, "HEAD"))
+        conn_queue(conn, body, len);
+}
+
+/**
+ * @brief send response with a small html body to client
+ *
+ * @param conn Connection struct
+ * @param status status line, like "404 Not Found"
+ * @param body html body
+ * @param req the request we are responding to
+ */
+static void send_response(Connection *conn, const char *status, const char *body,
+                          HttpRequest *req) {
+    send_body(conn, status, "text/html; charset=utf-8", body, strlen(body), req);
+}
+
+/**
+ * @brief send the file to client
+ *
+ * The file is queued as it is and moved to the socket with sendfile,
+ * so it never goes through user space.
+ *
+ * @param conn Connection struct
+ * @param filename path and name to the file
+ * @param req the request we are responding to
+ */
+static void sendFile(Connection *conn, const char* filename, HttpRequest *req) {
+    struct stat st;
+
+    int fd = open(filename, O_RDONLY);
+
+    // Send 404 response if cannot find the file
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        send_response(conn, "404 Not Found", "<p>Not Found</p>\n", req);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    send_header(conn, "200 OK", content_type(filename), st.st_size, req);
+
+    // The queue closes the file when it's sent
+    if (strcmp(req->method, "HEAD"))
+        conn_queue_file(conn, fd, st.st_size);
+    else
+        close(fd);
+}
+
+/**
+ * @brief send the server metrics to client
+ *
+ * @param conn Connection struct
+ * @param req the request we are responding to
+ */
+static void send_metrics(Connection *conn, HttpRequest *req) {
+    WebSocketServer* wss = conn->server;
+    int reactors = wss->bus != NULL ? wss->config.threads : 0;
+    uint64_t* bus_lags = malloc(sizeof(uint64_t) * (reactors + 1));
+    char* body = NULL;
+    size_t len;
+
+    if (bus_lags != NULL) {
+        for (int i = 0; i < reactors; i++)
+            bus_lags[i] = __atomic_load_n(&wss->reactors[i].bus_lag, __ATOMIC_RELAXED);
+        body = metrics_render(bus_lags, reactors, &len);
+        free(bus_lags);
+    }
+    if (body == NULL) {
+        send_response(conn, "500 Internal Server Error", "<p>Internal Server Error</p>\n", req);
+        return;
+    }
+
+    send_body(conn, "200 OK", "text/plain; version=0.0.4", body, len, req);
+    free(body);
+}
+
+/**
+ * @brief Parse the request line, like "GET /index.html HTTP/1.1"
+ *
+ * @param line the request line
+ * @param req request struct where the values are set
+ * @return int 1 if success, 0 if the line is malformed
+ */
+static int parse_request_line(const char *line, HttpRequest *req) {
+    const char* path = strchr(line, ' ');
+    if (path == NULL || (size_t)(path - line) >= sizeof(req->method))
+        return 0;
+
+    memcpy(req->method, line, path - line);
+    req->method[path - line] = '\0';
+    path++;
+
+    const char* version = strchr(path, ' ');
+    if (version == NULL)
+        return 0;
+
+    size_t path_len = strcspn(path, " ?");
+    if (path_len >= sizeof(req->path))
+        return 0;
+    memcpy(req->path, path, path_len);
+    req->path[path_len] = '\0';
+
+    if (path[path_len] == '?') {
+        const char* query = path + path_len + 1;
+        size_t query_len = version - query;
+        if (query_len >= sizeof(req->query)) {
+            query_len = sizeof(req->query) - 1;
+            req->query_cut = true;
+        }
+        memcpy(req->query, query, query_len);
+        req->query[query_len] = '\0';
+    }
+
+    version++;
+    if (strncmp(version, "HTTP/1.", 7) || version[7] < '0' || version[7] > '9')
+        return 0;
+    req->minor_version = version[7] - '0';
+
+    // HTTP/1.1 connections are persistent by default, HTTP/1.0 are not
+    req->keep_alive = req->minor_version >= 1;
+
+    return 1;
+}
+
+/**
+ * @brief Find the value of the query parameter
+ *
+ * @param query the query string without the '?'
+ * @param name name of the parameter
+ * @return const char* start of the value, ends at '&' or the end of the
+ * query, NULL if the parameter isn't there
+ */
+static const char* query_param(const char *query, const char *name) {
+    size_t name_len = strlen(name);
+
+    while (*query != '\0') {
+        if (!strncmp(query, name, name_len) && query[name_len] == '=')
+            return query + name_len + 1;
+        query += strcspn(query, "&");
+        if (*query == '&')
+            query++;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parse a decimal number that has nothing but digits
+ *
+ * @param value start of the number
+ * @param len length of the number
+ * @param number set to the value
+ * @return int 1 if success, 0 if empty, not a number or doesn't fit
+ */
+static int parse_number(const char *value, size_t len, uint64_t *number) {
+    uint64_t result = 0;
+
+    if (len == 0)
+        return 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9')
+            return 0;
+        uint64_t digit = value[i] - '0';
+        if (result > (UINT64_MAX - digit) / 10)
+            return 0;
+        result = result * 10 + digit;
+    }
+
+    *number = result;
+    return 1;
+}
+
+/**
+ * @brief Parse a header value that is a single number
+ *
+ * @param value the header value, may have white space around it
+ * @param number set to the value
+ * @return int 1 if success, 0 if the value isn't a number
+ */
+static int parse_number_header(const char *value, uint64_t *number) {
+    while (*value == ' ' || *value == '\t')
+        value++;
 
-    //TODO: use filename to determine the Content-Type
+    size_t len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
 
-    strcpy(buf, "HTTP/1.0 404 Not Found\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, SERVER_STR);
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
-    strcpy(buf, "\r\n");
-    send(conn->conn_fd, buf, strlen(buf), 0);
+    return parse_number(value, len, number);
 }
 
-static void send_file_content(Connection *conn, FILE *resource) {
+/**
+ * @brief Parse the request line and the headers of a single request
+ *
+ * A body is only ever framed with a single Content-Length. Anything that
+ * another server could frame differently, like a repeated Content-Length
+ * or a Transfer-Encoding, is malformed so the proxied requests and the
+ * pipelined ones can't be desynced.
+ *
+ * @param data start of the request
+ * @param len length of the request line and the headers
+ * @param req request struct where the values are set
+ * @return int 1 if success, 0 if the request is malformed
+ */
+int http_read_request(const char *data, size_t len, HttpRequest *req) {
+    const char* end = data + len;
     char buf[1024];
+    uint64_t number;
+
+    memset(req, 0, sizeof(*req));
+
+    read_line(&data, end, buf, sizeof(buf));
+    int valid = parse_request_line(buf, req);
+
+    while (read_line(&data, end, buf, sizeof(buf)) > 0) {
+        // If the web socket key is found, save the key
+        if (!strncasecmp(buf, "Sec-WebSocket-Key:", 18)){
+            get_str_from_buf(buf, req->ws_key, sizeof(req->ws_key), 18);
+        } else if (!strncasecmp(buf, "Sec-WebSocket-Version:", 22)) {
+            if (parse_number_header(buf + 22, &number) && number < 256)
+                req->ws_version = (int)number;
+            else
+                req->ws_version = -1;
+        } else if (!strncasecmp(buf, "Upgrade:", 8)) {
+            if (has_token(buf + 8, "websocket"))
+                req->upgrade = true;
+        } else if (!strncasecmp(buf, "Sec-WebSocket-Protocol:", 23)) {
+            // The header can be repeated, the values are one list
+            size_t used = strlen(req->protocols);
+            if (used > 0 && used < sizeof(req->protocols) - 1)
+                req->protocols[used++] = ',';
+            get_str_from_buf(buf, req->protocols + used, sizeof(req->protocols) - used, 23);
+        } else if (!strncasecmp(buf, "Connection:", 11)) {
+            if (has_token(buf + 11, "close"))
+                req->keep_alive = false;
+            else if (has_token(buf + 11, "keep-alive"))
+                req->keep_alive = true;
+            if (has_token(buf + 11, "upgrade"))
+                req->connection_upgrade = true;
+        } else if (!strncasecmp(buf, "Content-Length:", 15)) {
+            if (req->has_length || !parse_number_header(buf + 15, &req->content_length))
+                valid = 0;
+            req->has_length = true;
+        } else if (!strncasecmp(buf, "Transfer-Encoding:", 18)) {
+            // The bodies are skipped, so there is no use for chunked ones
+            valid = 0;
+        }
+    }
 
-    fgets(buf, sizeof(buf), resource);
-    while (!feof(resource)) {
-        send(conn->conn_fd, buf, strlen(buf), 0);
-        fgets(buf, sizeof(buf), resource);
+    // A since that isn't a whole number, or was cut with the query, would
+    // replay from the wrong place
+    const char* since = query_param(req->query, "since");
+    if (since != NULL) {
+        size_t since_len = strcspn(since, "&");
+        if ((req->query_cut && since[since_len] == '\0') ||
+            !parse_number(since, since_len, &req->since))
+            valid = 0;
+        req->has_since = true;
     }
+
+    return valid;
 }
 
-static void sendFile(Connection *conn, const char* filename) {
-    FILE *resource = NULL;
+/**
+ * @brief Check the headers of a websocket upgrade request
+ *
+ * @param req the parsed request
+ * @return int HTTP_NOT_UPGRADE if the request doesn't ask for an upgrade,
+ * HTTP_UPGRADE if it's a valid handshake, HTTP_BAD_UPGRADE or
+ * HTTP_BAD_VERSION if it isn't
+ */
+int http_check_upgrade(const HttpRequest *req) {
+    if (req->ws_key[0] == '\0' && !req->upgrade)
+        return HTTP_NOT_UPGRADE;
 
-    resource = fopen(filename, "r");
+    if (strcmp(req->method, "GET") || req->minor_version < 1 || req->ws_key[0] == '\0' ||
+        !req->upgrade || !req->connection_upgrade)
+        return HTTP_BAD_UPGRADE;
 
-    // Send 404 response if cannot find the file
-    if(resource == NULL) {
-        header_404(conn);
-    } else {
-        header_200(conn, filename);
-        send_file_content(conn, resource);
-        // Finally close the file
-        fclose(resource);
+    if (req->ws_version != 13)
+        return HTTP_BAD_VERSION;
+
+    return HTTP_UPGRADE;
+}
+
+/**
+ * @brief Pick the subprotocol of the connection
+ *
+ * The server's order decides, so the first codec added that the client
+ * also listed wins.
+ *
+ * @param wss the server
+ * @param protocols the subprotocols the client listed
+ * @return const WebSocketCodec* the codec or NULL if there is no match
+ */
+static const WebSocketCodec* pick_protocol(WebSocketServer *wss, const char *protocols) {
+    if (protocols[0] == '\0')
+        return NULL;
+
+    for (int i = 0; i < wss->protocol_count; i++) {
+        if (has_token(protocols, wss->protocols[i]->name))
+            return wss->protocols[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find the empty line that ends the request headers
+ *
+ * @param data the bytes received so far
+ * @param len amount of bytes received so far
+ * @return size_t length of the request line and the headers or 0 if the
+ * headers are not complete yet
+ */
+static size_t find_header_end(const uint8_t *data, size_t len) {
+    const uint8_t* end = data + len;
+    const uint8_t* p = data;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        if (p < end && p[0] == '\n')
+            return p + 1 - data;
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+            return p + 2 - data;
     }
 
+    return 0;
 }
 
-//TODO: handle headers properly
-static void handle_request_header(Connection *conn) {
+/**
+ * @brief Respond to a single request
+ *
+ * @param conn Connection struct
+ * @param req the parsed request
+ * @param valid false if the request was malformed
+ */
+static void handle_request_header(Connection *conn, HttpRequest *req, bool valid) {
     char buf[256];
-    char tmp[256] = {0};
+    char filename[sizeof(WEB_ROOT) + 256];
 
-    while(read_line(conn, buf, sizeof(buf)) > 1){
-        // If the web socket key is found, save the key to tmp and
-        // read the rest of the header
-        if (!strncmp(buf, "Sec-WebSocket-Key: ", 19)){
-            get_str_from_buf(buf, tmp, sizeof(tmp), 19);
-        }
-        // If the connection is regular http. Return html that lets
-        // the client know that this is webscoket server only
-        if (!strcmp(buf, "Connection: keep-alive")) {
-            sendFile(conn, "html/ws_only.html");
-        }
+    metrics_add(METRIC_HTTP_REQUESTS, 1);
+
+    int upgrade = valid ? http_check_upgrade(req) : HTTP_NOT_UPGRADE;
+
+    if (!valid || upgrade == HTTP_BAD_UPGRADE) {
+        req->keep_alive = false;
+        send_response(conn, "400 Bad Request", "<p>Bad Request</p>\n", req);
+        conn_shutdown(conn);
+        return;
+    }
 
+    if (upgrade == HTTP_BAD_VERSION) {
+        conn_queue(conn, UPGRADE_REQUIRED, sizeof(UPGRADE_REQUIRED) - 1);
+        conn_shutdown(conn);
+        return;
     }
 
-    // If the websocket key is found
-    if (tmp[0] != 0) {
+    if (upgrade == HTTP_UPGRADE) {
         // Create the Sec-WebSocket-Accept: header hash
-        socket_hash(tmp, buf);
+        socket_hash(req->ws_key, buf);
+        // Without a common subprotocol the handshake goes on without one
+        // and the client decides if that's fine
+        conn->codec = pick_protocol(conn->server, req->protocols);
         // Send the 101 header to complete the websocket handshake
-        header_101(conn, buf);
-        // handle the web socket connection
-        handle_connection(conn);
+        header_101(conn, buf, conn->codec != NULL ? conn->codec->name : NULL);
+        metrics_add(METRIC_HANDSHAKES, 1);
+        metrics_add(METRIC_HANDSHAKES_PENDING, -1);
+        __atomic_sub_fetch(&conn->server->handshakes_pending, 1, __ATOMIC_RELAXED);
+        metrics_record(METRIC_HANDSHAKE_TIME, metrics_now_ns() - conn->request_start_ns);
+        // Kept for the application, like for picking the topics
+        size_t path_len = strlen(req->path);
+        conn->path = malloc(path_len + 1);
+        if (conn->path != NULL)
+            memcpy(conn->path, req->path, path_len + 1);
+        // A client that reconnects tells the last message it has seen, so
+        // ws_subscribe sends the ones it missed
+        if (req->has_since) {
+            conn->resume = true;
+            conn->resume_seq = req->since;
+        }
+        // The rest of the bytes are frames
+        open_websocket(conn);
+        return;
+    }
+
+    if (strcmp(req->method, "GET") && strcmp(req->method, "HEAD")) {
+        send_response(conn, "501 Not Implemented", "<p>Not Implemented</p>\n", req);
+    } else if (!strcmp(req->path, "/metrics")) {
+        send_metrics(conn, req);
+    } else if (req->path[0] != '/' || strstr(req->path, "..") != NULL) {
+        // Don't let the client read files outside of the web root
+        send_response(conn, "404 Not Found", "<p>Not Found</p>\n", req);
+    } else {
+        // The root returns html that lets the client know that
+        // this is webscoket server only
+        const char* path = strcmp(req->path, "/") ? req->path : INDEX_FILE;
+        snprintf(filename, sizeof(filename), "%s%s", WEB_ROOT, path);
+        sendFile(conn, filename, req);
     }
+
+    if (!req->keep_alive)
+        conn_shutdown(conn);
+
+    conn->request_start_ns = metrics_now_ns();
 }
 
-void* accept_client(void* clientptr) {
-        Connection conn;
-        conn.conn_fd = *((int*) clientptr);
+/**
+ * @brief Copy the request of the client for the backend
+ *
+ * The request line and the headers go as the client sent them, so the
+ * backend sees the whole query and headers like Origin, Cookie and
+ * Sec-WebSocket-Extensions. Host is the one of the backend, and
+ * Content-Length is left out since the body was skipped.
+ *
+ * @param head the request line and the headers, with the empty line
+ * @param head_len length of head
+ * @param host the Host of the backend
+ * @param len set to the length of the request
+ * @return char* the request or NULL if out of memory, the caller frees it
+ */
+char* http_backend_request(const char *head, size_t head_len, const char *host, size_t *len) {
+    // Every line may get a \r more
+    char* out = malloc(2 * head_len + strlen(host) + 16);
+    const char* end = head + head_len;
+    const char* line = head;
+    size_t used = 0;
+
+    if (out == NULL)
+        return NULL;
 
-        // Read the data from client and print it
-        handle_request_header(&conn);
+    for (bool first = true; line < end; first = false) {
+        const char* next = memchr(line, '\n', end - line);
+        next = next != NULL ? next + 1 : end;
+        size_t text_len = next - line;
+        while (text_len > 0 && (line[text_len - 1] == '\n' || line[text_len - 1] == '\r'))
+            text_len--;
+        if (text_len == 0)
+            break;
+
+        if (first || (strncasecmp(line, "Host:", 5) && strncasecmp(line, "Content-Length:", 15))) {
+            memcpy(out + used, line, text_len);
+            used += text_len;
+            out[used++] = '\r';
+            out[used++] = '\n';
+        }
+        if (first)
+            used += sprintf(out + used, "Host: %s\r\n", host);
+        line = next;
+    }
 
-        // if (shutdown(client, SHUT_RDWR) == -1) {
-        //     perror("shutdown failed");
-        //     close(client);
-        //     exit(EXIT_FAILURE);
-        // }
+    out[used++] = '\r';
+    out[used++] = '\n';
+    *len = used;
+    return out;
+}
 
-        printf("request handled\n");
-        close_connection(&conn);
+/**
+ * @brief Hand the upgrade to the proxy if a route takes its path
+ *
+ * The backend gets the request of the client with its key, so its
+ * response is the one the client expects. The frames after the request go
+ * with it.
+ *
+ * @param conn Connection struct
+ * @param req the parsed upgrade request
+ * @param head the request line and the headers as the client sent them
+ * @param head_len length of head
+ * @param rest the bytes after the request
+ * @param rest_len amount of the bytes
+ * @return int 1 if the proxy took the client, 0 if the path isn't proxied
+ */
+static int proxy_request(Connection *conn, HttpRequest *req, const char *head, size_t head_len,
+                         const uint8_t *rest, size_t rest_len) {
+    Proxy* proxy = conn->server->proxy;
+    ProxyRoute* route = proxy_route(proxy, req->path);
+    if (route == NULL)
+        return 0;
+
+    size_t len;
+    char* request = http_backend_request(head, head_len, route->name, &len);
+    int handed = request != NULL && proxy_upgrade(proxy, route, conn, request, len, rest, rest_len);
+    free(request);
+
+    if (!handed) {
+        req->keep_alive = false;
+        send_response(conn, "503 Service Unavailable", "<p>Service Unavailable</p>\n", req);
+        conn_shutdown(conn);
+        return 1;
+    }
 
-        return NULL;
+    metrics_add(METRIC_HTTP_REQUESTS, 1);
+    // The proxy thread has its own copy of the socket
+    close_connection(conn);
+    return 1;
+}
+
+/**
+ * @brief Handle every complete request in the receive buffer
+ *
+ * The requests are handled in order, so pipelined requests are answered in
+ * the same order they were sent. Handling stops when the connection is
+ * upgraded and the rest of the buffer is left for the frames.
+ *
+ * @param conn Connection struct
+ */
+void handle_http(Connection *conn) {
+    size_t offset = 0;
+    HttpRequest req;
+
+    conn->recv_need = 0;
+
+    while (conn_state(conn) == CONN_HTTP) {
+        const uint8_t* data = conn->recv_buf + offset;
+        size_t available = conn->recv_len - offset;
+
+        // Clients may send empty lines between the pipelined requests
+        while (available > 0 && (*data == '\r' || *data == '\n')) {
+            data++;
+            available--;
+            offset++;
+        }
+
+        size_t header_len = find_header_end(data, available);
+        if (header_len == 0) {
+            if (available > MAX_HEADER_SIZE) {
+                memset(&req, 0, sizeof(req));
+                send_response(conn, "431 Request Header Fields Too Large",
+                              "<p>Request Header Fields Too Large</p>\n", &req);
+                conn_shutdown(conn);
+            }
+            break;
+        }
+
+        int valid = http_read_request((const char*)data, header_len, &req);
+
+        if (valid && req.content_length > MAX_BODY_SIZE) {
+            req.keep_alive = false;
+            send_response(conn, "413 Payload Too Large", "<p>Payload Too Large</p>\n", &req);
+            conn_shutdown(conn);
+            break;
+        }
+
+        // The body is skipped, but it has to be received first
+        uint64_t request_len = header_len + (valid ? req.content_length : 0);
+        if (request_len > available) {
+            conn->recv_need = request_len;
+            break;
+        }
+
+        offset += request_len;
+        if (valid && conn->server->proxy != NULL && http_check_upgrade(&req) == HTTP_UPGRADE &&
+            proxy_request(conn, &req, (const char*)data, header_len, conn->recv_buf + offset,
+                          conn->recv_len - offset)) {
+            offset = conn->recv_len;
+            break;
+        }
+        handle_request_header(conn, &req, valid);
+    }
+
+    conn_consume(conn, offset);
 }
@@ -1,6 +1,56 @@
 #ifndef WEB_SOCKET_HTTP_H
 #define WEB_SOCKET_HTTP_H
 
-void* accept_client(void* clientptr);
+#include "socketcon.h"
+
+// How many seconds an idle keep-alive connection is kept open
+#define KEEP_ALIVE_TIMEOUT 5
+
+// What http_check_upgrade says about the request
+#define HTTP_NOT_UPGRADE 0
+#define HTTP_UPGRADE 1
+// Asks for an upgrade but a header is missing or wrong
+#define HTTP_BAD_UPGRADE -1
+// Asks for a websocket version other than 13
+#define HTTP_BAD_VERSION -2
+
+// HttpRequest contains the parts of the request we care about
+typedef struct {
+    // GET, HEAD etc.
+    char method[16];
+    // Request path without the query string
+    char path[256];
+    // Query string without the '?', cut if it doesn't fit and then
+    // query_cut is set
+    char query[256];
+    bool query_cut;
+    // The x in HTTP/1.x
+    int minor_version;
+    // Should the connection stay open after the response
+    bool keep_alive;
+    // Sec-WebSocket-Key header value, empty if not a websocket handshake
+    char ws_key[64];
+    // Sec-WebSocket-Protocol values, the lines joined with commas
+    char protocols[256];
+    // Sec-WebSocket-Version header value, 0 if there is none
+    int ws_version;
+    // Upgrade header has the websocket token
+    bool upgrade;
+    // Connection header has the upgrade token
+    bool connection_upgrade;
+    // Content-Length header was seen
+    bool has_length;
+    // Length of the request body that needs to be skipped
+    uint64_t content_length;
+    // The since query parameter, the last message a reconnecting client
+    // has seen
+    bool has_since;
+    uint64_t since;
+} HttpRequest;
+
+void handle_http(Connection *conn);
+int http_read_request(const char *data, size_t len, HttpRequest *req);
+int http_check_upgrade(const HttpRequest *req);
+char* http_backend_request(const char *head, size_t head_len, const char *host, size_t *len);
 
 #endif
@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Records in each thread ring, has to be power of two
+#define LOG_RING_SIZE 256
+
+// Most arguments one record can hold
+#define LOG_MAX_ARGS 8
+
+// Space for the copied %s arguments in a record
+#define LOG_STR_SPACE 64
+
+// Size of the buffer the writer formats to before writing it out
+#define LOG_OUT_SIZE (64 * 1024)
+
+typedef enum {
+    // %% or a conversion we don't support, no argument
+    ARG_NONE,
+    ARG_INT,
+    ARG_UINT,
+    ARG_LONG,
+    ARG_ULONG,
+    ARG_LLONG,
+    ARG_ULLONG,
+    ARG_SIZE,
+    ARG_DOUBLE,
+    ARG_PTR,
+    ARG_STR,
+} ArgType;
+
+typedef struct {
+    uint64_t time_ns;
+    // Format string literal, only the pointer is copied
+    const char* fmt;
+    uint8_t level;
+    uint8_t nargs;
+    // Bytes used from strings
+    uint16_t str_used;
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void* p;
+    } args[LOG_MAX_ARGS];
+    // %s arguments are copied here and the arg holds the offset
+    char strings[LOG_STR_SPACE];
+} LogRecord;
+
+// Single producer single consumer ring. The owning thread writes records
+// and moves head, the writer thread reads them and moves tail
+typedef struct LogRing {
+    // Every ring ever created is in the list, they are never freed
+    struct LogRing* next;
+    // 1 while a thread owns the ring
+    int in_use;
+    // Id printed with every line of the ring
+    int id;
+    uint64_t head __attribute__((aligned(64)));
+    // Records lost because the ring was full
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    // Dropped records the writer has already reported
+    uint64_t reported;
+    LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+static LogRing* ring_head = NULL;
+static int ring_count = 0;
+static __thread LogRing* local = NULL;
+static int log_level = LOG_COMPILE_LEVEL;
+
+static pthread_key_t release_key;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+// Only one thread formats at a time, the writer thread or log_flush
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The writer thread sleeps on this when every ring is empty
+static uint32_t writer_futex = 0;
+// 1 while the writer thread is about to sleep or sleeps
+static uint32_t writer_sleeping = 0;
+
+static const char* level_names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR" };
+
+/**
+ * @brief Find the next conversion from the format string
+ *
+ * Both the logging thread and the writer use this, so they always agree
+ * which argument belongs to which conversion.
+ *
+ * @param fmt format string
+ * @param end set to point right after the conversion
+ * @param type set to the type of the argument
+ * @return const char* pointer to the '%' or NULL if there is no more
+ */
+static const char* find_spec(const char *fmt, const char **end, ArgType *type) {
+    const char* start = strchr(fmt, '%');
+    if (start == NULL)
+        return NULL;
+
+    const char* p = start + 1;
+    int longs = 0;
+    bool size = false;
+
+    // Flags, width and precision
+    while (*p != '\0' && strchr("-+ #0123456789.'", *p) != NULL)
+        p++;
+
+    // Length modifiers
+    for (;; p++) {
+        if (*p == 'l')
+            longs++;
+        else if (*p == 'z' || *p == 't' || *p == 'j')
+            size = true;
+        else if (*p != 'h')
+            break;
+    }
+
+    switch (*p) {
+        case 'd':
+        case 'i':
+            *type = size ? ARG_SIZE : longs >= 2 ? ARG_LLONG : longs ? ARG_LONG : ARG_INT;
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            *type = size ? ARG_SIZE : longs >= 2 ? ARG_ULLONG : longs ? ARG_ULONG : ARG_UINT;
+            break;
+        case 'c':
+            *type = ARG_INT;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            *type = ARG_DOUBLE;
+            break;
+        case 'p':
+            *type = ARG_PTR;
+            break;
+        case 's':
+            *type = ARG_STR;
+            break;
+        default:
+            *type = ARG_NONE;
+            break;
+    }
+
+    *end = *p != '\0' ? p + 1 : p;
+    return start;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Format one record to the buffer
+ *
+ * @param out output buffer
+ * @param size space left in the buffer
+ * @param ring the ring of the record
+ * @param rec the record
+ * @return size_t amount of bytes written
+ */
+static size_t format_record(char *out, size_t size, LogRing *ring, LogRecord *rec) {
+    char spec[32];
+    struct tm tm;
+    time_t secs = (time_t)(rec->time_ns / 1000000000ULL);
+    size_t len = 0;
+
+    gmtime_r(&secs, &tm);
+    len += strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    len += snprintf(out + len, size - len, ".%06uZ %-5s [%d] ",
+                    (unsigned int)(rec->time_ns % 1000000000ULL / 1000),
+                    level_names[rec->level], ring->id);
+
+    const char* fmt = rec->fmt;
+    const char* end;
+    ArgType type;
+    int arg = 0;
+
+    for (const char* start; (start = find_spec(fmt, &end, &type)) != NULL; fmt = end) {
+        // Copy the text before the conversion
+        size_t text = (size_t)(start - fmt);
+        if (text > size - len - 1)
+            text = size - len - 1;
+        memcpy(out + len, fmt, text);
+        len += text;
+
+        size_t spec_len = (size_t)(end - start);
+        if (spec_len >= sizeof(spec))
+            spec_len = sizeof(spec) - 1;
+        memcpy(spec, start, spec_len);
+        spec[spec_len] = '\0';
+
+        int n;
+        if (type == ARG_NONE) {
+            n = snprintf(out + len, size - len, "%s", !strcmp(spec, "%%") ? "%" : spec);
+        } else if (arg >= rec->nargs) {
+            n = snprintf(out + len, size - len, "(missing)");
+        } else {
+            switch (type) {
+                case ARG_INT: n = snprintf(out + len, size - len, spec, (int)rec->args[arg].i); break;
+                case ARG_UINT: n = snprintf(out + len, size - len, spec, (unsigned int)rec->args[arg].u); break;
+                case ARG_LONG: n = snprintf(out + len, size - len, spec, (long)rec->args[arg].i); break;
+                case ARG_ULONG: n = snprintf(out + len, size - len, spec, (unsigned long)rec->args[arg].u); break;
+                case ARG_LLONG: n = snprintf(out + len, size - len, spec, rec->args[arg].i); break;
+                case ARG_ULLONG: n = snprintf(out + len, size - len, spec, rec->args[arg].u); break;
+                case ARG_SIZE: n = snprintf(out + len, size - len, spec, (size_t)rec->args[arg].u); break;
+                case ARG_DOUBLE: n = snprintf(out + len, size - len, spec, rec->args[arg].d); break;
+                case ARG_PTR: n = snprintf(out + len, size - len, spec, rec->args[arg].p); break;
+                case ARG_STR: n = snprintf(out + len, size - len, spec, rec->strings + rec->args[arg].u); break;
+                default: n = 0; break;
+            }
+            arg++;
+        }
+
+        if (n > 0)
+            len += (size_t)n < size - len ? (size_t)n : size - len - 1;
+    }
+
+    len += snprintf(out + len, size - len, "%s\n", fmt);
+    // Make sure the line ends even if it was truncated
+    if (len >= size - 1) {
+        len = size - 1;
+        out[len - 1] = '\n';
+    }
+
+    return len;
+}
+
+/**
+ * @brief Write every pending record of every ring. Caller holds drain_lock
+ *
+ * @return int amount of records written
+ */
+static int drain_rings(void) {
+    static char out[LOG_OUT_SIZE];
+    size_t len = 0;
+    int count = 0;
+
+    LogRing* ring = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        for (; tail != head; tail++) {
+            // Leave room for one full line
+            if (LOG_OUT_SIZE - len < 1024) {
+                write(STDERR_FILENO, out, len);
+                len = 0;
+            }
+            len += format_record(out + len, LOG_OUT_SIZE - len, ring,
+                                 &ring->records[tail & (LOG_RING_SIZE - 1)]);
+            count++;
+        }
+
+        // Give the records back to the producer
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            if (LOG_OUT_SIZE - len < 1024) {
+                write(STDERR_FILENO, out, len);
+                len = 0;
+            }
+            int n = snprintf(out + len, LOG_OUT_SIZE - len,
+                             "log ring %d was full, %" PRIu64 " records dropped\n",
+                             ring->id, dropped - ring->reported);
+            if (n > 0)
+                len += (size_t)n < LOG_OUT_SIZE - len ? (size_t)n : LOG_OUT_SIZE - len - 1;
+            ring->reported = dropped;
+        }
+    }
+
+    if (len > 0)
+        write(STDERR_FILENO, out, len);
+
+    return count;
+}
+
+/**
+ * @brief Check if every ring has been written
+ *
+ * @return bool true if there is nothing to write
+ */
+static bool rings_empty(void) {
+    LogRing* ring = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) !=
+            __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+            return false;
+    }
+    return true;
+}
+
+static void* writer_thread(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&drain_lock);
+        int count = drain_rings();
+        pthread_mutex_unlock(&drain_lock);
+
+        // Keep going while there is work
+        if (count > 0)
+            continue;
+
+        uint32_t seen = __atomic_load_n(&writer_futex, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+
+        // A record published before the flag was set didn't wake anybody,
+        // so the rings are checked again now that it's set
+        if (rings_empty())
+            syscall(SYS_futex, &writer_futex, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+
+        __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Wake the writer thread if it sleeps
+ *
+ * Only the first thread that sees the writer sleeping makes the system
+ * call, a busy writer costs nothing.
+ */
+static void wake_writer(void) {
+    if (!__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST) ||
+        !__atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST))
+        return;
+
+    __atomic_add_fetch(&writer_futex, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &writer_futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void release_ring(void *ptr) {
+    LogRing* ring = ptr;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void start_writer(void) {
+    pthread_t thread;
+
+    pthread_key_create(&release_key, release_ring);
+    if (pthread_create(&thread, NULL, writer_thread, NULL) == 0)
+        pthread_detach(thread);
+}
+
+/**
+ * @brief Get the ring of the current thread
+ *
+ * The first call of the thread takes a released ring or creates a new one.
+ * The very first call starts the writer thread
+ *
+ * @return LogRing* the ring or NULL if out of memory
+ */
+static LogRing* thread_ring(void) {
+    if (local != NULL)
+        return local;
+
+    pthread_once(&start_once, start_writer);
+
+    LogRing* ring = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (ring == NULL) {
+        if (posix_memalign((void**)&ring, 64, sizeof(LogRing)) != 0)
+            return NULL;
+        memset(ring, 0, sizeof(LogRing));
+        ring->in_use = 1;
+        ring->id = __atomic_add_fetch(&ring_count, 1, __ATOMIC_RELAXED);
+
+        ring->next = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ring_head, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(release_key, ring);
+    local = ring;
+    return ring;
+}
+
+/**
+ * @brief Write log record, use the LOG_* macros instead of this
+ *
+ * @param level level of the record
+ * @param fmt printf style format string literal
+ */
+void log_write(int level, const char *fmt, ...) {
+    if (level < __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+        return;
+
+    LogRing* ring = thread_ring();
+    if (ring == NULL)
+        return;
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        // Never wait for the writer, losing a line is better than a stall
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord* rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->time_ns = now_ns();
+    rec->fmt = fmt;
+    rec->level = (uint8_t)level;
+    rec->nargs = 0;
+    rec->str_used = 0;
+
+    va_list args;
+    va_start(args, fmt);
+
+    const char* end;
+    ArgType type;
+    for (const char* p = fmt; find_spec(p, &end, &type) != NULL && rec->nargs < LOG_MAX_ARGS; p = end) {
+        int i = rec->nargs;
+
+        switch (type) {
+            case ARG_NONE: continue;
+            case ARG_INT: rec->args[i].i = va_arg(args, int); break;
+            case ARG_UINT: rec->args[i].u = va_arg(args, unsigned int); break;
+            case ARG_LONG: rec->args[i].i = va_arg(args, long); break;
+            case ARG_ULONG: rec->args[i].u = va_arg(args, unsigned long); break;
+            case ARG_LLONG: rec->args[i].i = va_arg(args, long long); break;
+            case ARG_ULLONG: rec->args[i].u = va_arg(args, unsigned long long); break;
+            case ARG_SIZE: rec->args[i].u = va_arg(args, size_t); break;
+            case ARG_DOUBLE: rec->args[i].d = va_arg(args, double); break;
+            case ARG_PTR: rec->args[i].p = va_arg(args, void*); break;
+            case ARG_STR: {
+                const char* str = va_arg(args, const char*);
+                size_t space = LOG_STR_SPACE - rec->str_used;
+                if (str == NULL)
+                    str = "(null)";
+                // Truncate what doesn't fit, the terminating null always does
+                size_t len = strlen(str);
+                if (len > space - 1)
+                    len = space > 0 ? space - 1 : 0;
+                if (space > 0) {
+                    memcpy(rec->strings + rec->str_used, str, len);
+                    rec->strings[rec->str_used + len] = '\0';
+                    rec->args[i].u = rec->str_used;
+                    rec->str_used += len + 1;
+                } else {
+                    // No space at all, point to the last null
+                    rec->args[i].u = LOG_STR_SPACE - 1;
+                }
+                break;
+            }
+        }
+
+        rec->nargs++;
+    }
+
+    va_end(args);
+
+    // Publish the record to the writer. Together with the sleeping flag,
+    // either the writer sees the record or this thread sees it sleeping
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+}
+
+/**
+ * @brief Set the lowest level that is logged
+ *
+ * Levels below LOG_COMPILE_LEVEL can't be turned on at runtime
+ *
+ * @param level one of the LOG_LEVEL_* values
+ */
+void log_set_level(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Write every pending record now
+ *
+ * Used before the process exits so the last lines are not lost
+ */
+void log_flush(void) {
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    pthread_mutex_unlock(&drain_lock);
+}
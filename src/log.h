@@ -0,0 +1,58 @@
+#ifndef WEB_SOCKET_LOG_H
+#define WEB_SOCKET_LOG_H
+
+/**
+ * Asynchronous logging
+ *
+ * LOG_* macros copy the format pointer and the arguments to a ring that
+ * belongs to the calling thread. Nothing is formatted and no lock is taken
+ * on the calling thread. A background thread formats the records and
+ * writes them to stderr.
+ *
+ * The format has to be a string literal since only the pointer is stored.
+ * %s arguments are copied to the record and may be truncated.
+ *
+ * Levels below LOG_COMPILE_LEVEL are removed at compile time.
+ */
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_set_level(int level);
+void log_flush(void);
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(fmt, ...) log_write(LOG_LEVEL_TRACE, "" fmt, ##__VA_ARGS__)
+#else
+#define LOG_TRACE(fmt, ...) ((void)0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) log_write(LOG_LEVEL_DEBUG, "" fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) ((void)0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) log_write(LOG_LEVEL_INFO, "" fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) ((void)0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) log_write(LOG_LEVEL_WARN, "" fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) ((void)0)
+#endif
+
+#define LOG_ERROR(fmt, ...) log_write(LOG_LEVEL_ERROR, "" fmt, ##__VA_ARGS__)
+
+#endif
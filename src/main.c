@@ -1,9 +1,369 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "server.h"
 
-int main(int argc, char const *argv[]) {
+/**
+ * @brief Subscribe the new connection to the topic named by its path
+ */
+static void pubsub_open(WebSocketServer *wss, WebSocketConn *conn) {
+    const char* path = ws_get_path(conn);
+    if (path == NULL || ws_subscribe(conn, path) < 0)
+        ws_close(conn, 1011, "cannot subscribe");
+}
+
+/**
+ * @brief Publish the message to every subscriber of the path
+ */
+static void pubsub_message(WebSocketServer *wss, WebSocketConn *conn,
+                           WebSocketMessageType type, const uint8_t *data, size_t len) {
+    if (ws_publish(wss, ws_get_path(conn), type, data, len) != 0)
+        ws_close(conn, 1009, "cannot publish");
+}
+
+/**
+ * @brief Hand the message to a worker process, it sends the reply
+ */
+static void worker_message(WebSocketServer *wss, WebSocketConn *conn,
+                           WebSocketMessageType type, const uint8_t *data, size_t len) {
+    if (ws_to_worker(conn, type, data, len) != 0)
+        ws_close(conn, 1013, "workers busy");
+}
+
+// Value of the raw codec, the payload as it is
+typedef struct {
+    const uint8_t* data;
+    size_t len;
+} RawValue;
+
+/**
+ * @brief Echo the message of a "raw" client back through the codec
+ */
+static void raw_decode(WebSocketServer *wss, WebSocketConn *conn,
+                       WebSocketMessageType type, const uint8_t *data, size_t len) {
+    RawValue value = { data, len };
+    ws_send_value(conn, &value);
+}
+
+static size_t raw_encoded_len(const void *value) {
+    return ((const RawValue*)value)->len;
+}
+
+static void raw_encode(const void *value, uint8_t *out) {
+    const RawValue* raw = value;
+    if (raw->len > 0)
+        memcpy(out, raw->data, raw->len);
+}
+
+static const WebSocketCodec raw_codec = {
+    .name = "raw",
+    .type = WS_BINARY,
+    .decode = raw_decode,
+    .encoded_len = raw_encoded_len,
+    .encode = raw_encode,
+};
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -a, --bind ADDR          address to listen on (default any ipv4)\n"
+        "  -p, --port PORT          port to listen on (default 8888)\n"
+        "  -b, --backlog N          listen backlog (default 4096)\n"
+        "  -t, --threads N          reactor threads (default one per cpu)\n"
+        "      --unix LIST          comma separated unix socket paths to\n"
+        "                           listen on too, @name is abstract\n"
+        "      --unix-mode MODE     octal permissions of the socket files\n"
+        "      --no-nodelay         keep Nagle's algorithm on\n"
+        "      --sndbuf BYTES       SO_SNDBUF of the connections\n"
+        "      --rcvbuf BYTES       SO_RCVBUF of the connections\n"
+        "      --defer-accept SECS  TCP_DEFER_ACCEPT timeout\n"
+        "      --fastopen N         TCP_FASTOPEN queue length\n"
+        "      --user-timeout MS    TCP_USER_TIMEOUT of the connections\n"
+        "      --max-handshakes N   drop new connections when N are not\n"
+        "                           upgraded yet, 0 is unlimited (default 16384)\n"
+        "      --connect-rate N     new connections per second per address\n"
+        "      --connect-burst N    burst of new connections per address\n"
+        "      --conn-message-rate N  messages per second per connection\n"
+        "      --conn-byte-rate N   bytes per second per connection\n"
+        "      --ip-message-rate N  messages per second per address\n"
+        "      --ip-byte-rate N     bytes per second per address, a client\n"
+        "                           over a limit isn't read until it's back\n"
+        "      --no-utf8-check      don't validate the text messages\n"
+        "      --coalesce-delay US  hold the output up to US microseconds to\n"
+        "                           send more frames with one system call\n"
+        "      --keep-buffers       idle connections keep their buffers\n"
+        "      --tls-cert FILE      serve wss:// with the PEM certificate chain\n"
+        "      --tls-key FILE       PEM private key of the certificate\n"
+        "      --pubsub             the path of the request is a topic, the\n"
+        "                           messages are sent to every subscriber\n"
+        "      --bus NAME           share the published messages with the\n"
+        "                           other servers through shared memory\n"
+        "      --bus-slots N        messages the bus holds (default 4096)\n"
+        "      --bus-slot-size BYTES  largest message and topic on the\n"
+        "                           bus (default 4096)\n"
+        "      --cluster-port PORT  port the other nodes of the cluster dial\n"
+        "      --cluster-peers LIST comma separated host:port cluster ports\n"
+        "                           of the other nodes\n"
+        "      --cluster-bind ADDR  address of the cluster port (default\n"
+        "                           the bind address or loopback)\n"
+        "      --replay N           keep N messages per topic for the clients\n"
+        "                           that resume with ?since=SEQ\n"
+        "      --replay-linger MS   keep them MS milliseconds after the last\n"
+        "                           subscriber leaves (default 60000)\n"
+        "      --proxy-routes LIST  comma separated PREFIX=host:port routes,\n"
+        "                           the upgrades under a prefix are relayed\n"
+        "                           to its backend\n"
+        "      --proxy-pool N       connected sockets kept per backend\n"
+        "                           (default 8)\n"
+        "      --workers NAME       hand the messages to the worker processes\n"
+        "                           through the shared memory object NAME\n"
+        "      --worker-count N     amount of the workers (default 1)\n"
+        "      --worker-ring-size BYTES  bytes of every ring, a message can\n"
+        "                           be half of it (default 1048576)\n"
+        "  -c, --capture FILE       record the inbound frames to FILE\n",
+        name);
+}
+
+// Values of the long options that don't have a short one
+enum {
+    OPT_NO_NODELAY = 256,
+    OPT_SNDBUF,
+    OPT_RCVBUF,
+    OPT_DEFER_ACCEPT,
+    OPT_FASTOPEN,
+    OPT_USER_TIMEOUT,
+    OPT_MAX_HANDSHAKES,
+    OPT_CONNECT_RATE,
+    OPT_CONNECT_BURST,
+    OPT_CONN_MESSAGE_RATE,
+    OPT_CONN_BYTE_RATE,
+    OPT_IP_MESSAGE_RATE,
+    OPT_IP_BYTE_RATE,
+    OPT_NO_UTF8_CHECK,
+    OPT_COALESCE_DELAY,
+    OPT_KEEP_BUFFERS,
+    OPT_TLS_CERT,
+    OPT_TLS_KEY,
+    OPT_PUBSUB,
+    OPT_BUS,
+    OPT_BUS_SLOTS,
+    OPT_BUS_SLOT_SIZE,
+    OPT_CLUSTER_PORT,
+    OPT_CLUSTER_PEERS,
+    OPT_CLUSTER_BIND,
+    OPT_REPLAY,
+    OPT_REPLAY_LINGER,
+    OPT_PROXY_ROUTES,
+    OPT_PROXY_POOL,
+    OPT_WORKERS,
+    OPT_WORKER_COUNT,
+    OPT_WORKER_RING_SIZE,
+    OPT_UNIX,
+    OPT_UNIX_MODE,
+};
+
+int main(int argc, char *argv[]) {
     WebSocketServer wss;
-    init_server(&wss);
+    WebSocketServerConfig config;
+    const char* capture_path = NULL;
+    int pubsub = 0;
+    int opt;
+
+    static const struct option options[] = {
+        { "bind", required_argument, NULL, 'a' },
+        { "port", required_argument, NULL, 'p' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "threads", required_argument, NULL, 't' },
+        { "unix", required_argument, NULL, OPT_UNIX },
+        { "unix-mode", required_argument, NULL, OPT_UNIX_MODE },
+        { "capture", required_argument, NULL, 'c' },
+        { "no-nodelay", no_argument, NULL, OPT_NO_NODELAY },
+        { "sndbuf", required_argument, NULL, OPT_SNDBUF },
+        { "rcvbuf", required_argument, NULL, OPT_RCVBUF },
+        { "defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT },
+        { "fastopen", required_argument, NULL, OPT_FASTOPEN },
+        { "user-timeout", required_argument, NULL, OPT_USER_TIMEOUT },
+        { "max-handshakes", required_argument, NULL, OPT_MAX_HANDSHAKES },
+        { "connect-rate", required_argument, NULL, OPT_CONNECT_RATE },
+        { "connect-burst", required_argument, NULL, OPT_CONNECT_BURST },
+        { "conn-message-rate", required_argument, NULL, OPT_CONN_MESSAGE_RATE },
+        { "conn-byte-rate", required_argument, NULL, OPT_CONN_BYTE_RATE },
+        { "ip-message-rate", required_argument, NULL, OPT_IP_MESSAGE_RATE },
+        { "ip-byte-rate", required_argument, NULL, OPT_IP_BYTE_RATE },
+        { "no-utf8-check", no_argument, NULL, OPT_NO_UTF8_CHECK },
+        { "coalesce-delay", required_argument, NULL, OPT_COALESCE_DELAY },
+        { "keep-buffers", no_argument, NULL, OPT_KEEP_BUFFERS },
+        { "tls-cert", required_argument, NULL, OPT_TLS_CERT },
+        { "tls-key", required_argument, NULL, OPT_TLS_KEY },
+        { "pubsub", no_argument, NULL, OPT_PUBSUB },
+        { "bus", required_argument, NULL, OPT_BUS },
+        { "bus-slots", required_argument, NULL, OPT_BUS_SLOTS },
+        { "bus-slot-size", required_argument, NULL, OPT_BUS_SLOT_SIZE },
+        { "cluster-port", required_argument, NULL, OPT_CLUSTER_PORT },
+        { "cluster-peers", required_argument, NULL, OPT_CLUSTER_PEERS },
+        { "cluster-bind", required_argument, NULL, OPT_CLUSTER_BIND },
+        { "replay", required_argument, NULL, OPT_REPLAY },
+        { "replay-linger", required_argument, NULL, OPT_REPLAY_LINGER },
+        { "proxy-routes", required_argument, NULL, OPT_PROXY_ROUTES },
+        { "proxy-pool", required_argument, NULL, OPT_PROXY_POOL },
+        { "workers", required_argument, NULL, OPT_WORKERS },
+        { "worker-count", required_argument, NULL, OPT_WORKER_COUNT },
+        { "worker-ring-size", required_argument, NULL, OPT_WORKER_RING_SIZE },
+        { NULL, 0, NULL, 0 },
+    };
+
+    init_server_config(&config);
+
+    while ((opt = getopt_long(argc, argv, "a:p:b:t:c:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                config.bind_address = optarg;
+                break;
+            case 'p':
+                config.port = (uint16_t)atoi(optarg);
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'c':
+                // Record the inbound frames for the replay tool
+                capture_path = optarg;
+                break;
+            case OPT_NO_NODELAY:
+                config.tcp_nodelay = 0;
+                break;
+            case OPT_SNDBUF:
+                config.send_buffer = atoi(optarg);
+                break;
+            case OPT_RCVBUF:
+                config.recv_buffer = atoi(optarg);
+                break;
+            case OPT_DEFER_ACCEPT:
+                config.defer_accept = atoi(optarg);
+                break;
+            case OPT_FASTOPEN:
+                config.fastopen = atoi(optarg);
+                break;
+            case OPT_USER_TIMEOUT:
+                config.user_timeout = atoi(optarg);
+                break;
+            case OPT_MAX_HANDSHAKES:
+                config.max_handshakes = atoi(optarg);
+                break;
+            case OPT_CONNECT_RATE:
+                config.connect_rate = atof(optarg);
+                break;
+            case OPT_CONNECT_BURST:
+                config.connect_burst = atof(optarg);
+                break;
+            case OPT_CONN_MESSAGE_RATE:
+                config.conn_message_rate = atof(optarg);
+                break;
+            case OPT_CONN_BYTE_RATE:
+                config.conn_byte_rate = atof(optarg);
+                break;
+            case OPT_IP_MESSAGE_RATE:
+                config.ip_message_rate = atof(optarg);
+                break;
+            case OPT_IP_BYTE_RATE:
+                config.ip_byte_rate = atof(optarg);
+                break;
+            case OPT_NO_UTF8_CHECK:
+                config.validate_utf8 = 0;
+                break;
+            case OPT_COALESCE_DELAY:
+                config.coalesce_delay_us = atoi(optarg);
+                break;
+            case OPT_KEEP_BUFFERS:
+                config.release_idle_buffers = 0;
+                break;
+            case OPT_TLS_CERT:
+                config.tls_cert = optarg;
+                break;
+            case OPT_TLS_KEY:
+                config.tls_key = optarg;
+                break;
+            case OPT_PUBSUB:
+                pubsub = 1;
+                break;
+            case OPT_BUS:
+                config.bus_name = optarg;
+                break;
+            case OPT_BUS_SLOTS:
+                config.bus_slots = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case OPT_BUS_SLOT_SIZE:
+                config.bus_slot_size = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case OPT_CLUSTER_PORT:
+                config.cluster_port = (uint16_t)atoi(optarg);
+                break;
+            case OPT_CLUSTER_PEERS:
+                config.cluster_peers = optarg;
+                break;
+            case OPT_CLUSTER_BIND:
+                config.cluster_bind = optarg;
+                break;
+            case OPT_REPLAY:
+                config.replay_size = atoi(optarg);
+                break;
+            case OPT_REPLAY_LINGER:
+                config.replay_linger_ms = atoi(optarg);
+                break;
+            case OPT_PROXY_ROUTES:
+                config.proxy_routes = optarg;
+                break;
+            case OPT_PROXY_POOL:
+                config.proxy_pool = atoi(optarg);
+                break;
+            case OPT_UNIX:
+                config.unix_paths = optarg;
+                break;
+            case OPT_UNIX_MODE:
+                config.unix_mode = (int)strtol(optarg, NULL, 8);
+                break;
+            case OPT_WORKERS:
+                config.worker_name = optarg;
+                break;
+            case OPT_WORKER_COUNT:
+                config.workers = atoi(optarg);
+                break;
+            case OPT_WORKER_RING_SIZE:
+                config.worker_ring_size = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!init_server(&wss, &config)) {
+        // Removes what was made before the failure, like the worker rings
+        free_server(&wss);
+        return EXIT_FAILURE;
+    }
+
+    wss.capture_path = capture_path;
+    if (pubsub) {
+        wss.handler.on_open = pubsub_open;
+        wss.handler.on_message = pubsub_message;
+        wss.handler.on_binary = NULL;
+    } else if (config.worker_name != NULL) {
+        wss.handler.on_message = worker_message;
+        wss.handler.on_binary = NULL;
+    } else {
+        // Clients that ask for the "raw" subprotocol get binary echoes
+        ws_add_protocol(&wss, &raw_codec);
+    }
+
     return run_server(&wss);
 
 }
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "histogram.h"
+#include "metrics.h"
+
+// Opcode is four bits
+#define OPCODE_COUNT 16
+
+// ThreadMetrics is written only by the thread that owns it
+typedef struct ThreadMetrics {
+    // Every ThreadMetrics ever created is in the list, they are never freed
+    struct ThreadMetrics* next;
+    // 1 while a thread owns the struct. When the thread exits, the next new
+    // thread takes it over and keeps adding to the same values
+    int in_use;
+    int64_t counters[METRIC_COUNT];
+    uint64_t frames_in[OPCODE_COUNT];
+    uint64_t bytes_in[OPCODE_COUNT];
+    uint64_t frames_out[OPCODE_COUNT];
+    uint64_t bytes_out[OPCODE_COUNT];
+    Histogram hists[METRIC_HIST_COUNT];
+} ThreadMetrics;
+
+// Head of the ThreadMetrics list. New structs are pushed with cas
+static ThreadMetrics* metrics_head = NULL;
+
+// The struct of the current thread
+static __thread ThreadMetrics* local = NULL;
+
+// Releases the struct when the thread exits
+static pthread_key_t release_key;
+static pthread_once_t release_once = PTHREAD_ONCE_INIT;
+
+static const char* counter_names[METRIC_COUNT] = {
+    [METRIC_CONNECTIONS_OPENED] = "websocket_connections_opened_total",
+    [METRIC_CONNECTIONS_CLOSED] = "websocket_connections_closed_total",
+    [METRIC_HTTP_REQUESTS] = "websocket_http_requests_total",
+    [METRIC_HANDSHAKES] = "websocket_handshakes_total",
+    [METRIC_HANDSHAKES_PENDING] = "websocket_handshakes_pending",
+    [METRIC_REJECTED_RATE_LIMIT] = "websocket_connections_rate_limited_total",
+    [METRIC_REJECTED_HANDSHAKES] = "websocket_connections_overloaded_total",
+    [METRIC_REJECTED_NO_FD] = "websocket_connections_no_fd_total",
+    [METRIC_WRITE_CALLS] = "websocket_write_calls_total",
+    [METRIC_QUEUED_BYTES] = "websocket_queued_bytes",
+    [METRIC_QUEUED_CHUNKS] = "websocket_queued_chunks",
+    [METRIC_TLS_HANDSHAKES] = "websocket_tls_full_handshakes_total",
+    [METRIC_TLS_RESUMED] = "websocket_tls_resumed_handshakes_total",
+    [METRIC_KTLS_CONNECTIONS] = "websocket_ktls_connections_total",
+    [METRIC_BUS_RECEIVED] = "websocket_bus_received_total",
+    [METRIC_BUS_DROPPED] = "websocket_bus_dropped_total",
+    [METRIC_BUS_GAPS] = "websocket_bus_gaps_total",
+    [METRIC_BUS_LAG] = "websocket_bus_lag_records",
+    [METRIC_CLUSTER_LINKS] = "websocket_cluster_links",
+    [METRIC_CLUSTER_FORWARDED] = "websocket_cluster_forwarded_total",
+    [METRIC_CLUSTER_RECEIVED] = "websocket_cluster_received_total",
+    [METRIC_CLUSTER_DROPPED] = "websocket_cluster_dropped_total",
+    [METRIC_CLUSTER_WRITES] = "websocket_cluster_write_calls_total",
+    [METRIC_CLUSTER_REFUSED] = "websocket_cluster_refused_total",
+    [METRIC_REPLAYED] = "websocket_replayed_messages_total",
+    [METRIC_REPLAY_GAPS] = "websocket_replay_gaps_total",
+    [METRIC_READ_PAUSES] = "websocket_read_pauses_total",
+    [METRIC_PROXY_SESSIONS] = "websocket_proxy_sessions",
+    [METRIC_PROXY_BYTES] = "websocket_proxy_spliced_bytes_total",
+    [METRIC_PROXY_FAILURES] = "websocket_proxy_failures_total",
+    [METRIC_WORKER_SENT] = "websocket_worker_sent_total",
+    [METRIC_WORKER_REPLIES] = "websocket_worker_replies_total",
+    [METRIC_WORKER_DROPPED] = "websocket_worker_dropped_total",
+    [METRIC_WORKER_WAKEUPS] = "websocket_worker_wakeups_total",
+};
+
+static const char* hist_names[METRIC_HIST_COUNT] = {
+    [METRIC_HANDSHAKE_TIME] = "websocket_handshake_seconds",
+    [METRIC_FRAME_HANDLE_TIME] = "websocket_frame_handle_seconds",
+    [METRIC_BUS_DELAY] = "websocket_bus_delay_seconds",
+};
+
+static const char* opcode_names[OPCODE_COUNT] = {
+    "continuation", "text", "binary", "0x3", "0x4", "0x5", "0x6", "0x7",
+    "close", "ping", "pong", "0xb", "0xc", "0xd", "0xe", "0xf",
+};
+
+static void release_metrics(void *ptr) {
+    ThreadMetrics* metrics = ptr;
+    __atomic_store_n(&metrics->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_release_key(void) {
+    pthread_key_create(&release_key, release_metrics);
+}
+
+/**
+ * @brief Get the ThreadMetrics of the current thread
+ *
+ * The first call of the thread takes a released struct or creates a new one
+ *
+ * @return ThreadMetrics* the metrics owned by the current thread
+ */
+static ThreadMetrics* thread_metrics(void) {
+    if (local != NULL)
+        return local;
+
+    pthread_once(&release_once, create_release_key);
+
+    ThreadMetrics* metrics = __atomic_load_n(&metrics_head, __ATOMIC_ACQUIRE);
+    for (; metrics != NULL; metrics = metrics->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&metrics->in_use, &expected, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (metrics == NULL) {
+        metrics = calloc(1, sizeof(ThreadMetrics));
+        if (metrics == NULL)
+            abort();
+        for (int i = 0; i < METRIC_HIST_COUNT; i++)
+            init_histogram(&metrics->hists[i]);
+        metrics->in_use = 1;
+
+        metrics->next = __atomic_load_n(&metrics_head, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&metrics_head, &metrics->next, metrics, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(release_key, metrics);
+    local = metrics;
+    return metrics;
+}
+
+// Only the owner writes, so load + store is enough and readers never
+// see a torn value
+#define LOCAL_ADD(field, value) \
+    __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Add value to counter or gauge
+ *
+ * @param metric the counter
+ * @param value amount to add, negative values decrease gauges
+ */
+void metrics_add(Metric metric, int64_t value) {
+    ThreadMetrics* metrics = thread_metrics();
+    LOCAL_ADD(metrics->counters[metric], value);
+}
+
+/**
+ * @brief Record value to histogram
+ *
+ * @param hist the histogram
+ * @param value the value in nanoseconds
+ */
+void metrics_record(MetricHistogram hist, uint64_t value) {
+    ThreadMetrics* metrics = thread_metrics();
+    histogram_record_relaxed(&metrics->hists[hist], value);
+}
+
+/**
+ * @brief Count a frame received from the client
+ *
+ * @param opcode opcode of the frame
+ * @param bytes total length of the frame
+ */
+void metrics_frame_in(uint8_t opcode, uint64_t bytes) {
+    ThreadMetrics* metrics = thread_metrics();
+    LOCAL_ADD(metrics->frames_in[opcode & 0xf], 1);
+    LOCAL_ADD(metrics->bytes_in[opcode & 0xf], bytes);
+}
+
+/**
+ * @brief Count a frame sent to the client
+ *
+ * @param opcode opcode of the frame
+ * @param bytes total length of the frame
+ */
+void metrics_frame_out(uint8_t opcode, uint64_t bytes) {
+    ThreadMetrics* metrics = thread_metrics();
+    LOCAL_ADD(metrics->frames_out[opcode & 0xf], 1);
+    LOCAL_ADD(metrics->bytes_out[opcode & 0xf], bytes);
+}
+
+// Growing text buffer for the metrics page
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    // Set when the buffer couldn't grow, the rest of the text is skipped
+    bool failed;
+} TextBuf;
+
+static void appendf(TextBuf *buf, const char *fmt, ...) {
+    va_list args;
+
+    while (!buf->failed) {
+        va_start(args, fmt);
+        int len = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (len >= 0 && (size_t)len < buf->cap - buf->len) {
+            buf->len += len;
+            return;
+        }
+
+        char* data = realloc(buf->data, buf->cap * 2);
+        if (data == NULL) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = data;
+        buf->cap *= 2;
+    }
+}
+
+static void render_opcodes(TextBuf *buf, const char *name, const char *help,
+                           const uint64_t *values) {
+    appendf(buf, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        // Reserved opcodes are shown only if somebody used them
+        if (values[i] == 0 && strncmp(opcode_names[i], "0x", 2) == 0)
+            continue;
+        appendf(buf, "%s{opcode=\"%s\"} %" PRIu64 "\n", name, opcode_names[i], values[i]);
+    }
+}
+
+static void render_histogram(TextBuf *buf, const char *name, const Histogram *hist) {
+    static const double quantiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+
+    appendf(buf, "# TYPE %s summary\n", name);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        appendf(buf, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i] / 100.0,
+                histogram_percentile(hist, quantiles[i]) / 1e9);
+    }
+    appendf(buf, "%s_max %.9f\n", name, hist->max / 1e9);
+    appendf(buf, "%s_sum %.9f\n", name, hist->sum / 1e9);
+    appendf(buf, "%s_count %" PRIu64 "\n", name, hist->total);
+}
+
+/**
+ * @brief Sum the metrics of every thread and render them as text
+ *
+ * The output is in the prometheus text format
+ *
+ * @param bus_lags bus records each reactor has not read yet
+ * @param reactors amount of bus_lags, 0 if the server doesn't use the bus
+ * @param len set to the length of the text
+ * @return char* the text, caller frees it. NULL if out of memory
+ */
+char* metrics_render(const uint64_t *bus_lags, int reactors, size_t *len) {
+    int64_t counters[METRIC_COUNT] = { 0 };
+    uint64_t frames_in[OPCODE_COUNT] = { 0 };
+    uint64_t bytes_in[OPCODE_COUNT] = { 0 };
+    uint64_t frames_out[OPCODE_COUNT] = { 0 };
+    uint64_t bytes_out[OPCODE_COUNT] = { 0 };
+    Histogram* hists = malloc(sizeof(Histogram) * METRIC_HIST_COUNT);
+    int threads = 0;
+
+    if (hists == NULL)
+        return NULL;
+
+    for (int i = 0; i < METRIC_HIST_COUNT; i++)
+        init_histogram(&hists[i]);
+
+    // Walking the list is safe without locks since the structs are never
+    // removed and new ones are only pushed to the head
+    ThreadMetrics* metrics = __atomic_load_n(&metrics_head, __ATOMIC_ACQUIRE);
+    for (; metrics != NULL; metrics = metrics->next) {
+        threads += __atomic_load_n(&metrics->in_use, __ATOMIC_RELAXED);
+        for (int i = 0; i < METRIC_COUNT; i++)
+            counters[i] += __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < OPCODE_COUNT; i++) {
+            frames_in[i] += __atomic_load_n(&metrics->frames_in[i], __ATOMIC_RELAXED);
+            bytes_in[i] += __atomic_load_n(&metrics->bytes_in[i], __ATOMIC_RELAXED);
+            frames_out[i] += __atomic_load_n(&metrics->frames_out[i], __ATOMIC_RELAXED);
+            bytes_out[i] += __atomic_load_n(&metrics->bytes_out[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRIC_HIST_COUNT; i++)
+            histogram_merge_relaxed(&hists[i], &metrics->hists[i]);
+    }
+
+    TextBuf buf = { .data = malloc(8192), .len = 0, .cap = 8192, .failed = false };
+    if (buf.data == NULL) {
+        free(hists);
+        return NULL;
+    }
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        bool gauge = i == METRIC_HANDSHAKES_PENDING || i == METRIC_BUS_LAG ||
+                     i == METRIC_CLUSTER_LINKS || i == METRIC_PROXY_SESSIONS ||
+                     i == METRIC_QUEUED_BYTES || i == METRIC_QUEUED_CHUNKS;
+        appendf(&buf, "# TYPE %s %s\n%s %" PRId64 "\n", counter_names[i],
+                gauge ? "gauge" : "counter", counter_names[i], counters[i]);
+    }
+
+    // The sum above hides a single reactor that fell behind
+    if (reactors > 0)
+        appendf(&buf, "# TYPE websocket_reactor_bus_lag_records gauge\n");
+    for (int i = 0; i < reactors; i++) {
+        appendf(&buf, "websocket_reactor_bus_lag_records{reactor=\"%d\"} %" PRIu64 "\n", i,
+                bus_lags[i]);
+    }
+
+    appendf(&buf, "# TYPE websocket_connections_active gauge\n"
+                  "websocket_connections_active %" PRId64 "\n",
+            counters[METRIC_CONNECTIONS_OPENED] - counters[METRIC_CONNECTIONS_CLOSED]);
+    appendf(&buf, "# TYPE websocket_threads gauge\nwebsocket_threads %d\n", threads);
+
+    render_opcodes(&buf, "websocket_frames_in_total", "Frames received", frames_in);
+    render_opcodes(&buf, "websocket_bytes_in_total", "Frame bytes received", bytes_in);
+    render_opcodes(&buf, "websocket_frames_out_total", "Frames sent", frames_out);
+    render_opcodes(&buf, "websocket_bytes_out_total", "Frame bytes sent", bytes_out);
+
+    for (int i = 0; i < METRIC_HIST_COUNT; i++)
+        render_histogram(&buf, hist_names[i], &hists[i]);
+
+    // Allocator stats are process wide so they are read only here
+    struct mallinfo2 info = mallinfo2();
+    appendf(&buf, "# TYPE malloc_arena_bytes gauge\nmalloc_arena_bytes %zu\n", info.arena);
+    appendf(&buf, "# TYPE malloc_mmap_bytes gauge\nmalloc_mmap_bytes %zu\n", info.hblkhd);
+    appendf(&buf, "# TYPE malloc_in_use_bytes gauge\nmalloc_in_use_bytes %zu\n", info.uordblks);
+    appendf(&buf, "# TYPE malloc_free_bytes gauge\nmalloc_free_bytes %zu\n", info.fordblks);
+
+    free(hists);
+    if (buf.failed) {
+        free(buf.data);
+        return NULL;
+    }
+    *len = buf.len;
+    return buf.data;
+}
@@ -0,0 +1,103 @@
+#ifndef WEB_SOCKET_METRICS_H
+#define WEB_SOCKET_METRICS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+ * Server metrics
+ *
+ * Every thread updates its own copy of the metrics with plain stores, so
+ * the hot paths never share a cache line or take a lock. The copies are
+ * summed when the metrics page is requested.
+ */
+
+// Counters and gauges. Gauges are counters that also go down
+typedef enum {
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_HTTP_REQUESTS,
+    METRIC_HANDSHAKES,
+    // Gauge: accepted connections that have not upgraded yet
+    METRIC_HANDSHAKES_PENDING,
+    // Connections dropped by the admission control
+    METRIC_REJECTED_RATE_LIMIT,
+    METRIC_REJECTED_HANDSHAKES,
+    // Connections dropped because the process ran out of file descriptors
+    METRIC_REJECTED_NO_FD,
+    // sendmsg and sendfile calls, compare with the sent frames to see how
+    // well the output is coalesced
+    METRIC_WRITE_CALLS,
+    // Gauges: frame bytes and chunks queued to the clients that are not
+    // written to the sockets yet
+    METRIC_QUEUED_BYTES,
+    METRIC_QUEUED_CHUNKS,
+    // TLS handshakes, the resumed ones are not in METRIC_TLS_HANDSHAKES
+    METRIC_TLS_HANDSHAKES,
+    METRIC_TLS_RESUMED,
+    // TLS connections which output is encrypted by the kernel
+    METRIC_KTLS_CONNECTIONS,
+    // Records the reactors read from the shared memory bus
+    METRIC_BUS_RECEIVED,
+    // Records the reactors lost because the publishers went around the
+    // ring before they were read
+    METRIC_BUS_DROPPED,
+    // Records the reactors gave up because the publisher never finished
+    // writing them
+    METRIC_BUS_GAPS,
+    // Gauge: records published to the bus that the reactors have not
+    // read yet, summed over the reactors
+    METRIC_BUS_LAG,
+    // Gauge: open links to the other nodes of the cluster
+    METRIC_CLUSTER_LINKS,
+    // Messages sent to and received from the other nodes
+    METRIC_CLUSTER_FORWARDED,
+    METRIC_CLUSTER_RECEIVED,
+    // Records dropped because the peer didn't read its link, or the
+    // message couldn't be handed to the cluster thread
+    METRIC_CLUSTER_DROPPED,
+    // send calls on the links, compare with the forwarded messages to see
+    // how well they are batched
+    METRIC_CLUSTER_WRITES,
+    // Links refused because the host is not in the peer list
+    METRIC_CLUSTER_REFUSED,
+    // Kept messages sent to the clients that resumed
+    METRIC_REPLAYED,
+    // Resumes that were too old for the kept messages
+    METRIC_REPLAY_GAPS,
+    // Times the reading of a connection was paused for the inbound limits
+    METRIC_READ_PAUSES,
+    // Gauge: clients relayed to a backend by the proxy
+    METRIC_PROXY_SESSIONS,
+    // Bytes the proxy moved with splice, both directions
+    METRIC_PROXY_BYTES,
+    // Upgrades the proxy couldn't take to a backend
+    METRIC_PROXY_FAILURES,
+    // Messages handed to the worker processes and replies sent back
+    METRIC_WORKER_SENT,
+    METRIC_WORKER_REPLIES,
+    // Messages dropped because the ring of the worker was full
+    METRIC_WORKER_DROPPED,
+    // Futex wakes of a worker that slept on its empty rings
+    METRIC_WORKER_WAKEUPS,
+    METRIC_COUNT,
+} Metric;
+
+typedef enum {
+    // From the start of the upgrade request to the sent 101 response
+    METRIC_HANDSHAKE_TIME,
+    // Time spent in handle_frame
+    METRIC_FRAME_HANDLE_TIME,
+    // From the publish to the bus until a reactor reads the record
+    METRIC_BUS_DELAY,
+    METRIC_HIST_COUNT,
+} MetricHistogram;
+
+uint64_t metrics_now_ns(void);
+void metrics_add(Metric metric, int64_t value);
+void metrics_record(MetricHistogram hist, uint64_t value);
+void metrics_frame_in(uint8_t opcode, uint64_t bytes);
+void metrics_frame_out(uint8_t opcode, uint64_t bytes);
+char* metrics_render(const uint64_t *bus_lags, int reactors, size_t *len);
+
+#endif
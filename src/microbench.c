@@ -0,0 +1,278 @@
+/**
+ * Microbenchmarks for the hot paths of the frame codec, the handshake and
+ * the text validation
+ *
+ * Every benchmark is calibrated to run at least BENCH_MIN_NS per round and
+ * is repeated BENCH_ROUNDS times. The median round is reported, so a single
+ * descheduled round doesn't move the result.
+ *
+ * Usage: microbench [-j] [-f filter]
+ *   -j  print json lines instead of a table, one object per result
+ *   -f  only run the benchmarks which name contains the filter
+ */
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto/base64.h"
+#include "crypto/sha1.h"
+#include "dataframe.h"
+#include "utf8.h"
+
+// How many times each benchmark is repeated
+#define BENCH_ROUNDS 7
+
+// Minimum duration of a single round in nanoseconds
+#define BENCH_MIN_NS 20000000ULL
+
+// Payload sizes every sized benchmark is run with
+static const size_t sizes[] = { 16, 125, 1024, 16 * 1024, 64 * 1024, 1024 * 1024 };
+
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+// Benchmark state that is set up once per size
+typedef struct {
+    size_t size;
+    uint8_t* input;
+    uint8_t* frame_bytes;
+    char* encoded;
+    uint8_t* output;
+    // JSON like text with some multi byte characters
+    uint8_t* text;
+    Dataframe frame;
+} BenchState;
+
+typedef void (*BenchFunc)(BenchState *state);
+
+// Results are written here so the compiler can't drop the work
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_create_frame(BenchState *state) {
+    Dataframe frame;
+    init_dataframe(&frame);
+    // create_frame unmasks in place, so every other run masks the bytes
+    // back. The cost is the same either way.
+    create_frame(&frame, state->frame_bytes);
+    sink += frame.data[0];
+    free_dataframe(&frame);
+}
+
+static void bench_get_frame_bytes(BenchState *state) {
+    uint8_t* bytes = get_frame_bytes(&state->frame);
+    sink += bytes[1];
+    free(bytes);
+}
+
+static void bench_mask_data(BenchState *state) {
+    mask_data(state->input, state->size, (const uint8_t*)"\x12\x34\x56\x78");
+    sink += state->input[0];
+}
+
+static void bench_mask_copy(BenchState *state) {
+    mask_copy(state->output, state->input, state->size, (const uint8_t*)"\x12\x34\x56\x78");
+    sink += state->output[0];
+}
+
+static void bench_len_bytes_int16(BenchState *state) {
+    sink += len_bytes_int(state->input, 2);
+}
+
+static void bench_len_bytes_int64(BenchState *state) {
+    sink += len_bytes_int(state->input, 8);
+}
+
+static void bench_sha1hash(BenchState *state) {
+    Sha1 sha;
+    sha1hash(&sha, state->input, state->size);
+    sink += sha.hash[0];
+}
+
+static void bench_base64encode(BenchState *state) {
+    base64encode(state->input, state->encoded, (int)state->size);
+    sink += state->encoded[0];
+}
+
+static void bench_base64decode(BenchState *state) {
+    base64decode(state->encoded, state->output, (int)strlen(state->encoded));
+    sink += state->output[0];
+}
+
+static void bench_utf8_validate(BenchState *state) {
+    Utf8State utf8;
+    utf8_init(&utf8);
+    sink += utf8_validate(&utf8, state->text, state->size);
+}
+
+typedef struct {
+    const char* name;
+    BenchFunc func;
+    // Sized benchmarks run with every size in sizes and report throughput
+    bool sized;
+    // UTF-8 implementation the benchmark runs with, skipped if the cpu
+    // doesn't support it
+    Utf8Impl utf8_impl;
+} Bench;
+
+static const Bench benches[] = {
+    { "create_frame", bench_create_frame, true, UTF8_IMPL_AUTO },
+    { "get_frame_bytes", bench_get_frame_bytes, true, UTF8_IMPL_AUTO },
+    { "mask_data", bench_mask_data, true, UTF8_IMPL_AUTO },
+    { "mask_copy", bench_mask_copy, true, UTF8_IMPL_AUTO },
+    { "len_bytes_int16", bench_len_bytes_int16, false, UTF8_IMPL_AUTO },
+    { "len_bytes_int64", bench_len_bytes_int64, false, UTF8_IMPL_AUTO },
+    { "sha1hash", bench_sha1hash, true, UTF8_IMPL_AUTO },
+    { "base64encode", bench_base64encode, true, UTF8_IMPL_AUTO },
+    { "base64decode", bench_base64decode, true, UTF8_IMPL_AUTO },
+    { "utf8_scalar", bench_utf8_validate, true, UTF8_IMPL_SCALAR },
+    { "utf8_sse4", bench_utf8_validate, true, UTF8_IMPL_SSE4 },
+    { "utf8_avx2", bench_utf8_validate, true, UTF8_IMPL_AVX2 },
+};
+
+static void init_state(BenchState *state, size_t size) {
+    state->size = size;
+    state->input = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        state->input[i] = (uint8_t)(i * 31 + 7);
+
+    // Masked frame like the ones clients send
+    init_dataframe(&state->frame);
+    set_as_last_frame(&state->frame);
+    set_op_code(&state->frame, BIN_FRAME);
+    set_mask_key(&state->frame, 0x12345678);
+    set_data(&state->frame, state->input, size);
+    state->frame_bytes = get_frame_bytes(&state->frame);
+
+    // Base64 grows 4/3 and needs room for the padding and the null
+    state->encoded = malloc(size * 4 / 3 + 8);
+    base64encode(state->input, state->encoded, (int)size);
+    state->output = malloc(size + 8);
+
+    // The text is cut at the size, so the last character may be split
+    static const char sample[] = "{\"name\": \"J\xc3\xb6rg\", \"price\": \"12\xe2\x82\xac\", \"id\": 12345}, ";
+    state->text = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        state->text[i] = (uint8_t)sample[i % (sizeof(sample) - 1)];
+}
+
+static void free_state(BenchState *state) {
+    free(state->input);
+    free(state->frame_bytes);
+    free(state->encoded);
+    free(state->output);
+    free(state->text);
+    free_dataframe(&state->frame);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Run the benchmark and return the median nanoseconds per operation
+ *
+ * @param bench the benchmark
+ * @param state the state for the benchmark
+ * @param iterations set to the amount of iterations in a round
+ * @param min set to the fastest round
+ * @return double median ns/op
+ */
+static double run_bench(const Bench *bench, BenchState *state, uint64_t *iterations, double *min) {
+    double rounds[BENCH_ROUNDS];
+    uint64_t iters = 1;
+
+    // Calibrate the iterations so the round is long enough for the clock.
+    // This also warms up the caches and the allocator
+    for (;;) {
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < iters; i++)
+            bench->func(state);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= BENCH_MIN_NS)
+            break;
+        iters = elapsed > 0 && iters * BENCH_MIN_NS / elapsed > iters * 2
+            ? iters * BENCH_MIN_NS / elapsed + 1
+            : iters * 2;
+    }
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < iters; i++)
+            bench->func(state);
+        rounds[r] = (double)(now_ns() - start) / iters;
+    }
+
+    qsort(rounds, BENCH_ROUNDS, sizeof(double), compare_double);
+    *iterations = iters;
+    *min = rounds[0];
+    return rounds[BENCH_ROUNDS / 2];
+}
+
+static void print_result(bool json, const char *name, size_t size, uint64_t iterations,
+                         double ns, double min) {
+    // bytes per nanosecond is the same as gigabytes per second
+    double gbps = size > 0 ? size / ns : 0.0;
+
+    if (json) {
+        printf("{\"bench\": \"%s\", \"size\": %zu, \"iterations\": %" PRIu64
+               ", \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f, \"gb_per_s\": %.4f}\n",
+               name, size, iterations, ns, min, gbps);
+    } else if (size > 0) {
+        printf("%-18s %10zu %14.1f %14.1f %10.3f\n", name, size, ns, min, gbps);
+    } else {
+        printf("%-18s %10s %14.1f %14.1f %10s\n", name, "-", ns, min, "-");
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    bool json = false;
+    const char* filter = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jf:")) != -1) {
+        switch (opt) {
+            case 'j': json = true; break;
+            case 'f': filter = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-f filter]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!json)
+        printf("%-18s %10s %14s %14s %10s\n", "bench", "size", "ns/op", "min ns/op", "GB/s");
+
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        const Bench* bench = &benches[b];
+        if (filter != NULL && strstr(bench->name, filter) == NULL)
+            continue;
+        if (bench->utf8_impl != UTF8_IMPL_AUTO && !utf8_set_impl(bench->utf8_impl))
+            continue;
+
+        for (size_t s = 0; s < (bench->sized ? SIZE_COUNT : 1); s++) {
+            BenchState state;
+            uint64_t iterations;
+            double min;
+
+            init_state(&state, bench->sized ? sizes[s] : 16);
+            double ns = run_bench(bench, &state, &iterations, &min);
+            print_result(json, bench->name, bench->sized ? sizes[s] : 0, iterations, ns, min);
+            free_state(&state);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,912 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+
+// How long to wait before the pool of a route is filled again after the
+// backend refused a connect
+#define RETRY_NS 1000000000ULL
+
+// Largest response headers the backend can send to the upgrade
+#define MAX_RESPONSE 8192
+
+// Empty pipes kept for the next sessions, the rest are closed
+#define MAX_FREE_PIPES 1024
+
+#define MAX_EVENTS 64
+
+// Sent to the client when the backend can't be reached
+static const char BAD_GATEWAY[] =
+    "HTTP/1.1 502 Bad Gateway\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/**
+ * @brief Wake the proxy thread up from epoll_wait
+ *
+ * @param proxy the Proxy
+ */
+static void wake_proxy(Proxy *proxy) {
+    if (__atomic_exchange_n(&proxy->wake_pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    uint64_t one = 1;
+    ssize_t n = write(proxy->wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+/**
+ * @brief Find the route of the path, the longest prefix wins
+ *
+ * The routes don't change after create_proxy, so any thread can call this.
+ *
+ * @param proxy the Proxy
+ * @param path path of the upgrade request
+ * @return ProxyRoute* the route or NULL if the path isn't proxied
+ */
+ProxyRoute* proxy_route(Proxy *proxy, const char *path) {
+    ProxyRoute* best = NULL;
+
+    for (size_t i = 0; i < proxy->route_count; i++) {
+        ProxyRoute* route = &proxy->routes[i];
+        if (strncmp(path, route->prefix, route->prefix_len) != 0)
+            continue;
+        // "/chat" takes "/chat" and "/chat/room" but not "/chatter"
+        char next = path[route->prefix_len];
+        if (next != '\0' && next != '/' && next != '?' && route->prefix[route->prefix_len - 1] != '/')
+            continue;
+        if (best == NULL || route->prefix_len > best->prefix_len)
+            best = route;
+    }
+    return best;
+}
+
+/**
+ * @brief Hand the client of the upgrade request to the proxy thread
+ *
+ * Called by the reactor, which closes its own copy of the socket after
+ * this. The reactor hasn't answered the request, the backend does.
+ *
+ * @param proxy the Proxy
+ * @param route the route of the request path
+ * @param conn the client connection
+ * @param request the upgrade request for the backend
+ * @param request_len length of the request
+ * @param early frames the client sent right after the request
+ * @param early_len length of the frames
+ * @return int 1 if success, 0 if out of memory or file descriptors
+ */
+int proxy_upgrade(Proxy *proxy, ProxyRoute *route, Connection *conn, const char *request,
+                  size_t request_len, const uint8_t *early, size_t early_len) {
+    ProxySession* session = calloc(1, sizeof(ProxySession));
+    uint8_t* out = malloc(request_len + early_len);
+    int fd = fcntl(conn->conn_fd, F_DUPFD_CLOEXEC, 0);
+    if (session == NULL || out == NULL || fd == -1) {
+        free(session);
+        free(out);
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+
+    // The request and the frames go to the backend as soon as it's
+    // connected, like the client sent them
+    memcpy(out, request, request_len);
+    if (early_len > 0)
+        memcpy(out + request_len, early, early_len);
+
+    session->route = route;
+    session->state = PROXY_HANDSHAKE;
+    session->client.session = session;
+    session->client.fd = fd;
+    session->client.connected = true;
+    session->client.pipe[0] = session->client.pipe[1] = -1;
+    session->upstream.session = session;
+    session->upstream.fd = -1;
+    session->upstream.pipe[0] = session->upstream.pipe[1] = -1;
+    session->upstream.out = out;
+    session->upstream.out_len = request_len + early_len;
+
+    ProxySession* head = __atomic_load_n(&proxy->incoming, __ATOMIC_RELAXED);
+    do {
+        session->next = head;
+    } while (!__atomic_compare_exchange_n(&proxy->incoming, &head, session, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    wake_proxy(proxy);
+    return 1;
+}
+
+/**
+ * @brief Give the end a pipe, an empty one of a closed session if there
+ * is one
+ *
+ * @param proxy the Proxy
+ * @param end the end
+ * @return int 1 if success, 0 if out of file descriptors
+ */
+static int take_pipe(Proxy *proxy, ProxyEnd *end) {
+    if (proxy->free_pipe_count > 0) {
+        proxy->free_pipe_count--;
+        end->pipe[0] = proxy->free_pipes[proxy->free_pipe_count][0];
+        end->pipe[1] = proxy->free_pipes[proxy->free_pipe_count][1];
+    } else if (pipe2(end->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        end->pipe[0] = end->pipe[1] = -1;
+        return 0;
+    }
+
+    int size = fcntl(end->pipe[0], F_GETPIPE_SZ);
+    end->pipe_size = size > 0 ? (size_t)size : 65536;
+    end->piped = 0;
+    return 1;
+}
+
+static void give_pipe(Proxy *proxy, ProxyEnd *end) {
+    if (end->pipe[0] == -1)
+        return;
+
+    // A pipe with bytes in it would hand them to the next session
+    if (end->piped == 0 && proxy->free_pipe_count < MAX_FREE_PIPES) {
+        proxy->free_pipes[proxy->free_pipe_count][0] = end->pipe[0];
+        proxy->free_pipes[proxy->free_pipe_count][1] = end->pipe[1];
+        proxy->free_pipe_count++;
+    } else {
+        close(end->pipe[0]);
+        close(end->pipe[1]);
+    }
+    end->pipe[0] = end->pipe[1] = -1;
+}
+
+/**
+ * @brief Set the events epoll waits for the socket from its state
+ *
+ * @param proxy the Proxy
+ * @param end the end
+ */
+static void update_events(Proxy *proxy, ProxyEnd *end) {
+    if (end->fd == -1)
+        return;
+
+    uint32_t events = 0;
+    if (!end->connected) {
+        // EPOLLOUT tells when the connect has finished
+        events = EPOLLOUT;
+    } else {
+        // Nothing is read while the pipe is full, so TCP slows the sender
+        if (!end->read_closed && (end->pipe[0] == -1 || end->piped < end->pipe_size))
+            events |= EPOLLIN;
+        if (end->want_write)
+            events |= EPOLLOUT;
+    }
+
+    if (events == end->events)
+        return;
+    struct epoll_event event = { .events = events, .data.ptr = end };
+    epoll_ctl(proxy->epoll_fd, EPOLL_CTL_MOD, end->fd, &event);
+    end->events = events;
+}
+
+static void close_end(Proxy *proxy, ProxyEnd *end) {
+    if (end->fd != -1) {
+        epoll_ctl(proxy->epoll_fd, EPOLL_CTL_DEL, end->fd, NULL);
+        close(end->fd);
+        end->fd = -1;
+    }
+    give_pipe(proxy, end);
+    free(end->out);
+    end->out = NULL;
+}
+
+/**
+ * @brief Start a non-blocking connect to the backend of the route
+ *
+ * @param proxy the Proxy
+ * @param route the route
+ * @param end the end that gets the socket, epoll events point to it
+ * @return int 1 if the connect started, 0 if fail
+ */
+static int dial(Proxy *proxy, ProxyRoute *route, ProxyEnd *end) {
+    int fd = socket(route->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == -1)
+        return 0;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr*)&route->addr, route->addr_len) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return 0;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = end };
+    if (epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return 0;
+    }
+    end->fd = fd;
+    end->events = EPOLLOUT;
+    end->connected = false;
+    return 1;
+}
+
+/**
+ * @brief Check the result of the connect
+ *
+ * @param end the end that was connecting
+ * @return int 1 if connected, 0 if the connect failed
+ */
+static int finish_connect(ProxyEnd *end) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(end->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+        return 0;
+    end->connected = true;
+    return 1;
+}
+
+/**
+ * @brief Connect sockets to the backends until every pool is full
+ *
+ * @param proxy the Proxy
+ * @param now current time in nanoseconds
+ */
+static void fill_pools(Proxy *proxy, uint64_t now) {
+    int size = proxy->wss->config.proxy_pool;
+
+    for (size_t i = 0; i < proxy->route_count; i++) {
+        ProxyRoute* route = &proxy->routes[i];
+        if (route->retry_ns > now)
+            continue;
+
+        while (route->pooled + route->dialing < (size_t)size) {
+            ProxyEnd* end = calloc(1, sizeof(ProxyEnd));
+            if (end == NULL)
+                return;
+            end->pipe[0] = end->pipe[1] = -1;
+            end->route = route;
+            if (!dial(proxy, route, end)) {
+                free(end);
+                route->retry_ns = now + RETRY_NS;
+                break;
+            }
+            end->next = route->connecting;
+            route->connecting = end;
+            route->dialing++;
+        }
+    }
+}
+
+/**
+ * @brief Take the end out of a list of the route
+ *
+ * @param list the pool or the connecting list
+ * @param end the end, it's in the list
+ */
+static void unlink_end(ProxyEnd **list, ProxyEnd *end) {
+    while (*list != end)
+        list = &(*list)->next;
+    *list = end->next;
+}
+
+/**
+ * @brief Handle an event of a socket in a pool
+ *
+ * A pooled socket has nothing to say, so anything after the connect means
+ * the backend closed it.
+ *
+ * @param proxy the Proxy
+ * @param end the pooled socket
+ */
+static void pool_event(Proxy *proxy, ProxyEnd *end) {
+    ProxyRoute* route = end->route;
+
+    if (!end->connected) {
+        unlink_end(&route->connecting, end);
+        route->dialing--;
+        if (finish_connect(end)) {
+            end->next = route->pool;
+            route->pool = end;
+            route->pooled++;
+            update_events(proxy, end);
+            return;
+        }
+        LOG_DEBUG("Cannot connect to proxy backend %s", route->name);
+        route->retry_ns = metrics_now_ns() + RETRY_NS;
+    } else {
+        unlink_end(&route->pool, end);
+        route->pooled--;
+    }
+
+    close_end(proxy, end);
+    free(end);
+}
+
+/**
+ * @brief Write the userspace output of the end
+ *
+ * @param end the end
+ * @return int 1 if everything is written, 0 if the socket is full and -1
+ * if the socket is gone
+ */
+static int write_out(ProxyEnd *end) {
+    while (end->out_sent < end->out_len) {
+        ssize_t n = send(end->fd, end->out + end->out_sent, end->out_len - end->out_sent,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            end->out_sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            end->want_write = true;
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    free(end->out);
+    end->out = NULL;
+    end->out_len = end->out_sent = 0;
+    end->want_write = false;
+    return 1;
+}
+
+/**
+ * @brief Move what the socket has to its pipe
+ *
+ * @param src the end that is read
+ * @return int 1 if success, -1 if the socket is gone
+ */
+static int fill_pipe(ProxyEnd *src) {
+    while (!src->read_closed && src->piped < src->pipe_size) {
+        ssize_t n = splice(src->fd, NULL, src->pipe[1], NULL, src->pipe_size - src->piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            src->piped += n;
+        } else if (n == 0) {
+            src->read_closed = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Move the pipe of src to the socket of dst
+ *
+ * The write side of dst is shut down once src has closed and its pipe is
+ * empty, so the close reaches the other peer.
+ *
+ * @param src the end the bytes were read from
+ * @param dst the end they are written to
+ * @return int 1 if success, -1 if the socket is gone
+ */
+static int drain_pipe(ProxyEnd *src, ProxyEnd *dst) {
+    if (dst->out != NULL) {
+        int status = write_out(dst);
+        if (status != 1)
+            return status;
+    }
+
+    while (src->piped > 0) {
+        ssize_t n = splice(src->pipe[0], NULL, dst->fd, NULL, src->piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            src->piped -= n;
+            metrics_add(METRIC_PROXY_BYTES, n);
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            dst->want_write = true;
+            return 1;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    dst->want_write = false;
+
+    if (src->read_closed && !dst->write_closed) {
+        shutdown(dst->fd, SHUT_WR);
+        dst->write_closed = true;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read the response of the backend to the upgrade
+ *
+ * The response and whatever came after it go to the client as they are.
+ *
+ * @param session the session
+ * @return int 1 if success, -1 if the backend is gone or broken
+ */
+static int read_response(ProxySession *session) {
+    ProxyEnd* upstream = &session->upstream;
+
+    if (session->response == NULL) {
+        session->response = malloc(MAX_RESPONSE);
+        if (session->response == NULL)
+            return -1;
+    }
+
+    for (;;) {
+        size_t room = MAX_RESPONSE - session->response_len;
+        if (room == 0)
+            return -1;
+        ssize_t n = recv(upstream->fd, session->response + session->response_len, room, 0);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        session->response_len += n;
+
+        if (memmem(session->response, session->response_len, "\r\n\r\n", 4) == NULL)
+            continue;
+
+        bool upgraded = session->response_len > 12 &&
+                        !memcmp(session->response, "HTTP/1.1 101", 12);
+        ProxyEnd* client = &session->client;
+        client->out = session->response;
+        client->out_len = session->response_len;
+        client->out_sent = 0;
+        session->response = NULL;
+        session->response_len = 0;
+
+        if (!upgraded) {
+            metrics_add(METRIC_PROXY_FAILURES, 1);
+            session->state = PROXY_REJECTED;
+            return 1;
+        }
+        session->state = PROXY_RELAY;
+        return 1;
+    }
+}
+
+/**
+ * @brief Answer the client with 502 and close it after that
+ *
+ * @param proxy the Proxy
+ * @param session the session
+ */
+static void bad_gateway(Proxy *proxy, ProxySession *session) {
+    LOG_WARN("Proxy backend %s failed", session->route->name);
+    metrics_add(METRIC_PROXY_FAILURES, 1);
+    close_end(proxy, &session->upstream);
+
+    ProxyEnd* client = &session->client;
+    free(client->out);
+    client->out = malloc(sizeof(BAD_GATEWAY) - 1);
+    client->out_len = client->out != NULL ? sizeof(BAD_GATEWAY) - 1 : 0;
+    client->out_sent = 0;
+    if (client->out != NULL)
+        memcpy(client->out, BAD_GATEWAY, client->out_len);
+    session->state = PROXY_REJECTED;
+}
+
+/**
+ * @brief Close both sockets of the session
+ *
+ * The session is freed at the end of the round, the other end may still
+ * have an event waiting in the same batch.
+ *
+ * @param proxy the Proxy
+ * @param session the session
+ * @param dead list of the sessions closed during the round
+ */
+static void close_session(Proxy *proxy, ProxySession *session, ProxySession **dead) {
+    close_end(proxy, &session->client);
+    close_end(proxy, &session->upstream);
+    free(session->response);
+    session->response = NULL;
+
+    if (session->live_prev != NULL)
+        session->live_prev->live_next = session->live_next;
+    else
+        proxy->sessions = session->live_next;
+    if (session->live_next != NULL)
+        session->live_next->live_prev = session->live_prev;
+
+    session->next = *dead;
+    *dead = session;
+    metrics_add(METRIC_PROXY_SESSIONS, -1);
+}
+
+/**
+ * @brief Move everything the session can move without blocking
+ *
+ * @param proxy the Proxy
+ * @param session the session
+ * @param dead list of the sessions closed during the round
+ */
+static void run_session(Proxy *proxy, ProxySession *session, ProxySession **dead) {
+    ProxyEnd* client = &session->client;
+    ProxyEnd* upstream = &session->upstream;
+
+    // The frames of the client wait in its pipe during the handshake
+    if (session->state != PROXY_REJECTED && fill_pipe(client) == -1) {
+        close_session(proxy, session, dead);
+        return;
+    }
+
+    if (session->state == PROXY_HANDSHAKE && upstream->connected) {
+        if (upstream->out != NULL && write_out(upstream) == -1) {
+            bad_gateway(proxy, session);
+        } else if (upstream->out == NULL && read_response(session) == -1) {
+            bad_gateway(proxy, session);
+        }
+    }
+
+    if (session->state == PROXY_REJECTED) {
+        // Nothing more is read, the client only gets the response
+        client->read_closed = true;
+        int status = client->out != NULL ? write_out(client) : 1;
+        if (status != 0) {
+            close_session(proxy, session, dead);
+            return;
+        }
+    }
+
+    if (session->state == PROXY_RELAY) {
+        if (drain_pipe(client, upstream) == -1 || fill_pipe(upstream) == -1 ||
+            drain_pipe(upstream, client) == -1 ||
+            (client->write_closed && upstream->write_closed)) {
+            close_session(proxy, session, dead);
+            return;
+        }
+    }
+
+    update_events(proxy, client);
+    update_events(proxy, upstream);
+}
+
+/**
+ * @brief Take a pooled socket for the session, or dial a new one
+ *
+ * @param proxy the Proxy
+ * @param session the session
+ * @return int 1 if success, 0 if the backend can't be reached
+ */
+static int attach_upstream(Proxy *proxy, ProxySession *session) {
+    ProxyRoute* route = session->route;
+    ProxyEnd* upstream = &session->upstream;
+    ProxyEnd* pooled;
+
+    for (;;) {
+        pooled = route->pool;
+        if (pooled == NULL)
+            return dial(proxy, route, upstream);
+        route->pool = pooled->next;
+        route->pooled--;
+
+        // The backend may have closed it since the last round, like after
+        // its idle timeout
+        char byte;
+        ssize_t n = recv(pooled->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        close_end(proxy, pooled);
+        free(pooled);
+    }
+
+    upstream->fd = pooled->fd;
+    upstream->connected = true;
+    upstream->events = EPOLLIN;
+    free(pooled);
+
+    // The events of the socket point to the session from now on
+    struct epoll_event event = { .events = upstream->events, .data.ptr = upstream };
+    epoll_ctl(proxy->epoll_fd, EPOLL_CTL_MOD, upstream->fd, &event);
+    return 1;
+}
+
+/**
+ * @brief Start the sessions the reactors handed over
+ *
+ * @param proxy the Proxy
+ * @param dead list of the sessions closed during the round
+ */
+static void start_sessions(Proxy *proxy, ProxySession **dead) {
+    ProxySession* session = __atomic_exchange_n(&proxy->incoming, NULL, __ATOMIC_ACQUIRE);
+
+    while (session != NULL) {
+        ProxySession* next = session->next;
+        ProxyEnd* client = &session->client;
+        metrics_add(METRIC_PROXY_SESSIONS, 1);
+
+        session->live_next = proxy->sessions;
+        if (proxy->sessions != NULL)
+            proxy->sessions->live_prev = session;
+        proxy->sessions = session;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == -1 ||
+            !take_pipe(proxy, client) || !take_pipe(proxy, &session->upstream)) {
+            LOG_ERROR("proxy session setup failed");
+            metrics_add(METRIC_PROXY_FAILURES, 1);
+            close_session(proxy, session, dead);
+            session = next;
+            continue;
+        }
+        client->events = EPOLLIN;
+
+        if (!attach_upstream(proxy, session))
+            bad_gateway(proxy, session);
+        run_session(proxy, session, dead);
+        session = next;
+    }
+}
+
+/**
+ * @brief Get how long epoll_wait can sleep before a pool is filled again
+ *
+ * @param proxy the Proxy
+ * @param now current time in nanoseconds
+ * @return int the timeout in milliseconds, -1 if nothing waits
+ */
+static int retry_timeout(Proxy *proxy, uint64_t now) {
+    int timeout = -1;
+
+    for (size_t i = 0; i < proxy->route_count; i++) {
+        ProxyRoute* route = &proxy->routes[i];
+        if (route->retry_ns == 0 ||
+            route->pooled + route->dialing >= (size_t)proxy->wss->config.proxy_pool)
+            continue;
+        int wait_ms = route->retry_ns > now ? (int)((route->retry_ns - now + 999999) / 1000000) : 0;
+        if (timeout == -1 || wait_ms < timeout)
+            timeout = wait_ms;
+    }
+    return timeout;
+}
+
+static void* proxy_loop(void *arg) {
+    Proxy* proxy = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!__atomic_load_n(&proxy->stopping, __ATOMIC_ACQUIRE)) {
+        fill_pools(proxy, metrics_now_ns());
+
+        int count = epoll_wait(proxy->epoll_fd, events, MAX_EVENTS,
+                               retry_timeout(proxy, metrics_now_ns()));
+        if (count == -1) {
+            if (errno != EINTR)
+                LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+            count = 0;
+        }
+
+        ProxySession* dead = NULL;
+        for (int i = 0; i < count; i++) {
+            ProxyEnd* end = events[i].data.ptr;
+
+            if (end == NULL) {
+                uint64_t value;
+                ssize_t n = read(proxy->wake_fd, &value, sizeof(value));
+                (void)n;
+                continue;
+            }
+            if (end->session == NULL) {
+                pool_event(proxy, end);
+                continue;
+            }
+
+            // The other end of the session may have closed it this round
+            ProxySession* session = end->session;
+            if (end->fd == -1)
+                continue;
+            if (!end->connected && !finish_connect(end))
+                bad_gateway(proxy, session);
+            run_session(proxy, session, &dead);
+        }
+
+        __atomic_store_n(&proxy->wake_pending, false, __ATOMIC_SEQ_CST);
+        start_sessions(proxy, &dead);
+
+        while (dead != NULL) {
+            ProxySession* next = dead->next;
+            free(dead);
+            dead = next;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Parse a "PREFIX=HOST:PORT" route
+ *
+ * @param route the route that is filled in
+ * @param spec the route text
+ * @return int 1 if success, 0 if the route is bad
+ */
+static int parse_route(ProxyRoute *route, const char *spec) {
+    const char* equals = strchr(spec, '=');
+    const char* colon = strrchr(spec, ':');
+    char host[256];
+
+    if (spec[0] != '/' || equals == NULL || colon == NULL || colon < equals ||
+        (size_t)(equals - spec) >= sizeof(route->prefix) ||
+        (size_t)(colon - equals - 1) >= sizeof(host)) {
+        fprintf(stderr, "invalid proxy route %s\n", spec);
+        return 0;
+    }
+
+    route->prefix_len = equals - spec;
+    memcpy(route->prefix, spec, route->prefix_len);
+    route->prefix[route->prefix_len] = '\0';
+
+    const char* start = equals + 1;
+    const char* end = colon;
+    if (*start == '[' && end > start && end[-1] == ']') {
+        start++;
+        end--;
+    }
+    memcpy(host, start, end - start);
+    host[end - start] = '\0';
+
+    struct addrinfo hints;
+    struct addrinfo* addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    int status = getaddrinfo(host, colon + 1, &hints, &addr);
+    if (status != 0) {
+        fprintf(stderr, "invalid proxy route %s: %s\n", spec, gai_strerror(status));
+        return 0;
+    }
+    memcpy(&route->addr, addr->ai_addr, addr->ai_addrlen);
+    route->addr_len = addr->ai_addrlen;
+    snprintf(route->name, sizeof(route->name), "%.63s", equals + 1);
+    freeaddrinfo(addr);
+    return 1;
+}
+
+/**
+ * @brief Parse the routes
+ *
+ * @param wss the server, config.proxy_routes is set
+ * @return Proxy* the proxy or NULL if fail
+ */
+Proxy* create_proxy(WebSocketServer *wss) {
+    Proxy* proxy = calloc(1, sizeof(Proxy));
+    if (proxy == NULL)
+        return NULL;
+
+    proxy->wss = wss;
+    proxy->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    proxy->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    proxy->free_pipes = malloc(MAX_FREE_PIPES * sizeof(*proxy->free_pipes));
+    if (proxy->epoll_fd == -1 || proxy->wake_fd == -1 || proxy->free_pipes == NULL) {
+        free_proxy(proxy);
+        return NULL;
+    }
+
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, proxy->wake_fd, &wake) == -1) {
+        free_proxy(proxy);
+        return NULL;
+    }
+
+    // Comma separated list of the routes
+    const char* routes = wss->config.proxy_routes;
+    size_t count = 1;
+    for (const char* p = routes; *p != '\0'; p++)
+        count += *p == ',';
+    proxy->routes = calloc(count, sizeof(ProxyRoute));
+    if (proxy->routes == NULL) {
+        free_proxy(proxy);
+        return NULL;
+    }
+
+    while (*routes != '\0') {
+        char spec[400];
+        size_t len = strcspn(routes, ",");
+        if (len > 0 && len < sizeof(spec)) {
+            memcpy(spec, routes, len);
+            spec[len] = '\0';
+            if (!parse_route(&proxy->routes[proxy->route_count], spec)) {
+                free_proxy(proxy);
+                return NULL;
+            }
+            proxy->route_count++;
+        }
+        routes += len;
+        if (*routes == ',')
+            routes++;
+    }
+
+    return proxy;
+}
+
+/**
+ * @brief Start the thread that relays the proxied connections
+ *
+ * @param proxy the Proxy
+ * @return int 1 if success, 0 if fail
+ */
+int start_proxy(Proxy *proxy) {
+    proxy->started = pthread_create(&proxy->thread, NULL, proxy_loop, proxy) == 0;
+    return proxy->started;
+}
+
+static void free_ends(Proxy *proxy, ProxyEnd *end) {
+    while (end != NULL) {
+        ProxyEnd* next = end->next;
+        close_end(proxy, end);
+        free(end);
+        end = next;
+    }
+}
+
+/**
+ * @brief Stop the thread and close every session and pooled socket
+ *
+ * @param proxy the Proxy
+ */
+void free_proxy(Proxy *proxy) {
+    if (proxy->started) {
+        __atomic_store_n(&proxy->stopping, true, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        ssize_t n = write(proxy->wake_fd, &one, sizeof(one));
+        (void)n;
+        pthread_join(proxy->thread, NULL);
+    }
+
+    ProxySession* dead = NULL;
+    while (proxy->sessions != NULL)
+        close_session(proxy, proxy->sessions, &dead);
+
+    // Handed over but never started, only the client socket and the
+    // request are there
+    ProxySession* session = __atomic_exchange_n(&proxy->incoming, NULL, __ATOMIC_ACQUIRE);
+    while (session != NULL) {
+        ProxySession* next = session->next;
+        close(session->client.fd);
+        free(session->upstream.out);
+        free(session);
+        session = next;
+    }
+
+    while (dead != NULL) {
+        ProxySession* next = dead->next;
+        free(dead);
+        dead = next;
+    }
+
+    for (size_t i = 0; i < proxy->route_count; i++) {
+        free_ends(proxy, proxy->routes[i].pool);
+        free_ends(proxy, proxy->routes[i].connecting);
+    }
+    free(proxy->routes);
+
+    for (size_t i = 0; i < proxy->free_pipe_count; i++) {
+        close(proxy->free_pipes[i][0]);
+        close(proxy->free_pipes[i][1]);
+    }
+    free(proxy->free_pipes);
+    if (proxy->epoll_fd != -1)
+        close(proxy->epoll_fd);
+    if (proxy->wake_fd != -1)
+        close(proxy->wake_fd);
+    free(proxy);
+}
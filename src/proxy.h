@@ -0,0 +1,130 @@
+#ifndef WEB_SOCKET_PROXY_H
+#define WEB_SOCKET_PROXY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "socketcon.h"
+
+/**
+ * Reverse proxy
+ *
+ * Upgrade requests which path starts with the prefix of a route are
+ * handed to the proxy thread together with the client socket. The thread
+ * opens a websocket connection to the backend of the route with the path,
+ * the query and the key of the client, and sends the 101 response of the
+ * backend to the client as it is. The key is the client's, so the
+ * Sec-WebSocket-Accept of the backend is the one the client expects, and
+ * the backend picks the subprotocol.
+ *
+ * After the handshake the frames need no changes: the client frames are
+ * already masked like the backend wants them and the backend frames are
+ * not masked like the client wants them. So both directions move with
+ * splice through a pipe and the payload is never copied to userspace.
+ *
+ * Every route keeps proxy_pool connected sockets to its backend, so an
+ * upgrade doesn't wait for the TCP handshake. The pooled sockets are
+ * plain TCP connections since the websocket handshake needs the path and
+ * the key of the client.
+ */
+
+typedef struct ProxyRoute {
+    // Path prefix of the route, like "/chat"
+    char prefix[128];
+    size_t prefix_len;
+    // Address of the backend, and "host:port" for the Host header
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[64];
+    // Connected sockets waiting for a client, and the ones still connecting
+    struct ProxyEnd* pool;
+    struct ProxyEnd* connecting;
+    size_t pooled;
+    size_t dialing;
+    // Time to fill the pool again after the backend refused
+    uint64_t retry_ns;
+} ProxyRoute;
+
+// ProxyEnd is one socket of a session, or a socket in the pool of a route
+typedef struct ProxyEnd {
+    struct ProxySession* session;
+    int fd;
+    // The bytes read from this socket wait in the pipe until the other
+    // end can take them
+    int pipe[2];
+    size_t piped;
+    size_t pipe_size;
+    // Bytes written to this socket from userspace before the pipe of the
+    // other end, the handshake and the frames sent with the upgrade
+    uint8_t* out;
+    size_t out_len;
+    size_t out_sent;
+    // The connect has finished
+    bool connected;
+    // The peer closed its side and everything it sent is written
+    bool read_closed;
+    bool write_closed;
+    // True while epoll waits for EPOLLOUT
+    bool want_write;
+    uint32_t events;
+    // Route and link of the pool, for the pooled sockets
+    ProxyRoute* route;
+    struct ProxyEnd* next;
+} ProxyEnd;
+
+typedef enum {
+    // Waiting for the 101 response of the backend
+    PROXY_HANDSHAKE,
+    // Relaying the frames
+    PROXY_RELAY,
+    // The backend said no, the client gets the response and is closed
+    PROXY_REJECTED,
+} ProxyState;
+
+typedef struct ProxySession {
+    struct ProxySession* next;
+    // Links of the running sessions, only the proxy thread touches these
+    struct ProxySession* live_prev;
+    struct ProxySession* live_next;
+    ProxyRoute* route;
+    ProxyState state;
+    ProxyEnd client;
+    ProxyEnd upstream;
+    // The response of the backend until the end of its headers
+    uint8_t* response;
+    size_t response_len;
+} ProxySession;
+
+typedef struct Proxy {
+    WebSocketServer* wss;
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    // True from the first wake up until the thread takes the sessions
+    bool wake_pending;
+    // The thread runs, and free_proxy asked it to stop
+    bool started;
+    bool stopping;
+    // Sessions handed over by the reactors, newest first
+    ProxySession* incoming;
+    // Sessions the thread has started
+    ProxySession* sessions;
+    ProxyRoute* routes;
+    size_t route_count;
+    // Empty pipes of the closed sessions, reused by the new ones
+    int (*free_pipes)[2];
+    size_t free_pipe_count;
+} Proxy;
+
+Proxy* create_proxy(WebSocketServer *wss);
+int start_proxy(Proxy *proxy);
+void free_proxy(Proxy *proxy);
+ProxyRoute* proxy_route(Proxy *proxy, const char *path);
+int proxy_upgrade(Proxy *proxy, ProxyRoute *route, Connection *conn, const char *request,
+                  size_t request_len, const uint8_t *early, size_t early_len);
+
+#endif
@@ -0,0 +1,708 @@
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bus.h"
+#include "cluster.h"
+#include "dataframe.h"
+#include "history.h"
+#include "log.h"
+#include "metrics.h"
+#include "pubsub.h"
+#include "reactor.h"
+
+// Most bus records a reactor reads in a single round, so a busy feed
+// doesn't starve the sockets
+#define BUS_BATCH 256
+
+// Initial amount of buckets in the topic table
+#define TOPIC_BUCKETS 64
+
+/**
+ * @brief FNV-1a hash of the topic name
+ *
+ * @param name the name
+ * @param len length of the name
+ * @return uint64_t the hash
+ */
+uint64_t topic_hash(const char *name, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find the topic in the table
+ *
+ * @param table the TopicTable
+ * @param name the topic name, doesn't have to be terminated
+ * @param len length of the name
+ * @param hash hash of the name
+ * @return Topic* the topic or NULL if nobody is subscribed to it
+ */
+Topic* topic_find(TopicTable *table, const char *name, size_t len, uint64_t hash) {
+    if (table->count == 0)
+        return NULL;
+
+    Topic* topic = table->buckets[hash & (table->bucket_count - 1)];
+    for (; topic != NULL; topic = topic->next) {
+        if (topic->hash == hash && !strncmp(topic->name, name, len) && topic->name[len] == '\0')
+            return topic;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Double the buckets of the table
+ *
+ * @param table the TopicTable
+ * @return int 1 if success, 0 if out of memory
+ */
+static int grow_table(TopicTable *table) {
+    size_t count = table->bucket_count != 0 ? table->bucket_count * 2 : TOPIC_BUCKETS;
+    Topic** buckets = calloc(count, sizeof(Topic*));
+    if (buckets == NULL)
+        return 0;
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        Topic* topic = table->buckets[i];
+        while (topic != NULL) {
+            Topic* next = topic->next;
+            size_t index = topic->hash & (count - 1);
+            topic->next = buckets[index];
+            buckets[index] = topic;
+            topic = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = count;
+    return 1;
+}
+
+/**
+ * @brief Add the topic to the table
+ *
+ * @param table the TopicTable
+ * @param name the topic name
+ * @param len length of the name
+ * @param hash hash of the name
+ * @return Topic* the new topic or NULL if out of memory
+ */
+Topic* topic_add(TopicTable *table, const char *name, size_t len, uint64_t hash) {
+    if (table->count >= table->bucket_count && !grow_table(table))
+        return NULL;
+
+    Topic* topic = malloc(sizeof(Topic) + len + 1);
+    if (topic == NULL)
+        return NULL;
+    topic->hash = hash;
+    topic->subscribers = NULL;
+    topic->count = 0;
+    topic->ring = NULL;
+    memcpy(topic->name, name, len);
+    topic->name[len] = '\0';
+
+    size_t index = hash & (table->bucket_count - 1);
+    topic->next = table->buckets[index];
+    table->buckets[index] = topic;
+    table->count++;
+    return topic;
+}
+
+/**
+ * @brief Remove the topic from the table and free it
+ *
+ * @param table the TopicTable
+ * @param topic the topic, it has no subscribers
+ */
+void topic_remove(TopicTable *table, Topic *topic) {
+    Topic** link = &table->buckets[topic->hash & (table->bucket_count - 1)];
+    while (*link != topic)
+        link = &(*link)->next;
+    *link = topic->next;
+    table->count--;
+    free(topic);
+}
+
+/**
+ * @brief Free every topic of the table and the buckets
+ *
+ * @param table the TopicTable, the topics have no subscribers
+ */
+void topic_table_free(TopicTable *table) {
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        while (table->buckets[i] != NULL) {
+            Topic* topic = table->buckets[i];
+            table->buckets[i] = topic->next;
+            free(topic);
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->bucket_count = 0;
+    table->count = 0;
+}
+
+/**
+ * @brief Unlink the subscription from its topic and free it
+ *
+ * The topic is freed when its last subscriber leaves. The caller unlinks
+ * the subscription from the connection.
+ *
+ * @param table the TopicTable of the reactor
+ * @param sub the subscription
+ */
+static void free_subscription(TopicTable *table, Subscription *sub) {
+    Topic* topic = sub->topic;
+
+    if (sub->prev != NULL)
+        sub->prev->next = sub->next;
+    else
+        topic->subscribers = sub->next;
+    if (sub->next != NULL)
+        sub->next->prev = sub->prev;
+
+    if (--topic->count == 0) {
+        // The other nodes stop sending the topic when no reactor wants it
+        WebSocketServer* wss = sub->conn->server;
+        if (wss->cluster != NULL)
+            cluster_interest(wss->cluster, topic->name, false);
+        if (wss->history != NULL)
+            history_watch(wss->history, topic->name, false);
+        topic_remove(table, topic);
+    }
+    free(sub);
+}
+
+/**
+ * @brief Subscribe the connection to the topic
+ *
+ * The messages published to the topic after this are sent to the
+ * connection. Must be called on the reactor thread of the connection,
+ * like from its callbacks.
+ *
+ * With replay_size set, the messages start with their sequence: the
+ * decimal number and a space in the text messages, 8 bytes big endian in
+ * the binary ones. If the upgrade request had a since query parameter,
+ * like "/feed?since=1234", the kept messages after that sequence are sent
+ * to the connection first.
+ *
+ * @param conn the connection
+ * @param topic the topic name, at most BUS_MAX_TOPIC bytes
+ * @return int 0 if success, 1 if subscribed but the messages after since
+ * are no longer all kept, so the application has to send the whole state,
+ * -1 if the connection isn't open or out of memory
+ */
+int ws_subscribe(WebSocketConn *conn, const char *topic) {
+    TopicTable* table = &conn->reactor->topics;
+    size_t len = strlen(topic);
+    uint64_t hash = topic_hash(topic, len);
+
+    if (len == 0 || len > BUS_MAX_TOPIC || conn_state(conn) != CONN_WEBSOCKET)
+        return -1;
+
+    Topic* found = topic_find(table, topic, len, hash);
+    if (found != NULL) {
+        for (Subscription* sub = conn->subscriptions; sub != NULL; sub = sub->conn_next) {
+            if (sub->topic == found)
+                return 0;
+        }
+    }
+
+    Subscription* sub = malloc(sizeof(Subscription));
+    if (sub == NULL)
+        return -1;
+    if (found == NULL) {
+        found = topic_add(table, topic, len, hash);
+        if (found == NULL) {
+            free(sub);
+            return -1;
+        }
+        if (conn->server->cluster != NULL)
+            cluster_interest(conn->server->cluster, topic, true);
+        if (conn->server->history != NULL)
+            history_watch(conn->server->history, topic, true);
+    }
+
+    sub->topic = found;
+    sub->conn = conn;
+    sub->replayed = 0;
+    sub->prev = NULL;
+    sub->next = found->subscribers;
+    if (found->subscribers != NULL)
+        found->subscribers->prev = sub;
+    found->subscribers = sub;
+    found->count++;
+
+    sub->conn_next = conn->subscriptions;
+    conn->subscriptions = sub;
+
+    // The subscription is in place, so nothing published after the replay
+    // is missed
+    bool gap = false;
+    if (conn->resume && conn->server->history != NULL)
+        sub->replayed = history_resume(conn->server->history, conn, topic, conn->resume_seq, &gap);
+    return gap ? 1 : 0;
+}
+
+/**
+ * @brief Stop sending the messages of the topic to the connection
+ *
+ * Must be called on the reactor thread of the connection.
+ *
+ * @param conn the connection
+ * @param topic the topic name
+ * @return int 0 if success, -1 if the connection wasn't subscribed
+ */
+int ws_unsubscribe(WebSocketConn *conn, const char *topic) {
+    Subscription** link = &conn->subscriptions;
+
+    for (; *link != NULL; link = &(*link)->conn_next) {
+        Subscription* sub = *link;
+        if (!strcmp(sub->topic->name, topic)) {
+            *link = sub->conn_next;
+            free_subscription(&conn->reactor->topics, sub);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Drop every subscription of the closed connection
+ *
+ * @param conn Connection struct
+ */
+void pubsub_drop(Connection *conn) {
+    while (conn->subscriptions != NULL) {
+        Subscription* sub = conn->subscriptions;
+        conn->subscriptions = sub->conn_next;
+        free_subscription(&conn->reactor->topics, sub);
+    }
+}
+
+/**
+ * @brief Frame the message for the subscribers
+ *
+ * The topic name, the frame and the nodes for the reactors are in a single
+ * allocation.
+ *
+ * @param topic the topic name
+ * @param topic_len length of the name
+ * @param type WS_TEXT or WS_BINARY
+ * @param len length of the payload
+ * @param nodes amount of reactors the message is handed to
+ * @param numbered true if the sequence is put in front of the payload
+ * @param seq the sequence
+ * @param payload set to where the payload is copied
+ * @return PubMessage* the message or NULL if out of memory
+ */
+static PubMessage* new_message(const char *topic, size_t topic_len, uint8_t type, size_t len,
+                               int nodes, bool numbered, uint64_t seq, uint8_t **payload) {
+    Dataframe frame;
+    char prefix[24];
+    size_t prefix_len = 0;
+
+    if (numbered && type == WS_TEXT) {
+        prefix_len = snprintf(prefix, sizeof(prefix), "%" PRIu64 " ", seq);
+    } else if (numbered) {
+        for (int i = 0; i < 8; i++)
+            prefix[i] = (char)(seq >> (56 - 8 * i));
+        prefix_len = 8;
+    }
+
+    init_dataframe(&frame);
+    frame.control = 0x80 | type;
+    set_data_length(&frame, prefix_len + len);
+
+    // The header is at most 14 bytes
+    size_t nodes_size = nodes * sizeof(PubNode);
+    PubMessage* message = malloc(sizeof(PubMessage) + nodes_size + topic_len + 1 + 14 +
+                                 prefix_len + len);
+    if (message == NULL)
+        return NULL;
+
+    message->refs = nodes;
+    message->seq = seq;
+    message->hash = topic_hash(topic, topic_len);
+    message->topic = (char*)message->nodes + nodes_size;
+    message->topic_len = topic_len;
+    memcpy(message->topic, topic, topic_len);
+    message->topic[topic_len] = '\0';
+
+    message->frame = (uint8_t*)message->topic + topic_len + 1;
+    uint64_t header_len = get_frame_header(&frame, message->frame);
+    message->frame_len = frame.total_len;
+    memcpy(message->frame + header_len, prefix, prefix_len);
+    *payload = message->frame + header_len + prefix_len;
+
+    return message;
+}
+
+void release_message(void *arg) {
+    PubMessage* message = arg;
+    if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(message);
+}
+
+/**
+ * @brief Queue the frame to every subscriber of the topic on this reactor
+ *
+ * @param topic the topic
+ * @param message the message
+ */
+static void fan_out(Topic *topic, PubMessage *message) {
+    for (Subscription* sub = topic->subscribers; sub != NULL; sub = sub->next) {
+        if (message->seq != 0 && message->seq <= sub->replayed)
+            continue;
+        // The queued frame holds a reference until it's written
+        __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+        conn_queue_frame(sub->conn, message->frame, message->frame_len, release_message, message);
+    }
+}
+
+/**
+ * @brief Hand the message to the reactors of this process
+ *
+ * @param wss the server
+ * @param topic the topic name
+ * @param topic_len length of the name
+ * @param type WS_TEXT or WS_BINARY
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if out of memory
+ */
+int pubsub_publish_local(WebSocketServer *wss, const char *topic, size_t topic_len,
+                         uint8_t type, const uint8_t *data, size_t len) {
+    int threads = wss->config.threads;
+    History* history = wss->history;
+    uint64_t seq = 0;
+    uint8_t* payload;
+
+    if (wss->reactors == NULL)
+        return -1;
+
+    // With the bus the sequences are the ones of the bus records, so the
+    // messages from the other nodes are not kept
+    bool record = history != NULL && wss->bus == NULL;
+    if (record) {
+        // Every reactor gets the messages in the order of the sequences
+        pthread_mutex_lock(&history->lock);
+        seq = history->seq + 1;
+    }
+
+    PubMessage* message = new_message(topic, topic_len, type, len, threads, history != NULL,
+                                      seq, &payload);
+    if (message == NULL) {
+        if (record)
+            pthread_mutex_unlock(&history->lock);
+        return -1;
+    }
+    if (len > 0)
+        memcpy(payload, data, len);
+
+    if (record) {
+        __atomic_store_n(&history->seq, seq, __ATOMIC_RELAXED);
+        HistoryRing* ring = history_find(history, topic, topic_len, message->hash);
+        if (ring != NULL)
+            history_append(history, ring, message);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        message->nodes[i].message = message;
+        reactor_publish(&wss->reactors[i], &message->nodes[i]);
+    }
+
+    if (record)
+        pthread_mutex_unlock(&history->lock);
+    return 0;
+}
+
+/**
+ * @brief Send the message to every subscriber of the topic
+ *
+ * Can be called from any thread. The payload is copied and framed once,
+ * the subscribers share the frame. With the bus the message goes to every
+ * server process that reads the bus, and with the cluster to the peers
+ * that have subscribers for the topic.
+ *
+ * @param wss the server
+ * @param topic the topic name, at most BUS_MAX_TOPIC bytes
+ * @param type WS_TEXT or WS_BINARY
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if the message can't be published
+ */
+int ws_publish(WebSocketServer *wss, const char *topic, WebSocketMessageType type,
+               const uint8_t *data, size_t len) {
+    size_t topic_len = strlen(topic);
+
+    if (topic_len == 0 || topic_len > BUS_MAX_TOPIC)
+        return -1;
+
+    int result;
+    if (wss->bus != NULL)
+        result = bus_publish(wss->bus, topic, type, data, len);
+    else
+        result = pubsub_publish_local(wss, topic, topic_len, type, data, len);
+
+    // The local subscribers get the message even if the peers can't, the
+    // result only tells about the local delivery
+    if (wss->cluster != NULL && cluster_forward(wss->cluster, topic, topic_len, type, data, len) != 0)
+        metrics_add(METRIC_CLUSTER_DROPPED, 1);
+
+    return result;
+}
+
+/**
+ * @brief Fan out the messages published to the reactor
+ *
+ * @param reactor the Reactor
+ */
+void pubsub_deliver(Reactor *reactor) {
+    PubNode* node = __atomic_exchange_n(&reactor->published, NULL, __ATOMIC_ACQUIRE);
+    PubNode* head = NULL;
+
+    // The list is newest first, reverse it to keep the publish order
+    while (node != NULL) {
+        PubNode* next = node->next;
+        node->next = head;
+        head = node;
+        node = next;
+    }
+
+    while (head != NULL) {
+        // The node is in the message, so it's read before the release
+        PubNode* next = head->next;
+        PubMessage* message = head->message;
+
+        Topic* topic = topic_find(&reactor->topics, message->topic, message->topic_len,
+                                  message->hash);
+        if (topic != NULL)
+            fan_out(topic, message);
+        release_message(message);
+
+        head = next;
+    }
+}
+
+/**
+ * @brief Lock the history if the bus record is not recorded yet
+ *
+ * Every reactor reads the records in order, and the first one to get past
+ * the newest recorded sequence records the next one. So everything up to
+ * the sequence of the history is recorded, and the other reactors skip the
+ * record without taking the lock.
+ *
+ * @param history the History or NULL
+ * @param seq sequence of the record
+ * @return bool true if the record has to be recorded and the lock is held
+ */
+static bool claim_record(History *history, uint64_t seq) {
+    if (history == NULL || seq <= __atomic_load_n(&history->seq, __ATOMIC_RELAXED))
+        return false;
+
+    pthread_mutex_lock(&history->lock);
+    if (seq > history->seq)
+        return true;
+    pthread_mutex_unlock(&history->lock);
+    return false;
+}
+
+/**
+ * @brief Read the new bus records and fan them out
+ *
+ * The records of the topics nobody on this reactor is subscribed to are
+ * skipped without copying them, unless the history keeps the topic.
+ *
+ * @param reactor the Reactor
+ */
+void pubsub_poll_bus(Reactor *reactor) {
+    BusConsumer* consumer = &reactor->bus;
+    History* history = reactor->wss->history;
+    BusRecord record;
+    uint64_t dropped = consumer->dropped;
+    uint64_t gaps = consumer->gaps;
+    uint64_t now = metrics_now_ns();
+    int count = 0;
+
+    // The reactor is awake, so the watcher doesn't have to wake it
+    __atomic_store_n(&reactor->bus_idle, false, __ATOMIC_SEQ_CST);
+    reactor->bus_seen = __atomic_load_n(&consumer->bus->header->futex, __ATOMIC_SEQ_CST);
+
+    while (count < BUS_BATCH && bus_peek(consumer, &record)) {
+        count++;
+
+        // The sequences start from 1, 0 is a message without one
+        uint64_t seq = consumer->read_seq + 1;
+        if (record.type != WS_TEXT && record.type != WS_BINARY) {
+            bus_commit(consumer);
+            continue;
+        }
+
+        uint64_t hash = topic_hash(record.topic, record.topic_len);
+        Topic* topic = topic_find(&reactor->topics, record.topic, record.topic_len, hash);
+        bool claimed = claim_record(history, seq);
+        HistoryRing* ring = NULL;
+        if (claimed) {
+            ring = history_find(history, record.topic, record.topic_len, hash);
+            if (ring == NULL) {
+                __atomic_store_n(&history->seq, seq, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&history->lock);
+                claimed = false;
+            }
+        }
+        if (topic == NULL && ring == NULL) {
+            bus_commit(consumer);
+            continue;
+        }
+
+        uint8_t* payload;
+        uint64_t published_ns = record.published_ns;
+        PubMessage* message = new_message(record.topic, record.topic_len, record.type,
+                                          record.len, 0, history != NULL, seq, &payload);
+        if (message != NULL) {
+            message->refs = 1;
+            if (record.len > 0)
+                memcpy(payload, record.data, record.len);
+        }
+
+        // The topic was found with the bytes of the record, so it's right
+        // only if the record didn't change meanwhile
+        bool intact = bus_commit(consumer);
+        if (claimed) {
+            if (intact && message != NULL)
+                history_append(history, ring, message);
+            __atomic_store_n(&history->seq, seq, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&history->lock);
+        }
+        if (!intact || message == NULL) {
+            free(message);
+            continue;
+        }
+
+        if (topic != NULL) {
+            metrics_record(METRIC_BUS_DELAY, now > published_ns ? now - published_ns : 0);
+            fan_out(topic, message);
+        }
+        release_message(message);
+    }
+
+    uint64_t lag = bus_lag(consumer);
+    metrics_add(METRIC_BUS_RECEIVED, count);
+    metrics_add(METRIC_BUS_DROPPED, consumer->dropped - dropped);
+    metrics_add(METRIC_BUS_GAPS, consumer->gaps - gaps);
+    metrics_add(METRIC_BUS_LAG, (int64_t)lag - (int64_t)reactor->bus_lag);
+    __atomic_store_n(&reactor->bus_lag, lag, __ATOMIC_RELAXED);
+    reactor->bus_backlog = count == BUS_BATCH && lag > 0;
+}
+
+/**
+ * @brief Tell the watcher the reactor is about to sleep with the bus read
+ *
+ * @param reactor the Reactor
+ * @return bool true if the reactor can sleep, false if something was
+ * published since the last read and the reactor has to read again
+ */
+bool pubsub_bus_idle(Reactor *reactor) {
+    BusWatch* watch = reactor->wss->bus_watch;
+    uint32_t* futex = &reactor->bus.bus->header->futex;
+
+    if (reactor->bus_backlog || __atomic_load_n(futex, __ATOMIC_SEQ_CST) != reactor->bus_seen)
+        return false;
+    if (__atomic_load_n(&reactor->bus_idle, __ATOMIC_RELAXED))
+        return true;
+
+    __atomic_store_n(&reactor->bus_idle, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&watch->idle_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&watch->sleeping, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &watch->idle_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+
+    // A publish between the check and the flag may have been missed by
+    // the watcher, so it's checked again now that the flag is set
+    if (__atomic_load_n(futex, __ATOMIC_SEQ_CST) != reactor->bus_seen) {
+        __atomic_store_n(&reactor->bus_idle, false, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Wake the reactors that sleep when something is published
+ *
+ * The reactors that are awake read the bus at the end of their round
+ * anyway, so the watcher only cares about the idle ones. It sleeps on the
+ * bus futex while some reactor is idle, and on its own futex while every
+ * reactor is busy, so it doesn't run while the publishers keep the
+ * reactors awake.
+ *
+ * @param arg the BusWatch
+ * @return void* NULL
+ */
+static void* watch_bus(void *arg) {
+    BusWatch* watch = arg;
+    WebSocketServer* wss = watch->wss;
+    uint32_t* futex = &wss->bus->header->futex;
+
+    for (;;) {
+        uint32_t idle_seq = __atomic_load_n(&watch->idle_seq, __ATOMIC_SEQ_CST);
+        uint32_t current = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+        int idle = 0;
+
+        for (int i = 0; i < wss->config.threads; i++) {
+            Reactor* reactor = &wss->reactors[i];
+            if (!__atomic_load_n(&reactor->bus_idle, __ATOMIC_SEQ_CST))
+                continue;
+            if (__atomic_load_n(&reactor->bus_seen, __ATOMIC_RELAXED) == current)
+                idle++;
+            else if (__atomic_exchange_n(&reactor->bus_idle, false, __ATOMIC_SEQ_CST))
+                reactor_wake(reactor);
+        }
+
+        if (idle > 0) {
+            bus_wait(wss->bus, current);
+            continue;
+        }
+
+        __atomic_store_n(&watch->sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&watch->idle_seq, __ATOMIC_SEQ_CST) == idle_seq)
+            syscall(SYS_futex, &watch->idle_seq, FUTEX_WAIT_PRIVATE, idle_seq, NULL, NULL, 0);
+        __atomic_store_n(&watch->sleeping, false, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the thread that wakes the reactors for the bus
+ *
+ * Called after the reactors are started.
+ *
+ * @param wss the server, wss->bus is open
+ * @return int 1 if success, 0 if fail
+ */
+int pubsub_start_watch(WebSocketServer *wss) {
+    BusWatch* watch = calloc(1, sizeof(BusWatch));
+    if (watch == NULL)
+        return 0;
+
+    watch->wss = wss;
+    wss->bus_watch = watch;
+    if (pthread_create(&watch->thread, NULL, watch_bus, watch) != 0) {
+        wss->bus_watch = NULL;
+        free(watch);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,110 @@
+#ifndef WEB_SOCKET_PUBSUB_H
+#define WEB_SOCKET_PUBSUB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "bus.h"
+#include "server.h"
+#include "socketcon.h"
+
+/**
+ * Topics
+ *
+ * Every reactor keeps its own table of the topics its connections are
+ * subscribed to, so subscribing and the fan out never take a lock. A
+ * published message is framed once and the same bytes are queued to
+ * every subscriber, the message is freed when the last of them has
+ * written it.
+ *
+ * Without the bus, ws_publish hands the message to every reactor. With
+ * the bus the message goes to the shared ring instead, and every reactor
+ * of every server process on the host reads it from there. Each reactor
+ * is a consumer of its own, so a slow reactor only delays its own
+ * subscribers.
+ */
+
+typedef struct PubMessage PubMessage;
+
+// PubNode hands a message to a single reactor
+typedef struct PubNode {
+    struct PubNode* next;
+    PubMessage* message;
+} PubNode;
+
+struct PubMessage {
+    // One for every reactor it's handed to, one for every queued frame and
+    // one while it's in the history
+    int refs;
+    // Sequence for the replay, 0 if the message isn't numbered
+    uint64_t seq;
+    uint64_t hash;
+    char* topic;
+    size_t topic_len;
+    // The whole frame, header and payload
+    uint8_t* frame;
+    size_t frame_len;
+    // One per reactor, the rest of the allocation is after them
+    PubNode nodes[];
+};
+
+// Subscription links a connection to a topic of its reactor
+typedef struct Subscription {
+    struct Topic* topic;
+    Connection* conn;
+    // Links of the topic's subscribers
+    struct Subscription* prev;
+    struct Subscription* next;
+    // Next subscription of the same connection
+    struct Subscription* conn_next;
+    // The messages up to this sequence were replayed, so they are skipped
+    uint64_t replayed;
+} Subscription;
+
+typedef struct Topic {
+    struct Topic* next;
+    uint64_t hash;
+    Subscription* subscribers;
+    size_t count;
+    // The kept messages, only in the table of the history
+    struct HistoryRing* ring;
+    char name[];
+} Topic;
+
+// Topics of a single reactor, only the reactor thread touches it. The
+// cluster uses the same table for the interest of the peers
+typedef struct {
+    Topic** buckets;
+    // Power of two
+    size_t bucket_count;
+    size_t count;
+} TopicTable;
+
+// BusWatch is the thread that wakes the idle reactors of the process
+// when something is published to the bus
+typedef struct BusWatch {
+    WebSocketServer* wss;
+    pthread_t thread;
+    // Bumped when a reactor goes idle, the watcher sleeps on it while
+    // every reactor is busy
+    uint32_t idle_seq;
+    bool sleeping;
+} BusWatch;
+
+uint64_t topic_hash(const char *name, size_t len);
+Topic* topic_find(TopicTable *table, const char *name, size_t len, uint64_t hash);
+Topic* topic_add(TopicTable *table, const char *name, size_t len, uint64_t hash);
+void topic_remove(TopicTable *table, Topic *topic);
+void topic_table_free(TopicTable *table);
+void release_message(void *arg);
+void pubsub_drop(Connection *conn);
+int pubsub_publish_local(WebSocketServer *wss, const char *topic, size_t topic_len,
+                         uint8_t type, const uint8_t *data, size_t len);
+void pubsub_deliver(struct Reactor *reactor);
+void pubsub_poll_bus(struct Reactor *reactor);
+bool pubsub_bus_idle(struct Reactor *reactor);
+int pubsub_start_watch(WebSocketServer *wss);
+
+#endif
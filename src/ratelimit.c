@@ -0,0 +1,215 @@
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+// Amount of entries in a set of the address table
+#define SET_WAYS 4
+
+/**
+ * @brief Initialize a full bucket
+ *
+ * @param bucket the TokenBucket
+ * @param burst the size of the bucket
+ * @param now current time in nanoseconds
+ */
+void init_token_bucket(TokenBucket *bucket, double burst, uint64_t now) {
+    bucket->tokens = burst;
+    bucket->last_ns = now;
+}
+
+/**
+ * @brief Add the tokens for the time since the last refill
+ *
+ * The tokens are refilled when the bucket is used, so the bucket doesn't
+ * need a timer.
+ */
+static void refill(TokenBucket *bucket, double rate, double burst, uint64_t now) {
+    if (now > bucket->last_ns) {
+        bucket->tokens += (now - bucket->last_ns) / 1e9 * rate;
+        if (bucket->tokens > burst)
+            bucket->tokens = burst;
+        bucket->last_ns = now;
+    }
+}
+
+/**
+ * @brief Take tokens from the bucket if there are enough of them
+ *
+ * @param bucket the TokenBucket
+ * @param rate tokens added per second
+ * @param burst the size of the bucket
+ * @param amount tokens needed
+ * @param now current time in nanoseconds
+ * @return bool true if the tokens were taken, false if the rate is exceeded
+ */
+bool token_bucket_take(TokenBucket *bucket, double rate, double burst,
+                       double amount, uint64_t now) {
+    refill(bucket, rate, burst, now);
+
+    if (bucket->tokens < amount)
+        return false;
+
+    bucket->tokens -= amount;
+    return true;
+}
+
+/**
+ * @brief Take tokens from the bucket even if there are not enough of them
+ *
+ * For the events that already happened, like bytes that were read. The
+ * bucket goes below zero and the caller waits until it's refilled, so an
+ * event bigger than the burst still gets through.
+ *
+ * @param bucket the TokenBucket
+ * @param rate tokens added per second
+ * @param burst the size of the bucket
+ * @param amount tokens used
+ * @param now current time in nanoseconds
+ * @return uint64_t nanoseconds until the bucket is not empty anymore, 0 if
+ * it's not empty now
+ */
+uint64_t token_bucket_charge(TokenBucket *bucket, double rate, double burst,
+                             double amount, uint64_t now) {
+    refill(bucket, rate, burst, now);
+
+    bucket->tokens -= amount;
+    if (bucket->tokens >= 0)
+        return 0;
+    return (uint64_t)(-bucket->tokens / rate * 1e9) + 1;
+}
+
+/**
+ * @brief Allocate the address table
+ *
+ * @param limiter the AddrLimiter
+ * @param capacity amount of addresses tracked at the same time
+ * @param rate events per second per address
+ * @param burst the size of the bucket of each address
+ * @return int 1 if success, 0 if the allocation failed
+ */
+int init_addr_limiter(AddrLimiter *limiter, size_t capacity, double rate, double burst) {
+    size_t sets = 1;
+    while (sets * SET_WAYS < capacity)
+        sets *= 2;
+
+    limiter->entries = calloc(sets * SET_WAYS, sizeof(AddrBucket));
+    if (limiter->entries == NULL)
+        return 0;
+
+    limiter->sets = sets;
+    limiter->seed = (uint64_t)(uintptr_t)limiter->entries ^ (uint64_t)rand() << 32 ^ (uint64_t)rand();
+    limiter->rate = rate;
+    limiter->burst = burst;
+    return 1;
+}
+
+void free_addr_limiter(AddrLimiter *limiter) {
+    free(limiter->entries);
+    limiter->entries = NULL;
+}
+
+/**
+ * @brief Turn the socket address to 16 byte key
+ *
+ * @param addr AF_INET or AF_INET6 address
+ * @param key where the key is written
+ */
+void addr_limiter_key(const struct sockaddr *addr, uint8_t *key) {
+    memset(key, 0, 16);
+
+    if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+    } else if (addr->sa_family == AF_INET) {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+    }
+}
+
+/**
+ * @brief Find the bucket of the address, a full bucket is made for a new
+ * address
+ *
+ * @param limiter the AddrLimiter
+ * @param key the address from addr_limiter_key
+ * @param now current time in nanoseconds
+ * @return TokenBucket* the bucket
+ */
+static TokenBucket* find_bucket(AddrLimiter *limiter, const uint8_t *key, uint64_t now) {
+    // FNV-1a with a random start value
+    uint64_t hash = 14695981039346656037ULL ^ limiter->seed;
+    for (int i = 0; i < 16; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    AddrBucket* set = &limiter->entries[(hash & (limiter->sets - 1)) * SET_WAYS];
+    AddrBucket* entry = NULL;
+    AddrBucket* oldest = &set[0];
+
+    for (int i = 0; i < SET_WAYS; i++) {
+        if (set[i].used && !memcmp(set[i].addr, key, 16)) {
+            entry = &set[i];
+            break;
+        }
+        if (!set[i].used || (oldest->used && set[i].bucket.last_ns < oldest->bucket.last_ns))
+            oldest = &set[i];
+    }
+
+    if (entry == NULL) {
+        entry = oldest;
+        memcpy(entry->addr, key, 16);
+        entry->used = true;
+        init_token_bucket(&entry->bucket, limiter->burst, now);
+    }
+
+    return &entry->bucket;
+}
+
+/**
+ * @brief Make the key of a client on a Unix domain socket from its user
+ *
+ * The key is in ff00::/8, which is never the address of a peer, so every
+ * local user gets its own buckets.
+ *
+ * @param uid user id of the client
+ * @param key where the key is written
+ */
+void addr_limiter_local_key(uint32_t uid, uint8_t *key) {
+    memset(key, 0, 16);
+    key[0] = 0xff;
+    memcpy(key + 12, &uid, 4);
+}
+
+/**
+ * @brief Take tokens from the bucket of the address
+ *
+ * @param limiter the AddrLimiter
+ * @param key the address from addr_limiter_key
+ * @param amount tokens needed
+ * @param now current time in nanoseconds
+ * @return bool true if the tokens were taken, false if the address is
+ * over the limit
+ */
+bool addr_limiter_take(AddrLimiter *limiter, const uint8_t *key, double amount, uint64_t now) {
+    TokenBucket* bucket = find_bucket(limiter, key, now);
+    return token_bucket_take(bucket, limiter->rate, limiter->burst, amount, now);
+}
+
+/**
+ * @brief Take tokens from the bucket of the address even if there are not
+ * enough of them, see token_bucket_charge
+ *
+ * @param limiter the AddrLimiter
+ * @param key the address from addr_limiter_key
+ * @param amount tokens used
+ * @param now current time in nanoseconds
+ * @return uint64_t nanoseconds until the bucket is not empty anymore
+ */
+uint64_t addr_limiter_charge(AddrLimiter *limiter, const uint8_t *key, double amount,
+                             uint64_t now) {
+    TokenBucket* bucket = find_bucket(limiter, key, now);
+    return token_bucket_charge(bucket, limiter->rate, limiter->burst, amount, now);
+}
@@ -0,0 +1,65 @@
+#ifndef WEB_SOCKET_RATE_LIMIT_H
+#define WEB_SOCKET_RATE_LIMIT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+// TokenBucket allows rate events per second with bursts up to burst events
+typedef struct {
+    // Tokens left, refilled when the bucket is used
+    double tokens;
+    // Time of the last refill in nanoseconds
+    uint64_t last_ns;
+} TokenBucket;
+
+// AddrBucket is the bucket of a single source address
+typedef struct {
+    // Ipv4 addresses are stored as ipv4 mapped ipv6 addresses
+    uint8_t addr[16];
+    bool used;
+    TokenBucket bucket;
+} AddrBucket;
+
+/**
+ * Token buckets per source address
+ *
+ * The table has a fixed size, so a flood of new addresses can't grow the
+ * memory. The addresses are hashed to sets of a few entries and the least
+ * recently used entry of the set is replaced when there is no room.
+ * Not thread safe.
+ */
+typedef struct {
+    AddrBucket* entries;
+    // Amount of sets, a power of two
+    size_t sets;
+    // Random seed so the clients can't pick addresses that collide
+    uint64_t seed;
+    double rate;
+    double burst;
+} AddrLimiter;
+
+// Inbound limits per client address, shared by the reactors. entries is
+// NULL in the limiters that are not used
+typedef struct PeerLimits {
+    pthread_mutex_t lock;
+    AddrLimiter messages;
+    AddrLimiter bytes;
+} PeerLimits;
+
+void init_token_bucket(TokenBucket *bucket, double burst, uint64_t now);
+bool token_bucket_take(TokenBucket *bucket, double rate, double burst,
+                       double amount, uint64_t now);
+uint64_t token_bucket_charge(TokenBucket *bucket, double rate, double burst,
+                             double amount, uint64_t now);
+int init_addr_limiter(AddrLimiter *limiter, size_t capacity, double rate, double burst);
+void free_addr_limiter(AddrLimiter *limiter);
+void addr_limiter_key(const struct sockaddr *addr, uint8_t *key);
+void addr_limiter_local_key(uint32_t uid, uint8_t *key);
+bool addr_limiter_take(AddrLimiter *limiter, const uint8_t *key, double amount, uint64_t now);
+uint64_t addr_limiter_charge(AddrLimiter *limiter, const uint8_t *key, double amount,
+                             uint64_t now);
+
+#endif
@@ -0,0 +1,681 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "registry.h"
+#include "socketcon.h"
+#include "tls.h"
+
+// Amount of events handled after a single epoll_wait
+#define MAX_EVENTS 256
+
+// How often the idle connections are looked for
+#define SWEEP_INTERVAL_NS 1000000000ULL
+
+// Output is not held for coalescing once this much is queued
+#define COALESCE_MAX_BYTES (64 * 1024)
+
+// Receive buffers a reactor keeps in its pool, 4 MB. The rest are freed
+#define POOL_MAX_BUFFERS 1024
+
+// The reactor of the current thread, NULL on other threads
+static __thread Reactor* current_reactor = NULL;
+
+/**
+ * @brief Wake the reactor up from epoll_wait
+ *
+ * Only the first call after the reactor took its lists writes to the
+ * eventfd, the rest of the work is picked up by the same wake up.
+ *
+ * @param reactor the Reactor
+ */
+void reactor_wake(Reactor *reactor) {
+    if (__atomic_exchange_n(&reactor->wake_pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    uint64_t one = 1;
+    // The write can only fail if the counter is about to overflow, and then
+    // the reactor is woken up anyway
+    ssize_t n = write(reactor->wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+/**
+ * @brief Hand accepted connections to the reactor
+ *
+ * The whole batch is added with a single wake up.
+ *
+ * @param reactor the Reactor that will own the connections
+ * @param conns list of connections linked with conn->next, the reactor
+ * owns them after this
+ */
+void reactor_add(Reactor *reactor, Connection *conns) {
+    Connection* last = conns;
+
+    for (Connection* conn = conns; conn != NULL; conn = conn->next) {
+        conn->reactor = reactor;
+        last = conn;
+    }
+
+    Connection* head = __atomic_load_n(&reactor->incoming, __ATOMIC_RELAXED);
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&reactor->incoming, &head, conns, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    reactor_wake(reactor);
+}
+
+/**
+ * @brief Hand a published message to the reactor
+ *
+ * @param reactor the Reactor that fans the message out
+ * @param node the node of the reactor in the message
+ */
+void reactor_publish(Reactor *reactor, PubNode *node) {
+    PubNode* head = __atomic_load_n(&reactor->published, __ATOMIC_RELAXED);
+    do {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&reactor->published, &head, node, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The reactor fans out the messages before it waits again
+    if (current_reactor != reactor)
+        reactor_wake(reactor);
+}
+
+/**
+ * @brief Ask the reactor to write the send queue of the connection
+ *
+ * The caller has set conn->flush_pending, so the connection is in the
+ * list only once.
+ *
+ * @param conn the connection
+ */
+void reactor_schedule_flush(Connection *conn) {
+    Reactor* reactor = conn->reactor;
+
+    // The list keeps the connection alive until it's flushed
+    ws_retain(conn);
+
+    Connection* head = __atomic_load_n(&reactor->flush_list, __ATOMIC_RELAXED);
+    do {
+        conn->next_flush = head;
+    } while (!__atomic_compare_exchange_n(&reactor->flush_list, &head, conn, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The reactor flushes the list before it waits again
+    if (current_reactor != reactor)
+        reactor_wake(reactor);
+}
+
+/**
+ * @brief Remove the connection from the reactor before the socket is closed
+ *
+ * @param conn the connection
+ */
+void reactor_remove(Connection *conn) {
+    Reactor* reactor = conn->reactor;
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->conn_fd, NULL);
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        reactor->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    conn->next = NULL;
+    conn->prev = NULL;
+}
+
+/**
+ * @brief Take a receive buffer from the pool of the reactor
+ *
+ * @param reactor the Reactor
+ * @return uint8_t* buffer of CONN_BUF_SIZE bytes or NULL if out of memory
+ */
+uint8_t* reactor_take_buffer(Reactor *reactor) {
+    void* buf = reactor->free_buffers;
+    if (buf == NULL)
+        return malloc(CONN_BUF_SIZE);
+
+    memcpy(&reactor->free_buffers, buf, sizeof(void*));
+    reactor->free_buffer_count--;
+    return buf;
+}
+
+/**
+ * @brief Give a receive buffer back to the pool of the reactor
+ *
+ * The buffers are plain malloc allocations, so the connection may also
+ * free one itself or hand it to the application.
+ *
+ * @param reactor the Reactor
+ * @param buf buffer of CONN_BUF_SIZE bytes
+ */
+void reactor_give_buffer(Reactor *reactor, uint8_t *buf) {
+    if (reactor->free_buffer_count >= POOL_MAX_BUFFERS) {
+        free(buf);
+        return;
+    }
+
+    memcpy(buf, &reactor->free_buffers, sizeof(void*));
+    reactor->free_buffers = buf;
+    reactor->free_buffer_count++;
+}
+
+/**
+ * @brief Set the events epoll waits for the connection from its state
+ *
+ * @param reactor the Reactor
+ * @param conn the connection
+ */
+static void update_events(Reactor *reactor, Connection *conn) {
+    bool reading = !conn->read_closed && conn->paused_until_ns == 0;
+    struct epoll_event event = {
+        .events = (reading ? EPOLLIN : 0) | (conn->want_write ? EPOLLOUT : 0),
+        .data.ptr = conn,
+    };
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->conn_fd, &event);
+}
+
+/**
+ * @brief Set the events epoll waits for the connection
+ *
+ * @param reactor the Reactor
+ * @param conn the connection
+ * @param want_write true if the socket is full and EPOLLOUT is needed
+ */
+static void watch_output(Reactor *reactor, Connection *conn, bool want_write) {
+    if (conn->want_write == want_write)
+        return;
+
+    conn->want_write = want_write;
+    update_events(reactor, conn);
+}
+
+/**
+ * @brief Add the accepted connections to epoll
+ *
+ * @param reactor the Reactor
+ */
+static void register_incoming(Reactor *reactor) {
+    Connection* conn = __atomic_exchange_n(&reactor->incoming, NULL, __ATOMIC_ACQUIRE);
+
+    while (conn != NULL) {
+        Connection* next = conn->next;
+
+        conn->prev = NULL;
+        conn->next = reactor->conns;
+        if (reactor->conns != NULL)
+            reactor->conns->prev = conn;
+        reactor->conns = conn;
+
+        metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+        metrics_add(METRIC_HANDSHAKES_PENDING, 1);
+
+        SSL_CTX* tls_ctx = reactor->wss->tls_ctx;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (tls_ctx != NULL && !conn->local && !tls_start(conn, tls_ctx)) {
+            LOG_ERROR("TLS session alloc failed");
+            close_connection(conn);
+        } else if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->conn_fd, &event) == -1) {
+            LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+            close_connection(conn);
+        }
+
+        conn = next;
+    }
+}
+
+/**
+ * @brief Write the send queue of the connection to the socket
+ *
+ * @param reactor the Reactor
+ * @param conn the connection
+ */
+static void flush_connection(Reactor *reactor, Connection *conn) {
+    // Cleared before the inbox is taken, so a send after this schedules
+    // the connection again
+    __atomic_store_n(&conn->flush_pending, false, __ATOMIC_SEQ_CST);
+    if (conn_state(conn) == CONN_CLOSED)
+        return;
+
+    uint64_t queued = ws_buffered_amount(conn);
+    int status = conn_flush(conn);
+    bool writable = status == 1 &&
+        __atomic_exchange_n(&conn->writable_requested, false, __ATOMIC_ACQ_REL);
+    bool progress = ws_buffered_amount(conn) != queued;
+    ConnState state = conn_state(conn);
+
+    // Slow readers are not idle as long as they keep reading
+    if (progress)
+        conn->last_active_ns = metrics_now_ns();
+
+    if (status == -1) {
+        close_connection(conn);
+        return;
+    }
+
+    if (status == 0) {
+        watch_output(reactor, conn, true);
+        return;
+    }
+
+    // The socket was full and now everything is written
+    if (conn->want_write) {
+        watch_output(reactor, conn, false);
+        writable = true;
+    }
+
+    if (state == CONN_CLOSING) {
+        close_connection(conn);
+        return;
+    }
+
+    WebSocketServer* wss = reactor->wss;
+    if (writable && state == CONN_WEBSOCKET && wss->handler.on_writable != NULL)
+        wss->handler.on_writable(wss, conn);
+}
+
+/**
+ * @brief Check if the output of the connection can wait for more frames
+ *
+ * @param reactor the Reactor
+ * @param conn the connection
+ * @return bool true if the flush can be delayed
+ */
+static bool can_delay(Reactor *reactor, Connection *conn) {
+    return reactor->wss->config.coalesce_delay_us > 0 &&
+        conn_state(conn) == CONN_WEBSOCKET &&
+        !conn->want_write &&
+        ws_buffered_amount(conn) < COALESCE_MAX_BYTES;
+}
+
+/**
+ * @brief Flush every connection that has new output
+ *
+ * With coalesce_delay_us the connections are moved to the delayed list
+ * instead. They keep flush_pending set, so the senders just add to the
+ * inbox without waking the reactor until the deadline.
+ *
+ * @param reactor the Reactor
+ * @param now current time in nanoseconds
+ */
+static void flush_connections(Reactor *reactor, uint64_t now) {
+    Connection* conn = __atomic_exchange_n(&reactor->flush_list, NULL, __ATOMIC_ACQUIRE);
+
+    while (conn != NULL) {
+        Connection* next = conn->next_flush;
+
+        if (conn->flush_deadline_ns != 0) {
+            // Already waiting in the delayed list
+            ws_release(conn);
+        } else if (can_delay(reactor, conn)) {
+            // The reference of the flush list moves to the delayed list
+            conn->flush_deadline_ns = now + reactor->wss->config.coalesce_delay_us * 1000ULL;
+            conn->next_delayed = NULL;
+            if (reactor->delayed_tail != NULL)
+                reactor->delayed_tail->next_delayed = conn;
+            else
+                reactor->delayed_head = conn;
+            reactor->delayed_tail = conn;
+        } else {
+            flush_connection(reactor, conn);
+            ws_release(conn);
+        }
+
+        conn = next;
+    }
+}
+
+/**
+ * @brief Flush the delayed connections which deadline has passed
+ *
+ * Every connection is delayed the same time, so the list is in deadline
+ * order and only its head needs to be checked.
+ *
+ * @param reactor the Reactor
+ * @param now current time in nanoseconds
+ */
+static void flush_delayed(Reactor *reactor, uint64_t now) {
+    while (reactor->delayed_head != NULL && reactor->delayed_head->flush_deadline_ns <= now) {
+        Connection* conn = reactor->delayed_head;
+        reactor->delayed_head = conn->next_delayed;
+        if (reactor->delayed_head == NULL)
+            reactor->delayed_tail = NULL;
+
+        conn->flush_deadline_ns = 0;
+        flush_connection(reactor, conn);
+        ws_release(conn);
+    }
+}
+
+/**
+ * @brief Get how long epoll_wait can sleep
+ *
+ * @param reactor the Reactor
+ * @param timeout set to the time to sleep
+ */
+static void wait_timeout(Reactor *reactor, struct timespec *timeout) {
+    uint64_t wait_ns = SWEEP_INTERVAL_NS;
+
+    // The callbacks of the last round may have queued more output or
+    // published messages
+    if (__atomic_load_n(&reactor->flush_list, __ATOMIC_RELAXED) != NULL ||
+        __atomic_load_n(&reactor->published, __ATOMIC_RELAXED) != NULL ||
+        (reactor->bus.bus != NULL && !pubsub_bus_idle(reactor))) {
+        wait_ns = 0;
+    } else if (reactor->delayed_head != NULL) {
+        uint64_t now = metrics_now_ns();
+        uint64_t deadline = reactor->delayed_head->flush_deadline_ns;
+        wait_ns = deadline > now ? deadline - now : 0;
+    }
+
+    if (wait_ns > 0 && reactor->next_resume_ns != 0) {
+        uint64_t now = metrics_now_ns();
+        uint64_t resume = reactor->next_resume_ns > now ? reactor->next_resume_ns - now : 0;
+        if (resume < wait_ns)
+            wait_ns = resume;
+    }
+
+    timeout->tv_sec = wait_ns / 1000000000ULL;
+    timeout->tv_nsec = wait_ns % 1000000000ULL;
+}
+
+/**
+ * @brief Stop reading the connection until the time
+ *
+ * The client can't send more than the socket buffers hold meanwhile, so
+ * TCP slows it down.
+ *
+ * @param reactor the Reactor
+ * @param conn the connection
+ * @param until time to read again in nanoseconds
+ */
+static void pause_reading(Reactor *reactor, Connection *conn, uint64_t until) {
+    metrics_add(METRIC_READ_PAUSES, 1);
+
+    // The paused list holds a reference
+    if (conn->paused_until_ns == 0) {
+        ws_retain(conn);
+        conn->next_paused = reactor->paused;
+        reactor->paused = conn;
+    }
+    conn->paused_until_ns = until;
+    if (reactor->next_resume_ns == 0 || until < reactor->next_resume_ns)
+        reactor->next_resume_ns = until;
+    update_events(reactor, conn);
+}
+
+/**
+ * @brief Charge the input to the buckets of the connection and of its
+ * address, and pause the reading if the client went over a limit
+ *
+ * The buckets are refilled here from the time since the last read, so
+ * there are no timers.
+ *
+ * @param conn the connection
+ * @param bytes amount of bytes read
+ * @param frames amount of frames handled
+ */
+static void limit_input(Connection *conn, size_t bytes, size_t frames) {
+    WebSocketServer* wss = conn->server;
+    const WebSocketServerConfig* config = &wss->config;
+    PeerLimits* limits = wss->peer_limits;
+    uint64_t now = conn->last_active_ns;
+    uint64_t wait_ns = 0;
+    uint64_t wait;
+
+    if (config->conn_message_rate > 0 && frames > 0) {
+        wait = token_bucket_charge(&conn->message_bucket, config->conn_message_rate,
+                                   config->conn_message_rate, frames, now);
+        wait_ns = wait > wait_ns ? wait : wait_ns;
+    }
+    if (config->conn_byte_rate > 0) {
+        wait = token_bucket_charge(&conn->byte_bucket, config->conn_byte_rate,
+                                   config->conn_byte_rate, bytes, now);
+        wait_ns = wait > wait_ns ? wait : wait_ns;
+    }
+
+    // The connections of an address can be on every reactor
+    if (limits != NULL) {
+        pthread_mutex_lock(&limits->lock);
+        if (limits->messages.entries != NULL && frames > 0) {
+            wait = addr_limiter_charge(&limits->messages, conn->peer, frames, now);
+            wait_ns = wait > wait_ns ? wait : wait_ns;
+        }
+        if (limits->bytes.entries != NULL) {
+            wait = addr_limiter_charge(&limits->bytes, conn->peer, bytes, now);
+            wait_ns = wait > wait_ns ? wait : wait_ns;
+        }
+        pthread_mutex_unlock(&limits->lock);
+    }
+
+    if (wait_ns > 0 && conn_state(conn) != CONN_CLOSED && !conn->read_closed)
+        pause_reading(conn->reactor, conn, now + wait_ns);
+}
+
+/**
+ * @brief Read from the socket and handle the complete requests or frames
+ *
+ * @param conn the connection
+ */
+static void handle_input(Connection *conn) {
+    ssize_t n = conn_fill(conn);
+
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            close_connection(conn);
+        else if (conn->tls_want_write)
+            watch_output(conn->reactor, conn, true);
+        return;
+    }
+
+    if (n == 0) {
+        // The peer won't send anything more, but it may still read the
+        // responses that are queued
+        conn->read_closed = true;
+        update_events(conn->reactor, conn);
+        conn_shutdown(conn);
+        return;
+    }
+
+    conn->last_active_ns = metrics_now_ns();
+    size_t frames = 0;
+
+    switch (conn_state(conn)) {
+        case CONN_HTTP:
+            handle_http(conn);
+            // The frames sent right after the handshake are already here
+            if (conn_state(conn) == CONN_WEBSOCKET)
+                frames = handle_frames(conn);
+            break;
+        case CONN_WEBSOCKET:
+            frames = handle_frames(conn);
+            break;
+        default:
+            // Nothing is handled after the close, so the input is dropped
+            conn_consume(conn, conn->recv_len);
+            break;
+    }
+
+    limit_input(conn, n, frames);
+}
+
+/**
+ * @brief Read the paused connections again when their buckets have
+ * refilled
+ *
+ * @param reactor the Reactor
+ * @param now current time in nanoseconds
+ */
+static void resume_paused(Reactor *reactor, uint64_t now) {
+    if (reactor->next_resume_ns == 0 || now < reactor->next_resume_ns)
+        return;
+
+    reactor->next_resume_ns = 0;
+    Connection** link = &reactor->paused;
+    while (*link != NULL) {
+        Connection* conn = *link;
+        if (conn_state(conn) != CONN_CLOSED && conn->paused_until_ns > now) {
+            if (reactor->next_resume_ns == 0 || conn->paused_until_ns < reactor->next_resume_ns)
+                reactor->next_resume_ns = conn->paused_until_ns;
+            link = &conn->next_paused;
+            continue;
+        }
+
+        *link = conn->next_paused;
+        conn->next_paused = NULL;
+        conn->paused_until_ns = 0;
+        if (conn_state(conn) != CONN_CLOSED) {
+            update_events(reactor, conn);
+            // Decrypted bytes left in the TLS session don't wake epoll up.
+            // A connection paused again goes to the head of the list
+            while (conn_state(conn) != CONN_CLOSED && !conn->read_closed &&
+                   conn->paused_until_ns == 0 && tls_pending(conn))
+                handle_input(conn);
+        }
+        ws_release(conn);
+    }
+}
+
+/**
+ * @brief Close the connections that have been idle for too long
+ *
+ * Websocket connections can be idle as long as they want, the timeout
+ * is only for http and closing connections.
+ *
+ * @param reactor the Reactor
+ * @param now current time in nanoseconds
+ */
+static void sweep_idle(Reactor *reactor, uint64_t now) {
+    uint64_t timeout = KEEP_ALIVE_TIMEOUT * 1000000000ULL;
+
+    Connection* conn = reactor->conns;
+    while (conn != NULL) {
+        Connection* next = conn->next;
+        if (conn_state(conn) != CONN_WEBSOCKET && now - conn->last_active_ns > timeout)
+            close_connection(conn);
+        conn = next;
+    }
+
+    registry_collect(reactor->wss->registry);
+    reactor->last_sweep_ns = now;
+}
+
+static void* reactor_loop(void *arg) {
+    Reactor* reactor = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    current_reactor = reactor;
+
+    for (;;) {
+        // Nanosecond timeout, the coalescing delays are microseconds
+        struct timespec timeout;
+        wait_timeout(reactor, &timeout);
+        int count = epoll_pwait2(reactor->epoll_fd, events, MAX_EVENTS, &timeout, NULL);
+        if (count == -1) {
+            if (errno != EINTR)
+                LOG_ERROR("epoll_pwait2 failed: %s", strerror(errno));
+            count = 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            Connection* conn = events[i].data.ptr;
+
+            // NULL is the wake up eventfd, the lists are taken below
+            if (conn == NULL) {
+                uint64_t value;
+                ssize_t n = read(reactor->wake_fd, &value, sizeof(value));
+                (void)n;
+                continue;
+            }
+
+            // Closing the connection may drop the last reference
+            ws_retain(conn);
+            bool readable = events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ||
+                            (conn->tls_want_write && events[i].events & EPOLLOUT);
+            if (events[i].events & EPOLLOUT)
+                flush_connection(reactor, conn);
+            // Decrypted bytes left in the TLS session don't wake epoll up
+            while (readable && conn_state(conn) != CONN_CLOSED) {
+                handle_input(conn);
+                readable = !conn->read_closed && conn->paused_until_ns == 0 &&
+                           tls_pending(conn);
+            }
+            ws_release(conn);
+        }
+
+        // Everything queued during this round, by the callbacks or by
+        // other threads, is written with a single pass. Other threads
+        // wake the reactor again after this
+        __atomic_store_n(&reactor->wake_pending, false, __ATOMIC_SEQ_CST);
+        register_incoming(reactor);
+        pubsub_deliver(reactor);
+        if (reactor->bus.bus != NULL)
+            pubsub_poll_bus(reactor);
+
+        uint64_t now = metrics_now_ns();
+        flush_connections(reactor, now);
+        flush_delayed(reactor, now);
+        resume_paused(reactor, now);
+
+        if (now - reactor->last_sweep_ns >= SWEEP_INTERVAL_NS)
+            sweep_idle(reactor, now);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the reactor threads
+ *
+ * @param wss the server, wss->reactors is set to the started reactors and
+ * the bus watcher is started if the server uses the bus
+ * @param count amount of reactor threads
+ * @return int 1 if success, 0 if fail
+ */
+int start_reactors(WebSocketServer *wss, int count) {
+    Reactor* reactors = calloc(count, sizeof(Reactor));
+    if (reactors == NULL)
+        return 0;
+
+    // The bus watcher looks at the reactors as soon as they run
+    wss->reactors = reactors;
+    if (wss->bus != NULL && !pubsub_start_watch(wss))
+        return 0;
+
+    for (int i = 0; i < count; i++) {
+        Reactor* reactor = &reactors[i];
+
+        reactor->wss = wss;
+        reactor->last_sweep_ns = metrics_now_ns();
+        if (wss->bus != NULL)
+            bus_consumer_init(&reactor->bus, wss->bus);
+
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactor->epoll_fd == -1 || reactor->wake_fd == -1)
+            return 0;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) == -1)
+            return 0;
+
+        if (pthread_create(&reactor->thread, NULL, reactor_loop, reactor) != 0)
+            return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,76 @@
+#ifndef WEB_SOCKET_REACTOR_H
+#define WEB_SOCKET_REACTOR_H
+
+#include <pthread.h>
+
+#include "bus.h"
+#include "pubsub.h"
+#include "server.h"
+#include "socketcon.h"
+
+/**
+ * Reactor is a thread with an epoll loop
+ *
+ * Every connection belongs to a single reactor for its whole life. Only
+ * the reactor thread reads from the socket, writes to it and calls the
+ * callbacks of the connection. Other threads hand work to the reactor
+ * by pushing to the lists below without locks and wake it up with the
+ * eventfd. The reactor takes a whole list at once.
+ */
+typedef struct Reactor {
+    pthread_t thread;
+    WebSocketServer* wss;
+    int epoll_fd;
+    // Written to wake the reactor up from epoll_wait
+    int wake_fd;
+    // True from the first wake up until the reactor takes the lists, the
+    // other threads don't write to wake_fd meanwhile
+    bool wake_pending;
+    // Accepted connections waiting to be added to epoll
+    Connection* incoming;
+    // Connections with output waiting to be written
+    Connection* flush_list;
+    // Every connection the reactor owns, only the reactor touches this
+    Connection* conns;
+    // Connections which output is held for coalescing, in deadline order
+    Connection* delayed_head;
+    Connection* delayed_tail;
+    // Time of the last idle timeout check
+    uint64_t last_sweep_ns;
+    // Connections which reading is paused for the inbound limits, and the
+    // earliest time one of them is read again, 0 if none is paused
+    Connection* paused;
+    uint64_t next_resume_ns;
+    // Receive buffers of CONN_BUF_SIZE bytes the idle connections gave
+    // back, linked through their first bytes
+    void* free_buffers;
+    size_t free_buffer_count;
+    // Topics the connections of the reactor are subscribed to
+    TopicTable topics;
+    // Messages published with ws_publish, newest first
+    PubNode* published;
+    // The reactor reads the shared bus with this, bus.bus is NULL if the
+    // server doesn't use the bus
+    BusConsumer bus;
+    // Value of the bus futex when the reactor last started to read the bus
+    uint32_t bus_seen;
+    // True while the reactor sleeps with the bus read. The watcher thread
+    // wakes it when something new is published
+    bool bus_idle;
+    // More records are waiting than a single round reads
+    bool bus_backlog;
+    // Records published to the bus the reactor has not read yet, as of
+    // the last read. Also read by the metrics page
+    uint64_t bus_lag;
+} Reactor;
+
+int start_reactors(WebSocketServer *wss, int count);
+void reactor_wake(Reactor *reactor);
+void reactor_add(Reactor *reactor, Connection *conns);
+void reactor_publish(Reactor *reactor, PubNode *node);
+void reactor_schedule_flush(Connection *conn);
+void reactor_remove(Connection *conn);
+uint8_t* reactor_take_buffer(Reactor *reactor);
+void reactor_give_buffer(Reactor *reactor, uint8_t *buf);
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+
+// The slot index is the low half of the handle, the generation the high
+#define HANDLE_INDEX(handle) ((uint32_t)(handle))
+
+/**
+ * @brief Allocate an empty registry
+ *
+ * @return Registry* the registry or NULL if out of memory
+ */
+Registry* create_registry(void) {
+    Registry* registry = calloc(1, sizeof(Registry));
+    if (registry == NULL)
+        return NULL;
+    pthread_mutex_init(&registry->lock, NULL);
+    return registry;
+}
+
+/**
+ * @brief Free the registry, nothing can use it anymore
+ *
+ * @param registry the Registry
+ */
+void free_registry(Registry *registry) {
+    for (int i = 0; i < 2; i++) {
+        while (registry->retired[i] != NULL) {
+            Connection* conn = registry->retired[i];
+            registry->retired[i] = conn->next_retired;
+            ws_release(conn);
+        }
+    }
+    for (int i = 0; i < REGISTRY_MAX_PAGES; i++)
+        free(registry->pages[i]);
+    free(registry->free_heap);
+    pthread_mutex_destroy(&registry->lock);
+    free(registry);
+}
+
+/**
+ * @brief Get the slot of the index
+ *
+ * @param registry the Registry
+ * @param index the slot index
+ * @return RegistrySlot* the slot, NULL if the page doesn't exist
+ */
+static RegistrySlot* get_slot(Registry *registry, uint32_t index) {
+    if (index >= (uint32_t)REGISTRY_PAGE_SIZE * REGISTRY_MAX_PAGES)
+        return NULL;
+    RegistrySlot* page = __atomic_load_n(&registry->pages[index >> REGISTRY_PAGE_SHIFT], __ATOMIC_ACQUIRE);
+    if (page == NULL)
+        return NULL;
+    return &page[index & (REGISTRY_PAGE_SIZE - 1)];
+}
+
+static void heap_push(Registry *registry, uint32_t index) {
+    uint32_t* heap = registry->free_heap;
+    uint32_t i = registry->free_count++;
+
+    while (i > 0 && heap[(i - 1) / 2] > index) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = index;
+}
+
+static uint32_t heap_pop(Registry *registry) {
+    uint32_t* heap = registry->free_heap;
+    uint32_t top = heap[0];
+    uint32_t last = heap[--registry->free_count];
+    uint32_t i = 0;
+
+    for (;;) {
+        uint32_t child = i * 2 + 1;
+        if (child >= registry->free_count)
+            break;
+        if (child + 1 < registry->free_count && heap[child + 1] < heap[child])
+            child++;
+        if (heap[child] >= last)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/**
+ * @brief Release the connections removed before the oldest reader
+ *
+ * A connection retired in epoch e can be seen by readers of epoch e and
+ * older. The epoch only moves forward when there are no readers left in
+ * the epoch before it, so once the readers of e are gone, the connections
+ * retired in e are released and the epoch can move on. Caller holds the lock.
+ *
+ * @param registry the Registry
+ */
+static void try_advance(Registry *registry) {
+    uint64_t epoch = __atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST);
+    int old = (epoch + 1) & 1;
+
+    // Readers of the previous epoch may still see the connections
+    if (__atomic_load_n(&registry->readers[old], __ATOMIC_SEQ_CST) != 0)
+        return;
+
+    Connection* conn = registry->retired[old];
+    // registry_collect peeks at the lists without the lock
+    __atomic_store_n(&registry->retired[old], NULL, __ATOMIC_RELAXED);
+    while (conn != NULL) {
+        Connection* next = conn->next_retired;
+        ws_release(conn);
+        conn = next;
+    }
+
+    __atomic_store_n(&registry->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Add the connection and give it a handle
+ *
+ * The registry keeps a reference to the connection until it's removed.
+ *
+ * @param registry the Registry
+ * @param conn the connection, conn->handle is set
+ * @return int 1 if success, 0 if the registry is full or out of memory
+ */
+int registry_add(Registry *registry, Connection *conn) {
+    pthread_mutex_lock(&registry->lock);
+
+    uint32_t index;
+    if (registry->free_count > 0) {
+        index = heap_pop(registry);
+    } else {
+        index = registry->used_slots;
+        uint32_t page = index >> REGISTRY_PAGE_SHIFT;
+        if (page >= REGISTRY_MAX_PAGES) {
+            pthread_mutex_unlock(&registry->lock);
+            return 0;
+        }
+        if (registry->pages[page] == NULL) {
+            RegistrySlot* slots = calloc(REGISTRY_PAGE_SIZE, sizeof(RegistrySlot));
+            // Reserve the room for the free slots of the page too, so
+            // the remove never fails
+            uint32_t cap = (page + 1) * REGISTRY_PAGE_SIZE;
+            uint32_t* heap = slots != NULL ? realloc(registry->free_heap, cap * sizeof(uint32_t)) : NULL;
+            if (heap == NULL) {
+                free(slots);
+                pthread_mutex_unlock(&registry->lock);
+                return 0;
+            }
+            registry->free_heap = heap;
+            __atomic_store_n(&registry->pages[page], slots, __ATOMIC_RELEASE);
+        }
+        registry->used_slots++;
+    }
+
+    RegistrySlot* slot = get_slot(registry, index);
+    // Generation 0 is never used, so 0 is never a valid handle
+    if (slot->generation == 0)
+        slot->generation = 1;
+    conn->handle = (uint64_t)slot->generation << 32 | index;
+
+    ws_retain(conn);
+    __atomic_store_n(&slot->conn, conn, __ATOMIC_RELEASE);
+    if (index >= registry->high_water)
+        __atomic_store_n(&registry->high_water, index + 1, __ATOMIC_RELEASE);
+    registry->count++;
+
+    pthread_mutex_unlock(&registry->lock);
+    return 1;
+}
+
+/**
+ * @brief Remove the connection, its handle stops working right away
+ *
+ * @param registry the Registry
+ * @param conn the connection added with registry_add
+ */
+void registry_remove(Registry *registry, Connection *conn) {
+    uint32_t index = HANDLE_INDEX(conn->handle);
+
+    pthread_mutex_lock(&registry->lock);
+
+    RegistrySlot* slot = get_slot(registry, index);
+    __atomic_store_n(&slot->conn, NULL, __ATOMIC_RELEASE);
+    slot->generation++;
+    heap_push(registry, index);
+    registry->count--;
+
+    // Don't walk the empty slots at the end
+    uint32_t high_water = registry->high_water;
+    while (high_water > 0 && get_slot(registry, high_water - 1)->conn == NULL)
+        high_water--;
+    __atomic_store_n(&registry->high_water, high_water, __ATOMIC_RELEASE);
+
+    // Readers may still have the pointer, so the reference is kept until
+    // they are gone
+    int current = __atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST) & 1;
+    conn->next_retired = registry->retired[current];
+    __atomic_store_n(&registry->retired[current], conn, __ATOMIC_RELAXED);
+    try_advance(registry);
+
+    pthread_mutex_unlock(&registry->lock);
+}
+
+/**
+ * @brief Release the removed connections that no reader can see anymore
+ *
+ * Called now and then, so the last removed connections are not kept
+ * around until the next remove.
+ *
+ * @param registry the Registry
+ */
+void registry_collect(Registry *registry) {
+    if (__atomic_load_n(&registry->retired[0], __ATOMIC_RELAXED) == NULL &&
+        __atomic_load_n(&registry->retired[1], __ATOMIC_RELAXED) == NULL)
+        return;
+
+    pthread_mutex_lock(&registry->lock);
+    // Twice, so the connections of both epochs are released if possible
+    try_advance(registry);
+    try_advance(registry);
+    pthread_mutex_unlock(&registry->lock);
+}
+
+/**
+ * @brief Start reading the slots
+ *
+ * The connections seen before registry_read_end stay allocated, even if
+ * they are removed meanwhile.
+ *
+ * @param registry the Registry
+ * @return uint64_t the epoch, given to registry_read_end
+ */
+uint64_t registry_read_begin(Registry *registry) {
+    for (;;) {
+        uint64_t epoch = __atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&registry->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        // The epoch moved on before the reader was counted, so the
+        // writer may not have seen it
+        if (__atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&registry->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief Stop reading the slots
+ *
+ * @param registry the Registry
+ * @param epoch returned by registry_read_begin
+ */
+void registry_read_end(Registry *registry, uint64_t epoch) {
+    __atomic_sub_fetch(&registry->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Find the connection of the handle, caller is inside a read
+ *
+ * @param registry the Registry
+ * @param handle the handle
+ * @return Connection* the connection or NULL if the handle is stale
+ */
+Connection* registry_get(Registry *registry, uint64_t handle) {
+    RegistrySlot* slot = get_slot(registry, HANDLE_INDEX(handle));
+    if (slot == NULL)
+        return NULL;
+
+    // The slot may have been reused, the handle of the connection tells
+    Connection* conn = __atomic_load_n(&slot->conn, __ATOMIC_ACQUIRE);
+    if (conn == NULL || conn->handle != handle)
+        return NULL;
+    return conn;
+}
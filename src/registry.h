@@ -0,0 +1,68 @@
+#ifndef WEB_SOCKET_REGISTRY_H
+#define WEB_SOCKET_REGISTRY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "server.h"
+#include "socketcon.h"
+
+// Slots per page, the pages never move so readers don't see reallocs
+#define REGISTRY_PAGE_SHIFT 12
+#define REGISTRY_PAGE_SIZE (1 << REGISTRY_PAGE_SHIFT)
+#define REGISTRY_MAX_PAGES 4096
+
+typedef struct {
+    // The connection in the slot, NULL if the slot is free
+    Connection* conn;
+    // Generation of the current or the next handle of the slot
+    uint32_t generation;
+} RegistrySlot;
+
+/**
+ * Registry of the open websocket connections
+ *
+ * A slot map: the handle is the slot index and the generation of the slot,
+ * and the generation changes every time the slot is freed, so a stale handle
+ * never finds the connection that reused the slot. Free slots are reused
+ * lowest index first, which keeps the connections packed at the start of
+ * the slots and the walks short.
+ *
+ * The reactors add and remove connections under lock. Readers never take
+ * the lock: they walk the slots inside an epoch, and the reference the
+ * registry holds of a removed connection is released only after every
+ * reader that could have seen it has left its epoch.
+ */
+typedef struct Registry {
+    // lock guards everything below except the slots and the reader counts
+    pthread_mutex_t lock;
+    RegistrySlot* pages[REGISTRY_MAX_PAGES];
+    // Slots below this may be in use, readers walk up to here
+    uint32_t high_water;
+    // Slots below this have been used at least once
+    uint32_t used_slots;
+    // Amount of connections in the registry
+    uint32_t count;
+    // Min heap of the free slots below used_slots
+    uint32_t* free_heap;
+    uint32_t free_count;
+    // Current epoch, readers register in readers[epoch & 1]
+    uint64_t epoch;
+    uint64_t readers[2];
+    // Removed connections waiting for the readers of the epoch to leave,
+    // linked with next_retired
+    Connection* retired[2];
+} Registry;
+
+Registry* create_registry(void);
+void free_registry(Registry *registry);
+int registry_add(Registry *registry, Connection *conn);
+void registry_remove(Registry *registry, Connection *conn);
+void registry_collect(Registry *registry);
+uint64_t registry_read_begin(Registry *registry);
+void registry_read_end(Registry *registry, uint64_t epoch);
+Connection* registry_get(Registry *registry, uint64_t handle);
+
+#endif
@@ -0,0 +1,238 @@
+/**
+ * Replay a capture log recorded with the server -c flag
+ *
+ * Every captured connection is opened again, does the handshake and sends
+ * the same frames in the same order. The frames are sent at the recorded
+ * speed, N times faster or as fast as possible. Whatever the server sends
+ * back is read and dropped by a separate thread so the server never blocks
+ * on a full socket.
+ *
+ * Usage: replay [-H host] [-p port] [-x speed] capture_file
+ *   -x  1 is the recorded speed (default), 10 is ten times faster and
+ *       0 sends everything as fast as possible
+ */
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "client.h"
+#include "dataframe.h"
+
+typedef struct {
+    int epfd;
+    volatile bool done;
+} Drain;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t target) {
+    uint64_t now = now_ns();
+    if (target <= now)
+        return;
+
+    uint64_t left = target - now;
+    struct timespec ts = { .tv_sec = left / 1000000000, .tv_nsec = left % 1000000000 };
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Read and drop everything the server sends
+ */
+static void* drain_thread(void *arg) {
+    Drain* drain = arg;
+    struct epoll_event events[64];
+    uint8_t buf[64 * 1024];
+
+    while (!drain->done) {
+        int n = epoll_wait(drain->epfd, events, 64, 100);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            // Stop watching the connection when the server closes it
+            if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+                epoll_ctl(drain->epfd, EPOLL_CTL_DEL, fd, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Send the captured frame masked like a client frame
+ *
+ * @param fd the socket
+ * @param control control byte of the captured frame
+ * @param data the unmasked payload
+ * @param len length of the payload
+ * @return int 1 if success, 0 if the send failed
+ */
+static int send_frame(int fd, uint8_t control, uint8_t *data, uint64_t len) {
+    Dataframe frame;
+
+    init_dataframe(&frame);
+    frame.control = control;
+    set_mask_key(&frame, (uint32_t)rand());
+    set_data(&frame, data, len);
+
+    uint8_t* bytes = get_frame_bytes(&frame);
+    ssize_t sent = send(fd, bytes, frame.total_len, MSG_NOSIGNAL);
+    int success = sent == (ssize_t)frame.total_len;
+
+    free(bytes);
+    free_dataframe(&frame);
+    return success;
+}
+
+int main(int argc, char *argv[]) {
+    const char* host = "127.0.0.1";
+    uint16_t port = 8888;
+    double speed = 1.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:x:")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = (uint16_t)atoi(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            default: optind = argc + 1;
+        }
+    }
+
+    if (optind != argc - 1 || speed < 0) {
+        fprintf(stderr, "Usage: %s [-H host] [-p port] [-x speed] capture_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(argv[optind], "rb");
+    if (file == NULL || !capture_read_header(file)) {
+        fprintf(stderr, "%s is not a capture log\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    Drain drain = { .epfd = epoll_create1(0), .done = false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, drain_thread, &drain);
+
+    // Sockets are indexed with the captured connection id
+    int* fds = NULL;
+    uint32_t fd_count = 0;
+
+    uint64_t opened = 0, frames = 0, bytes = 0, failed = 0;
+    // Recorded time of the current record from the start of the log
+    uint64_t log_us = 0;
+    // How far behind the schedule the replay was at worst
+    uint64_t max_lag = 0;
+    uint64_t start = now_ns();
+
+    CaptureRecord type;
+    uint64_t delta_us, len;
+    uint32_t id;
+    uint8_t control;
+    uint8_t* data;
+
+    while (capture_read_record(file, &type, &delta_us, &id, &control, &data, &len)) {
+        log_us += delta_us;
+
+        if (speed > 0) {
+            uint64_t target = start + (uint64_t)(log_us * 1000 / speed);
+            sleep_until(target);
+            uint64_t now = now_ns();
+            if (now > target && now - target > max_lag)
+                max_lag = now - target;
+        }
+
+        // capture_read_record keeps the ids under CAPTURE_MAX_ID, so the
+        // count can't wrap
+        if (id >= fd_count) {
+            uint32_t count = fd_count ? fd_count : 64;
+            while (count <= id)
+                count *= 2;
+            int* grown = realloc(fds, count * sizeof(int));
+            if (grown == NULL) {
+                fprintf(stderr, "out of memory for %" PRIu32 " connections\n", count);
+                free(data);
+                break;
+            }
+            fds = grown;
+            for (uint32_t i = fd_count; i < count; i++)
+                fds[i] = -1;
+            fd_count = count;
+        }
+
+        switch (type) {
+            case CAPTURE_OPEN:
+                fds[id] = client_connect(host, port);
+                if (fds[id] != -1 && !client_handshake(fds[id], host, "/")) {
+                    close(fds[id]);
+                    fds[id] = -1;
+                }
+                if (fds[id] == -1) {
+                    failed++;
+                    break;
+                }
+                opened++;
+                struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[id] };
+                epoll_ctl(drain.epfd, EPOLL_CTL_ADD, fds[id], &ev);
+                break;
+            case CAPTURE_FRAME:
+                if (fds[id] == -1)
+                    break;
+                if (send_frame(fds[id], control, data, len)) {
+                    frames++;
+                    bytes += len;
+                } else {
+                    failed++;
+                }
+                break;
+            case CAPTURE_CLOSE:
+                if (fds[id] == -1)
+                    break;
+                epoll_ctl(drain.epfd, EPOLL_CTL_DEL, fds[id], NULL);
+                close(fds[id]);
+                fds[id] = -1;
+                break;
+            default:
+                fprintf(stderr, "unknown record type %d\n", type);
+                break;
+        }
+
+        free(data);
+    }
+
+    if (!feof(file))
+        fprintf(stderr, "broken record at offset %ld, the rest is not replayed\n", ftell(file));
+
+    double elapsed = (now_ns() - start) / 1e9;
+    drain.done = true;
+    pthread_join(thread, NULL);
+
+    for (uint32_t i = 0; i < fd_count; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    free(fds);
+    close(drain.epfd);
+    fclose(file);
+
+    printf("{\"connections\": %" PRIu64 ", \"frames\": %" PRIu64 ", \"bytes\": %" PRIu64
+           ", \"failed\": %" PRIu64 ", \"recorded_s\": %.3f, \"elapsed_s\": %.3f"
+           ", \"frames_per_sec\": %.1f, \"max_lag_us\": %.1f}\n",
+           opened, frames, bytes, failed, log_us / 1e6, elapsed,
+           elapsed > 0 ? frames / elapsed : 0.0, max_lag / 1e3);
+
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 
 /**
  * <sys/socket.h>
@@ -11,6 +13,22 @@
  */
 #include <sys/socket.h>
 
+/**
+ * <sys/un.h>
+ *
+ * structs:
+ * sockaddr_un
+ */
+#include <sys/un.h>
+
+/**
+ * <sys/stat.h>
+ *
+ * functions:
+ * lstat(), chmod()
+ */
+#include <sys/stat.h>
+
 /**
  * <netinet/in.h>
  *
@@ -25,6 +43,30 @@
  */
 #include <netinet/in.h>
 
+/**
+ * <netinet/tcp.h>
+ *
+ * defines:
+ * TCP_NODELAY, TCP_DEFER_ACCEPT, TCP_FASTOPEN, TCP_USER_TIMEOUT
+ */
+#include <netinet/tcp.h>
+
+/**
+ * <netdb.h>
+ *
+ * functions:
+ * getaddrinfo(), freeaddrinfo(), gai_strerror()
+ */
+#include <netdb.h>
+
+/**
+ * <stddef.h>
+ *
+ * defines:
+ * offsetof
+ */
+#include <stddef.h>
+
 /**
  * <stdint.h>
  *
@@ -68,92 +110,784 @@
  */
 #include <unistd.h>
 
-#include <pthread.h>
+/**
+ * <fcntl.h>
+ *
+ * functions:
+ * open(), O_CLOEXEC
+ */
+#include <fcntl.h>
+
+/**
+ * <errno.h>
+ *
+ * defines:
+ * errno
+ */
+#include <errno.h>
+
+/**
+ * <poll.h>
+ *
+ * functions:
+ * poll()
+ */
+#include <poll.h>
+
+/**
+ * <signal.h>
+ *
+ * functions:
+ * signal()
+ */
+#include <signal.h>
 
-#include "http.h"
+#include "bus.h"
+#include "cluster.h"
+#include "history.h"
+#include "capture.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "registry.h"
 #include "server.h"
+#include "socketcon.h"
+#include "tls.h"
+#include "worker.h"
+
+// Amount of connections accepted before they are handed to the reactors
+#define ACCEPT_BATCH 64
+
+// Amount of client addresses the connect rate limit keeps track of
+#define RATE_LIMIT_ADDRESSES 16384
 
-void init_server(WebSocketServer* wss) {
-    wss->clients = NULL;
+// Acceptor is the state of the accept loop
+typedef struct {
+    WebSocketServer* wss;
+    // Kept open so there is a descriptor to give up when the process runs
+    // out of them
+    int reserve_fd;
+    // Connect rate per address, entries is NULL if there is no limit
+    AddrLimiter limiter;
+    // Connections of the current batch per reactor
+    Connection** batches;
+    unsigned int next_reactor;
+    // Time of the last out of descriptors warning
+    uint64_t last_warn_ns;
+} Acceptor;
+
+/**
+ * @brief The default on_message, sends the message back as it is
+ */
+static void echo_message(WebSocketServer *wss, WebSocketConn *conn,
+                         WebSocketMessageType type, const uint8_t *data, size_t len) {
+    ws_send(conn, type, data, len);
 }
 
-void free_server(WebSocketServer* wss) {
-    if (wss->clients != NULL) {
-        free(wss->clients);
+/**
+ * @brief The default on_binary, sends the buffer back without copying it
+ */
+static void echo_binary(WebSocketServer *wss, WebSocketConn *conn, WebSocketBuffer *buffer) {
+    ws_send_owned(conn, WS_BINARY, buffer);
+}
+
+/**
+ * @brief Set the default settings
+ *
+ * @param config the settings
+ */
+void init_server_config(WebSocketServerConfig* config) {
+    config->bind_address = NULL;
+    config->port = 8888;
+    // Large enough for connect bursts, the kernel caps it to somaxconn
+    config->backlog = 4096;
+    config->tcp_nodelay = 1;
+    config->send_buffer = 0;
+    config->recv_buffer = 0;
+    config->defer_accept = 0;
+    config->fastopen = 0;
+    config->user_timeout = 0;
+    config->threads = 0;
+    config->max_handshakes = 16384;
+    config->connect_rate = 0;
+    config->connect_burst = 0;
+    config->validate_utf8 = 1;
+    config->coalesce_delay_us = 0;
+    config->release_idle_buffers = 1;
+    config->tls_cert = NULL;
+    config->tls_key = NULL;
+    config->bus_name = NULL;
+    // 16 MB ring
+    config->bus_slots = 4096;
+    config->bus_slot_size = 4096;
+    config->cluster_port = 0;
+    config->cluster_peers = NULL;
+    config->cluster_bind = NULL;
+    config->replay_size = 0;
+    config->replay_linger_ms = 60000;
+    config->conn_message_rate = 0;
+    config->conn_byte_rate = 0;
+    config->ip_message_rate = 0;
+    config->ip_byte_rate = 0;
+    config->proxy_routes = NULL;
+    config->proxy_pool = 8;
+    config->worker_name = NULL;
+    config->workers = 1;
+    config->worker_ring_size = 1024 * 1024;
+    config->unix_paths = NULL;
+    config->unix_mode = 0;
+}
+
+/**
+ * @brief Set the integer socket option and report the failure
+ *
+ * @param fd the socket
+ * @param level SOL_SOCKET or IPPROTO_TCP
+ * @param option the option
+ * @param value the value of the option
+ * @param name name of the option for the error message
+ * @return int 1 if success, 0 if fail
+ */
+static int set_option(int fd, int level, int option, int value, const char *name) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) == -1) {
+        LOG_ERROR("setsockopt(%s) failed: %s", name, strerror(errno));
+        return 0;
     }
+    return 1;
 }
 
-int run_server(WebSocketServer* wss) {
+/**
+ * @brief Apply the settings that are not inherited from the listening socket
+ *
+ * @param config the settings
+ * @param fd the accepted socket
+ */
+static void configure_connection(const WebSocketServerConfig *config, int fd) {
+    if (config->tcp_nodelay)
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (config->user_timeout > 0)
+        set_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, config->user_timeout, "TCP_USER_TIMEOUT");
+}
 
-    // Ports range is 0-65535 (0x0000-0xffff)
-    // which is exacly what uint16_t holds
-    uint16_t port = 8888;
+/**
+ * @brief Create the listening socket with the settings
+ *
+ * The buffer sizes are set before listen, so the accepted sockets inherit
+ * them and the window scaling is negotiated for the right size.
+ *
+ * @param config the settings
+ * @return int the listening socket or -1 if fail
+ */
+static int open_listener(const WebSocketServerConfig *config) {
+    struct addrinfo hints;
+    struct addrinfo* addr;
+    char port[8];
 
-    pthread_t thread;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = config->bind_address != NULL ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(port, sizeof(port), "%u", (unsigned int)config->port);
 
-    struct sockaddr_in sa;
+    int status = getaddrinfo(config->bind_address, port, &hints, &addr);
+    if (status != 0) {
+        fprintf(stderr, "invalid bind address %s: %s\n", config->bind_address, gai_strerror(status));
+        return -1;
+    }
 
-    // Set ipv4 tcp socket with stream socket
-    int socketfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int socketfd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
     if (socketfd == -1) {
         perror("cannot create socket");
-        exit(EXIT_FAILURE);
+        freeaddrinfo(addr);
+        return -1;
     }
 
     // Try to reuse the port
-    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)) == -1) {
-        perror("setsockopt(SO_REUSEADDR) failed");
-        exit(EXIT_FAILURE);
-    }
+    int ok = set_option(socketfd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
 
-    // Initialize the sa struct with zeros (nulls) amount the struct size
-    // TODO: do we really need this?
-    memset(&sa, 0, sizeof(sa));
-
-    // Set the socket addres to be ipv4
-    sa.sin_family = AF_INET;
-    // Set the socket port to port with correct byte order
-    sa.sin_port = htons(port);
-    // Set socket to accept any incoming messages
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (ok && config->send_buffer > 0)
+        ok = set_option(socketfd, SOL_SOCKET, SO_SNDBUF, config->send_buffer, "SO_SNDBUF");
+    if (ok && config->recv_buffer > 0)
+        ok = set_option(socketfd, SOL_SOCKET, SO_RCVBUF, config->recv_buffer, "SO_RCVBUF");
+    // Wake up accept only when the client has sent the request
+    if (ok && config->defer_accept > 0)
+        ok = set_option(socketfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config->defer_accept, "TCP_DEFER_ACCEPT");
+    // Let returning clients send the request in the SYN
+    if (ok && config->fastopen > 0)
+        ok = set_option(socketfd, IPPROTO_TCP, TCP_FASTOPEN, config->fastopen, "TCP_FASTOPEN");
+    if (!ok) {
+        freeaddrinfo(addr);
+        close(socketfd);
+        return -1;
+    }
 
     // Bind the socketfd file descriptor to local addres (lsof -i tcp)
-    if (bind(socketfd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+    if (bind(socketfd, addr->ai_addr, addr->ai_addrlen) == -1) {
         perror("bind failed");
+        freeaddrinfo(addr);
         close(socketfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    freeaddrinfo(addr);
 
     // Prepare to accept connections on socket FD.
-    // This tries 10 times if connection is working and returns -1
-    // if there is a problem
-    if (listen(socketfd, 10) == -1) {
+    // backlog is the amount of connections the kernel keeps waiting for
+    // accept before it starts dropping them
+    if (listen(socketfd, config->backlog) == -1) {
         perror("listen failed");
         close(socketfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    // Tcp connection loop
-    for (;;) {
-        // Wait for new connection and set the file descriptor for it
-        int connectfd = accept(socketfd, NULL, NULL);
+    return socketfd;
+}
+
+/**
+ * @brief Create a listening Unix domain socket
+ *
+ * A socket file left by an earlier server is removed, anything else at
+ * the path is left alone and the bind fails.
+ *
+ * @param config the settings
+ * @param path path of the socket, or '@' and the name of an abstract one
+ * @return int the listening socket or -1 if fail
+ */
+static int open_unix_listener(const WebSocketServerConfig *config, const char *path) {
+    struct sockaddr_un addr;
+    bool abstract = path[0] == '@';
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "invalid unix socket path %s\n", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    // The name of an abstract socket starts with a zero byte and isn't
+    // terminated, so its length is the length of the address
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+    } else {
+        addr_len++;
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+    }
+
+    int socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socketfd == -1) {
+        perror("cannot create unix socket");
+        return -1;
+    }
+
+    int ok = 1;
+    if (config->send_buffer > 0)
+        ok = set_option(socketfd, SOL_SOCKET, SO_SNDBUF, config->send_buffer, "SO_SNDBUF");
+    if (ok && config->recv_buffer > 0)
+        ok = set_option(socketfd, SOL_SOCKET, SO_RCVBUF, config->recv_buffer, "SO_RCVBUF");
+
+    if (!ok || bind(socketfd, (struct sockaddr*)&addr, addr_len) == -1) {
+        fprintf(stderr, "cannot bind %s: %s\n", path, strerror(errno));
+        close(socketfd);
+        return -1;
+    }
+
+    if (!abstract && config->unix_mode > 0 && chmod(path, config->unix_mode) == -1) {
+        fprintf(stderr, "cannot chmod %s: %s\n", path, strerror(errno));
+        close(socketfd);
+        return -1;
+    }
+
+    if (listen(socketfd, config->backlog) == -1) {
+        perror("listen failed");
+        close(socketfd);
+        return -1;
+    }
+
+    return socketfd;
+}
+
+/**
+ * @brief Open the Unix domain sockets of config.unix_paths
+ *
+ * @param wss the server
+ * @return int 1 if success, 0 if fail
+ */
+static int open_unix_listeners(WebSocketServer *wss) {
+    const char* paths = wss->config.unix_paths;
+
+    while (*paths != '\0') {
+        char path[sizeof(((struct sockaddr_un*)0)->sun_path) + 1];
+        size_t len = strcspn(paths, ",");
+        if (len >= sizeof(path) || wss->unix_count == WS_MAX_UNIX_LISTENERS) {
+            fprintf(stderr, "invalid unix socket paths %s\n", wss->config.unix_paths);
+            return 0;
+        }
+
+        if (len > 0) {
+            memcpy(path, paths, len);
+            path[len] = '\0';
+            int fd = open_unix_listener(&wss->config, path);
+            if (fd == -1)
+                return 0;
+            wss->unix_fds[wss->unix_count++] = fd;
+        }
+        paths += len;
+        if (*paths == ',')
+            paths++;
+    }
+    return 1;
+}
+
+/**
+ * @brief Allocate the inbound limits of the client addresses
+ *
+ * @param config the settings, ip_message_rate or ip_byte_rate is set
+ * @return PeerLimits* the limits or NULL if out of memory
+ */
+static PeerLimits* create_peer_limits(const WebSocketServerConfig *config) {
+    PeerLimits* limits = calloc(1, sizeof(PeerLimits));
+    if (limits == NULL)
+        return NULL;
+
+    pthread_mutex_init(&limits->lock, NULL);
+    if ((config->ip_message_rate > 0 &&
+         !init_addr_limiter(&limits->messages, RATE_LIMIT_ADDRESSES,
+                            config->ip_message_rate, config->ip_message_rate)) ||
+        (config->ip_byte_rate > 0 &&
+         !init_addr_limiter(&limits->bytes, RATE_LIMIT_ADDRESSES,
+                            config->ip_byte_rate, config->ip_byte_rate))) {
+        free_addr_limiter(&limits->messages);
+        pthread_mutex_destroy(&limits->lock);
+        free(limits);
+        return NULL;
+    }
+    return limits;
+}
+
+/**
+ * @brief Initialize the server and open the listening socket
+ *
+ * @param wss the server
+ * @param config the settings, NULL uses the defaults
+ * @return int 1 if success, 0 if the socket couldn't be opened
+ */
+int init_server(WebSocketServer* wss, const WebSocketServerConfig* config) {
+    wss->registry = create_registry();
+    wss->capture_path = NULL;
+    memset(&wss->handler, 0, sizeof(wss->handler));
+    wss->handler.on_message = echo_message;
+    wss->handler.on_binary = echo_binary;
+    wss->user_data = NULL;
+    wss->reactors = NULL;
+    wss->tls_ctx = NULL;
+    wss->bus = NULL;
+    wss->bus_watch = NULL;
+    wss->cluster = NULL;
+    wss->proxy = NULL;
+    wss->workers = NULL;
+    wss->history = NULL;
+    wss->peer_limits = NULL;
+    wss->listen_fd = -1;
+    wss->protocol_count = 0;
+    wss->unix_count = 0;
+    wss->handshakes_pending = 0;
+
+    if (config != NULL)
+        wss->config = *config;
+    else
+        init_server_config(&wss->config);
+
+    // One reactor per cpu unless the application wants something else
+    if (wss->config.threads <= 0)
+        wss->config.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (wss->config.threads <= 0)
+        wss->config.threads = 1;
+
+    if (wss->registry == NULL)
+        return 0;
+
+    // With only one of them the port would serve plain text to clients
+    // that expect wss://
+    if ((wss->config.tls_cert != NULL) != (wss->config.tls_key != NULL)) {
+        fprintf(stderr, "TLS needs both the certificate and the key\n");
+        return 0;
+    }
+
+    if (wss->config.tls_cert != NULL) {
+        wss->tls_ctx = create_tls_context(wss->config.tls_cert, wss->config.tls_key);
+        if (wss->tls_ctx == NULL)
+            return 0;
+        // OpenSSL writes to the socket with write, which raises SIGPIPE
+        // when the client is gone
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (wss->config.bus_name != NULL) {
+        wss->bus = bus_open(wss->config.bus_name, wss->config.bus_slots,
+                            wss->config.bus_slot_size);
+        if (wss->bus == NULL)
+            return 0;
+    }
+
+    if (wss->config.replay_size > 0) {
+        wss->history = create_history(wss->config.replay_size,
+                                      (uint64_t)wss->config.replay_linger_ms * 1000000);
+        if (wss->history == NULL)
+            return 0;
+    }
+
+    if (wss->config.ip_message_rate > 0 || wss->config.ip_byte_rate > 0) {
+        wss->peer_limits = create_peer_limits(&wss->config);
+        if (wss->peer_limits == NULL)
+            return 0;
+    }
+
+    if (wss->config.cluster_port != 0) {
+        wss->cluster = create_cluster(wss);
+        if (wss->cluster == NULL)
+            return 0;
+    }
+
+    if (wss->config.proxy_routes != NULL) {
+        // splice needs the plain socket, the TLS records are in userspace
+        if (wss->tls_ctx != NULL) {
+            fprintf(stderr, "the proxy doesn't work with TLS\n");
+            return 0;
+        }
+        wss->proxy = create_proxy(wss);
+        if (wss->proxy == NULL)
+            return 0;
+    }
+
+    if (wss->config.worker_name != NULL) {
+        wss->workers = create_workers(wss);
+        if (wss->workers == NULL)
+            return 0;
+    }
+
+    wss->listen_fd = open_listener(&wss->config);
+    if (wss->listen_fd == -1)
+        return 0;
+
+    return wss->config.unix_paths == NULL || open_unix_listeners(wss);
+}
+
+void free_server(WebSocketServer* wss) {
+    // The threads of the modules read the rest, so they stop first
+    if (wss->cluster != NULL) {
+        free_cluster(wss->cluster);
+        wss->cluster = NULL;
+    }
+    if (wss->proxy != NULL) {
+        free_proxy(wss->proxy);
+        wss->proxy = NULL;
+    }
+    if (wss->workers != NULL) {
+        free_workers(wss->workers);
+        wss->workers = NULL;
+    }
+    if (wss->registry != NULL) {
+        free_registry(wss->registry);
+        wss->registry = NULL;
+    }
+    if (wss->tls_ctx != NULL) {
+        free_tls_context(wss->tls_ctx);
+        wss->tls_ctx = NULL;
+    }
+    if (wss->bus != NULL) {
+        bus_close(wss->bus);
+        wss->bus = NULL;
+    }
+    if (wss->history != NULL) {
+        free_history(wss->history);
+        wss->history = NULL;
+    }
+    if (wss->peer_limits != NULL) {
+        free_addr_limiter(&wss->peer_limits->messages);
+        free_addr_limiter(&wss->peer_limits->bytes);
+        pthread_mutex_destroy(&wss->peer_limits->lock);
+        free(wss->peer_limits);
+        wss->peer_limits = NULL;
+    }
+    if (wss->listen_fd != -1) {
+        close(wss->listen_fd);
+        wss->listen_fd = -1;
+    }
+    for (int i = 0; i < wss->unix_count; i++)
+        close(wss->unix_fds[i]);
+    wss->unix_count = 0;
+    capture_close();
+    log_flush();
+}
+
+/**
+ * @brief Speak the subprotocol of the codec
+ *
+ * Called before run_server. The handshake prefers the codecs added first.
+ *
+ * @param wss the server
+ * @param codec the codec, must stay valid while the server runs
+ * @return int 1 if success, 0 if the server has WS_MAX_PROTOCOLS already
+ */
+int ws_add_protocol(WebSocketServer *wss, const WebSocketCodec *codec) {
+    if (wss->protocol_count == WS_MAX_PROTOCOLS)
+        return 0;
 
-        // if file descriptor is -1, the kernel couldn't create new port
-        // for the connection
+    wss->protocols[wss->protocol_count++] = codec;
+    return 1;
+}
+
+/**
+ * @brief Give up a file descriptor to drop a connection when the process
+ * has run out of them
+ *
+ * Without this the connection stays in the backlog and the listening
+ * socket stays readable, so the accept loop would spin.
+ *
+ * @param acceptor the Acceptor
+ * @param listen_fd the listening socket
+ * @return int 1 if a connection was dropped, 0 if there was no reserve
+ */
+static int shed_connection(Acceptor *acceptor, int listen_fd) {
+    uint64_t now = metrics_now_ns();
+
+    metrics_add(METRIC_REJECTED_NO_FD, 1);
+    if (now - acceptor->last_warn_ns > 1000000000ULL) {
+        LOG_WARN("Out of file descriptors, dropping connections");
+        acceptor->last_warn_ns = now;
+    }
+
+    if (acceptor->reserve_fd == -1) {
+        acceptor->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return 0;
+    }
+
+    close(acceptor->reserve_fd);
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd != -1)
+        close(fd);
+    acceptor->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return fd != -1;
+}
+
+/**
+ * @brief Decide if the new connection is let in
+ *
+ * @param acceptor the Acceptor
+ * @param key address of the client from addr_limiter_key
+ * @param now current time in nanoseconds
+ * @return int 1 if the connection is accepted, 0 if it's dropped
+ */
+static int admit(Acceptor *acceptor, const uint8_t *key, uint64_t now) {
+    WebSocketServer* wss = acceptor->wss;
+
+    if (acceptor->limiter.entries != NULL &&
+        !addr_limiter_take(&acceptor->limiter, key, 1.0, now)) {
+        metrics_add(METRIC_REJECTED_RATE_LIMIT, 1);
+        return 0;
+    }
+
+    // The reactors decrement the count when the handshake is done
+    if (wss->config.max_handshakes > 0 &&
+        __atomic_load_n(&wss->handshakes_pending, __ATOMIC_RELAXED) >= wss->config.max_handshakes) {
+        metrics_add(METRIC_REJECTED_HANDSHAKES, 1);
+        return 0;
+    }
+
+    __atomic_add_fetch(&wss->handshakes_pending, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * @brief Accept the connections waiting in the backlog
+ *
+ * At most ACCEPT_BATCH connections are accepted and then handed to the
+ * reactors with one wake up per reactor.
+ *
+ * @param acceptor the Acceptor
+ * @param listen_fd the listening socket
+ */
+static void accept_batch(Acceptor *acceptor, int listen_fd) {
+    WebSocketServer* wss = acceptor->wss;
+    int threads = wss->config.threads;
+    uint64_t now = metrics_now_ns();
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+
+        // The reactors only do non-blocking io
+        int connectfd = accept4(listen_fd, (struct sockaddr*)&addr, &addr_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (connectfd == -1) {
-            perror("accept failed");
-            close(socketfd);
-            exit(EXIT_FAILURE);
+            // The client gave up before we got to it
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection(acceptor, listen_fd))
+                    continue;
+                // Not even the reserve is there, give the reactors time
+                // to close something
+                usleep(10000);
+                break;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // ENOBUFS and ENOMEM go away when the memory is freed
+                LOG_ERROR("accept failed: %s", strerror(errno));
+                usleep(1000);
+            }
+            break;
         }
 
-        // Handle each connection in a thread
-        if (pthread_create(&thread, NULL, accept_client, &connectfd) != 0) {
-            perror("thread failed");
+        // The clients of the Unix domain sockets are told apart by their
+        // user, the kernel gives the credentials of the connect
+        uint8_t key[16];
+        struct ucred cred = { .pid = 0, .uid = 0, .gid = 0 };
+        bool local = addr.ss_family == AF_UNIX;
+        if (local) {
+            socklen_t cred_len = sizeof(cred);
+            // Without them the client would pass for root, so it's closed
+            if (getsockopt(connectfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+                LOG_ERROR("getsockopt(SO_PEERCRED) failed: %s", strerror(errno));
+                close(connectfd);
+                continue;
+            }
+            addr_limiter_local_key(cred.uid, key);
+        } else {
+            addr_limiter_key((struct sockaddr*)&addr, key);
+        }
+
+        if (!admit(acceptor, key, now)) {
+            close(connectfd);
+            continue;
+        }
+
+        if (!local)
+            configure_connection(&wss->config, connectfd);
+
+        // The reactor owns the connection and frees it when it's done
+        Connection* conn = malloc(sizeof(Connection));
+        if (conn == NULL) {
+            LOG_ERROR("connection alloc failed");
+            __atomic_sub_fetch(&wss->handshakes_pending, 1, __ATOMIC_RELAXED);
             close(connectfd);
+            continue;
         }
+        init_connection(conn, connectfd, wss);
+        memcpy(conn->peer, key, sizeof(key));
+        conn->local = local;
+        conn->cred.pid = cred.pid;
+        conn->cred.uid = cred.uid;
+        conn->cred.gid = cred.gid;
+
+        // Connections are spread evenly to the reactors
+        int index = acceptor->next_reactor++ % threads;
+        conn->next = acceptor->batches[index];
+        acceptor->batches[index] = conn;
     }
 
+    for (int i = 0; i < threads; i++) {
+        if (acceptor->batches[i] != NULL) {
+            reactor_add(&wss->reactors[i], acceptor->batches[i]);
+            acceptor->batches[i] = NULL;
+        }
+    }
+}
+
+int run_server(WebSocketServer* wss) {
+    int socketfd = wss->listen_fd;
+    // The TCP socket first, then the Unix domain sockets
+    struct pollfd pfds[1 + WS_MAX_UNIX_LISTENERS];
+    int pfd_count = 1 + wss->unix_count;
+    Acceptor acceptor;
+
+    pfds[0].fd = socketfd;
+    pfds[0].events = POLLIN;
+    for (int i = 0; i < wss->unix_count; i++) {
+        pfds[1 + i].fd = wss->unix_fds[i];
+        pfds[1 + i].events = POLLIN;
+    }
+
+    memset(&acceptor, 0, sizeof(acceptor));
+    acceptor.wss = wss;
+    acceptor.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    acceptor.batches = calloc(wss->config.threads, sizeof(Connection*));
+    if (acceptor.batches == NULL) {
+        perror("cannot allocate accept batches");
+        exit(EXIT_FAILURE);
+    }
+
+    if (wss->config.connect_rate > 0) {
+        double burst = wss->config.connect_burst;
+        if (burst < 1.0)
+            burst = wss->config.connect_rate > 1.0 ? wss->config.connect_rate : 1.0;
+        if (!init_addr_limiter(&acceptor.limiter, RATE_LIMIT_ADDRESSES,
+                               wss->config.connect_rate, burst)) {
+            perror("cannot allocate rate limiter");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Start capturing the traffic before the first connection comes in
+    if (wss->capture_path != NULL && !capture_open(wss->capture_path)) {
+        perror("cannot open capture file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!start_reactors(wss, wss->config.threads)) {
+        perror("cannot start reactors");
+        close(socketfd);
+        exit(EXIT_FAILURE);
+    }
+
+    // The reactors are up before the peers can send anything
+    if (wss->cluster != NULL && !start_cluster(wss->cluster)) {
+        perror("cannot start cluster");
+        close(socketfd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (wss->proxy != NULL && !start_proxy(wss->proxy)) {
+        perror("cannot start proxy");
+        close(socketfd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (wss->workers != NULL && !start_workers(wss->workers)) {
+        perror("cannot start worker replies");
+        close(socketfd);
+        exit(EXIT_FAILURE);
+    }
+
+    LOG_INFO("Listening on %s port %u with %d reactors",
+             wss->config.bind_address != NULL ? wss->config.bind_address : "0.0.0.0",
+             (unsigned int)wss->config.port, wss->config.threads);
+    if (wss->unix_count > 0)
+        LOG_INFO("Listening on unix sockets %s", wss->config.unix_paths);
+
+    // Connection loop
+    for (;;) {
+        // Wait until a backlog has connections and take them in a batch
+        int ready = poll(pfds, pfd_count, -1);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll failed");
+            break;
+        }
+        for (int i = 0; i < pfd_count && ready > 0; i++) {
+            if (pfds[i].revents != 0)
+                accept_batch(&acceptor, pfds[i].fd);
+        }
+    }
 
+    free_addr_limiter(&acceptor.limiter);
+    free(acceptor.batches);
     close(socketfd);
     return EXIT_SUCCESS;
 }
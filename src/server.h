@@ -1,14 +1,283 @@
 #ifndef WEB_SOCKET_SERVER_H
 #define WEB_SOCKET_SERVER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct WebSocketServer WebSocketServer;
+
+// WebSocketConn is a single websocket connection. The pointer is valid
+// until on_close returns, or longer if the application holds a reference
+// taken with ws_retain
+typedef struct Connection WebSocketConn;
+
+// WebSocketHandle names a connection without keeping it alive. Handles are
+// never reused, so the handle of a closed connection never finds another
+// connection. 0 is never a valid handle
+typedef uint64_t WebSocketHandle;
+
+// Type of the message, same values as the frame opcodes
+typedef enum {
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+} WebSocketMessageType;
+
+// WebSocketBuffer is a received message the application owns
 typedef struct {
-    int* clients;
-} WebSocketServer;
+    // The payload
+    uint8_t* data;
+    size_t len;
+    // Start of the allocation, data points inside it
+    void* base;
+} WebSocketBuffer;
 
+/**
+ * Application callbacks
+ *
+ * Every callback is called on the reactor thread that owns the connection,
+ * so the callbacks of a single connection never run at the same time.
+ * Any callback can be NULL.
+ */
+typedef struct {
+    // The handshake is done and messages can be sent
+    void (*on_open)(WebSocketServer *wss, WebSocketConn *conn);
+    // A complete message was received. The data is borrowed from the
+    // receive buffer and is only valid until the callback returns
+    void (*on_message)(WebSocketServer *wss, WebSocketConn *conn,
+                       WebSocketMessageType type, const uint8_t *data, size_t len);
+    // If set, binary messages are given here instead of on_message. The
+    // application owns the buffer and frees it with ws_buffer_free or
+    // passes it to ws_send_owned. Large messages are received straight
+    // to the buffer, so they are never copied
+    void (*on_binary)(WebSocketServer *wss, WebSocketConn *conn, WebSocketBuffer *buffer);
+    // The connection is gone. code is the close code the client sent,
+    // or 1006 if the connection was lost without a close frame
+    void (*on_close)(WebSocketServer *wss, WebSocketConn *conn, int code);
+    // Everything queued so far is written to the socket. Called after
+    // ws_request_writable or after the socket was full
+    void (*on_writable)(WebSocketServer *wss, WebSocketConn *conn);
+} WebSocketHandler;
+
+// Most subprotocols a server can speak
+#define WS_MAX_PROTOCOLS 8
+
+// Most Unix domain sockets a server listens on besides the TCP port
+#define WS_MAX_UNIX_LISTENERS 8
+
+// Credentials of a client on a Unix domain socket, from SO_PEERCRED
+typedef struct {
+    int32_t pid;
+    uint32_t uid;
+    uint32_t gid;
+} WebSocketPeerCred;
 
-void init_server(WebSocketServer* wss);
+/**
+ * Codec of a subprotocol, like JSON, MessagePack or raw
+ *
+ * The codecs are added with ws_add_protocol. The client lists the
+ * subprotocols it speaks in Sec-WebSocket-Protocol and the handshake
+ * picks the first codec, in the order they were added, that the client
+ * listed. The messages of a connection with a codec are given to decode
+ * instead of on_message and on_binary, and ws_send_value encodes with it.
+ */
+typedef struct {
+    // Name of the subprotocol in the handshake, like "json"
+    const char* name;
+    // Frame type of the encoded messages
+    WebSocketMessageType type;
+    // Decode the message straight from the receive buffer and hand the
+    // result to the application. The data is only valid until the call
+    // returns
+    void (*decode)(WebSocketServer *wss, WebSocketConn *conn,
+                   WebSocketMessageType type, const uint8_t *data, size_t len);
+    // Exact length of the encoded value
+    size_t (*encoded_len)(const void *value);
+    // Write the encoded value to out, which has room for encoded_len bytes.
+    // out is the payload of the frame in the send queue
+    void (*encode)(const void *value, uint8_t *out);
+} WebSocketCodec;
+
+// Settings of the listening socket and the accepted connections
+typedef struct {
+    // Address the server listens on, NULL listens on every ipv4 address.
+    // Can be an ipv6 address like "::"
+    const char* bind_address;
+    uint16_t port;
+    // Length of the queue of connections waiting for accept
+    int backlog;
+    // Disable Nagle's algorithm, so small frames are sent right away
+    int tcp_nodelay;
+    // SO_SNDBUF and SO_RCVBUF in bytes, 0 keeps the kernel default
+    int send_buffer;
+    int recv_buffer;
+    // TCP_DEFER_ACCEPT in seconds. The connection is accepted only when the
+    // request arrives, 0 disables it
+    int defer_accept;
+    // TCP_FASTOPEN queue length, 0 disables it
+    int fastopen;
+    // TCP_USER_TIMEOUT in milliseconds. Connections with unacknowledged
+    // data are dropped after this, 0 keeps the kernel default
+    int user_timeout;
+    // Amount of reactor threads, 0 starts one per cpu
+    int threads;
+    // Connections that have not finished the handshake yet. New connections
+    // are dropped when there are this many, 0 is unlimited
+    int max_handshakes;
+    // New connections per second allowed from a single address, with
+    // bursts up to connect_burst. 0 is unlimited
+    double connect_rate;
+    double connect_burst;
+    // Close connections that send text messages that are not UTF-8, as
+    // RFC 6455 requires. Applications that check the text themselves, or
+    // don't care, can turn this off to skip the validation
+    int validate_utf8;
+    // Hold the output of a connection up to this many microseconds, so
+    // frames sent close to each other go out with one system call and in
+    // fewer packets. 0 writes at the end of every reactor round
+    int coalesce_delay_us;
+    // Give the receive buffer back to the reactor's pool, and let OpenSSL
+    // free its record buffers, whenever a connection has nothing left to
+    // handle. An idle connection keeps only its state, well under 1 KB
+    // without TLS
+    int release_idle_buffers;
+    // PEM files of the certificate chain and the private key. If both are
+    // set, the connections are wss:// only. Only one of them is an error
+    const char* tls_cert;
+    const char* tls_key;
+    // Name of the shared memory bus, like "/feed". If set, ws_publish
+    // writes to the bus and the messages reach the subscribers of every
+    // server process on the host that uses the same bus
+    const char* bus_name;
+    // Geometry of the bus when this server creates it: amount of slots,
+    // rounded up to a power of two, and bytes per slot. The topic and the
+    // payload of a message must fit in a slot
+    uint32_t bus_slots;
+    uint32_t bus_slot_size;
+    // Port the other nodes of the cluster dial, 0 disables the cluster
+    uint16_t cluster_port;
+    // Comma separated "host:port" cluster ports of every other node, an
+    // IPv6 address goes in brackets like "[::1]:9001". Only these hosts
+    // can open a link to this node
+    const char* cluster_peers;
+    // Address the cluster port listens on. NULL is bind_address, or the
+    // loopback address if that isn't set either
+    const char* cluster_bind;
+    // Messages kept per topic for the clients that reconnect, 0 disables
+    // the replay. See ws_subscribe
+    int replay_size;
+    // How long the kept messages of a topic without subscribers are kept
+    int replay_linger_ms;
+    // Inbound messages and bytes per second of a connection and of all the
+    // connections of a client address, 0 is no limit. A client over its
+    // limit is not read until the bucket refills, so TCP slows it down.
+    // The buckets hold one second worth of the rate
+    double conn_message_rate;
+    double conn_byte_rate;
+    double ip_message_rate;
+    double ip_byte_rate;
+    // Comma separated "PREFIX=HOST:PORT" routes, the upgrades with a path
+    // under a prefix are relayed to the backend of the longest one. NULL
+    // disables the proxy. Doesn't work with TLS, see proxy.h
+    const char* proxy_routes;
+    // Connected sockets kept for every backend of the proxy
+    int proxy_pool;
+    // Shared memory object of the rings to the worker processes, like
+    // "/app", NULL if there are no workers. See ws_to_worker
+    const char* worker_name;
+    // Amount of the worker processes, and bytes of every ring. A message
+    // can be half of a ring
+    int workers;
+    uint32_t worker_ring_size;
+    // Comma separated Unix domain socket paths to listen on besides the
+    // TCP port, a path that starts with '@' is an abstract socket. The
+    // clients on these get no TLS, see ws_get_peer_cred
+    const char* unix_paths;
+    // Permissions of the socket files, 0 leaves them to the umask
+    int unix_mode;
+} WebSocketServerConfig;
+
+struct WebSocketServer {
+    // The open websocket connections, see ws_lookup and ws_for_each
+    struct Registry* registry;
+    // Inbound frames are recorded to this file if it's set
+    const char* capture_path;
+    // Application callbacks. init_server sets a handler that echoes
+    // every message back
+    WebSocketHandler handler;
+    // Free for the application, the server never touches it
+    void* user_data;
+    // The settings init_server was called with
+    WebSocketServerConfig config;
+    // The listening socket
+    int listen_fd;
+    // The Unix domain sockets of config.unix_paths
+    int unix_fds[WS_MAX_UNIX_LISTENERS];
+    int unix_count;
+    // Accepted connections that have not upgraded yet, for max_handshakes
+    int handshakes_pending;
+    // The reactor threads, config.threads of them, set by run_server
+    struct Reactor* reactors;
+    // The TLS context of the connections, NULL if TLS is not used
+    struct ssl_ctx_st* tls_ctx;
+    // The shared memory bus and its watcher thread, NULL if not used
+    struct Bus* bus;
+    struct BusWatch* bus_watch;
+    // Links to the other nodes, NULL if not used
+    struct Cluster* cluster;
+    // Relays the proxied connections, NULL if there are no routes
+    struct Proxy* proxy;
+    // The rings to the worker processes, NULL if there are none
+    struct Workers* workers;
+    // The kept messages of the topics, NULL if the replay isn't used
+    struct History* history;
+    // Inbound limits per client address, NULL if there are none
+    struct PeerLimits* peer_limits;
+    // The subprotocols in the order of preference, see ws_add_protocol
+    const WebSocketCodec* protocols[WS_MAX_PROTOCOLS];
+    int protocol_count;
+};
+
+
+void init_server_config(WebSocketServerConfig* config);
+int init_server(WebSocketServer* wss, const WebSocketServerConfig* config);
 int run_server(WebSocketServer* wss);
 void free_server(WebSocketServer* wss);
+int ws_add_protocol(WebSocketServer *wss, const WebSocketCodec *codec);
+
+// The ws_* functions can be called from any thread
+int ws_send(WebSocketConn *conn, WebSocketMessageType type, const uint8_t *data, size_t len);
+int ws_send_buffer(WebSocketConn *conn, WebSocketMessageType type, const uint8_t *data,
+                   size_t len, void (*free_fn)(void *arg), void *arg);
+int ws_send_owned(WebSocketConn *conn, WebSocketMessageType type, WebSocketBuffer *buffer);
+void ws_buffer_free(WebSocketBuffer *buffer);
+int ws_send_value(WebSocketConn *conn, const void *value);
+int ws_close(WebSocketConn *conn, uint16_t code, const char *reason);
+void ws_request_writable(WebSocketConn *conn);
+size_t ws_buffered_amount(WebSocketConn *conn);
+void ws_retain(WebSocketConn *conn);
+void ws_release(WebSocketConn *conn);
+void ws_set_user_data(WebSocketConn *conn, void *data);
+void* ws_get_user_data(WebSocketConn *conn);
+WebSocketServer* ws_get_server(WebSocketConn *conn);
+WebSocketHandle ws_get_handle(WebSocketConn *conn);
+const char* ws_get_path(WebSocketConn *conn);
+const char* ws_get_protocol(WebSocketConn *conn);
+int ws_get_peer_cred(WebSocketConn *conn, WebSocketPeerCred *cred);
+WebSocketConn* ws_lookup(WebSocketServer *wss, WebSocketHandle handle);
+size_t ws_for_each(WebSocketServer *wss, void (*fn)(WebSocketConn *conn, void *arg), void *arg);
+size_t ws_connection_count(WebSocketServer *wss);
+
+// Topics. ws_subscribe and ws_unsubscribe are called on the reactor thread
+// of the connection, from its callbacks. ws_publish can be called from any
+// thread
+int ws_subscribe(WebSocketConn *conn, const char *topic);
+int ws_unsubscribe(WebSocketConn *conn, const char *topic);
+int ws_publish(WebSocketServer *wss, const char *topic, WebSocketMessageType type,
+               const uint8_t *data, size_t len);
+
+// Worker processes. ws_to_worker is called on the reactor thread of the
+// connection, from its callbacks
+int ws_to_worker(WebSocketConn *conn, WebSocketMessageType type, const uint8_t *data, size_t len);
 
 
 
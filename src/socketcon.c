@@ -1,214 +1,1278 @@
+#define _GNU_SOURCE
 
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "dataframe.h"
+#include "log.h"
+#include "metrics.h"
+#include "pubsub.h"
+#include "reactor.h"
+#include "registry.h"
 #include "socketcon.h"
-
-// Check if the byte has mask
-#define MASK_BIT(byte) (byte >> 7)
-
-// Get the length bits
-#define LENGTH_BITS(byte) (byte & 0x7f)
+#include "tls.h"
+#include "worker.h"
 
 // Get the op code from byte. The op code is the four rightmost bits
 #define OP_CODE(byte) (byte & 0x0f)
 
+// Check if the FIN bit is set in the control byte
+#define FIN_BIT(byte) (byte >> 7)
+
+// Get the RSV bits from the control byte
+#define RSV_BITS(byte) (byte & 0x70)
+
+// Check if the opcode is a control frame opcode
+#define IS_CONTROL(opcode) ((opcode) & 0x08)
+
+/**
+ * @brief Initialize the connection struct for the accepted socket
+ *
+ * @param conn Connection struct
+ * @param conn_fd the accepted socket file descriptor
+ * @param wss the server the connection belongs to
+ */
+void init_connection(Connection *conn, int conn_fd, WebSocketServer *wss) {
+    memset(conn, 0, sizeof(*conn));
+    conn->conn_fd = conn_fd;
+    conn->is_alive = true;
+    conn->state = CONN_HTTP;
+    conn->opened_ns = metrics_now_ns();
+    conn->request_start_ns = conn->opened_ns;
+    conn->last_active_ns = conn->opened_ns;
+    conn->refs = 1;
+    conn->server = wss;
+    conn->close_code = CLOSE_ABNORMAL;
+    init_token_bucket(&conn->message_bucket, wss->config.conn_message_rate, conn->opened_ns);
+    init_token_bucket(&conn->byte_bucket, wss->config.conn_byte_rate, conn->opened_ns);
+}
+
+static void free_chunk(OutChunk *chunk) {
+    if (chunk->file_fd != -1)
+        close(chunk->file_fd);
+    if (chunk->free_fn != NULL)
+        chunk->free_fn(chunk->free_arg);
+    free(chunk);
+}
+
+/**
+ * @brief Allocate a memory chunk
+ *
+ * @param inline_len amount of bytes stored in the chunk itself
+ * @return OutChunk* the chunk or NULL if out of memory
+ */
+static OutChunk* alloc_chunk(size_t inline_len) {
+    OutChunk* chunk = malloc(sizeof(OutChunk) + inline_len);
+    if (chunk == NULL)
+        return NULL;
+    chunk->file_fd = -1;
+    chunk->len = inline_len;
+    chunk->sent = 0;
+    chunk->inline_len = inline_len;
+    chunk->ext_data = NULL;
+    chunk->free_fn = NULL;
+    chunk->free_arg = NULL;
+    chunk->closing = false;
+    return chunk;
+}
+
+/**
+ * @brief Drop the output that is not written yet, called by the reactor
+ *
+ * @param conn Connection struct
+ */
+static void free_queue(Connection *conn) {
+    OutChunk* inbox = __atomic_exchange_n(&conn->inbox, NULL, __ATOMIC_ACQUIRE);
+    if (conn->out_tail != NULL)
+        conn->out_tail->next = inbox;
+    else
+        conn->out_head = inbox;
+
+    while (conn->out_head != NULL) {
+        OutChunk* chunk = conn->out_head;
+        conn->out_head = chunk->next;
+        __atomic_sub_fetch(&conn->out_bytes, chunk->len - chunk->sent, __ATOMIC_RELAXED);
+        metrics_add(METRIC_QUEUED_BYTES, -(int64_t)(chunk->len - chunk->sent));
+        metrics_add(METRIC_QUEUED_CHUNKS, -1);
+        free_chunk(chunk);
+    }
+    conn->out_tail = NULL;
+}
+
+/**
+ * @brief Get the state of the connection
+ *
+ * The state can be changed by other threads with ws_close
+ *
+ * @param conn Connection struct
+ * @return ConnState the current state
+ */
+ConnState conn_state(Connection *conn) {
+    return __atomic_load_n(&conn->state, __ATOMIC_ACQUIRE);
+}
+
 /**
- * @brief read the frame bytes from socket
- *
- * @param client client file descriptor
- * @return uint8_t pointer to data buffer
- */
-static uint8_t* read_frame(Connection *conn) {
-    // TODO: error handling. atleast the recv return handlinf
-    // ptr tells us how many bytes have we read
-    uint64_t ptr = 2;
-    // frame needs atleast two bytes
-    uint64_t frame_length = 2;
-    uint64_t data_len = 0;
-    // Allocate 2 bytes because the frame is atleast two bytes long
-    uint8_t* buffer = malloc(sizeof(uint8_t) * frame_length);
-
-    // read the first two bytes
-
-    recv(conn->conn_fd, buffer, sizeof(uint8_t) * 2, MSG_WAITALL);
-    // If data length is represented in 16 bits
-    if (LENGTH_BITS(buffer[1]) == 126) {
-        frame_length += 2;
-        buffer = realloc(buffer, sizeof(uint8_t) * frame_length);
-        // Read the 16 bits of length to buffer
-        recv(conn->conn_fd, buffer + ptr, sizeof(uint8_t) * 2, 0);
-        // Set the data length
-        data_len += len_bytes_int(buffer + ptr, 2);
-        ptr += 2;
-
-    // If data length is represented in 64 bits
-    } else if (LENGTH_BITS(buffer[1]) == 127) {
-        frame_length += 8;
-        buffer = realloc(buffer, sizeof(uint8_t) * frame_length);
-        // Read the 64 bits of length to buffer
-        recv(conn->conn_fd, buffer + ptr, sizeof(uint8_t) * 8, 0);
-        // Set the data length
-        data_len = len_bytes_int(buffer + ptr, 8);
-        ptr += 8;
-
-    // Else the data is represented in the original 7 bits
+ * @brief Set the state of the connection
+ *
+ * @param conn Connection struct
+ * @param state the new state
+ */
+void set_conn_state(Connection *conn, ConnState state) {
+    __atomic_store_n(&conn->state, state, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Read from the socket to the receive buffer
+ *
+ * The first buffer comes from the pool of the reactor. The buffer grows
+ * when there isn't much room left or when recv_need says the next frame
+ * is larger than the buffer. Frames larger than
+ * CONN_BUF_SIZE get a buffer of their own exact size and nothing after
+ * the frame is read to it, so the whole buffer can be given to the
+ * application without copying.
+ *
+ * @param conn Connection struct
+ * @return ssize_t amount of bytes read, 0 if the peer closed and -1 on
+ * error. errno is EAGAIN if there was nothing to read
+ */
+ssize_t conn_fill(Connection *conn) {
+    bool large = conn->recv_need > CONN_BUF_SIZE && conn->recv_need > conn->recv_len;
+
+    if (conn->recv_need > conn->recv_cap ||
+        (!large && conn->recv_cap - conn->recv_len < CONN_BUF_SIZE / 4)) {
+        size_t cap = conn->recv_cap > 0 ? conn->recv_cap * 2 : CONN_BUF_SIZE;
+        if (large)
+            cap = conn->recv_need;
+
+        uint8_t* buf;
+        if (conn->recv_cap == 0 && cap == CONN_BUF_SIZE)
+            buf = reactor_take_buffer(conn->reactor);
+        else
+            buf = realloc(conn->recv_buf, cap);
+        if (buf == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->recv_buf = buf;
+        conn->recv_cap = cap;
+    }
+
+    size_t room = conn->recv_cap - conn->recv_len;
+    if (large && conn->recv_need - conn->recv_len < room)
+        room = conn->recv_need - conn->recv_len;
+
+    ssize_t n;
+    if (conn->tls != NULL)
+        n = tls_read(conn, conn->recv_buf + conn->recv_len, room);
+    else
+        n = recv(conn->conn_fd, conn->recv_buf + conn->recv_len, room, 0);
+    if (n > 0)
+        conn->recv_len += n;
+
+    return n;
+}
+
+/**
+ * @brief Drop bytes from the start of the receive buffer
+ *
+ * @param conn Connection struct
+ * @param len amount of bytes that were handled
+ */
+void conn_consume(Connection *conn, size_t len) {
+    if (len == 0)
+        return;
+
+    conn->recv_len -= len;
+    if (conn->recv_len > 0) {
+        memmove(conn->recv_buf, conn->recv_buf + len, conn->recv_len);
+        return;
+    }
+
+    // Don't keep the memory of a large frame around after it's handled,
+    // and don't keep a buffer at all while the connection is idle
+    if (conn->recv_cap > CONN_BUF_SIZE) {
+        free(conn->recv_buf);
+    } else if (conn->recv_cap == CONN_BUF_SIZE && conn->server->config.release_idle_buffers) {
+        reactor_give_buffer(conn->reactor, conn->recv_buf);
     } else {
-        data_len = LENGTH_BITS(buffer[1]);
+        return;
+    }
+    conn->recv_buf = NULL;
+    conn->recv_cap = 0;
+}
+
+/**
+ * @brief Ask the reactor to flush the connection unless it's already asked
+ *
+ * Senders that find the connection already in the flush list don't touch
+ * the reactor at all, so a burst of sends costs a single wake up.
+ *
+ * @param conn Connection struct
+ */
+static void schedule_flush(Connection *conn) {
+    if (!__atomic_exchange_n(&conn->flush_pending, true, __ATOMIC_ACQ_REL))
+        reactor_schedule_flush(conn);
+}
+
+/**
+ * @brief Push the chunk to the inbox of the connection
+ *
+ * @param conn Connection struct
+ * @param chunk the chunk, the connection owns it after this
+ */
+static void push_chunk(Connection *conn, OutChunk *chunk) {
+    __atomic_add_fetch(&conn->out_bytes, chunk->len, __ATOMIC_RELAXED);
+    metrics_add(METRIC_QUEUED_BYTES, chunk->len);
+    metrics_add(METRIC_QUEUED_CHUNKS, 1);
+
+    OutChunk* head = __atomic_load_n(&conn->inbox, __ATOMIC_RELAXED);
+    do {
+        chunk->next = head;
+    } while (!__atomic_compare_exchange_n(&conn->inbox, &head, chunk, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    schedule_flush(conn);
+}
+
+/**
+ * @brief Add the chunk to the send queue unless the connection is closed
+ *
+ * @param conn Connection struct
+ * @param chunk the chunk, freed if it can't be queued
+ * @return int 0 if success, -1 if the connection is closed
+ */
+static int queue_chunk(Connection *conn, OutChunk *chunk) {
+    if (conn_state(conn) == CONN_CLOSED) {
+        free_chunk(chunk);
+        return -1;
+    }
+    push_chunk(conn, chunk);
+    return 0;
+}
+
+/**
+ * @brief Copy the bytes to the send queue
+ *
+ * @param conn Connection struct
+ * @param data the bytes
+ * @param len amount of bytes
+ * @return int 0 if success, -1 if the connection is closed
+ */
+int conn_queue(Connection *conn, const void *data, size_t len) {
+    if (len == 0)
+        return 0;
+
+    OutChunk* chunk = alloc_chunk(len);
+    if (chunk == NULL)
+        return -1;
+    memcpy(chunk->data, data, len);
+
+    return queue_chunk(conn, chunk);
+}
+
+/**
+ * @brief Add the file to the send queue
+ *
+ * The file content is moved to the socket with sendfile so it never
+ * goes through user space.
+ *
+ * @param conn Connection struct
+ * @param fd the file, the queue closes it when it's sent
+ * @param len amount of bytes sent from the start of the file
+ * @return int 0 if success, -1 if the connection is closed
+ */
+int conn_queue_file(Connection *conn, int fd, uint64_t len) {
+    if (len == 0) {
+        close(fd);
+        return 0;
+    }
+
+    OutChunk* chunk = alloc_chunk(0);
+    if (chunk == NULL) {
+        close(fd);
+        return -1;
+    }
+    chunk->file_fd = fd;
+    chunk->len = len;
+
+    return queue_chunk(conn, chunk);
+}
+
+// Most iovecs given to a single sendmsg, each chunk takes one or two
+#define FLUSH_IOV_MAX 64
+
+/**
+ * @brief Move the inbox to the end of the send queue in the sending order
+ *
+ * @param conn Connection struct
+ */
+static void take_inbox(Connection *conn) {
+    OutChunk* chunk = __atomic_exchange_n(&conn->inbox, NULL, __ATOMIC_ACQUIRE);
+    OutChunk* head = NULL;
+    OutChunk* tail = chunk;
+
+    // The inbox is newest first
+    while (chunk != NULL) {
+        OutChunk* next = chunk->next;
+        chunk->next = head;
+        head = chunk;
+        chunk = next;
+    }
+
+    if (head == NULL)
+        return;
+    if (conn->out_tail != NULL)
+        conn->out_tail->next = head;
+    else
+        conn->out_head = head;
+    conn->out_tail = tail;
+}
+
+/**
+ * @brief Add the unsent bytes of a memory chunk to the iovecs
+ *
+ * @param chunk the chunk
+ * @param iov room for two iovecs
+ * @return int amount of iovecs used
+ */
+static int chunk_iov(OutChunk *chunk, struct iovec *iov) {
+    int count = 0;
+
+    if (chunk->sent < chunk->inline_len) {
+        iov[count].iov_base = chunk->data + chunk->sent;
+        iov[count].iov_len = chunk->inline_len - chunk->sent;
+        count++;
+    }
+    if (chunk->ext_data != NULL) {
+        uint64_t ext_sent = chunk->sent > chunk->inline_len ? chunk->sent - chunk->inline_len : 0;
+        iov[count].iov_base = (uint8_t*)chunk->ext_data + ext_sent;
+        iov[count].iov_len = chunk->len - chunk->inline_len - ext_sent;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Mark bytes from the start of the send queue as written
+ *
+ * @param conn Connection struct
+ * @param n amount of bytes written
+ */
+static void consume_output(Connection *conn, size_t n) {
+    __atomic_sub_fetch(&conn->out_bytes, n, __ATOMIC_RELAXED);
+    metrics_add(METRIC_QUEUED_BYTES, -(int64_t)n);
+
+    while (n > 0) {
+        OutChunk* chunk = conn->out_head;
+        uint64_t left = chunk->len - chunk->sent;
+        uint64_t used = n < left ? n : left;
+
+        chunk->sent += used;
+        n -= used;
+        if (chunk->sent < chunk->len)
+            break;
+
+        conn->out_head = chunk->next;
+        if (conn->out_head == NULL)
+            conn->out_tail = NULL;
+        if (chunk->closing)
+            conn->close_sent = true;
+        metrics_add(METRIC_QUEUED_CHUNKS, -1);
+        free_chunk(chunk);
+    }
+}
+
+/**
+ * @brief Write the send queue to the socket, called by the reactor
+ *
+ * Everything sent from any thread before the call is written, in the order
+ * it was sent. Consecutive memory chunks go to the socket with a single
+ * sendmsg, so a burst of small frames costs one system call and the kernel
+ * can put them in the same packets. Without kernel TLS the TLS connections
+ * write a record at a time, gathered the same way.
+ *
+ * @param conn Connection struct
+ * @return int 1 if the queue is empty, 0 if the socket is full and -1 if
+ * the connection is broken
+ */
+int conn_flush(Connection *conn) {
+    bool user_tls = conn->tls != NULL && !conn->ktls_send;
+
+    take_inbox(conn);
+
+    while (conn->out_head != NULL) {
+        // A sender lost the race with the close frame
+        if (conn->close_sent) {
+            free_queue(conn);
+            return 1;
+        }
+
+        OutChunk* chunk = conn->out_head;
+        size_t wanted = 0;
+        ssize_t n;
+
+        if (chunk->file_fd == -1) {
+            struct iovec iov[FLUSH_IOV_MAX];
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 0 };
+
+            // Gather the memory chunks up to the next file or the close frame
+            OutChunk* next = chunk;
+            while (next != NULL && next->file_fd == -1 && msg.msg_iovlen + 2 <= FLUSH_IOV_MAX) {
+                int count = chunk_iov(next, iov + msg.msg_iovlen);
+                for (int i = 0; i < count; i++)
+                    wanted += iov[msg.msg_iovlen + i].iov_len;
+                msg.msg_iovlen += count;
+                bool closing = next->closing;
+                next = next->next;
+                if (closing)
+                    break;
+            }
+
+            if (user_tls) {
+                n = tls_send(conn, iov, msg.msg_iovlen);
+                if (wanted > TLS_RECORD_SIZE)
+                    wanted = TLS_RECORD_SIZE;
+            } else {
+                // Let the kernel merge the batch with the next one
+                int flags = MSG_NOSIGNAL | (next != NULL ? MSG_MORE : 0);
+                n = sendmsg(conn->conn_fd, &msg, flags);
+            }
+        } else {
+            off_t offset = chunk->sent;
+            wanted = chunk->len - chunk->sent;
+            if (user_tls) {
+                n = tls_sendfile(conn, chunk->file_fd, chunk->sent, wanted);
+                if (wanted > TLS_RECORD_SIZE)
+                    wanted = TLS_RECORD_SIZE;
+            } else {
+                n = sendfile(conn->conn_fd, chunk->file_fd, &offset, wanted);
+            }
+            // The file got shorter, so the response can't be completed
+            if (n == 0)
+                return -1;
+        }
+
+        metrics_add(METRIC_WRITE_CALLS, 1);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        consume_output(conn, n);
+
+        // A short write means the socket buffer is full, EPOLLOUT tells
+        // when there is room again
+        if ((size_t)n < wanted)
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Close the connection after the queued output is written
+ *
+ * @param conn Connection struct
+ */
+void conn_shutdown(Connection *conn) {
+    if (conn_state(conn) == CONN_CLOSED)
+        return;
+    set_conn_state(conn, CONN_CLOSING);
+    // The flush closes the socket once the queue is empty
+    schedule_flush(conn);
+}
+
+/**
+ * @brief Add a framed chunk to the send queue
+ *
+ * @param conn Connection struct
+ * @param chunk the frame, the queue owns it after this
+ * @param closing true if this is the close frame
+ * @param close_code the code of the close frame
+ * @return int 0 if success, -1 if the connection isn't open
+ */
+static int queue_frame(Connection *conn, OutChunk *chunk, bool closing, int close_code) {
+    uint8_t control = chunk->inline_len > 0 ? chunk->data[0] : chunk->ext_data[0];
+    uint64_t total_len = chunk->len;
+
+    if (closing) {
+        // Only one close frame is sent, the thread that moves the state
+        // to closing sends it
+        ConnState expected = CONN_WEBSOCKET;
+        if (!__atomic_compare_exchange_n(&conn->state, &expected, CONN_CLOSING, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free_chunk(chunk);
+            return -1;
+        }
+        __atomic_store_n(&conn->close_code, close_code, __ATOMIC_RELAXED);
+        chunk->closing = true;
+    } else if (conn_state(conn) != CONN_WEBSOCKET) {
+        // Nothing can be sent after the close frame. A frame that passes
+        // this while another thread closes is dropped by conn_flush
+        free_chunk(chunk);
+        return -1;
+    }
+
+    push_chunk(conn, chunk);
+    metrics_frame_out(OP_CODE(control), total_len);
+    return 0;
+}
+
+/**
+ * @brief Frame the payload and add it to the send queue
+ *
+ * @param conn Connection struct
+ * @param control the control byte of the frame
+ * @param data the payload
+ * @param len length of the payload
+ * @param closing true if this is the close frame
+ * @param close_code the code of the close frame
+ * @return int 0 if success, -1 if the connection isn't open
+ */
+static int send_frame(Connection *conn, uint8_t control, const uint8_t *data,
+                      size_t len, bool closing, int close_code) {
+    Dataframe frame;
+
+    init_dataframe(&frame);
+    frame.control = control;
+    set_data_length(&frame, len);
+
+    // The header is at most 14 bytes
+    OutChunk* chunk = alloc_chunk(len + 14);
+    if (chunk == NULL)
+        return -1;
+    uint64_t header_len = get_frame_header(&frame, chunk->data);
+    if (len > 0)
+        memcpy(chunk->data + header_len, data, len);
+    chunk->len = frame.total_len;
+    chunk->inline_len = frame.total_len;
+
+    return queue_frame(conn, chunk, closing, close_code);
+}
+
+/**
+ * @brief Send a message to the client
+ *
+ * The payload is copied, so the caller can reuse the buffer right away.
+ *
+ * @param conn the connection
+ * @param type WS_TEXT or WS_BINARY
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if the message was queued, -1 if the connection isn't open
+ */
+int ws_send(WebSocketConn *conn, WebSocketMessageType type, const uint8_t *data, size_t len) {
+    return send_frame(conn, 0x80 | type, data, len, false, 0);
+}
+
+/**
+ * @brief Send a message without copying the payload
+ *
+ * Only the frame header is stored in the send queue, the payload is
+ * written to the socket straight from data. free_fn is called with arg
+ * once the payload is written, or right away if the message can't be
+ * queued, so the caller gives up the buffer in every case.
+ *
+ * @param conn the connection
+ * @param type WS_TEXT or WS_BINARY
+ * @param data the payload, must stay valid until free_fn is called
+ * @param len length of the payload
+ * @param free_fn called when the payload isn't needed anymore, can be NULL
+ * @param arg argument of free_fn
+ * @return int 0 if the message was queued, -1 if the connection isn't open
+ */
+int ws_send_buffer(WebSocketConn *conn, WebSocketMessageType type, const uint8_t *data,
+                   size_t len, void (*free_fn)(void *arg), void *arg) {
+    Dataframe frame;
+
+    init_dataframe(&frame);
+    frame.control = 0x80 | type;
+    set_data_length(&frame, len);
+
+    OutChunk* chunk = alloc_chunk(14);
+    if (chunk == NULL) {
+        if (free_fn != NULL)
+            free_fn(arg);
+        return -1;
     }
+    chunk->inline_len = get_frame_header(&frame, chunk->data);
+    chunk->len = frame.total_len;
+    chunk->ext_data = len > 0 ? data : NULL;
+    chunk->free_fn = free_fn;
+    chunk->free_arg = arg;
+
+    return queue_frame(conn, chunk, false, 0);
+}
 
-    // Read the mask bytes if there is any
-    if (MASK_BIT(buffer[1])) {
-        frame_length += 4;
-        buffer = realloc(buffer, sizeof(uint8_t) * frame_length);
-        // Read the four mask bytes
-        recv(conn->conn_fd, buffer + ptr, sizeof(uint8_t) * 4, 0);
-        // Move the pointer
-        ptr += 4;
+/**
+ * @brief Send a frame that is already framed, without copying it
+ *
+ * Server frames are not masked, so the same frame bytes can be queued to
+ * any amount of connections.
+ *
+ * @param conn Connection struct
+ * @param frame the whole frame, must stay valid until free_fn is called
+ * @param len length of the frame
+ * @param free_fn called when the frame isn't needed anymore, can be NULL
+ * @param arg argument of free_fn
+ * @return int 0 if the frame was queued, -1 if the connection isn't open
+ */
+int conn_queue_frame(Connection *conn, const uint8_t *frame, size_t len,
+                     void (*free_fn)(void *arg), void *arg) {
+    OutChunk* chunk = alloc_chunk(0);
+    if (chunk == NULL) {
+        if (free_fn != NULL)
+            free_fn(arg);
+        return -1;
     }
+    chunk->len = len;
+    chunk->ext_data = frame;
+    chunk->free_fn = free_fn;
+    chunk->free_arg = arg;
 
-    // Finally add the data_length to frame_length and allocate memory for it
-    frame_length += data_len;
-    buffer = realloc(buffer, sizeof(uint8_t) * frame_length);
-    // Then read the rest of the frame i.e. the data bytes
-    recv(conn->conn_fd, buffer + ptr, sizeof(uint8_t) * data_len, 0);
+    return queue_frame(conn, chunk, false, 0);
+}
 
-    // Retun the pointer to the data
-    return buffer;
+static void free_buffer_arg(void *arg) {
+    ws_buffer_free(arg);
+}
+
+/**
+ * @brief Send a received buffer without copying it
+ *
+ * @param conn the connection
+ * @param type WS_TEXT or WS_BINARY
+ * @param buffer the buffer, freed after it's written
+ * @return int 0 if the message was queued, -1 if the connection isn't open
+ */
+int ws_send_owned(WebSocketConn *conn, WebSocketMessageType type, WebSocketBuffer *buffer) {
+    return ws_send_buffer(conn, type, buffer->data, buffer->len, free_buffer_arg, buffer);
 }
 
 /**
- * @brief send the close signal to client
+ * @brief Send a value encoded with the codec of the connection
  *
- * @param client client file descriptor
- * @return int -1 to signal the end of the connection
+ * The codec encodes straight to the payload of the frame in the send
+ * queue, so the message is written to memory only once.
+ *
+ * @param conn the connection
+ * @param value the value, only read during the call
+ * @return int 0 if the message was queued, -1 if the connection isn't open
+ * or has no codec
  */
-static int close_socket(Connection *conn) {
+int ws_send_value(WebSocketConn *conn, const void *value) {
+    const WebSocketCodec* codec = conn->codec;
+    if (codec == NULL || codec->encode == NULL)
+        return -1;
+
+    size_t len = codec->encoded_len(value);
     Dataframe frame;
-    uint8_t* data_bytes;
-    // Init the frame
+
     init_dataframe(&frame);
+    frame.control = 0x80 | codec->type;
+    set_data_length(&frame, len);
 
-    // When sending a close frame. It has to be the last frame
-    set_as_last_frame(&frame);
+    // The header is at most 14 bytes
+    OutChunk* chunk = alloc_chunk(len + 14);
+    if (chunk == NULL)
+        return -1;
+    uint64_t header_len = get_frame_header(&frame, chunk->data);
+    codec->encode(value, chunk->data + header_len);
+    chunk->len = frame.total_len;
+    chunk->inline_len = frame.total_len;
 
-    // We want close the frame
-    set_op_code(&frame, CLOSE_FRAME);
+    return queue_frame(conn, chunk, false, 0);
+}
 
-    // Set close message we want to send
-    // 2 first bytes are the close code. and the rest is the message
-    set_data(&frame, (uint8_t*)"\0\1Close Socket!", 15);
+/**
+ * @brief Free a buffer given to on_binary
+ *
+ * @param buffer the buffer
+ */
+void ws_buffer_free(WebSocketBuffer *buffer) {
+    free(buffer->base);
+    free(buffer);
+}
 
-    // Get the frame as a byte array
-    data_bytes = get_frame_bytes(&frame);
+/**
+ * @brief Start the closing handshake
+ *
+ * The socket is closed when the close frame is written.
+ *
+ * @param conn the connection
+ * @param code the close code, like 1000
+ * @param reason text sent with the code, can be NULL
+ * @return int 0 if success, -1 if the connection is already closing
+ */
+int ws_close(WebSocketConn *conn, uint16_t code, const char *reason) {
+    // Control frame payload can't be longer than 125 bytes
+    uint8_t payload[125];
+    size_t reason_len = reason != NULL ? strlen(reason) : 0;
 
-    // Send the actual data to client
-    send(conn->conn_fd, data_bytes, frame.total_len, 0);
+    if (reason_len > sizeof(payload) - 2)
+        reason_len = sizeof(payload) - 2;
 
-    // Free the mallocs
-    free_dataframe(&frame);
-    free(data_bytes);
-    // Return -1 to signal the end of the socket connection
-    return -1;
+    payload[0] = (uint8_t)(code >> 8);
+    payload[1] = (uint8_t)code;
+    memcpy(payload + 2, reason, reason_len);
+
+    return send_frame(conn, 0x80 | CLOSE_FRAME, payload, reason_len + 2, true, code);
 }
 
 /**
- * @brief echo the frame back to the client
+ * @brief Ask for on_writable when everything queued so far is written
  *
- * @param client client file descriptor
- * @param Dataframe pointer to frame you want to send
- * @return int 1 to signal that connection keeps on going
+ * @param conn the connection
  */
-static int echo_frame(Connection *conn, Dataframe *frame) {
-    Dataframe echo;
-    uint8_t* echo_buf;
+void ws_request_writable(WebSocketConn *conn) {
+    __atomic_store_n(&conn->writable_requested, true, __ATOMIC_RELEASE);
+    if (conn_state(conn) != CONN_CLOSED)
+        schedule_flush(conn);
+}
 
-    // Init the echo frame
-    init_dataframe(&echo);
+/**
+ * @brief Get the amount of bytes queued but not yet written to the socket
+ *
+ * @param conn the connection
+ * @return size_t amount of bytes
+ */
+size_t ws_buffered_amount(WebSocketConn *conn) {
+    return __atomic_load_n(&conn->out_bytes, __ATOMIC_RELAXED);
+}
 
-    // We currently want to frame only a one frame
-    set_as_last_frame(&echo);
+/**
+ * @brief Keep the connection struct alive after on_close
+ *
+ * Needed when other threads may still send to the connection. The sends
+ * fail once the connection is closed.
+ *
+ * @param conn the connection
+ */
+void ws_retain(WebSocketConn *conn) {
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+}
 
-    // Only the text frame is supported
-    set_op_code(&echo, TEXT_FRAME);
+/**
+ * @brief Release a reference taken with ws_retain
+ *
+ * @param conn the connection, freed when the last reference is gone
+ */
+void ws_release(WebSocketConn *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    free_queue(conn);
+    free(conn->recv_buf);
+    free(conn->message);
+    free(conn->path);
+    free(conn);
+}
+
+void ws_set_user_data(WebSocketConn *conn, void *data) {
+    conn->user_data = data;
+}
+
+void* ws_get_user_data(WebSocketConn *conn) {
+    return conn->user_data;
+}
 
-    // Copy message data from recieved frame
-    set_data(&echo, frame->data, frame->data_length);
+WebSocketServer* ws_get_server(WebSocketConn *conn) {
+    return conn->server;
+}
 
-    // Get bytes from frame and send it
-    echo_buf = get_frame_bytes(&echo);
-    send(conn->conn_fd, echo_buf, echo.total_len, 0);
+WebSocketHandle ws_get_handle(WebSocketConn *conn) {
+    return conn->handle;
+}
 
-    // free the mallocs
-    free(echo_buf);
-    free_dataframe(&echo);
+const char* ws_get_path(WebSocketConn *conn) {
+    return conn->path;
+}
 
+/**
+ * @brief Get the subprotocol picked in the handshake
+ *
+ * @param conn the connection
+ * @return const char* name of the codec or NULL if the connection has none
+ */
+const char* ws_get_protocol(WebSocketConn *conn) {
+    return conn->codec != NULL ? conn->codec->name : NULL;
+}
+
+/**
+ * @brief Get the process, user and group of a client on a Unix domain
+ * socket
+ *
+ * The kernel recorded them when the client connected, so they can't be
+ * forged by the client. A client whose credentials can't be read is
+ * closed before it gets a connection.
+ *
+ * @param conn the connection
+ * @param cred set to the credentials
+ * @return int 1 if success, 0 if the client came through TCP
+ */
+int ws_get_peer_cred(WebSocketConn *conn, WebSocketPeerCred *cred) {
+    if (!conn->local)
+        return 0;
+    *cred = conn->cred;
     return 1;
 }
 
-static int handle_frame(Connection *conn, Dataframe *frame) {
-    // return -1 if we dont want to close the connection
-    int return_val = 1;
+/**
+ * @brief Find the open connection of the handle
+ *
+ * Takes O(1) and never blocks the reactors.
+ *
+ * @param wss the server
+ * @param handle handle from ws_get_handle
+ * @return WebSocketConn* the connection with a reference the caller
+ * releases with ws_release, NULL if the connection is closed
+ */
+WebSocketConn* ws_lookup(WebSocketServer *wss, WebSocketHandle handle) {
+    uint64_t epoch = registry_read_begin(wss->registry);
+    Connection* conn = registry_get(wss->registry, handle);
+    if (conn != NULL)
+        ws_retain(conn);
+    registry_read_end(wss->registry, epoch);
+    return conn;
+}
+
+/**
+ * @brief Call fn for every open websocket connection
+ *
+ * The connections are walked in the order of their slots without locks, so
+ * connections can open and close meanwhile. Those may or may not be seen,
+ * every other connection is seen once. The connection is valid while fn
+ * runs, fn takes a reference with ws_retain to keep it longer.
+ *
+ * @param wss the server
+ * @param fn called with every connection
+ * @param arg given to fn
+ * @return size_t amount of connections fn was called with
+ */
+size_t ws_for_each(WebSocketServer *wss, void (*fn)(WebSocketConn *conn, void *arg), void *arg) {
+    Registry* registry = wss->registry;
+    size_t count = 0;
+
+    uint64_t epoch = registry_read_begin(registry);
+    uint32_t high_water = __atomic_load_n(&registry->high_water, __ATOMIC_ACQUIRE);
+
+    for (uint32_t page = 0; page << REGISTRY_PAGE_SHIFT < high_water; page++) {
+        RegistrySlot* slots = __atomic_load_n(&registry->pages[page], __ATOMIC_ACQUIRE);
+        uint32_t end = high_water - (page << REGISTRY_PAGE_SHIFT);
+        if (end > REGISTRY_PAGE_SIZE)
+            end = REGISTRY_PAGE_SIZE;
+
+        for (uint32_t i = 0; i < end; i++) {
+            Connection* conn = __atomic_load_n(&slots[i].conn, __ATOMIC_ACQUIRE);
+            if (conn == NULL)
+                continue;
+            fn(conn, arg);
+            count++;
+        }
+    }
 
-    printf("Handle frame op code: %02x\n", OP_CODE(frame->control));
+    registry_read_end(registry, epoch);
+    return count;
+}
 
-    switch (OP_CODE(frame->control)) {
+/**
+ * @brief Get the amount of open websocket connections
+ *
+ * @param wss the server
+ * @return size_t amount of connections
+ */
+size_t ws_connection_count(WebSocketServer *wss) {
+    return __atomic_load_n(&wss->registry->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Switch the connection to websocket after the handshake response
+ *
+ * @param conn Connection struct
+ */
+void open_websocket(Connection *conn) {
+    set_conn_state(conn, CONN_WEBSOCKET);
+
+    conn->upgraded = true;
+    conn->capture_id = capture_connection_open();
+    if (!registry_add(conn->server->registry, conn))
+        LOG_WARN("Connection registry is full");
+
+    WebSocketServer* wss = conn->server;
+    if (wss->handler.on_open != NULL)
+        wss->handler.on_open(wss, conn);
+}
+
+/**
+ * @brief Give a complete message to the application
+ *
+ * @param conn Connection struct
+ * @param opcode TEXT_FRAME or BIN_FRAME
+ * @param data the payload
+ * @param len length of the payload
+ */
+static void deliver_message(Connection *conn, uint8_t opcode, const uint8_t *data, size_t len) {
+    WebSocketServer* wss = conn->server;
+    if (conn->codec != NULL)
+        conn->codec->decode(wss, conn, (WebSocketMessageType)opcode, data, len);
+    else if (wss->handler.on_message != NULL)
+        wss->handler.on_message(wss, conn, (WebSocketMessageType)opcode, data, len);
+}
+
+/**
+ * @brief Give a binary message to on_binary
+ *
+ * @param conn Connection struct
+ * @param base the allocation the application takes over
+ * @param data the payload inside base
+ * @param len length of the payload
+ */
+static void deliver_buffer(Connection *conn, void *base, uint8_t *data, size_t len) {
+    WebSocketServer* wss = conn->server;
+    WebSocketBuffer* buffer = malloc(sizeof(WebSocketBuffer));
+    if (buffer == NULL) {
+        free(base);
+        ws_close(conn, CLOSE_TOO_BIG, "Out of memory");
+        return;
+    }
+    buffer->base = base;
+    buffer->data = data;
+    buffer->len = len;
+    wss->handler.on_binary(wss, conn, buffer);
+}
+
+/**
+ * @brief Give a binary frame in the receive buffer to on_binary
+ *
+ * If the frame is the only thing in the buffer, the whole receive buffer
+ * is given away and a new one is allocated on the next read. Otherwise
+ * the payload is copied, which only happens to frames smaller than
+ * CONN_BUF_SIZE.
+ *
+ * @param conn Connection struct
+ * @param payload the payload in the receive buffer
+ * @param len length of the payload
+ * @param whole true if the frame fills the whole allocation of the
+ * receive buffer
+ */
+static void deliver_binary_frame(Connection *conn, uint8_t *payload, size_t len, bool whole) {
+    if (whole) {
+        void* base = conn->recv_buf;
+        conn->recv_buf = NULL;
+        conn->recv_len = 0;
+        conn->recv_cap = 0;
+        deliver_buffer(conn, base, payload, len);
+        return;
+    }
+
+    // malloc(0) may return NULL
+    uint8_t* copy = malloc(len > 0 ? len : 1);
+    if (copy == NULL) {
+        ws_close(conn, CLOSE_TOO_BIG, "Out of memory");
+        return;
+    }
+    memcpy(copy, payload, len);
+    deliver_buffer(conn, copy, copy, len);
+}
+
+/**
+ * @brief Add the fragment to the message that is being gathered
+ *
+ * @param conn Connection struct
+ * @param data the payload of the fragment
+ * @param len length of the payload
+ * @return int 1 if success, 0 if the message got too large
+ */
+static int append_fragment(Connection *conn, const uint8_t *data, size_t len) {
+    if (conn->message_len + len > MAX_MESSAGE_SIZE)
+        return 0;
+
+    uint8_t* message = realloc(conn->message, conn->message_len + len);
+    if (message == NULL && conn->message_len + len > 0)
+        return 0;
+
+    conn->message = message;
+    memcpy(conn->message + conn->message_len, data, len);
+    conn->message_len += len;
+    return 1;
+}
+
+/**
+ * @brief Check that the next part of a text message is UTF-8
+ *
+ * The connection is closed with 1007 if it isn't.
+ *
+ * @param conn Connection struct
+ * @param data the payload of the frame
+ * @param len length of the payload
+ * @param fin true if this is the last fragment of the message
+ * @return int 1 if the text is fine, 0 if the connection is closing
+ */
+static int check_text(Connection *conn, const uint8_t *data, size_t len, bool fin) {
+    if (!conn->server->config.validate_utf8)
+        return 1;
+
+    if (utf8_validate(&conn->utf8, data, len) && (!fin || utf8_complete(&conn->utf8)))
+        return 1;
+
+    ws_close(conn, CLOSE_INVALID_DATA, "Invalid UTF-8");
+    return 0;
+}
+
+/**
+ * @brief Check if a close frame may carry the code
+ *
+ * 1005, 1006 and 1015 are only for telling the application why the
+ * connection closed, they are never sent. Codes below 3000 that RFC 6455
+ * and the IANA registry don't define are reserved.
+ *
+ * @param code the close code
+ * @return bool true if the peer may send the code
+ */
+bool valid_close_code(int code) {
+    if (code >= 3000 && code <= 4999)
+        return true;
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014);
+}
+
+/**
+ * @brief Handle a single frame
+ *
+ * @param conn Connection struct
+ * @param frame the parsed frame header
+ * @param payload the unmasked payload in the receive buffer
+ * @param whole true if the frame fills the receive buffer, so the buffer
+ * can be given to the application
+ */
+static void handle_frame(Connection *conn, Dataframe *frame, uint8_t *payload, bool whole) {
+    uint8_t opcode = OP_CODE(frame->control);
+    bool fin = FIN_BIT(frame->control);
+    // The codec decodes from the receive buffer, the buffer isn't given away
+    bool owned = conn->server->handler.on_binary != NULL && conn->codec == NULL;
+
+    LOG_DEBUG("Handle frame op code: %02x", opcode);
+
+    switch (opcode) {
         case CONT_FRAME:
-            //TODO:
-            break;
-        case  TEXT_FRAME:
-            return_val = echo_frame(conn, frame);
+            // Continuation without a first fragment
+            if (conn->message_opcode == 0) {
+                ws_close(conn, CLOSE_PROTOCOL_ERROR, "Unexpected continuation");
+                break;
+            }
+            if (conn->message_opcode == TEXT_FRAME &&
+                !check_text(conn, payload, frame->data_length, fin))
+                break;
+            if (!append_fragment(conn, payload, frame->data_length)) {
+                ws_close(conn, CLOSE_TOO_BIG, "Message too big");
+                break;
+            }
+            if (fin && owned && conn->message_opcode == BIN_FRAME) {
+                // The gathered message is handed over as it is
+                uint8_t* message = conn->message;
+                size_t len = conn->message_len;
+                conn->message = NULL;
+                conn->message_len = 0;
+                conn->message_opcode = 0;
+                if (message == NULL)
+                    message = malloc(1);
+                if (message != NULL)
+                    deliver_buffer(conn, message, message, len);
+            } else if (fin) {
+                deliver_message(conn, conn->message_opcode, conn->message, conn->message_len);
+                free(conn->message);
+                conn->message = NULL;
+                conn->message_len = 0;
+                conn->message_opcode = 0;
+            }
             break;
+        case TEXT_FRAME:
         case BIN_FRAME:
-            //TODO:
+            // The previous message has to be finished first
+            if (conn->message_opcode != 0) {
+                ws_close(conn, CLOSE_PROTOCOL_ERROR, "Expected continuation");
+                break;
+            }
+            if (opcode == TEXT_FRAME) {
+                utf8_init(&conn->utf8);
+                if (!check_text(conn, payload, frame->data_length, fin))
+                    break;
+            }
+            if (fin && owned && opcode == BIN_FRAME) {
+                deliver_binary_frame(conn, payload, frame->data_length, whole);
+            } else if (fin) {
+                deliver_message(conn, opcode, payload, frame->data_length);
+            } else {
+                conn->message_opcode = opcode;
+                if (!append_fragment(conn, payload, frame->data_length))
+                    ws_close(conn, CLOSE_TOO_BIG, "Message too big");
+            }
             break;
-        case CLOSE_FRAME:
-            return_val = close_socket(conn);
+        case CLOSE_FRAME: {
+            if (frame->data_length == 1 ||
+                (frame->data_length >= 2 && !valid_close_code(payload[0] << 8 | payload[1]))) {
+                ws_close(conn, CLOSE_PROTOCOL_ERROR, "Invalid close code");
+                break;
+            }
+            // The reason after the code is text too
+            if (frame->data_length > 2) {
+                utf8_init(&conn->utf8);
+                if (!check_text(conn, payload + 2, frame->data_length - 2, true))
+                    break;
+            }
+            // Reply with the same code and close the socket after that
+            int code = frame->data_length >= 2 ? (payload[0] << 8 | payload[1]) : CLOSE_NO_STATUS;
+            send_frame(conn, 0x80 | CLOSE_FRAME, payload, frame->data_length >= 2 ? 2 : 0, true, code);
             break;
+        }
         case PING_FRAME:
-            //TODO:
+            send_frame(conn, 0x80 | PONG_FRAME, payload, frame->data_length, false, 0);
             break;
         case PONG_FRAME:
-            //TODO:
+            conn->is_alive = true;
             break;
         default:
-            //TODO: error maybe?
+            ws_close(conn, CLOSE_PROTOCOL_ERROR, "Unknown opcode");
             break;
     }
+}
+
+/**
+ * @brief Check that the frame follows the rules of RFC 6455
+ *
+ * @param frame the parsed frame header
+ * @return const char* reason of the error or NULL if the frame is fine
+ */
+static const char* check_frame(Dataframe *frame) {
+    uint8_t opcode = OP_CODE(frame->control);
 
-    // Remember to free the frame after its used
-    free_dataframe(frame);
-    return return_val;
+    // Client frames must be masked
+    if (!(frame->data_info >> 7))
+        return "Frame not masked";
+    // No extensions are negotiated, so the RSV bits must be zero
+    if (RSV_BITS(frame->control))
+        return "Reserved bits set";
+    // Control frames can't be fragmented and have at most 125 bytes
+    if (IS_CONTROL(opcode) && (!FIN_BIT(frame->control) || frame->data_length > 125))
+        return "Invalid control frame";
+
+    return NULL;
 }
 
-void handle_connection(Connection *conn) {
-    // Connection loop
-    // The connection thread dies after this loop breaks
-    for (;;) {
+/**
+ * @brief Handle every complete frame in the receive buffer
+ *
+ * The payload is unmasked in place and given to the application straight
+ * from the receive buffer, or as the receive buffer itself to on_binary.
+ *
+ * @param conn Connection struct
+ * @return size_t amount of frames handled
+ */
+size_t handle_frames(Connection *conn) {
+    size_t offset = 0;
+    size_t frames = 0;
+
+    conn->recv_need = 0;
+
+    while (conn_state(conn) == CONN_WEBSOCKET) {
+        uint8_t* data = conn->recv_buf + offset;
+        size_t available = conn->recv_len - offset;
         Dataframe frame;
-        uint8_t* frame_buf;
-        // Create frame from the input data
+
         init_dataframe(&frame);
-        frame_buf = read_frame(conn);
-        create_frame(&frame, frame_buf);
-        // create_frame copies the frame struct so we need to free it
-        free(frame_buf);
+        uint64_t header_len = read_frame_header(&frame, data, available);
+        if (header_len == 0)
+            break;
+
+        if (frame.data_length > MAX_MESSAGE_SIZE) {
+            ws_close(conn, CLOSE_TOO_BIG, "Message too big");
+            break;
+        }
+
+        // Wait until the whole frame is in the buffer
+        if (frame.total_len > available) {
+            conn->recv_need = frame.total_len;
+            break;
+        }
+
+        const char* error = check_frame(&frame);
+        if (error != NULL) {
+            ws_close(conn, CLOSE_PROTOCOL_ERROR, error);
+            break;
+        }
 
-        // -1 from handle_frame signals the end of the connection
-        if (handle_frame(conn, &frame) == -1)
+        uint8_t* payload = data + header_len;
+        mask_data(payload, frame.data_length, payload - 4);
+        bool whole = offset == 0 && frame.total_len == conn->recv_len &&
+                     conn->recv_len == conn->recv_cap;
+        offset += frame.total_len;
+
+        capture_frame(conn->capture_id, frame.control, payload, frame.data_length);
+        metrics_frame_in(OP_CODE(frame.control), frame.total_len);
+
+        uint64_t start = metrics_now_ns();
+        handle_frame(conn, &frame, payload, whole);
+        metrics_record(METRIC_FRAME_HANDLE_TIME, metrics_now_ns() - start);
+        frames++;
+
+        // The application took the receive buffer
+        if (conn->recv_buf == NULL) {
+            offset = 0;
             break;
+        }
     }
+
+    conn_consume(conn, offset);
+    return frames;
 }
 
 /**
- * @brief Close the socket and free the Connection struct
+ * @brief Close the socket and release the reactor's reference
+ *
+ * Called only by the reactor thread that owns the connection.
  *
  * @param conn Connection struct
  */
 void close_connection(Connection* conn) {
+    ConnState old_state = __atomic_exchange_n(&conn->state, CONN_CLOSED, __ATOMIC_ACQ_REL);
+    if (old_state == CONN_CLOSED)
+        return;
+
+    // Chunks pushed after this are freed with the connection
+    free_queue(conn);
+    int close_code = __atomic_load_n(&conn->close_code, __ATOMIC_RELAXED);
+
+    reactor_remove(conn);
+    tls_close(conn);
     close(conn->conn_fd);
+
+    if (conn->upgraded) {
+        if (conn->handle != 0)
+            registry_remove(conn->server->registry, conn);
+        pubsub_drop(conn);
+        if (conn->server->workers != NULL)
+            workers_connection_closed(conn);
+        capture_connection_close(conn->capture_id);
+        WebSocketServer* wss = conn->server;
+        if (wss->handler.on_close != NULL)
+            wss->handler.on_close(wss, conn, close_code);
+    } else {
+        metrics_add(METRIC_HANDSHAKES_PENDING, -1);
+        __atomic_sub_fetch(&conn->server->handshakes_pending, 1, __ATOMIC_RELAXED);
+    }
+
+    LOG_DEBUG("Connection closed");
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    ws_release(conn);
 }
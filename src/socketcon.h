@@ -2,15 +2,190 @@
 #define WEB_SOCKET_SOCKET_CON_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/types.h>
 
-typedef struct {
+#include "ratelimit.h"
+#include "server.h"
+#include "utf8.h"
+
+// Initial size of the per connection receive buffer
+#define CONN_BUF_SIZE 4096
+
+// Largest frame or reassembled message that is accepted
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+// Close codes, https://tools.ietf.org/html/rfc6455#section-7.4.1
+#define CLOSE_NORMAL 1000
+#define CLOSE_PROTOCOL_ERROR 1002
+#define CLOSE_NO_STATUS 1005
+#define CLOSE_ABNORMAL 1006
+#define CLOSE_INVALID_DATA 1007
+#define CLOSE_TOO_BIG 1009
+
+typedef enum {
+    // Reading http requests
+    CONN_HTTP,
+    // Upgraded to websocket
+    CONN_WEBSOCKET,
+    // The socket is closed after the queued output is written
+    CONN_CLOSING,
+    // The socket is closed, the struct lives until the last reference
+    // is released
+    CONN_CLOSED,
+} ConnState;
+
+// OutChunk is a piece of output waiting in the send queue
+typedef struct OutChunk {
+    struct OutChunk* next;
+    // File chunks are sent with sendfile from file_fd, -1 for memory chunks
+    int file_fd;
+    // Amount of bytes in the chunk
+    uint64_t len;
+    // Amount of bytes already sent, also the offset in the file
+    uint64_t sent;
+    // Amount of bytes in data, the rest of the chunk is in ext_data
+    uint64_t inline_len;
+    // Payload owned by the application, sent after data without copying
+    const uint8_t* ext_data;
+    // Called with free_arg when ext_data is not needed anymore
+    void (*free_fn)(void *arg);
+    void* free_arg;
+    // The close frame, nothing is sent after it
+    bool closing;
+    // The bytes of memory chunks, like the frame header
+    uint8_t data[];
+} OutChunk;
+
+typedef struct Connection {
     // conn_fd is the socket file descriptor
     int conn_fd;
     // is_alive is updated with ping-pong
     bool is_alive;
+    // state is read and changed with atomics. Only the reactor sets
+    // CONN_CLOSED, other threads can only move it to CONN_CLOSING
+    ConnState state;
+    // capture_id identifies the connection in the capture log, 0 if the
+    // capture is not on
+    uint32_t capture_id;
+    // opened_ns is the time the connection was accepted
+    uint64_t opened_ns;
+    // request_start_ns is the time the current http request started
+    uint64_t request_start_ns;
+    // last_active_ns is the time of the last read, used for idle timeouts
+    uint64_t last_active_ns;
+    // Amount of references. The reactor holds one until the connection
+    // is closed
+    int refs;
+    // The server and the reactor thread the connection belongs to
+    WebSocketServer* server;
+    struct Reactor* reactor;
+    // Application data set with ws_set_user_data
+    void* user_data;
+    // Handle in the registry, 0 if the connection isn't registered
+    uint64_t handle;
+    // Next connection waiting for the registry readers to leave
+    struct Connection* next_retired;
+    // The TLS session, NULL if the server doesn't use TLS
+    struct ssl_st* tls;
+    // Path of the upgrade request, NULL before the handshake
+    char* path;
+    // Codec of the subprotocol picked in the handshake, NULL if none
+    const WebSocketCodec* codec;
+    // Last sequence the client has seen, from the since query parameter of
+    // the upgrade request. Set only if resume is true
+    uint64_t resume_seq;
+    bool resume;
+
+    // recv_buf holds the bytes read from the socket that are not consumed yet.
+    // It's allocated on the first read and grows to fit the largest frame
+    uint8_t* recv_buf;
+    // Amount of bytes in recv_buf
+    size_t recv_len;
+    // Size of recv_buf
+    size_t recv_cap;
+    // Amount of bytes the next frame or request needs in the buffer
+    size_t recv_need;
+
+    // Fragments of the current message are gathered here
+    uint8_t* message;
+    size_t message_len;
+    // Opcode of the first fragment, 0 if there is no fragmented message
+    uint8_t message_opcode;
+    // UTF-8 state of the text message, carried over the fragments
+    Utf8State utf8;
+    // Close code sent by the client
+    int close_code;
+
+    // Any thread can send without locks. The senders push chunks to the
+    // inbox, newest first, and the reactor takes the whole inbox at once
+    OutChunk* inbox;
+    // Amount of queued bytes that are not written yet
+    uint64_t out_bytes;
+    // True while the connection is in the flush list of the reactor
+    bool flush_pending;
+    // True if on_writable should be called when the queue is empty
+    bool writable_requested;
+
+    // Only the reactor thread touches these
+    // Output taken from the inbox, oldest first
+    OutChunk* out_head;
+    OutChunk* out_tail;
+    // The close frame is written, so the rest of the output is dropped
+    bool close_sent;
+    // True while the reactor waits for EPOLLOUT
+    bool want_write;
+    // The peer closed its side, nothing more is read
+    bool read_closed;
+    // The handshake is done and on_open was called
+    bool upgraded;
+    // The TLS handshake is done
+    bool tls_ready;
+    // Kernel TLS encrypts the output, so it's written to the socket as is
+    bool ktls_send;
+    // The TLS handshake waits for the socket to be writable
+    bool tls_want_write;
+    // Links of the reactor lists
+    struct Connection* next;
+    struct Connection* prev;
+    struct Connection* next_flush;
+    // Link of the reactor's delayed flush list
+    struct Connection* next_delayed;
+    // Time the delayed output must be written, 0 if it's not delayed
+    uint64_t flush_deadline_ns;
+    // Inbound limits, see conn_message_rate and conn_byte_rate
+    TokenBucket message_bucket;
+    TokenBucket byte_bucket;
+    // Client address for the per address limits, ipv4 mapped to ipv6.
+    // The clients on a Unix domain socket are keyed with their user id
+    uint8_t peer[16];
+    // The client came through a Unix domain socket, cred is set
+    bool local;
+    WebSocketPeerCred cred;
+    // The socket isn't read until this time because the client went over
+    // a limit, 0 if reading isn't paused
+    uint64_t paused_until_ns;
+    // Link of the reactor's paused list
+    struct Connection* next_paused;
+    // Topics the connection is subscribed to
+    struct Subscription* subscriptions;
 } Connection;
 
-void handle_connection(Connection *conn);
+void init_connection(Connection *conn, int conn_fd, WebSocketServer *wss);
+ConnState conn_state(Connection *conn);
+void set_conn_state(Connection *conn, ConnState state);
+ssize_t conn_fill(Connection *conn);
+void conn_consume(Connection *conn, size_t len);
+int conn_queue(Connection *conn, const void *data, size_t len);
+int conn_queue_file(Connection *conn, int fd, uint64_t len);
+int conn_queue_frame(Connection *conn, const uint8_t *frame, size_t len,
+                     void (*free_fn)(void *arg), void *arg);
+int conn_flush(Connection *conn);
+void conn_shutdown(Connection *conn);
+void open_websocket(Connection *conn);
+size_t handle_frames(Connection *conn);
+bool valid_close_code(int code);
 void close_connection(Connection *conn);
 
 #endif
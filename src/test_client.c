@@ -1,39 +1,537 @@
+/**
+ * Load generator and latency benchmark for the websocket server
+ *
+ * Opens N websocket connections from a few threads and sends text frames
+ * at the target rate. Every payload starts with the time the message was
+ * scheduled to be sent, so when the message comes back (echo) or is fanned
+ * out to the other connections (broadcast) the latency is measured from
+ * the schedule and stalls of the sender are not hidden.
+ *
+ * The results are printed to stdout as json.
+ *
+ * Usage: client [-H host] [-p port] [-c connections] [-t threads]
+ *               [-r rate] [-s size] [-d seconds] [-w seconds]
+ *               [-m echo|broadcast] [-P publishers]
+ */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
-#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-int main(void) {
-    struct sockaddr_in sa;
+#include "client.h"
+#include "dataframe.h"
+#include "histogram.h"
+
+// Payload starts with 16 hex chars of timestamp and 8 hex chars of sender id
+#define PAYLOAD_HEADER 24
+
+// Smallest message that fits the payload header
+#define MIN_MESSAGE_SIZE 32
+
+// Size of the read buffer of each connection
+#define READ_BUF_SIZE (64 * 1024)
+
+typedef enum {
+    // Every connection sends and gets its own messages back
+    MODE_ECHO,
+    // Publishers send and every connection receives
+    MODE_BROADCAST,
+} Mode;
 
-    int SocketFD;
+typedef struct {
+    const char* host;
+    uint16_t port;
+    int connections;
+    int threads;
+    // Messages per second for the whole run, 0 means as fast as possible
+    double rate;
+    size_t size;
+    double duration;
+    double warmup;
+    Mode mode;
+    int publishers;
+} Options;
 
-    SocketFD = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (SocketFD == -1) {
-        perror("cannot create socket");
-        exit(EXIT_FAILURE);
+typedef struct {
+    int fd;
+    // Global id of the connection, used as the sender id
+    uint32_t id;
+    bool publisher;
+    // In closed loop mode publisher waits for its own message before
+    // sending the next one
+    bool waiting;
+    // Bytes received but not parsed yet
+    uint8_t* rx;
+    size_t rx_len;
+    size_t rx_cap;
+    // Bytes queued but not sent yet
+    uint8_t* tx;
+    size_t tx_len;
+    size_t tx_cap;
+    bool want_write;
+} LoadConn;
+
+typedef struct {
+    pthread_t thread;
+    const Options* opts;
+    int first_conn;
+    int conn_count;
+    LoadConn* conns;
+    int epfd;
+    // xorshift state for the mask keys, never 0
+    uint64_t rng;
+    // Nothing is counted before the warmup is over
+    uint64_t warm_end;
+    // Results
+    Histogram latency;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;
+} Worker;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Parse 'len' hex chars to int
+ */
+static uint64_t parse_hex(const uint8_t* data, int len) {
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
     }
+    return value;
+}
 
-    memset(&sa, 0, sizeof sa);
+/**
+ * @brief Next mask key from the xorshift64* generator of the worker
+ *
+ * rand() takes a global lock on every call, which the worker threads
+ * would fight over for every message.
+ */
+static uint32_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
 
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(8888);
-    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+static void reserve(uint8_t** buf, size_t* len, size_t* cap, size_t amount) {
+    if (*len + amount > *cap) {
+        while (*len + amount > *cap)
+            *cap = *cap ? *cap * 2 : 4096;
+        *buf = realloc(*buf, *cap);
+    }
+}
+
+static void set_write_interest(Worker *w, LoadConn *conn, bool want) {
+    if (conn->want_write == want)
+        return;
+    conn->want_write = want;
+    struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = conn };
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
 
-    if (connect(SocketFD, (struct sockaddr *)&sa, sizeof sa) == -1) {
-        perror("connect failed");
-        close(SocketFD);
-        exit(EXIT_FAILURE);
+static void flush_conn(Worker *w, LoadConn *conn) {
+    size_t done = 0;
+    while (done < conn->tx_len) {
+        ssize_t n = send(conn->fd, conn->tx + done, conn->tx_len - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                w->errors++;
+            break;
+        }
+        done += n;
     }
+    memmove(conn->tx, conn->tx + done, conn->tx_len - done);
+    conn->tx_len -= done;
+    set_write_interest(w, conn, conn->tx_len > 0);
+}
+
+/**
+ * @brief Build a masked text frame with the timestamp header and queue it
+ *
+ * The frame is written straight to the send buffer and the payload is
+ * masked in place there.
+ *
+ * @param w the worker owning the connection
+ * @param conn the connection
+ * @param scheduled the time the message was supposed to be sent
+ */
+static void send_message(Worker *w, LoadConn *conn, uint64_t scheduled) {
+    const Options* opts = w->opts;
+    Dataframe frame;
+
+    init_dataframe(&frame);
+    set_as_last_frame(&frame);
+    set_op_code(&frame, TEXT_FRAME);
+    // Client frames must always be masked
+    set_mask_key(&frame, next_random(&w->rng));
+    set_data_length(&frame, opts->size);
 
-    write(SocketFD, "Hello socket world!", 20);
+    // The header is at most 14 bytes
+    reserve(&conn->tx, &conn->tx_len, &conn->tx_cap, opts->size + 14);
+    uint8_t* out = conn->tx + conn->tx_len;
+    uint8_t* payload = out + get_frame_header(&frame, out);
 
-    shutdown(SocketFD, SHUT_RDWR);
+    // The nul of snprintf is overwritten by the filler
+    snprintf((char*)payload, PAYLOAD_HEADER + 1, "%016" PRIx64 "%08" PRIx32, scheduled, conn->id);
+    memset(payload + PAYLOAD_HEADER, 'x', opts->size - PAYLOAD_HEADER);
+    mask_copy(payload, payload, opts->size, payload - 4);
+    conn->tx_len += frame.total_len;
+
+    if (scheduled >= w->warm_end) {
+        w->sent++;
+        w->bytes_sent += frame.total_len;
+    }
+    conn->waiting = true;
+
+    flush_conn(w, conn);
+}
+
+/**
+ * @brief Parse every complete frame from the read buffer
+ *
+ * @param w the worker owning the connection
+ * @param conn the connection
+ */
+static void handle_frames(Worker *w, LoadConn *conn) {
+    size_t offset = 0;
+
+    for (;;) {
+        uint64_t frame_len = get_frame_length(conn->rx + offset, conn->rx_len - offset);
+        if (frame_len == 0 || frame_len > conn->rx_len - offset)
+            break;
+
+        Dataframe frame;
+        init_dataframe(&frame);
+        create_frame(&frame, conn->rx + offset);
+        offset += frame_len;
+
+        uint64_t now = now_ns();
+        if (now >= w->warm_end) {
+            w->received++;
+            w->bytes_received += frame_len;
+        }
+
+        if (frame.data_length >= PAYLOAD_HEADER) {
+            uint64_t scheduled = parse_hex(frame.data, 16);
+            uint32_t sender = (uint32_t)parse_hex(frame.data + 16, 8);
+
+            if (now >= w->warm_end && now >= scheduled)
+                histogram_record(&w->latency, now - scheduled);
+
+            // Closed loop: the publisher can send the next message
+            if (sender == conn->id)
+                conn->waiting = false;
+        }
+
+        free_dataframe(&frame);
+    }
+
+    memmove(conn->rx, conn->rx + offset, conn->rx_len - offset);
+    conn->rx_len -= offset;
+}
+
+static bool read_conn(Worker *w, LoadConn *conn) {
+    for (;;) {
+        if (conn->rx_cap - conn->rx_len < READ_BUF_SIZE / 2) {
+            conn->rx_cap += READ_BUF_SIZE;
+            conn->rx = realloc(conn->rx, conn->rx_cap);
+        }
+
+        ssize_t n = recv(conn->fd, conn->rx + conn->rx_len, conn->rx_cap - conn->rx_len, 0);
+        if (n == 0)
+            return false;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+
+        conn->rx_len += n;
+        handle_frames(w, conn);
+    }
+
+    return true;
+}
+
+static int open_connections(Worker *w) {
+    const Options* opts = w->opts;
+
+    w->conns = calloc(w->conn_count, sizeof(LoadConn));
+    w->epfd = epoll_create1(0);
+
+    for (int i = 0; i < w->conn_count; i++) {
+        LoadConn* conn = &w->conns[i];
+        conn->id = w->first_conn + i;
+        conn->fd = client_connect(opts->host, opts->port);
+        if (conn->fd == -1) {
+            perror("connect failed");
+            return 0;
+        }
+        if (!client_handshake(conn->fd, opts->host, "/")) {
+            fprintf(stderr, "handshake failed\n");
+            return 0;
+        }
+
+        conn->publisher = opts->mode == MODE_ECHO || (int)conn->id < opts->publishers;
+
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+    }
+
+    return 1;
+}
+
+static void* run_worker(void *arg) {
+    Worker* w = arg;
+    const Options* opts = w->opts;
+    struct epoll_event events[64];
+    int publisher_count = 0;
+
+    for (int i = 0; i < w->conn_count; i++)
+        publisher_count += w->conns[i].publisher;
+
+    uint64_t start = now_ns();
+    w->warm_end = start + (uint64_t)(opts->warmup * 1e9);
+    uint64_t end = w->warm_end + (uint64_t)(opts->duration * 1e9);
+
+    // Every worker sends its share of the total rate
+    int total_publishers = opts->mode == MODE_ECHO ? opts->connections : opts->publishers;
+    double rate = opts->rate * publisher_count / total_publishers;
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t next_send = start;
+    int next_conn = 0;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= end)
+            break;
+
+        if (publisher_count > 0) {
+            if (interval > 0) {
+                // Open loop: send everything that is due
+                while (next_send <= now) {
+                    // The count says there is a publisher, but a scan that
+                    // can't find one must not spin forever
+                    int scanned = 0;
+                    while (!w->conns[next_conn].publisher && scanned++ < w->conn_count)
+                        next_conn = (next_conn + 1) % w->conn_count;
+                    if (!w->conns[next_conn].publisher) {
+                        publisher_count = 0;
+                        break;
+                    }
+                    send_message(w, &w->conns[next_conn], next_send);
+                    next_conn = (next_conn + 1) % w->conn_count;
+                    next_send += interval;
+                }
+            } else {
+                // Closed loop: one message in flight per publisher
+                for (int i = 0; i < w->conn_count; i++) {
+                    LoadConn* conn = &w->conns[i];
+                    if (conn->publisher && !conn->waiting)
+                        send_message(w, conn, now);
+                }
+            }
+        }
+
+        // Sleep exactly until the next message is due, millisecond
+        // timeout of epoll_wait would add up to 1ms to every latency
+        uint64_t timeout = 100000000;
+        if (interval > 0)
+            timeout = next_send > now ? next_send - now : 0;
+        struct timespec ts = { .tv_sec = timeout / 1000000000, .tv_nsec = timeout % 1000000000 };
+
+        int n = epoll_pwait2(w->epfd, events, 64, &ts, NULL);
+        for (int i = 0; i < n; i++) {
+            LoadConn* conn = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT)
+                flush_conn(w, conn);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (!read_conn(w, conn)) {
+                    w->errors++;
+                    epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    // The subscribers of a broadcast were never counted
+                    if (conn->publisher) {
+                        conn->publisher = false;
+                        publisher_count--;
+                    }
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-H host] [-p port] [-c connections] [-t threads]\n"
+        "          [-r rate] [-s size] [-d seconds] [-w seconds]\n"
+        "          [-m echo|broadcast] [-P publishers]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static void print_results(const Options *opts, Worker *workers, double elapsed) {
+    Histogram total;
+    uint64_t sent = 0, received = 0, bytes_sent = 0, bytes_received = 0, errors = 0;
+
+    init_histogram(&total);
+    for (int i = 0; i < opts->threads; i++) {
+        histogram_merge(&total, &workers[i].latency);
+        sent += workers[i].sent;
+        received += workers[i].received;
+        bytes_sent += workers[i].bytes_sent;
+        bytes_received += workers[i].bytes_received;
+        errors += workers[i].errors;
+    }
+
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", opts->mode == MODE_ECHO ? "echo" : "broadcast");
+    printf("  \"connections\": %d,\n", opts->connections);
+    printf("  \"threads\": %d,\n", opts->threads);
+    printf("  \"message_size\": %zu,\n", opts->size);
+    printf("  \"target_rate\": %.0f,\n", opts->rate);
+    printf("  \"duration_s\": %.3f,\n", elapsed);
+    printf("  \"sent\": %" PRIu64 ",\n", sent);
+    printf("  \"received\": %" PRIu64 ",\n", received);
+    printf("  \"errors\": %" PRIu64 ",\n", errors);
+    printf("  \"send_msgs_per_sec\": %.1f,\n", sent / elapsed);
+    printf("  \"recv_msgs_per_sec\": %.1f,\n", received / elapsed);
+    printf("  \"send_bytes_per_sec\": %.1f,\n", bytes_sent / elapsed);
+    printf("  \"recv_bytes_per_sec\": %.1f,\n", bytes_received / elapsed);
+    printf("  \"latency_us\": {\n");
+    printf("    \"count\": %" PRIu64 ",\n", total.total);
+    printf("    \"min\": %.3f,\n", total.total ? total.min / 1e3 : 0.0);
+    printf("    \"mean\": %.3f,\n", total.total ? (double)total.sum / total.total / 1e3 : 0.0);
+    printf("    \"p50\": %.3f,\n", histogram_percentile(&total, 50.0) / 1e3);
+    printf("    \"p90\": %.3f,\n", histogram_percentile(&total, 90.0) / 1e3);
+    printf("    \"p99\": %.3f,\n", histogram_percentile(&total, 99.0) / 1e3);
+    printf("    \"p999\": %.3f,\n", histogram_percentile(&total, 99.9) / 1e3);
+    printf("    \"max\": %.3f\n", total.max / 1e3);
+    printf("  },\n");
+
+    // Only the non-empty buckets, as [upper bound in us, count] pairs
+    printf("  \"histogram\": [");
+    bool first = true;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (total.counts[i] == 0)
+            continue;
+        printf("%s[%.3f, %" PRIu64 "]", first ? "" : ", ",
+               histogram_bucket_value(i) / 1e3, total.counts[i]);
+        first = false;
+    }
+    printf("]\n");
+    printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options opts = {
+        .host = "127.0.0.1",
+        .port = 8888,
+        .connections = 10,
+        .threads = 2,
+        .rate = 1000,
+        .size = 64,
+        .duration = 10,
+        .warmup = 1,
+        .mode = MODE_ECHO,
+        .publishers = 1,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:t:r:s:d:w:m:P:")) != -1) {
+        switch (opt) {
+            case 'H': opts.host = optarg; break;
+            case 'p': opts.port = (uint16_t)atoi(optarg); break;
+            case 'c': opts.connections = atoi(optarg); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'r': opts.rate = atof(optarg); break;
+            case 's': opts.size = (size_t)atol(optarg); break;
+            case 'd': opts.duration = atof(optarg); break;
+            case 'w': opts.warmup = atof(optarg); break;
+            case 'm':
+                if (!strcmp(optarg, "echo"))
+                    opts.mode = MODE_ECHO;
+                else if (!strcmp(optarg, "broadcast"))
+                    opts.mode = MODE_BROADCAST;
+                else
+                    usage(argv[0]);
+                break;
+            case 'P': opts.publishers = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (opts.connections < 1 || opts.threads < 1 || opts.publishers < 1 || opts.rate < 0)
+        usage(argv[0]);
+    if (opts.threads > opts.connections)
+        opts.threads = opts.connections;
+    if (opts.publishers > opts.connections)
+        opts.publishers = opts.connections;
+    if (opts.size < MIN_MESSAGE_SIZE)
+        opts.size = MIN_MESSAGE_SIZE;
+
+    Worker* workers = calloc(opts.threads, sizeof(Worker));
+    int first = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        Worker* w = &workers[i];
+        w->opts = &opts;
+        w->first_conn = first;
+        // Any seed but 0 does, the keys don't have to be unpredictable
+        w->rng = (now_ns() ^ (uint64_t)i << 32) | 1;
+        w->conn_count = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        first += w->conn_count;
+        init_histogram(&w->latency);
+        if (!open_connections(w))
+            exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < opts.threads; i++)
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    for (int i = 0; i < opts.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9 - opts.warmup;
+
+    print_results(&opts, workers, elapsed > 0 ? elapsed : 1);
+
+    for (int i = 0; i < opts.threads; i++) {
+        for (int j = 0; j < workers[i].conn_count; j++) {
+            LoadConn* conn = &workers[i].conns[j];
+            close(conn->fd);
+            free(conn->rx);
+            free(conn->tx);
+        }
+        free(workers[i].conns);
+        close(workers[i].epfd);
+    }
+    free(workers);
 
-    close(SocketFD);
     return EXIT_SUCCESS;
 }
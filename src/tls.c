@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "tls.h"
+
+// The output of several chunks is gathered here to make a single record
+static __thread uint8_t record_buf[TLS_RECORD_SIZE];
+
+/**
+ * @brief Log the oldest error of the OpenSSL error queue
+ *
+ * @param what the function that failed
+ */
+static void log_tls_error(const char *what) {
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    LOG_ERROR("%s failed: %s", what, buf);
+}
+
+/**
+ * @brief Create the TLS context shared by every connection
+ *
+ * Session tickets are on, so returning clients resume the session without
+ * a full handshake. The ticket keys are made when the context is created
+ * and every reactor uses the same context, so a ticket works on any of them.
+ *
+ * @param cert_path PEM file with the certificate and its chain
+ * @param key_path PEM file with the private key
+ * @return SSL_CTX* the context or NULL if fail
+ */
+SSL_CTX* create_tls_context(const char *cert_path, const char *key_path) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        log_tls_error("SSL_CTX_new");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // EOF without close_notify is a normal close, the websocket close
+    // handshake tells if the messages are complete
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF |
+                        SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"websocket", 9);
+    // A write that didn't finish is retried from the record buffer of the
+    // next flush, which may be a different buffer with the same bytes
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1) {
+        log_tls_error("SSL_CTX_use_certificate_chain_file");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        log_tls_error("SSL_CTX_use_PrivateKey_file");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void free_tls_context(SSL_CTX *ctx) {
+    SSL_CTX_free(ctx);
+}
+
+/**
+ * @brief Start the server side of the TLS session of the connection
+ *
+ * @param conn Connection struct
+ * @param ctx the TLS context
+ * @return int 1 if success, 0 if out of memory
+ */
+int tls_start(Connection *conn, SSL_CTX *ctx) {
+    SSL* ssl = SSL_new(ctx);
+    if (ssl == NULL)
+        return 0;
+
+    if (SSL_set_fd(ssl, conn->conn_fd) != 1) {
+        SSL_free(ssl);
+        return 0;
+    }
+    SSL_set_accept_state(ssl);
+    // OpenSSL frees the record buffers of the idle sessions
+    if (conn->server->config.release_idle_buffers)
+        SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+    conn->tls = ssl;
+    return 1;
+}
+
+/**
+ * @brief Note the finished handshake and check if kernel TLS took over
+ *
+ * @param conn Connection struct
+ */
+static void finish_handshake(Connection *conn) {
+    conn->tls_ready = true;
+    metrics_add(SSL_session_reused(conn->tls) ? METRIC_TLS_RESUMED : METRIC_TLS_HANDSHAKES, 1);
+
+    conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->tls));
+    if (conn->ktls_send)
+        metrics_add(METRIC_KTLS_CONNECTIONS, 1);
+}
+
+/**
+ * @brief Turn the failed SSL call to errno like recv and send do
+ *
+ * @param conn Connection struct
+ * @param ret the return value of the call
+ * @return ssize_t 0 if the peer closed, -1 otherwise
+ */
+static ssize_t tls_error(Connection *conn, int ret) {
+    int error = SSL_get_error(conn->tls, ret);
+
+    switch (error) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0 || errno == EAGAIN)
+                errno = ECONNRESET;
+            break;
+        default:
+            // Broken records or a failed handshake
+            errno = EPROTO;
+            break;
+    }
+
+    ERR_clear_error();
+    return -1;
+}
+
+/**
+ * @brief Read and decrypt, running the handshake first if it's not done
+ *
+ * @param conn Connection struct
+ * @param buf where the plaintext is read
+ * @param len size of buf
+ * @return ssize_t same as recv
+ */
+ssize_t tls_read(Connection *conn, void *buf, size_t len) {
+    conn->tls_want_write = false;
+
+    int n = SSL_read(conn->tls, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (!conn->tls_ready && SSL_is_init_finished(conn->tls))
+        finish_handshake(conn);
+    if (n > 0)
+        return n;
+
+    // The handshake has more to send but the socket is full
+    if (SSL_get_error(conn->tls, n) == SSL_ERROR_WANT_WRITE)
+        conn->tls_want_write = true;
+    return tls_error(conn, n);
+}
+
+/**
+ * @brief Encrypt a single record
+ *
+ * @param conn Connection struct
+ * @param data the plaintext, at most TLS_RECORD_SIZE bytes
+ * @param len amount of bytes
+ * @return ssize_t same as send
+ */
+static ssize_t write_record(Connection *conn, const void *data, size_t len) {
+    int n = SSL_write(conn->tls, data, (int)len);
+    if (n > 0)
+        return n;
+
+    ssize_t ret = tls_error(conn, n);
+    // The peer closed the session, writing can't go on
+    if (ret == 0) {
+        errno = EPIPE;
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Encrypt the start of the buffers as a single record
+ *
+ * At most TLS_RECORD_SIZE bytes are written. Small buffers are gathered to
+ * one record, so a burst of small frames costs one record and one write
+ * like the sendmsg of the plain sockets.
+ *
+ * After EAGAIN the call has to be repeated with at least the same bytes,
+ * which the send queue does since nothing is consumed from it.
+ *
+ * @param conn Connection struct
+ * @param iov the buffers
+ * @param count amount of buffers
+ * @return ssize_t same as sendmsg
+ */
+ssize_t tls_send(Connection *conn, const struct iovec *iov, int count) {
+    const void* data = iov[0].iov_base;
+    size_t len = iov[0].iov_len;
+
+    // A large buffer is encrypted straight from the chunk
+    if (count > 1 && len < TLS_RECORD_SIZE) {
+        len = 0;
+        for (int i = 0; i < count && len < TLS_RECORD_SIZE; i++) {
+            size_t part = iov[i].iov_len;
+            if (part > TLS_RECORD_SIZE - len)
+                part = TLS_RECORD_SIZE - len;
+            memcpy(record_buf + len, iov[i].iov_base, part);
+            len += part;
+        }
+        data = record_buf;
+    }
+
+    if (len > TLS_RECORD_SIZE)
+        len = TLS_RECORD_SIZE;
+    return write_record(conn, data, len);
+}
+
+/**
+ * @brief Read a record worth of the file and encrypt it
+ *
+ * @param conn Connection struct
+ * @param fd the file
+ * @param offset where to read the file
+ * @param len amount of bytes left to send
+ * @return ssize_t same as sendfile, 0 if the file is shorter than len
+ */
+ssize_t tls_sendfile(Connection *conn, int fd, uint64_t offset, size_t len) {
+    if (len > TLS_RECORD_SIZE)
+        len = TLS_RECORD_SIZE;
+
+    ssize_t n = pread(fd, record_buf, len, offset);
+    if (n <= 0)
+        return n;
+    return write_record(conn, record_buf, n);
+}
+
+/**
+ * @brief Check if decrypted bytes are waiting in the session
+ *
+ * The socket doesn't become readable for them, so the reactor has to
+ * read again before it waits.
+ *
+ * @param conn Connection struct
+ * @return bool true if there are bytes to read
+ */
+bool tls_pending(Connection *conn) {
+    return conn->tls != NULL && SSL_pending(conn->tls) > 0;
+}
+
+/**
+ * @brief Send close_notify and free the session before the socket is closed
+ *
+ * @param conn Connection struct
+ */
+void tls_close(Connection *conn) {
+    if (conn->tls == NULL)
+        return;
+
+    // Don't wait for the answer of the peer, the socket is closed anyway
+    if (conn->tls_ready)
+        SSL_shutdown(conn->tls);
+    ERR_clear_error();
+    SSL_free(conn->tls);
+    conn->tls = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef WEB_SOCKET_TLS_H
+#define WEB_SOCKET_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <openssl/ssl.h>
+
+#include "socketcon.h"
+
+// Most plaintext bytes in a single TLS record
+#define TLS_RECORD_SIZE 16384
+
+/**
+ * TLS termination
+ *
+ * The handshake runs inside tls_read, the first reads of a connection
+ * drive it. When the kernel supports it, OpenSSL hands the record
+ * encryption to kernel TLS after the handshake. Then conn->ktls_send is
+ * set and the output is written with the plain sendmsg and sendfile, so
+ * the zero copy paths keep working. Otherwise the output goes through
+ * tls_send and tls_sendfile, one record at a time.
+ */
+
+SSL_CTX* create_tls_context(const char *cert_path, const char *key_path);
+void free_tls_context(SSL_CTX *ctx);
+int tls_start(Connection *conn, SSL_CTX *ctx);
+ssize_t tls_read(Connection *conn, void *buf, size_t len);
+ssize_t tls_send(Connection *conn, const struct iovec *iov, int count);
+ssize_t tls_sendfile(Connection *conn, int fd, uint64_t offset, size_t len);
+bool tls_pending(Connection *conn);
+void tls_close(Connection *conn);
+
+#endif
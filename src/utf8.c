@@ -0,0 +1,421 @@
+/**
+ * UTF-8 validation for text frames
+ *
+ * Long inputs are checked with the lookup table algorithm of Keiser and
+ * Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte". Each
+ * byte is classified by its high nibble, the low nibble of the byte before
+ * it and the high nibble of the byte itself with three shuffles, and the
+ * and of the results is non zero only for invalid pairs. Three and four
+ * byte characters are checked by shifting the block by two and three bytes.
+ *
+ * The vector code only sees whole blocks starting at a character boundary,
+ * so the characters that are split between fragments or blocks are left to
+ * the scalar state machine.
+ */
+#include <string.h>
+
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_X86
+#endif
+
+// Inputs shorter than this are faster to check without vectors
+#define SIMD_MIN_LEN 64
+
+static Utf8Impl selected_impl = UTF8_IMPL_AUTO;
+
+/**
+ * @brief Reset the state for a new message
+ *
+ * @param state the state
+ */
+void utf8_init(Utf8State *state) {
+    state->need = 0;
+    state->lo = 0x80;
+    state->hi = 0xBF;
+}
+
+/**
+ * @brief Check if the message can end here
+ *
+ * @param state the state after the last fragment
+ * @return bool true if no character is left unfinished
+ */
+bool utf8_complete(const Utf8State *state) {
+    return state->need == 0;
+}
+
+/**
+ * @brief Validate byte by byte, continuing from the state
+ *
+ * @param state the state, updated to the end of data
+ * @param data the bytes
+ * @param len amount of bytes
+ * @return bool false if the bytes are not valid UTF-8
+ */
+static bool validate_scalar(Utf8State *state, const uint8_t *data, size_t len) {
+    size_t i = 0;
+
+    while (i < len) {
+        // Skip ascii eight bytes at a time
+        if (state->need == 0 && len - i >= 8) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            if ((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        uint8_t c = data[i++];
+
+        if (state->need > 0) {
+            if (c < state->lo || c > state->hi)
+                return false;
+            state->need--;
+            state->lo = 0x80;
+            state->hi = 0xBF;
+            continue;
+        }
+
+        if (c < 0x80)
+            continue;
+        // Continuation bytes and the overlong 0xC0 and 0xC1 can't start a character
+        if (c < 0xC2)
+            return false;
+
+        if (c < 0xE0) {
+            state->need = 1;
+        } else if (c < 0xF0) {
+            state->need = 2;
+            // Overlong and utf-16 surrogates
+            if (c == 0xE0)
+                state->lo = 0xA0;
+            else if (c == 0xED)
+                state->hi = 0x9F;
+        } else if (c < 0xF5) {
+            state->need = 3;
+            // Overlong and above U+10FFFF
+            if (c == 0xF0)
+                state->lo = 0x90;
+            else if (c == 0xF4)
+                state->hi = 0x8F;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#ifdef UTF8_X86
+
+// Error classes of the lookup tables. A pair of bytes is invalid when the
+// same bit is set in all three lookups.
+#define TOO_SHORT  (1 << 0)
+#define TOO_LONG   (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE  (1 << 3)
+#define SURROGATE  (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS  (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// Indexed with the high nibble of the previous byte
+static const uint8_t byte_1_high[16] = {
+    // Ascii
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    // Continuation
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    // Two byte leads
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    // Three byte lead
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    // Four byte lead
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+// Indexed with the low nibble of the previous byte
+static const uint8_t byte_1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    // 0xED
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+// Indexed with the high nibble of the current byte
+static const uint8_t byte_2_high[16] = {
+    // Ascii
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    // Continuation 0x80 - 0x8F
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    // 0x90 - 0x9F
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    // 0xA0 - 0xBF
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    // Leads
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// Bytes at the end of a block that start a character which continues in
+// the next block are larger than these
+static const uint8_t max_complete[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+/**
+ * @brief Find the start of the last character before end
+ *
+ * The character may continue past end, so it is checked again by the
+ * scalar code.
+ *
+ * @param data the bytes
+ * @param end the end of the vector checked bytes
+ * @return size_t index of the first byte of the character
+ */
+static size_t char_boundary(const uint8_t *data, size_t end) {
+    for (size_t i = end; i > 0 && end - i < 4; i--) {
+        if ((data[i - 1] & 0xC0) != 0x80)
+            return i - 1;
+    }
+    // Too many continuation bytes, the vector code already failed
+    return end;
+}
+
+/**
+ * @brief Validate whole 16 byte blocks with SSE4
+ *
+ * @param data the bytes, starting at a character boundary
+ * @param len amount of bytes
+ * @param ok set to false if the bytes are not valid UTF-8
+ * @return size_t amount of bytes checked
+ */
+__attribute__((target("sse4.1")))
+static size_t validate_sse4(const uint8_t *data, size_t len, bool *ok) {
+    const __m128i tbl_1_high = _mm_loadu_si128((const __m128i*)byte_1_high);
+    const __m128i tbl_1_low = _mm_loadu_si128((const __m128i*)byte_1_low);
+    const __m128i tbl_2_high = _mm_loadu_si128((const __m128i*)byte_2_high);
+    const __m128i max = _mm_loadu_si128((const __m128i*)(max_complete + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i third_min = _mm_set1_epi8(0xE0 - 0x80);
+    const __m128i fourth_min = _mm_set1_epi8(0xF0 - 0x80);
+    const __m128i high_bit = _mm_set1_epi8((char)0x80);
+
+    __m128i prev = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    size_t end = len & ~(size_t)15;
+
+    for (size_t i = 0; i < end; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i*)(data + i));
+
+        if (_mm_movemask_epi8(input) == 0) {
+            // Ascii is fine unless the last block ended in the middle of a character
+            error = _mm_or_si128(error, prev_incomplete);
+        } else {
+            __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+            __m128i high_1 = _mm_shuffle_epi8(tbl_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+            __m128i low_1 = _mm_shuffle_epi8(tbl_1_low, _mm_and_si128(prev1, nibble));
+            __m128i high_2 = _mm_shuffle_epi8(tbl_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+            __m128i special = _mm_and_si128(_mm_and_si128(high_1, low_1), high_2);
+
+            // Bytes two and three after a three or four byte lead must be continuations
+            __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+            __m128i must_23 = _mm_or_si128(_mm_subs_epu8(prev2, third_min), _mm_subs_epu8(prev3, fourth_min));
+            must_23 = _mm_and_si128(must_23, high_bit);
+
+            error = _mm_or_si128(error, _mm_xor_si128(must_23, special));
+            prev_incomplete = _mm_subs_epu8(input, max);
+        }
+
+        prev = input;
+    }
+
+    *ok = _mm_testz_si128(error, error);
+    return char_boundary(data, end);
+}
+
+/**
+ * @brief Validate whole 32 byte blocks with AVX2
+ *
+ * Same as validate_sse4 with twice the width. The shuffles work on 16 byte
+ * lanes, so the tables are repeated in both lanes.
+ *
+ * @param data the bytes, starting at a character boundary
+ * @param len amount of bytes
+ * @param ok set to false if the bytes are not valid UTF-8
+ * @return size_t amount of bytes checked
+ */
+__attribute__((target("avx2")))
+static size_t validate_avx2(const uint8_t *data, size_t len, bool *ok) {
+    const __m256i tbl_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte_1_high));
+    const __m256i tbl_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte_1_low));
+    const __m256i tbl_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte_2_high));
+    const __m256i max = _mm256_loadu_si256((const __m256i*)max_complete);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i third_min = _mm256_set1_epi8(0xE0 - 0x80);
+    const __m256i fourth_min = _mm256_set1_epi8(0xF0 - 0x80);
+    const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    size_t end = len & ~(size_t)31;
+
+    for (size_t i = 0; i < end; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i*)(data + i));
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+        } else {
+            // The high lane of prev and the low lane of input, so alignr can
+            // shift bytes across the lanes
+            __m256i carry = _mm256_permute2x128_si256(prev, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, carry, 15);
+            __m256i high_1 = _mm256_shuffle_epi8(tbl_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            __m256i low_1 = _mm256_shuffle_epi8(tbl_1_low, _mm256_and_si256(prev1, nibble));
+            __m256i high_2 = _mm256_shuffle_epi8(tbl_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+            __m256i special = _mm256_and_si256(_mm256_and_si256(high_1, low_1), high_2);
+
+            __m256i prev2 = _mm256_alignr_epi8(input, carry, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, carry, 13);
+            __m256i must_23 = _mm256_or_si256(_mm256_subs_epu8(prev2, third_min),
+                                              _mm256_subs_epu8(prev3, fourth_min));
+            must_23 = _mm256_and_si256(must_23, high_bit);
+
+            error = _mm256_or_si256(error, _mm256_xor_si256(must_23, special));
+            prev_incomplete = _mm256_subs_epu8(input, max);
+        }
+
+        prev = input;
+    }
+
+    *ok = _mm256_testz_si256(error, error);
+    return char_boundary(data, end);
+}
+
+#endif
+
+/**
+ * @brief Get the implementation in use, detect it on the first call
+ *
+ * @return Utf8Impl the implementation
+ */
+static Utf8Impl current_impl(void) {
+    Utf8Impl impl = __atomic_load_n(&selected_impl, __ATOMIC_RELAXED);
+    if (impl != UTF8_IMPL_AUTO)
+        return impl;
+
+    impl = UTF8_IMPL_SCALAR;
+#ifdef UTF8_X86
+    if (__builtin_cpu_supports("avx2"))
+        impl = UTF8_IMPL_AVX2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        impl = UTF8_IMPL_SSE4;
+#endif
+
+    // Every thread detects the same one, so racing here is fine
+    __atomic_store_n(&selected_impl, impl, __ATOMIC_RELAXED);
+    return impl;
+}
+
+/**
+ * @brief Choose the implementation, mostly for benchmarks
+ *
+ * @param impl the implementation, UTF8_IMPL_AUTO detects it again
+ * @return bool false if the cpu doesn't support it
+ */
+bool utf8_set_impl(Utf8Impl impl) {
+#ifdef UTF8_X86
+    if (impl == UTF8_IMPL_AVX2 && !__builtin_cpu_supports("avx2"))
+        return false;
+    if (impl == UTF8_IMPL_SSE4 && !__builtin_cpu_supports("sse4.1"))
+        return false;
+#else
+    if (impl == UTF8_IMPL_AVX2 || impl == UTF8_IMPL_SSE4)
+        return false;
+#endif
+    __atomic_store_n(&selected_impl, impl, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * @brief Get the name of the implementation in use
+ *
+ * @return const char* the name
+ */
+const char* utf8_impl_name(void) {
+    switch (current_impl()) {
+        case UTF8_IMPL_AVX2:
+            return "avx2";
+        case UTF8_IMPL_SSE4:
+            return "sse4";
+        default:
+            return "scalar";
+    }
+}
+
+/**
+ * @brief Validate the next part of a message
+ *
+ * The message can be split anywhere, even in the middle of a character.
+ * Call utf8_complete after the last part.
+ *
+ * @param state the state, initialized with utf8_init for every message
+ * @param data the bytes
+ * @param len amount of bytes
+ * @return bool false if the bytes are not valid UTF-8
+ */
+bool utf8_validate(Utf8State *state, const uint8_t *data, size_t len) {
+    size_t i = 0;
+
+    // Finish the character left over from the previous part, so the
+    // vector code starts at a character boundary
+    while (i < len && state->need > 0) {
+        if (!validate_scalar(state, data + i, 1))
+            return false;
+        i++;
+    }
+
+#ifdef UTF8_X86
+    if (len - i >= SIMD_MIN_LEN) {
+        Utf8Impl impl = current_impl();
+        bool ok = true;
+
+        if (impl == UTF8_IMPL_AVX2)
+            i += validate_avx2(data + i, len - i, &ok);
+        else if (impl == UTF8_IMPL_SSE4)
+            i += validate_sse4(data + i, len - i, &ok);
+
+        if (!ok)
+            return false;
+    }
+#endif
+
+    return validate_scalar(state, data + i, len - i);
+}
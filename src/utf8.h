@@ -0,0 +1,32 @@
+#ifndef WEB_SOCKET_UTF8_H
+#define WEB_SOCKET_UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Utf8State carries an unfinished character from one fragment to the next
+typedef struct {
+    // Continuation bytes still needed
+    uint8_t need;
+    // Allowed range of the next continuation byte
+    uint8_t lo;
+    uint8_t hi;
+} Utf8State;
+
+// The validator implementations, UTF8_IMPL_AUTO picks the fastest one the
+// cpu supports
+typedef enum {
+    UTF8_IMPL_AUTO,
+    UTF8_IMPL_SCALAR,
+    UTF8_IMPL_SSE4,
+    UTF8_IMPL_AVX2,
+} Utf8Impl;
+
+void utf8_init(Utf8State *state);
+bool utf8_validate(Utf8State *state, const uint8_t *data, size_t len);
+bool utf8_complete(const Utf8State *state);
+bool utf8_set_impl(Utf8Impl impl);
+const char* utf8_impl_name(void);
+
+#endif
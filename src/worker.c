@@ -0,0 +1,596 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "socketcon.h"
+#include "worker.h"
+
+// The rings start on their own page after the header
+#define RINGS_OFFSET 4096
+
+// How long worker_attach waits for the server to finish creating the rings
+#define OPEN_WAIT_US 1000000
+
+// Length of the record that tells the reader to go back to the start
+#define WORKER_WRAP 0xffffffffU
+
+// Replies the reply thread takes from a ring before it looks at the next
+#define REPLY_BATCH 64
+
+static uint64_t record_size(size_t len) {
+    return (sizeof(WorkerRecord) + len + 15) & ~15ULL;
+}
+
+static uint64_t round_up_pow2(uint64_t value) {
+    uint64_t pow2 = 4096;
+    while (pow2 < value && pow2 < (1ULL << 32))
+        pow2 <<= 1;
+    return pow2;
+}
+
+static size_t section_size(const WorkerHeader *header) {
+    return sizeof(WorkerWake) +
+           (header->reactor_count + 1) * (sizeof(WorkerRing) + header->ring_size);
+}
+
+/**
+ * @brief Get the largest payload a ring can carry
+ *
+ * A record of half the ring always fits once the reader has caught up,
+ * wherever the ring wraps.
+ *
+ * @param header the rings
+ * @return size_t the payload can be this long
+ */
+size_t workers_max_message(const WorkerHeader *header) {
+    return header->ring_size / 2 - sizeof(WorkerRecord);
+}
+
+/**
+ * @brief Point the queues to the rings of the worker
+ *
+ * @param header the mapped rings
+ * @param index index of the worker
+ * @param wake set to where the worker sleeps
+ * @param requests reactor_count queues, set to the request rings
+ * @param reply set to the reply ring
+ */
+static void map_worker(WorkerHeader *header, uint32_t index, WorkerWake **wake,
+                       WorkerQueue *requests, WorkerQueue *reply) {
+    uint8_t* section = (uint8_t*)header + RINGS_OFFSET + index * section_size(header);
+    size_t stride = sizeof(WorkerRing) + header->ring_size;
+
+    *wake = (WorkerWake*)section;
+    section += sizeof(WorkerWake);
+
+    for (uint32_t i = 0; i <= header->reactor_count; i++) {
+        WorkerQueue* queue = i < header->reactor_count ? &requests[i] : reply;
+        queue->ring = (WorkerRing*)(section + i * stride);
+        queue->data = section + i * stride + sizeof(WorkerRing);
+        queue->size = header->ring_size;
+        queue->taken = 0;
+    }
+}
+
+/**
+ * @brief Write a record to the ring
+ *
+ * Only the one writer of the ring calls this.
+ *
+ * @param queue the ring
+ * @param type type of the message
+ * @param handle the connection
+ * @param data the payload
+ * @param len length of the payload, at most workers_max_message
+ * @param was_empty set to true if the reader had read everything before
+ * @return int 1 if success, 0 if the ring is full
+ */
+static int ring_push(WorkerQueue *queue, uint8_t type, WebSocketHandle handle,
+                     const uint8_t *data, size_t len, bool *was_empty) {
+    WorkerRing* ring = queue->ring;
+    uint64_t start = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t need = record_size(len);
+    uint64_t offset = start & (queue->size - 1);
+    // A record never wraps, the end of the ring is skipped instead
+    uint64_t skip = queue->size - offset < need ? queue->size - offset : 0;
+
+    if (start + skip + need - head > queue->size)
+        return 0;
+
+    if (skip > 0) {
+        ((WorkerRecord*)(queue->data + offset))->len = WORKER_WRAP;
+        offset = 0;
+    }
+
+    WorkerRecord* record = (WorkerRecord*)(queue->data + offset);
+    record->len = (uint32_t)len;
+    record->type = type;
+    record->handle = handle;
+    if (len > 0)
+        memcpy(record->data, data, len);
+
+    // Together with the sleeping flag of the reader, either the reader
+    // sees the record or the writer sees the reader sleeping
+    __atomic_store_n(&ring->tail, start + skip + need, __ATOMIC_SEQ_CST);
+    *was_empty = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == start;
+    return 1;
+}
+
+/**
+ * @brief Get the oldest record of the ring without consuming it
+ *
+ * Only the one reader of the ring calls this.
+ *
+ * @param queue the ring
+ * @return WorkerRecord* the record or NULL if the ring is empty
+ */
+static WorkerRecord* ring_peek(WorkerQueue *queue) {
+    WorkerRing* ring = queue->ring;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return NULL;
+
+        uint64_t offset = head & (queue->size - 1);
+        WorkerRecord* record = (WorkerRecord*)(queue->data + offset);
+        if (record->len == WORKER_WRAP) {
+            head += queue->size - offset;
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        // The other process may be broken, a record past the end would
+        // read outside of the ring
+        if (record_size(record->len) > queue->size - offset || head + record_size(record->len) > tail) {
+            LOG_ERROR("Broken worker ring, %" PRIu64 " bytes dropped", tail - head);
+            __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        queue->taken = record_size(record->len);
+        return record;
+    }
+}
+
+static void ring_consume(WorkerQueue *queue) {
+    WorkerRing* ring = queue->ring;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + queue->taken, __ATOMIC_RELEASE);
+    queue->taken = 0;
+}
+
+static bool ring_empty(WorkerQueue *queue) {
+    return __atomic_load_n(&queue->ring->tail, __ATOMIC_SEQ_CST) ==
+           __atomic_load_n(&queue->ring->head, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Wake the reader of a ring that was empty, if it sleeps
+ *
+ * @param wake where the reader sleeps
+ * @return bool true if the reader was woken
+ */
+static bool wake_reader(WorkerWake *wake) {
+    if (!__atomic_load_n(&wake->sleeping, __ATOMIC_SEQ_CST))
+        return false;
+
+    __atomic_add_fetch(&wake->futex, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &wake->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return true;
+}
+
+/**
+ * @brief Sleep until a writer wakes the reader
+ *
+ * @param header the rings, a reader doesn't sleep after they are closed
+ * @param wake where the reader sleeps
+ * @param queues the rings of the reader
+ * @param count amount of the rings
+ */
+static void sleep_reader(WorkerHeader *header, WorkerWake *wake, WorkerQueue *queues,
+                         size_t count) {
+    uint32_t seen = __atomic_load_n(&wake->futex, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&wake->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    // A write before the flag was set didn't wake anybody, so the rings
+    // are checked again now that it's set
+    bool empty = !__atomic_load_n(&header->closed, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < count && empty; i++)
+        empty = ring_empty(&queues[i]);
+    if (empty)
+        syscall(SYS_futex, &wake->futex, FUTEX_WAIT, seen, NULL, NULL, 0);
+
+    __atomic_store_n(&wake->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Hand the message to the worker of the connection
+ *
+ * @param workers the Workers
+ * @param conn the connection, called on its reactor thread
+ * @param type type of the message
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if the ring is full or the message too big
+ */
+static int push_request(Workers *workers, Connection *conn, uint8_t type, const uint8_t *data,
+                        size_t len) {
+    WorkerHeader* header = workers->header;
+    uint32_t reactor = (uint32_t)(conn->reactor - workers->wss->reactors);
+    uint32_t worker = (uint32_t)(conn->handle % header->worker_count);
+    WorkerQueue* queue = &workers->requests[worker * header->reactor_count + reactor];
+    bool was_empty;
+
+    if (len > workers_max_message(header) || !ring_push(queue, type, conn->handle, data, len, &was_empty)) {
+        metrics_add(METRIC_WORKER_DROPPED, 1);
+        return -1;
+    }
+
+    metrics_add(METRIC_WORKER_SENT, 1);
+    if (was_empty && wake_reader(workers->wakes[worker]))
+        metrics_add(METRIC_WORKER_WAKEUPS, 1);
+    return 0;
+}
+
+/**
+ * @brief Hand the message to the worker process of the connection
+ *
+ * Called on the reactor thread of the connection, from its callbacks. The
+ * reply comes back through ws_send on the connection.
+ *
+ * @param conn the connection
+ * @param type type of the message
+ * @param data the payload, copied to the ring
+ * @param len length of the payload
+ * @return int 0 if success, -1 if there are no workers or the ring of the
+ * worker is full
+ */
+int ws_to_worker(WebSocketConn *conn, WebSocketMessageType type, const uint8_t *data, size_t len) {
+    Workers* workers = conn->server->workers;
+    if (workers == NULL)
+        return -1;
+    return push_request(workers, conn, (uint8_t)type, data, len);
+}
+
+/**
+ * @brief Tell the worker the connection is gone
+ *
+ * Called by close_connection on the reactor thread of the connection.
+ *
+ * @param conn the connection
+ */
+void workers_connection_closed(Connection *conn) {
+    push_request(conn->server->workers, conn, WORKER_CLOSE, NULL, 0);
+}
+
+/**
+ * @brief Send the reply to its connection
+ *
+ * @param workers the Workers
+ * @param record the reply
+ */
+static void deliver_reply(Workers *workers, WorkerRecord *record) {
+    WebSocketConn* conn = ws_lookup(workers->wss, record->handle);
+    if (conn == NULL)
+        return;
+
+    if (record->type == WORKER_CLOSE)
+        ws_close(conn, 1000, "");
+    else
+        ws_send(conn, record->type == WS_BINARY ? WS_BINARY : WS_TEXT, record->data, record->len);
+    ws_release(conn);
+    metrics_add(METRIC_WORKER_REPLIES, 1);
+}
+
+/**
+ * @brief Send the replies of the workers to the clients
+ *
+ * @param arg the Workers
+ * @return void* NULL
+ */
+static void* reply_loop(void *arg) {
+    Workers* workers = arg;
+    WorkerHeader* header = workers->header;
+
+    while (!__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+        size_t handled = 0;
+
+        for (uint32_t i = 0; i < header->worker_count; i++) {
+            WorkerQueue* queue = &workers->replies[i];
+            WorkerRecord* record;
+            for (int n = 0; n < REPLY_BATCH && (record = ring_peek(queue)) != NULL; n++) {
+                deliver_reply(workers, record);
+                ring_consume(queue);
+                handled++;
+            }
+        }
+
+        if (handled == 0)
+            sleep_reader(header, &header->server, workers->replies, header->worker_count);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Create the rings of the workers
+ *
+ * An object left by an earlier server with the same name is removed, its
+ * workers have to attach again.
+ *
+ * @param wss the server, config.worker_name is set and the amount of
+ * reactors is known
+ * @return Workers* the Workers or NULL if fail
+ */
+Workers* create_workers(WebSocketServer *wss) {
+    const char* name = wss->config.worker_name;
+    uint32_t count = wss->config.workers > 0 ? (uint32_t)wss->config.workers : 1;
+    Workers* workers = calloc(1, sizeof(Workers));
+    if (workers == NULL)
+        return NULL;
+
+    WorkerHeader layout = {
+        .worker_count = count,
+        .reactor_count = (uint32_t)wss->config.threads,
+        .ring_size = round_up_pow2(wss->config.worker_ring_size),
+    };
+    size_t size = RINGS_OFFSET + count * section_size(&layout);
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    WorkerHeader* header = MAP_FAILED;
+    if (fd != -1 && ftruncate(fd, size) == 0)
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        LOG_ERROR("Cannot create the worker rings %s: %s", name, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(name);
+        }
+        free(workers);
+        return NULL;
+    }
+    // The mapping stays after the descriptor is closed
+    close(fd);
+
+    workers->wss = wss;
+    workers->header = header;
+    workers->map_size = size;
+    workers->requests = calloc((size_t)count * layout.reactor_count, sizeof(WorkerQueue));
+    workers->replies = calloc(count, sizeof(WorkerQueue));
+    workers->wakes = calloc(count, sizeof(WorkerWake*));
+    if (workers->requests == NULL || workers->replies == NULL || workers->wakes == NULL) {
+        free_workers(workers);
+        return NULL;
+    }
+
+    // ftruncate filled the rings with zeros, they are all empty
+    header->version = WORKER_VERSION;
+    header->worker_count = layout.worker_count;
+    header->reactor_count = layout.reactor_count;
+    header->ring_size = layout.ring_size;
+    for (uint32_t i = 0; i < count; i++) {
+        map_worker(header, i, &workers->wakes[i], &workers->requests[i * layout.reactor_count],
+                   &workers->replies[i]);
+    }
+    // The workers use the rings only after they see the magic
+    __atomic_store_n(&header->magic, WORKER_MAGIC, __ATOMIC_RELEASE);
+
+    return workers;
+}
+
+/**
+ * @brief Start the thread that sends the replies of the workers
+ *
+ * @param workers the Workers
+ * @return int 1 if success, 0 if fail
+ */
+int start_workers(Workers *workers) {
+    workers->started = pthread_create(&workers->thread, NULL, reply_loop, workers) == 0;
+    return workers->started;
+}
+
+/**
+ * @brief Wake a reader whether it sleeps or is about to
+ *
+ * @param wake where the reader sleeps
+ */
+static void wake_always(WorkerWake *wake) {
+    __atomic_add_fetch(&wake->futex, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &wake->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief Close the rings, stop the reply thread and remove the object
+ *
+ * The workers are woken up and see the rings closed, the requests they
+ * haven't read are lost.
+ *
+ * @param workers the Workers
+ */
+void free_workers(Workers *workers) {
+    WorkerHeader* header = workers->header;
+
+    __atomic_store_n(&header->closed, 1, __ATOMIC_SEQ_CST);
+    wake_always(&header->server);
+    if (workers->started)
+        pthread_join(workers->thread, NULL);
+    for (uint32_t i = 0; workers->wakes != NULL && i < header->worker_count; i++) {
+        if (workers->wakes[i] != NULL)
+            wake_always(workers->wakes[i]);
+    }
+
+    munmap(header, workers->map_size);
+    shm_unlink(workers->wss->config.worker_name);
+    free(workers->requests);
+    free(workers->replies);
+    free(workers->wakes);
+    free(workers);
+}
+
+/**
+ * @brief Attach to the rings of a worker, called by the worker process
+ *
+ * @param name name of the shared memory object the server was given
+ * @param index index of the worker, below the worker count of the server
+ * @return WorkerEnd* the rings or NULL if the server hasn't created them
+ */
+WorkerEnd* worker_attach(const char *name, uint32_t index) {
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return NULL;
+
+    WorkerHeader* header = NULL;
+    struct stat st;
+    for (int waited = 0; waited < OPEN_WAIT_US; waited += 1000) {
+        if (fstat(fd, &st) == -1)
+            break;
+        if ((size_t)st.st_size >= RINGS_OFFSET) {
+            header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (header == MAP_FAILED)
+                header = NULL;
+            break;
+        }
+        usleep(1000);
+    }
+    close(fd);
+    if (header == NULL)
+        return NULL;
+
+    // The server may still be setting the rings up
+    for (int waited = 0; __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != WORKER_MAGIC; waited += 1000) {
+        if (waited >= OPEN_WAIT_US) {
+            munmap(header, st.st_size);
+            return NULL;
+        }
+        usleep(1000);
+    }
+
+    WorkerEnd* worker = calloc(1, sizeof(WorkerEnd));
+    if (worker != NULL)
+        worker->requests = calloc(header->reactor_count, sizeof(WorkerQueue));
+
+    if (header->version != WORKER_VERSION || index >= header->worker_count ||
+        (size_t)st.st_size < RINGS_OFFSET + header->worker_count * section_size(header) ||
+        worker == NULL || worker->requests == NULL) {
+        LOG_ERROR("Cannot use worker %u of the rings %s", index, name);
+        if (worker != NULL)
+            free(worker->requests);
+        free(worker);
+        munmap(header, st.st_size);
+        return NULL;
+    }
+
+    worker->header = header;
+    worker->map_size = st.st_size;
+    worker->request_count = header->reactor_count;
+    map_worker(header, index, &worker->wake, worker->requests, &worker->reply);
+    return worker;
+}
+
+void worker_detach(WorkerEnd *worker) {
+    munmap(worker->header, worker->map_size);
+    free(worker->requests);
+    free(worker);
+}
+
+/**
+ * @brief Take the next request without waiting
+ *
+ * The rings of the reactors are read in turns. The message points into
+ * the ring, so it must be finished with worker_done before the next call.
+ *
+ * @param worker the WorkerEnd
+ * @param message set to the request
+ * @return int 1 if there was a request, 0 if every ring is empty
+ */
+int worker_next(WorkerEnd *worker, WorkerMessage *message) {
+    for (uint32_t i = 0; i < worker->request_count; i++) {
+        uint32_t index = (worker->next + i) % worker->request_count;
+        WorkerQueue* queue = &worker->requests[index];
+        WorkerRecord* record = ring_peek(queue);
+        if (record == NULL)
+            continue;
+
+        message->handle = record->handle;
+        message->type = record->type;
+        message->data = record->data;
+        message->len = record->len;
+        worker->current = queue;
+        worker->next = (index + 1) % worker->request_count;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Give the space of the request worker_next returned back to the
+ * server
+ *
+ * @param worker the WorkerEnd
+ */
+void worker_done(WorkerEnd *worker) {
+    if (worker->current == NULL)
+        return;
+    ring_consume(worker->current);
+    worker->current = NULL;
+}
+
+/**
+ * @brief Sleep until the server sends a request or closes the rings
+ *
+ * @param worker the WorkerEnd, the last request is done
+ */
+void worker_wait(WorkerEnd *worker) {
+    sleep_reader(worker->header, worker->wake, worker->requests, worker->request_count);
+}
+
+/**
+ * @brief Check if the server has closed the rings
+ *
+ * The worker should detach then, a new server makes new rings.
+ *
+ * @param worker the WorkerEnd
+ * @return bool true if closed
+ */
+bool worker_closed(WorkerEnd *worker) {
+    return __atomic_load_n(&worker->header->closed, __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * @brief Send a reply to the connection
+ *
+ * @param worker the WorkerEnd
+ * @param handle handle of the connection from the request
+ * @param type WS_TEXT, WS_BINARY or WORKER_CLOSE to close the connection
+ * @param data the payload
+ * @param len length of the payload
+ * @return int 0 if success, -1 if the ring is full, try again later, or
+ * the reply is too big
+ */
+int worker_reply(WorkerEnd *worker, WebSocketHandle handle, uint8_t type, const uint8_t *data,
+                 size_t len) {
+    bool was_empty;
+
+    if (len > workers_max_message(worker->header) ||
+        !ring_push(&worker->reply, type, handle, data, len, &was_empty))
+        return -1;
+
+    if (was_empty)
+        wake_reader(&worker->header->server);
+    return 0;
+}
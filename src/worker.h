@@ -0,0 +1,148 @@
+#ifndef WEB_SOCKET_WORKER_H
+#define WEB_SOCKET_WORKER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "server.h"
+
+// Identifies a mapping that holds the worker rings
+#define WORKER_MAGIC 0x5753574b
+#define WORKER_VERSION 2
+
+// Record type of a closed connection. The server sends it when a client
+// goes away, and a worker sends it to close a client
+#define WORKER_CLOSE 0x8
+
+/**
+ * Shared memory transport to worker processes
+ *
+ * The server creates a POSIX shared memory object with single producer,
+ * single consumer byte rings. Every reactor has its own request ring to
+ * every worker, and every worker has one reply ring that the reply thread
+ * of the server reads. So every ring has one writer and one reader and
+ * needs no locks, only the positions are shared.
+ *
+ * The messages of a connection always go to the same worker, picked with
+ * its handle. A worker replies with the handle and the reply thread sends
+ * the reply to the connection, wherever its reactor is. The worker reads
+ * the message straight from the ring, the only copy is the one from the
+ * receive buffer to the ring.
+ *
+ * A reader that has nothing to read sleeps on a futex. A writer wakes it
+ * only when the ring was empty before the write and the reader said it
+ * sleeps, so a busy reader costs no system calls at all.
+ *
+ * A ring that is full refuses the message and the application decides
+ * what to do, nothing waits for the workers.
+ * The workers are started after the server and restarted with it, the
+ * server makes a new object every time it starts. When the server is
+ * freed it removes the object and marks the rings closed, so the workers
+ * know to detach.
+ */
+
+// WorkerRing is the shared part of a ring, the bytes follow it
+typedef struct {
+    // Bytes written, only the writer moves this
+    uint64_t tail __attribute__((aligned(64)));
+    // Bytes read, only the reader moves this
+    uint64_t head __attribute__((aligned(64)));
+} WorkerRing;
+
+// WorkerWake is where a reader sleeps
+typedef struct {
+    // Bumped by a writer that wakes the reader
+    uint32_t futex __attribute__((aligned(64)));
+    // True while the reader is about to sleep or sleeps
+    uint32_t sleeping;
+} WorkerWake;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t worker_count;
+    uint32_t reactor_count;
+    // Bytes of a ring, power of two
+    uint64_t ring_size;
+    // The reply thread of the server sleeps here
+    WorkerWake server;
+    // Set when the server is freed, the readers stop reading
+    uint32_t closed;
+} WorkerHeader;
+
+// WorkerRecord is a message in a ring, the payload follows it
+typedef struct {
+    // Length of the payload, WORKER_WRAP if the rest of the ring is unused
+    uint32_t len;
+    // WS_TEXT, WS_BINARY or WORKER_CLOSE
+    uint8_t type;
+    uint8_t reserved[3];
+    WebSocketHandle handle;
+    uint8_t data[];
+} WorkerRecord;
+
+// WorkerQueue is the local view of a ring
+typedef struct {
+    WorkerRing* ring;
+    uint8_t* data;
+    uint64_t size;
+    // Size of the record worker_next returned, read but not consumed
+    uint64_t taken;
+} WorkerQueue;
+
+// Workers is the server end of the rings
+typedef struct Workers {
+    WebSocketServer* wss;
+    pthread_t thread;
+    // The reply thread runs
+    bool started;
+    WorkerHeader* header;
+    size_t map_size;
+    // requests[worker * reactor_count + reactor]
+    WorkerQueue* requests;
+    // One per worker
+    WorkerQueue* replies;
+    WorkerWake** wakes;
+} Workers;
+
+// WorkerEnd is the rings of a single worker, in the worker process
+typedef struct {
+    WorkerHeader* header;
+    size_t map_size;
+    WorkerWake* wake;
+    // One per reactor of the server
+    WorkerQueue* requests;
+    uint32_t request_count;
+    // The ring worker_next reads next, so no reactor is starved
+    uint32_t next;
+    WorkerQueue* current;
+    WorkerQueue reply;
+} WorkerEnd;
+
+// A request the worker reads, the data points into the ring until
+// worker_done
+typedef struct {
+    WebSocketHandle handle;
+    uint8_t type;
+    const uint8_t* data;
+    size_t len;
+} WorkerMessage;
+
+Workers* create_workers(WebSocketServer *wss);
+int start_workers(Workers *workers);
+void free_workers(Workers *workers);
+void workers_connection_closed(struct Connection *conn);
+size_t workers_max_message(const WorkerHeader *header);
+
+WorkerEnd* worker_attach(const char *name, uint32_t index);
+void worker_detach(WorkerEnd *worker);
+int worker_next(WorkerEnd *worker, WorkerMessage *message);
+void worker_done(WorkerEnd *worker);
+void worker_wait(WorkerEnd *worker);
+bool worker_closed(WorkerEnd *worker);
+int worker_reply(WorkerEnd *worker, WebSocketHandle handle, uint8_t type, const uint8_t *data,
+                 size_t len);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef WEB_SOCKET_TEST_H
+#define WEB_SOCKET_TEST_H
+
+#include <stdio.h>
+
+/**
+ * Checks for the test programs
+ *
+ * A failed check prints where it is and the test goes on, main returns
+ * TEST_RESULT so make test stops at the first program that failed.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            test_failures++;                                                 \
+        }                                                                    \
+    } while (0)
+
+#define TEST_RESULT (test_failures == 0 ? 0 : 1)
+
+#endif
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/bus.h"
+#include "test.h"
+
+// Claims a sequence like a publisher that dies before it writes the slot
+static void dead_publisher(Bus *bus) {
+    __atomic_fetch_add(&bus->header->write_seq, 1, __ATOMIC_RELAXED);
+}
+
+static int read_next(BusConsumer *consumer, char *data) {
+    BusRecord record;
+    if (!bus_peek(consumer, &record))
+        return 0;
+    memcpy(data, record.data, record.len);
+    data[record.len] = '\0';
+    return bus_commit(consumer);
+}
+
+static void test_order(Bus *bus) {
+    BusConsumer consumer;
+    char data[64];
+
+    bus_consumer_init(&consumer, bus);
+    CHECK(!read_next(&consumer, data));
+
+    CHECK(bus_publish(bus, "t", 1, (const uint8_t*)"one", 3) == 0);
+    CHECK(bus_publish(bus, "t", 1, (const uint8_t*)"two", 3) == 0);
+    CHECK(read_next(&consumer, data) && !strcmp(data, "one"));
+    CHECK(read_next(&consumer, data) && !strcmp(data, "two"));
+    CHECK(!read_next(&consumer, data));
+    CHECK(consumer.dropped == 0 && consumer.gaps == 0);
+}
+
+static void test_stale_by_time(Bus *bus) {
+    BusConsumer consumer;
+    char data[64];
+
+    bus_consumer_init(&consumer, bus);
+
+    // The last claimed slot is unfinished but nothing waits for it
+    dead_publisher(bus);
+    CHECK(!read_next(&consumer, data));
+    CHECK(consumer.gaps == 0);
+
+    // A record behind it waits, at first
+    CHECK(bus_publish(bus, "t", 1, (const uint8_t*)"after", 5) == 0);
+    CHECK(!read_next(&consumer, data));
+
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = BUS_STALE_NS + 10000000 };
+    nanosleep(&ts, NULL);
+
+    CHECK(read_next(&consumer, data) && !strcmp(data, "after"));
+    CHECK(consumer.gaps == 1);
+}
+
+static void test_stale_by_head(Bus *bus) {
+    BusConsumer consumer;
+    char data[64];
+    uint32_t half = bus->header->slot_count / 2;
+
+    bus_consumer_init(&consumer, bus);
+    dead_publisher(bus);
+    for (uint32_t i = 0; i < half; i++)
+        CHECK(bus_publish(bus, "t", 1, (const uint8_t*)"x", 1) == 0);
+
+    // Half a ring has been claimed after the slot, no need to wait
+    CHECK(read_next(&consumer, data) && !strcmp(data, "x"));
+    CHECK(consumer.gaps == 1 && consumer.dropped == 0);
+}
+
+int main(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "/websocket-test-bus-%d", (int)getpid());
+
+    Bus* bus = bus_open(name, 16, 256);
+    CHECK(bus != NULL);
+    if (bus == NULL)
+        return TEST_RESULT;
+
+    test_order(bus);
+    test_stale_by_time(bus);
+    test_stale_by_head(bus);
+
+    bus_close(bus);
+    shm_unlink(name);
+    return TEST_RESULT;
+}
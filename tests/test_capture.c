@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/capture.h"
+#include "test.h"
+
+// Writes the bytes after the magic to a temporary file, ready to be read
+static FILE* log_file(const void *records, size_t len) {
+    FILE* file = tmpfile();
+    fwrite(CAPTURE_MAGIC, 1, 8, file);
+    fwrite(records, 1, len, file);
+    rewind(file);
+    return file;
+}
+
+static int read_one(const void *records, size_t len, uint32_t *id, uint8_t **data,
+                    uint64_t *data_len) {
+    CaptureRecord type;
+    uint64_t delta_us;
+    uint8_t control;
+    FILE* file = log_file(records, len);
+
+    CHECK(capture_read_header(file));
+    int result = capture_read_record(file, &type, &delta_us, id, &control, data, data_len);
+    fclose(file);
+    return result;
+}
+
+static void test_records(void) {
+    // open 1, frame 1 with "hi", close 1
+    const uint8_t records[] = {
+        CAPTURE_OPEN, 0x05, 0x01,
+        CAPTURE_FRAME, 0x80, 0x01, 0x01, 0x81, 0x02, 'h', 'i',
+        CAPTURE_CLOSE, 0x00, 0x01,
+    };
+    FILE* file = log_file(records, sizeof(records));
+    CaptureRecord type;
+    uint64_t delta_us, len;
+    uint32_t id;
+    uint8_t control;
+    uint8_t* data;
+
+    CHECK(capture_read_header(file));
+
+    CHECK(capture_read_record(file, &type, &delta_us, &id, &control, &data, &len));
+    CHECK(type == CAPTURE_OPEN && delta_us == 5 && id == 1 && data == NULL);
+
+    CHECK(capture_read_record(file, &type, &delta_us, &id, &control, &data, &len));
+    CHECK(type == CAPTURE_FRAME && delta_us == 128 && id == 1 && control == 0x81);
+    CHECK(len == 2 && data != NULL && !memcmp(data, "hi", 2));
+    free(data);
+
+    CHECK(capture_read_record(file, &type, &delta_us, &id, &control, &data, &len));
+    CHECK(type == CAPTURE_CLOSE && id == 1);
+
+    CHECK(!capture_read_record(file, &type, &delta_us, &id, &control, &data, &len));
+    fclose(file);
+}
+
+static void test_broken_ids(void) {
+    uint32_t id;
+    uint8_t* data;
+    uint64_t len;
+
+    const uint8_t zero[] = { CAPTURE_OPEN, 0x00, 0x00 };
+    CHECK(!read_one(zero, sizeof(zero), &id, &data, &len));
+
+    // 2^31 wrapped the doubling in the replay to zero
+    const uint8_t huge[] = { CAPTURE_OPEN, 0x00, 0x80, 0x80, 0x80, 0x80, 0x08 };
+    CHECK(!read_one(huge, sizeof(huge), &id, &data, &len));
+
+    // 2^32 + 1 would be truncated to id 1
+    const uint8_t wide[] = { CAPTURE_OPEN, 0x00, 0x81, 0x80, 0x80, 0x80, 0x10 };
+    CHECK(!read_one(wide, sizeof(wide), &id, &data, &len));
+
+    // CAPTURE_MAX_ID is the last id that is fine
+    const uint8_t max[] = { CAPTURE_OPEN, 0x00, 0x80, 0x80, 0x80, 0x08 };
+    CHECK(read_one(max, sizeof(max), &id, &data, &len));
+    CHECK(id == CAPTURE_MAX_ID);
+    const uint8_t over[] = { CAPTURE_OPEN, 0x00, 0x81, 0x80, 0x80, 0x08 };
+    CHECK(!read_one(over, sizeof(over), &id, &data, &len));
+}
+
+static void test_truncated(void) {
+    uint32_t id;
+    uint8_t* data;
+    uint64_t len;
+
+    // Varint longer than 64 bits
+    const uint8_t endless[] = {
+        CAPTURE_OPEN, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 0x01,
+    };
+    CHECK(!read_one(endless, sizeof(endless), &id, &data, &len));
+
+    // Payload shorter than its length
+    const uint8_t payload[] = { CAPTURE_FRAME, 0x00, 0x01, 0x81, 0x05, 'h', 'i' };
+    CHECK(!read_one(payload, sizeof(payload), &id, &data, &len));
+    CHECK(data == NULL);
+
+    const uint8_t header[] = { CAPTURE_OPEN, 0x00 };
+    CHECK(!read_one(header, sizeof(header), &id, &data, &len));
+}
+
+int main(void) {
+    FILE* file = tmpfile();
+    fwrite("WSCAP999", 1, 8, file);
+    rewind(file);
+    CHECK(!capture_read_header(file));
+    fclose(file);
+
+    test_records();
+    test_broken_ids();
+    test_truncated();
+    return TEST_RESULT;
+}
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cluster.h"
+#include "test.h"
+
+static struct sockaddr_storage ip_addr(const char *host, uint16_t port) {
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+    } else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+    }
+    return addr;
+}
+
+static bool allowed(Cluster *cluster, const char *host) {
+    struct sockaddr_storage addr = ip_addr(host, 40000);
+    return cluster_peer_allowed(cluster, &addr);
+}
+
+static void test_peers(WebSocketServer *wss) {
+    wss->config.cluster_peers = "127.0.0.1:9101,[::1]:9102";
+    Cluster* cluster = create_cluster(wss);
+    CHECK(cluster != NULL);
+    if (cluster == NULL)
+        return;
+
+    // Any port of a peer host is fine
+    CHECK(allowed(cluster, "127.0.0.1"));
+    CHECK(allowed(cluster, "::ffff:127.0.0.1"));
+    CHECK(allowed(cluster, "::1"));
+    CHECK(!allowed(cluster, "127.0.0.2"));
+    CHECK(!allowed(cluster, "::2"));
+    CHECK(!allowed(cluster, "10.0.0.1"));
+
+    // Nobody listed in the bind address, so the port is on loopback
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    CHECK(getsockname(cluster->listen_fd, (struct sockaddr*)&addr, &len) == 0);
+    CHECK(addr.ss_family == AF_INET &&
+          ((struct sockaddr_in*)&addr)->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+
+    // The thread stops and the links are freed
+    CHECK(start_cluster(cluster));
+    free_cluster(cluster);
+}
+
+// Link to the cluster port like a peer on this host
+static int dial_cluster(Cluster *cluster) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || getsockname(cluster->listen_fd, (struct sockaddr*)&addr, &len) == -1 ||
+        connect(fd, (struct sockaddr*)&addr, len) == -1)
+        return -1;
+    struct timeval timeout = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static size_t make_record(uint8_t *out, uint8_t kind, const char *topic, const char *body) {
+    size_t topic_len = strlen(topic);
+    size_t body_len = body != NULL ? strlen(body) : 0;
+    uint32_t len = 2 + topic_len + body_len;
+
+    out[0] = len >> 24;
+    out[1] = len >> 16;
+    out[2] = len >> 8;
+    out[3] = len;
+    out[4] = kind;
+    out[5] = topic_len;
+    memcpy(out + 6, topic, topic_len);
+    if (body_len > 0)
+        memcpy(out + 6 + topic_len, body, body_len);
+    return 4 + len;
+}
+
+static void wait_remote_topics(Cluster *cluster, size_t count) {
+    for (int i = 0; i < 200; i++) {
+        if (__atomic_load_n(&cluster->remote_topics, __ATOMIC_RELAXED) == count)
+            return;
+        struct timespec wait = { 0, 5000000 };
+        nanosleep(&wait, NULL);
+    }
+}
+
+// Reads until the peer closes, 1 if it did
+static int closed_by_peer(int fd) {
+    char buf[256];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        ;
+    return n == 0;
+}
+
+static void test_records(WebSocketServer *wss) {
+    uint8_t record[300];
+    size_t len;
+
+    wss->config.cluster_peers = "127.0.0.1:9101";
+    Cluster* cluster = create_cluster(wss);
+    CHECK(cluster != NULL);
+    if (cluster == NULL)
+        return;
+    CHECK(start_cluster(cluster));
+
+    // A message of a topic the peer subscribed to comes back on its link
+    int fd = dial_cluster(cluster);
+    CHECK(fd != -1);
+    len = make_record(record, CLUSTER_SUB, "news", NULL);
+    CHECK(send(fd, record, len, 0) == (ssize_t)len);
+    wait_remote_topics(cluster, 1);
+    CHECK(cluster->remote_topics == 1);
+    CHECK(cluster_forward(cluster, "news", 4, WS_TEXT, (const uint8_t*)"hi", 2) == 0);
+
+    uint8_t expected[] = { 0, 0, 0, 9, CLUSTER_MSG, 4, 'n', 'e', 'w', 's', WS_TEXT, 'h', 'i' };
+    uint8_t got[sizeof(expected)];
+    CHECK(recv(fd, got, sizeof(got), MSG_WAITALL) == (ssize_t)sizeof(got));
+    CHECK(!memcmp(got, expected, sizeof(expected)));
+
+    // A message on an inbound link, only the dialing side gets those
+    len = make_record(record, CLUSTER_MSG, "news", "\x01hi");
+    CHECK(send(fd, record, len, 0) == (ssize_t)len);
+    CHECK(closed_by_peer(fd));
+    close(fd);
+    wait_remote_topics(cluster, 0);
+    CHECK(cluster->remote_topics == 0);
+
+    // No topic
+    fd = dial_cluster(cluster);
+    len = make_record(record, CLUSTER_SUB, "", NULL);
+    CHECK(send(fd, record, len, 0) == (ssize_t)len);
+    CHECK(closed_by_peer(fd));
+    close(fd);
+
+    // Topic longer than the record
+    fd = dial_cluster(cluster);
+    len = make_record(record, CLUSTER_SUB, "news", NULL);
+    record[5] = 200;
+    CHECK(send(fd, record, len, 0) == (ssize_t)len);
+    CHECK(closed_by_peer(fd));
+    close(fd);
+
+    // Length field past the largest record
+    fd = dial_cluster(cluster);
+    uint8_t huge[] = { 0x7f, 0xff, 0xff, 0xff, CLUSTER_SUB, 1, 'a' };
+    CHECK(send(fd, huge, sizeof(huge), 0) == (ssize_t)sizeof(huge));
+    CHECK(closed_by_peer(fd));
+    close(fd);
+
+    // Unknown kind
+    fd = dial_cluster(cluster);
+    len = make_record(record, 9, "news", NULL);
+    CHECK(send(fd, record, len, 0) == (ssize_t)len);
+    CHECK(closed_by_peer(fd));
+    close(fd);
+
+    free_cluster(cluster);
+}
+
+static void test_no_peers(WebSocketServer *wss) {
+    wss->config.cluster_peers = NULL;
+    Cluster* cluster = create_cluster(wss);
+    CHECK(cluster != NULL);
+    if (cluster == NULL)
+        return;
+    CHECK(!allowed(cluster, "127.0.0.1"));
+    free_cluster(cluster);
+}
+
+static void test_bad_peer(WebSocketServer *wss) {
+    wss->config.cluster_peers = "127.0.0.1:9101,no-port";
+    CHECK(create_cluster(wss) == NULL);
+}
+
+int main(void) {
+    WebSocketServer wss;
+    memset(&wss, 0, sizeof(wss));
+    init_server_config(&wss.config);
+    // Any free port
+    wss.config.cluster_port = 0;
+
+    test_peers(&wss);
+    test_records(&wss);
+    test_no_peers(&wss);
+    test_bad_peer(&wss);
+    return TEST_RESULT;
+}
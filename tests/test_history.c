@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/history.h"
+#include "test.h"
+
+static void append(History *history, HistoryRing *ring, uint64_t seq) {
+    PubMessage* message = calloc(1, sizeof(PubMessage));
+    message->refs = 1;
+    message->seq = seq;
+    history_append(history, ring, message);
+    release_message(message);
+    history->seq = seq;
+}
+
+static void test_since(void) {
+    History* history = create_history(4, 1000000000ULL);
+    bool gap;
+
+    history_watch(history, "feed", true);
+    HistoryRing* ring = history_find(history, "feed", 4, topic_hash("feed", 4));
+    CHECK(ring != NULL);
+    for (uint64_t seq = 1; seq <= 3; seq++)
+        append(history, ring, seq);
+
+    // Seen everything, nothing to queue
+    CHECK(history_resume(history, NULL, "feed", 3, &gap) == 3);
+    CHECK(!gap);
+
+    // From the future, clamped so the live messages after 3 get through
+    CHECK(history_resume(history, NULL, "feed", 1000, &gap) == 3);
+    CHECK(gap);
+    CHECK(history_resume(history, NULL, "feed", UINT64_MAX, &gap) == 3);
+    CHECK(gap);
+
+    // No ring for the topic
+    CHECK(history_resume(history, NULL, "other", 3, &gap) == 3);
+    CHECK(gap);
+
+    // The oldest messages were dropped, the ring starts after seq 2
+    for (uint64_t seq = 4; seq <= 6; seq++)
+        append(history, ring, seq);
+    CHECK(ring->floor == 2);
+    CHECK(history_resume(history, NULL, "feed", 6, &gap) == 6);
+    CHECK(!gap);
+
+    free_history(history);
+}
+
+int main(void) {
+    test_since();
+    return TEST_RESULT;
+}
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/http.h"
+#include "test.h"
+
+#define UPGRADE_HEADERS                 \
+    "Host: localhost\r\n"               \
+    "Upgrade: websocket\r\n"            \
+    "Connection: keep-alive, Upgrade\r\n"
+
+static int parse(const char *request, HttpRequest *req) {
+    return http_read_request(request, strlen(request), req);
+}
+
+static void test_content_length(void) {
+    HttpRequest req;
+
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 12\r\n\r\n", &req));
+    CHECK(req.content_length == 12);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length:  7 \r\n\r\n", &req));
+    CHECK(req.content_length == 7);
+    CHECK(parse("GET / HTTP/1.1\r\n\r\n", &req));
+    CHECK(req.content_length == 0);
+
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 12abc\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: +1\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length:\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 1 2\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 18446744073709551616\r\n\r\n", &req));
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 18446744073709551615\r\n\r\n", &req));
+
+    // Repeated, even with the same value
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 5\r\ncontent-length: 6\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n", &req));
+}
+
+static void test_transfer_encoding(void) {
+    HttpRequest req;
+
+    CHECK(!parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", &req));
+    CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 4\r\nTransfer-Encoding: chunked\r\n\r\n",
+                 &req));
+    CHECK(!parse("POST / HTTP/1.1\r\ntransfer-encoding: identity\r\n\r\n", &req));
+}
+
+static void test_request_line(void) {
+    HttpRequest req;
+
+    CHECK(parse("GET /index.html?a=1 HTTP/1.1\r\n\r\n", &req));
+    CHECK(!strcmp(req.method, "GET"));
+    CHECK(!strcmp(req.path, "/index.html"));
+    CHECK(!strcmp(req.query, "a=1"));
+    CHECK(req.keep_alive);
+
+    CHECK(parse("GET / HTTP/1.0\r\n\r\n", &req));
+    CHECK(!req.keep_alive);
+
+    CHECK(!parse("GET /\r\n\r\n", &req));
+    CHECK(!parse("GET / HTTP/2.0\r\n\r\n", &req));
+    CHECK(!parse("GARBAGE\r\n\r\n", &req));
+}
+
+static void test_since(void) {
+    HttpRequest req;
+
+    CHECK(parse("GET /feed?since=1234 HTTP/1.1\r\n\r\n", &req));
+    CHECK(req.has_since && req.since == 1234);
+    CHECK(parse("GET /feed?a=1&since=0&b=2 HTTP/1.1\r\n\r\n", &req));
+    CHECK(req.has_since && req.since == 0);
+    CHECK(parse("GET /feed?since=18446744073709551615 HTTP/1.1\r\n\r\n", &req));
+    CHECK(req.since == UINT64_MAX);
+    CHECK(parse("GET /feed?nosince=x HTTP/1.1\r\n\r\n", &req));
+    CHECK(!req.has_since);
+
+    CHECK(!parse("GET /feed?since= HTTP/1.1\r\n\r\n", &req));
+    CHECK(!parse("GET /feed?since=12x HTTP/1.1\r\n\r\n", &req));
+    CHECK(!parse("GET /feed?since=-1 HTTP/1.1\r\n\r\n", &req));
+    CHECK(!parse("GET /feed?since=18446744073709551616 HTTP/1.1\r\n\r\n", &req));
+
+    // Cut in the middle of the number by the query limit
+    char request[512];
+    snprintf(request, sizeof(request), "GET /feed?pad=%0*d&since=123456 HTTP/1.1\r\n\r\n",
+             240, 0);
+    CHECK(!parse(request, &req));
+}
+
+static void test_backend_request(void) {
+    const char head[] =
+        "GET /chat?token=abc HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Origin: https://example.com\r\n"
+        "Cookie: session=1\n"
+        "Content-Length: 3\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+    const char expected[] =
+        "GET /chat?token=abc HTTP/1.1\r\n"
+        "Host: 10.0.0.1:9000\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Origin: https://example.com\r\n"
+        "Cookie: session=1\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+    size_t len;
+
+    char* request = http_backend_request(head, sizeof(head) - 1, "10.0.0.1:9000", &len);
+    CHECK(request != NULL);
+    if (request == NULL)
+        return;
+    CHECK(len == sizeof(expected) - 1 && !memcmp(request, expected, len));
+    free(request);
+
+    // The query isn't cut like HttpRequest.query
+    char long_head[1024];
+    char query[600];
+    memset(query, 'q', sizeof(query) - 1);
+    query[sizeof(query) - 1] = '\0';
+    snprintf(long_head, sizeof(long_head), "GET /chat?%s HTTP/1.1\r\nHost: a\r\n\r\n", query);
+    request = http_backend_request(long_head, strlen(long_head), "b", &len);
+    CHECK(request != NULL && memmem(request, len, query, strlen(query)) != NULL);
+    free(request);
+}
+
+static void test_upgrade(void) {
+    HttpRequest req;
+
+    parse("GET /chat HTTP/1.1\r\n" UPGRADE_HEADERS
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_UPGRADE);
+    CHECK(!strcmp(req.ws_key, "dGhlIHNhbXBsZSBub25jZQ=="));
+
+    parse("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_NOT_UPGRADE);
+
+    // Missing Upgrade
+    parse("GET /chat HTTP/1.1\r\nConnection: Upgrade\r\n"
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_UPGRADE);
+
+    // Missing Connection: upgrade
+    parse("GET /chat HTTP/1.1\r\nUpgrade: websocket\r\nConnection: keep-alive\r\n"
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_UPGRADE);
+
+    // Missing key
+    parse("GET /chat HTTP/1.1\r\n" UPGRADE_HEADERS "Sec-WebSocket-Version: 13\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_UPGRADE);
+
+    // Not GET
+    parse("POST /chat HTTP/1.1\r\n" UPGRADE_HEADERS
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_UPGRADE);
+
+    // HTTP/1.0
+    parse("GET /chat HTTP/1.0\r\n" UPGRADE_HEADERS
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_UPGRADE);
+
+    // Wrong, missing and broken versions
+    parse("GET /chat HTTP/1.1\r\n" UPGRADE_HEADERS
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 8\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_VERSION);
+    parse("GET /chat HTTP/1.1\r\n" UPGRADE_HEADERS
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_VERSION);
+    parse("GET /chat HTTP/1.1\r\n" UPGRADE_HEADERS
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13x\r\n\r\n", &req);
+    CHECK(http_check_upgrade(&req) == HTTP_BAD_VERSION);
+}
+
+static void test_close_codes(void) {
+    CHECK(valid_close_code(1000));
+    CHECK(valid_close_code(1002));
+    CHECK(valid_close_code(1011));
+    CHECK(valid_close_code(1013));
+    CHECK(valid_close_code(3000));
+    CHECK(valid_close_code(4999));
+
+    CHECK(!valid_close_code(0));
+    CHECK(!valid_close_code(999));
+    CHECK(!valid_close_code(1004));
+    CHECK(!valid_close_code(1005));
+    CHECK(!valid_close_code(1006));
+    CHECK(!valid_close_code(1015));
+    CHECK(!valid_close_code(1016));
+    CHECK(!valid_close_code(2999));
+    CHECK(!valid_close_code(5000));
+}
+
+int main(void) {
+    test_content_length();
+    test_transfer_encoding();
+    test_request_line();
+    test_since();
+    test_backend_request();
+    test_upgrade();
+    test_close_codes();
+    return TEST_RESULT;
+}
@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/log.h"
+#include "test.h"
+
+static char* read_all(FILE *file, size_t *len) {
+    fflush(file);
+    fseek(file, 0, SEEK_END);
+    *len = (size_t)ftell(file);
+    rewind(file);
+
+    char* text = malloc(*len + 1);
+    *len = fread(text, 1, *len, file);
+    text[*len] = '\0';
+    return text;
+}
+
+int main(void) {
+    FILE* file = tmpfile();
+    int saved = dup(STDERR_FILENO);
+    dup2(fileno(file), STDERR_FILENO);
+
+    // Let the writer start and go to sleep, the line has to wake it
+    LOG_ERROR("first line");
+    log_flush();
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 50000000 };
+    nanosleep(&pause, NULL);
+
+    size_t len;
+    LOG_ERROR("woke %d", 42);
+    char* text = NULL;
+    for (int i = 0; i < 200; i++) {
+        free(text);
+        text = read_all(file, &len);
+        if (strstr(text, "woke 42") != NULL)
+            break;
+        struct timespec wait = { .tv_sec = 0, .tv_nsec = 5000000 };
+        nanosleep(&wait, NULL);
+    }
+    CHECK(strstr(text, "woke 42\n") != NULL);
+    free(text);
+
+    // More long lines than a ring holds, some are dropped and reported
+    char line[200];
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    for (int i = 0; i < 20000; i++)
+        LOG_ERROR("%d %s %s %s %s", i, line, line, line, line);
+    log_flush();
+
+    text = read_all(file, &len);
+    dup2(saved, STDERR_FILENO);
+
+    CHECK(len > 0 && text[len - 1] == '\n');
+    CHECK(strstr(text, "records dropped\n") != NULL);
+    free(text);
+    fclose(file);
+    return TEST_RESULT;
+}
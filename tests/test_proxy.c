@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/proxy.h"
+#include "test.h"
+
+// Open file descriptors of the process, a leak shows up as a difference
+static int count_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    int count = 0;
+    if (dir == NULL)
+        return -1;
+    while (readdir(dir) != NULL)
+        count++;
+    closedir(dir);
+    return count;
+}
+
+static int open_backend(uint16_t *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1 ||
+        getsockname(fd, (struct sockaddr*)&addr, &len) == -1)
+        return -1;
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void set_timeout(int fd) {
+    struct timeval timeout = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// A client socket and the server side of it, like the reactor has
+static int client_pair(int *server_side) {
+    uint16_t port = 0;
+    int listen_fd = open_backend(&port);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1 || fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        return -1;
+    // The reactors only have non-blocking sockets
+    *server_side = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    close(listen_fd);
+    set_timeout(fd);
+    return fd;
+}
+
+// Reads exactly len bytes, 1 if they are the expected ones
+static int read_exact(int fd, const char *expected, size_t len) {
+    char buf[256];
+    if (len > sizeof(buf) || recv(fd, buf, len, MSG_WAITALL) != (ssize_t)len)
+        return 0;
+    return !memcmp(buf, expected, len);
+}
+
+static Proxy* start_route(WebSocketServer *wss, uint16_t port, char *routes, size_t size) {
+    snprintf(routes, size, "/chat=127.0.0.1:%u", (unsigned int)port);
+    wss->config.proxy_routes = routes;
+    // Every session dials, so the backend accepts the socket of the session
+    wss->config.proxy_pool = 0;
+    Proxy* proxy = create_proxy(wss);
+    if (proxy != NULL && !start_proxy(proxy)) {
+        free_proxy(proxy);
+        return NULL;
+    }
+    return proxy;
+}
+
+static int hand_over(Proxy *proxy, const char *request, const char *early) {
+    Connection conn;
+    int server_side = -1;
+    int client = client_pair(&server_side);
+    if (client == -1 || server_side == -1)
+        return -1;
+
+    memset(&conn, 0, sizeof(conn));
+    conn.conn_fd = server_side;
+    int handed = proxy_upgrade(proxy, &proxy->routes[0], &conn, request, strlen(request),
+                               (const uint8_t*)early, strlen(early));
+    // The reactor closes its own copy
+    close(server_side);
+    if (!handed) {
+        close(client);
+        return -1;
+    }
+    return client;
+}
+
+static void test_relay(WebSocketServer *wss) {
+    static const char request[] = "GET /chat HTTP/1.1\r\nHost: b\r\n\r\n";
+    static const char response[] = "HTTP/1.1 101 Switching Protocols\r\n\r\n";
+    char routes[64];
+    uint16_t port = 0;
+    int backend = open_backend(&port);
+    Proxy* proxy = start_route(wss, port, routes, sizeof(routes));
+    CHECK(backend != -1 && proxy != NULL);
+    if (backend == -1 || proxy == NULL)
+        return;
+
+    int client = hand_over(proxy, request, "early");
+    CHECK(client != -1);
+    int upstream = accept(backend, NULL, NULL);
+    CHECK(upstream != -1);
+    set_timeout(upstream);
+
+    // The request and the bytes the client sent after it
+    CHECK(read_exact(upstream, request, sizeof(request) - 1));
+    CHECK(read_exact(upstream, "early", 5));
+
+    // The response and the first frame of the backend in one write
+    char first[128];
+    snprintf(first, sizeof(first), "%sfirst", response);
+    CHECK(send(upstream, first, strlen(first), 0) == (ssize_t)strlen(first));
+    CHECK(read_exact(client, first, strlen(first)));
+
+    // Both directions
+    CHECK(send(client, "ping", 4, 0) == 4);
+    CHECK(read_exact(upstream, "ping", 4));
+    CHECK(send(upstream, "pong", 4, 0) == 4);
+    CHECK(read_exact(client, "pong", 4));
+
+    // The client half closes, the backend still sends
+    shutdown(client, SHUT_WR);
+    char byte;
+    CHECK(recv(upstream, &byte, 1, 0) == 0);
+    CHECK(send(upstream, "last", 4, 0) == 4);
+    CHECK(read_exact(client, "last", 4));
+    close(upstream);
+    CHECK(recv(client, &byte, 1, 0) == 0);
+    close(client);
+
+    free_proxy(proxy);
+    close(backend);
+}
+
+static void test_rejected(WebSocketServer *wss) {
+    static const char request[] = "GET /chat HTTP/1.1\r\nHost: b\r\n\r\n";
+    static const char forbidden[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
+    char routes[64];
+    uint16_t port = 0;
+    int backend = open_backend(&port);
+    Proxy* proxy = start_route(wss, port, routes, sizeof(routes));
+    CHECK(backend != -1 && proxy != NULL);
+    if (backend == -1 || proxy == NULL)
+        return;
+
+    // The client gets the answer of the backend and is closed
+    int client = hand_over(proxy, request, "");
+    int upstream = accept(backend, NULL, NULL);
+    set_timeout(upstream);
+    CHECK(read_exact(upstream, request, sizeof(request) - 1));
+    CHECK(send(upstream, forbidden, sizeof(forbidden) - 1, 0) == (ssize_t)sizeof(forbidden) - 1);
+    CHECK(read_exact(client, forbidden, sizeof(forbidden) - 1));
+    char byte;
+    CHECK(recv(client, &byte, 1, 0) == 0);
+    close(client);
+    close(upstream);
+
+    free_proxy(proxy);
+    close(backend);
+}
+
+static void test_backend_down(WebSocketServer *wss) {
+    static const char bad_gateway[] = "HTTP/1.1 502 Bad Gateway\r\n";
+    char routes[64];
+    uint16_t port = 0;
+    // The port was free a moment ago, nothing listens on it
+    close(open_backend(&port));
+    Proxy* proxy = start_route(wss, port, routes, sizeof(routes));
+    CHECK(proxy != NULL);
+    if (proxy == NULL)
+        return;
+
+    int client = hand_over(proxy, "GET /chat HTTP/1.1\r\n\r\n", "");
+    CHECK(client != -1);
+    CHECK(read_exact(client, bad_gateway, sizeof(bad_gateway) - 1));
+    char buf[128];
+    ssize_t n;
+    while ((n = recv(client, buf, sizeof(buf), 0)) > 0)
+        ;
+    CHECK(n == 0);
+    close(client);
+
+    free_proxy(proxy);
+}
+
+static void test_bad_routes(WebSocketServer *wss) {
+    int before = count_fds();
+
+    wss->config.proxy_routes = "/a=127.0.0.1:9000,chat=127.0.0.1:9001";
+    CHECK(create_proxy(wss) == NULL);
+    wss->config.proxy_routes = "/a=127.0.0.1:9000,/b=127.0.0.1";
+    CHECK(create_proxy(wss) == NULL);
+    CHECK(count_fds() == before);
+}
+
+static void test_free(WebSocketServer *wss) {
+    uint16_t port = 0;
+    int backend = open_backend(&port);
+    CHECK(backend != -1);
+    int before = count_fds();
+
+    char routes[64];
+    snprintf(routes, sizeof(routes), "/chat=127.0.0.1:%u", (unsigned int)port);
+    wss->config.proxy_routes = routes;
+    wss->config.proxy_pool = 4;
+    Proxy* proxy = create_proxy(wss);
+    CHECK(proxy != NULL);
+    if (proxy == NULL)
+        return;
+    CHECK(proxy_route(proxy, "/chat/room") == &proxy->routes[0]);
+    CHECK(proxy_route(proxy, "/other") == NULL);
+
+    // Wait for the pool to fill, then the pooled sockets are closed too
+    CHECK(start_proxy(proxy));
+    for (int i = 0; i < 200 && __atomic_load_n(&proxy->routes[0].pooled, __ATOMIC_RELAXED) < 4; i++) {
+        struct timespec wait = { 0, 5000000 };
+        nanosleep(&wait, NULL);
+    }
+    CHECK(__atomic_load_n(&proxy->routes[0].pooled, __ATOMIC_RELAXED) == 4);
+    free_proxy(proxy);
+    CHECK(count_fds() == before);
+    close(backend);
+}
+
+int main(void) {
+    WebSocketServer wss;
+    memset(&wss, 0, sizeof(wss));
+    init_server_config(&wss.config);
+
+    test_bad_routes(&wss);
+    test_free(&wss);
+    test_relay(&wss);
+    test_rejected(&wss);
+    test_backend_down(&wss);
+    return TEST_RESULT;
+}
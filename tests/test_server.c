@@ -0,0 +1,32 @@
+#include <string.h>
+
+#include "../src/server.h"
+#include "test.h"
+
+static void test_tls_config(void) {
+    WebSocketServerConfig config;
+    WebSocketServer wss;
+
+    // Half of the TLS settings would serve plain text on the port
+    init_server_config(&config);
+    config.bind_address = "127.0.0.1";
+    config.port = 0;
+    config.tls_cert = "cert.pem";
+    CHECK(!init_server(&wss, &config));
+    free_server(&wss);
+
+    config.tls_cert = NULL;
+    config.tls_key = "key.pem";
+    CHECK(!init_server(&wss, &config));
+    free_server(&wss);
+
+    config.tls_key = NULL;
+    CHECK(init_server(&wss, &config));
+    CHECK(wss.tls_ctx == NULL);
+    free_server(&wss);
+}
+
+int main(void) {
+    test_tls_config();
+    return TEST_RESULT;
+}
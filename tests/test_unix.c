@@ -0,0 +1,88 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/server.h"
+#include "test.h"
+
+static const char HANDSHAKE[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static int opened = 0;
+static int got_cred = 0;
+static WebSocketPeerCred cred;
+
+static void on_open(WebSocketServer *wss, WebSocketConn *conn) {
+    got_cred = ws_get_peer_cred(conn, &cred);
+    __atomic_store_n(&opened, 1, __ATOMIC_RELEASE);
+}
+
+static void* serve(void *arg) {
+    run_server(arg);
+    return NULL;
+}
+
+// Connect to the abstract socket and do the handshake
+static int connect_local(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(path);
+    memcpy(addr.sun_path + 1, path + 1, len - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 ||
+        connect(fd, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + len) == -1 ||
+        write(fd, HANDSHAKE, sizeof(HANDSHAKE) - 1) != (ssize_t)sizeof(HANDSHAKE) - 1)
+        return -1;
+
+    char response[256];
+    ssize_t n = read(fd, response, sizeof(response) - 1);
+    if (n < 12 || memcmp(response, "HTTP/1.1 101", 12))
+        return -1;
+    return fd;
+}
+
+int main(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "@websocket-test-%d", (int)getpid());
+
+    WebSocketServerConfig config;
+    init_server_config(&config);
+    // Any free TCP port, the test only uses the Unix domain socket
+    config.port = 0;
+    config.bind_address = "127.0.0.1";
+    config.threads = 1;
+    config.unix_paths = path;
+
+    WebSocketServer wss;
+    CHECK(init_server(&wss, &config));
+    wss.handler.on_open = on_open;
+
+    // The server runs until the test exits
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, serve, &wss) == 0);
+
+    int fd = connect_local(path);
+    CHECK(fd != -1);
+    for (int i = 0; i < 200 && !__atomic_load_n(&opened, __ATOMIC_ACQUIRE); i++) {
+        struct timespec wait = { 0, 5000000 };
+        nanosleep(&wait, NULL);
+    }
+    CHECK(opened);
+    CHECK(got_cred);
+    CHECK(cred.pid == getpid() && cred.uid == getuid() && cred.gid == getgid());
+    close(fd);
+    return TEST_RESULT;
+}
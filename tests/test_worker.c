@@ -0,0 +1,55 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/worker.h"
+#include "test.h"
+
+static void test_close(WebSocketServer *wss) {
+    Workers* workers = create_workers(wss);
+    CHECK(workers != NULL);
+    if (workers == NULL)
+        return;
+
+    WorkerEnd* worker = worker_attach(wss->config.worker_name, 1);
+    CHECK(worker != NULL);
+    CHECK(worker_attach(wss->config.worker_name, 2) == NULL);
+    if (worker == NULL)
+        return;
+    CHECK(!worker_closed(worker));
+
+    // The reply thread is asleep on empty rings and has to wake up
+    CHECK(start_workers(workers));
+    usleep(10000);
+    free_workers(workers);
+
+    // The object is gone, the worker still has its mapping
+    CHECK(shm_open(wss->config.worker_name, O_RDWR, 0600) == -1 && errno == ENOENT);
+    CHECK(worker_closed(worker));
+    WorkerMessage message;
+    CHECK(!worker_next(worker, &message));
+    // Returns right away after the close
+    worker_wait(worker);
+    worker_detach(worker);
+}
+
+int main(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "/websocket-test-workers-%d", (int)getpid());
+
+    WebSocketServer wss;
+    memset(&wss, 0, sizeof(wss));
+    init_server_config(&wss.config);
+    wss.config.worker_name = name;
+    wss.config.workers = 2;
+    wss.config.threads = 2;
+
+    test_close(&wss);
+    shm_unlink(name);
+    return TEST_RESULT;
+}